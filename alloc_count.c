@@ -0,0 +1,57 @@
+#include "alloc_count.h"
+#include <stddef.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static long allocations;
+static long frees;
+static long live;
+
+void* malloc(size_t size) {
+    allocations++;
+    void* result = __libc_malloc(size);
+    live += result != 0;
+    return result;
+}
+
+void* calloc(size_t n, size_t size) {
+    allocations++;
+    void* result = __libc_calloc(n, size);
+    live += result != 0;
+    return result;
+}
+
+void* realloc(void* ptr, size_t size) {
+    allocations++;
+    void* result = __libc_realloc(ptr, size);
+    if (!ptr) {
+        live += result != 0;
+    } else if (!size) {
+        /* glibc frees ptr */
+        live--;
+    }
+    return result;
+}
+
+void free(void* ptr) {
+    if (ptr) {
+        frees++;
+        live--;
+    }
+    __libc_free(ptr);
+}
+
+long alloc_count_allocations(void) {
+    return allocations;
+}
+
+long alloc_count_frees(void) {
+    return frees;
+}
+
+long alloc_count_live(void) {
+    return live;
+}
@@ -0,0 +1,23 @@
+/*
+  Counts heap allocations, for tests that check that code doesn't
+  allocate.  Linking alloc_count.o into a program replaces malloc,
+  calloc, realloc and free with wrappers that count calls and pass
+  them on to the C library's allocator.  This relies on glibc's
+  __libc_malloc and friends.
+ */
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+/* calls to malloc, calloc and realloc so far */
+long alloc_count_allocations(void);
+
+/* calls to free (of a non-NULL pointer) so far */
+long alloc_count_frees(void);
+
+/*
+  Blocks allocated and not yet freed.  Unlike allocations minus frees,
+  this counts a realloc of an existing block as neither.
+ */
+long alloc_count_live(void);
+
+#endif
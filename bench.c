@@ -0,0 +1,1195 @@
+/*
+  Microbenchmarks.  Run with no arguments to run all of them, or name
+  the ones to run.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compact_tree.h"
+#include "eval.h"
+#include "eval_native.h"
+#include "layout.h"
+#include "lex.h"
+#include "parse.h"
+#include "scan.h"
+#include "svg.h"
+#include "tree_file.h"
+#include "tree_format.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* sample_exprs[] = {
+    "a->b[i] + 0x1f * (int)c - foo(bar, 1.5e3)",
+    "*(unsigned long *)p += sizeof(struct frob) << 2",
+    "x_very_long_identifier_name /* comment */ && !y || z ? q : r",
+    "t.a.b->c[\"str\\\"ing\"] >>= '\\n' ^ ~mask",
+    0
+};
+
+/*
+  Returns a malloced string of about size bytes, made by repeating
+  sample_exprs joined with commas.
+ */
+static char* make_corpus(size_t size) {
+    char* corpus = malloc(size + 256);
+    size_t used = 0;
+    const char** expr = sample_exprs;
+    while (used < size) {
+        if (used) {
+            corpus[used++] = ',';
+        }
+        size_t len = strlen(*expr);
+        memcpy(corpus + used, *expr, len);
+        used += len;
+        if (!*++expr) {
+            expr = sample_exprs;
+        }
+    }
+    corpus[used] = 0;
+    return corpus;
+}
+
+static void bench_lex() {
+    const char* expr = sample_exprs[0];
+
+    /* the first call in the process pays for any lexer setup */
+    double start = now();
+    lex_buf buf = start_lex(expr);
+    get_next_token(&buf);
+    double cold = now() - start;
+
+    start = now();
+    buf = start_lex(expr);
+    get_next_token(&buf);
+    double warm = now() - start;
+
+    printf("lex: cold start %.1f us, warm start %.1f us\n",
+           cold * 1e6, warm * 1e6);
+
+    char* corpus = make_corpus(1 << 20);
+    long tokens = 0;
+    int iterations = 20;
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        buf = start_lex(corpus);
+        while (get_next_token(&buf).token_type != END_OF_EXPRESSION) {
+            ++tokens;
+        }
+        }
+    double elapsed = now() - start;
+    printf("lex: %.1f M tokens/s, %.1f MB/s\n",
+           tokens / elapsed / 1e6,
+           iterations * strlen(corpus) / elapsed / 1e6);
+    free(corpus);
+}
+
+/*
+  Lexes a corpus of long identifiers, whitespace runs, and comment
+  blocks -- the things the scanners handle -- with each of the scan
+  implementations.
+ */
+static void bench_scan() {
+    size_t size = 1 << 22;
+    char* corpus = malloc(size + 1);
+    size_t used = 0;
+    while (used + 3000 < size) {
+        for (int i = 0; i < 200; ++i) {
+            corpus[used++] = "abcdefghijklmnopqrstuvwxyz_0123456789"[i % 37];
+        }
+        memcpy(corpus + used, "  +\t\n  ", 7);
+        used += 7;
+        memcpy(corpus + used, "/*", 2);
+        used += 2;
+        for (int i = 0; i < 2000; ++i) {
+            corpus[used++] = "comment text * / "[i % 17];
+        }
+        memcpy(corpus + used, "*/-", 3);
+        used += 3;
+    }
+    corpus[used - 1] = 0;
+
+    static const struct {
+        enum scan_simd simd;
+        const char* name;
+    } impls[] = {
+        {SCAN_SIMD_NONE, "scalar"},
+        {SCAN_SIMD_SSE2, "sse2"},
+        {SCAN_SIMD_AVX2, "avx2"},
+    };
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+        if (!scan_set_simd(impls[i].simd)) {
+            continue;
+        }
+        int iterations = 10;
+        double start = now();
+        for (int j = 0; j < iterations; ++j) {
+            lex_buf buf = start_lex(corpus);
+            while (get_next_token(&buf).token_type != END_OF_EXPRESSION) {
+            }
+                }
+        double elapsed = now() - start;
+        printf("scan: %s %.0f MB/s\n", impls[i].name,
+               iterations * used / elapsed / 1e6);
+    }
+    scan_set_simd(SCAN_SIMD_AUTO);
+    free(corpus);
+}
+
+static void bench_parse() {
+    static const char* exprs[] = {
+        "a->b[i] + 0x1f * (int)c - foo(bar, 1.5e3)",
+        "*(unsigned long *)p += sizeof(struct frob) << 2",
+        "x && !y || z ? q : r = s, t",
+        "t.a.b->c[\"str\"] >>= '\\n' ^ ~mask",
+        "x",
+        0
+    };
+    struct parser_ctx* ctx = parser_ctx_new();
+    long parses = 0;
+    double start = now();
+    for (int i = 0; i < 200000; ++i) {
+        for (const char** expr = exprs; *expr; ++expr) {
+            parser_ctx_parse(ctx, *expr, 0);
+            ++parses;
+        }
+    }
+    double elapsed = now() - start;
+    printf("parse: %.0f ns/expression\n", elapsed / parses * 1e9);
+    parser_ctx_free(ctx);
+}
+
+/*
+  Parses long operator chains: a flat one with every operator at the
+  same precedence, and one that cycles through all the precedence
+  levels.
+ */
+static void bench_binop() {
+    static const char* cycle[] = {"*", "+", "<<", "<", "==", "&", "^", "|",
+                                  "&&", "||", 0};
+    int n_ops = 10000;
+    char* flat = malloc(n_ops * 4 + 2);
+    char* levels = malloc(n_ops * 4 + 2);
+    char* f = flat;
+    char* l = levels;
+    for (int i = 0; i < n_ops; ++i) {
+        f += sprintf(f, "a+");
+        l += sprintf(l, "a%s", cycle[i % 10]);
+    }
+    sprintf(f, "a");
+    sprintf(l, "a");
+
+    struct parser_ctx* ctx = parser_ctx_new();
+    const char* names[] = {"flat", "levels"};
+    const char* exprs[] = {flat, levels};
+    for (int i = 0; i < 2; ++i) {
+        int iterations = 200;
+        double start = now();
+        for (int j = 0; j < iterations; ++j) {
+            parser_ctx_parse(ctx, exprs[i], 0);
+        }
+        double elapsed = now() - start;
+        printf("binop: %s chain %.1f ns/operator\n", names[i],
+               elapsed / iterations / n_ops * 1e9);
+    }
+    parser_ctx_free(ctx);
+    free(flat);
+    free(levels);
+}
+
+/*
+  Parses typecasts with thousands of typedefs in scope, passing them
+  as a list each time and as a prebuilt set.
+ */
+static void bench_typenames() {
+    int n_names = 5000;
+    char** names = malloc((n_names + 1) * sizeof(char*));
+    for (int i = 0; i < n_names; ++i) {
+        names[i] = malloc(16);
+        sprintf(names[i], "type%d_t", i);
+    }
+    names[n_names] = 0;
+    const char* expr = "(type4321_t)p + (int)q * (x)";
+
+    struct parser_ctx* ctx = parser_ctx_new();
+    int iterations = 2000;
+    double start = now();
+    for (int i = 0; i < iterations; ++i) {
+        parser_ctx_parse(ctx, expr, names);
+    }
+    double elapsed = now() - start;
+    printf("typenames: list of %d, %.0f ns/expression\n", n_names,
+           elapsed / iterations * 1e9);
+
+    struct typename_set* set = typename_set_new(names);
+    parser_ctx_set_typenames(ctx, set);
+    iterations = 1000000;
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        parser_ctx_parse(ctx, expr, 0);
+    }
+    elapsed = now() - start;
+    printf("typenames: set of %d, %.0f ns/expression\n", n_names,
+           elapsed / iterations * 1e9);
+
+    parser_ctx_free(ctx);
+    typename_set_free(set);
+    for (int i = 0; i < n_names; ++i) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+/* Counts identifiers and literals by walking the pointer tree */
+static long count_leaves(struct parse_tree_node* root) {
+    long leaves = 0;
+    int allocated = 64;
+    struct parse_tree_node** stack = malloc(allocated * sizeof(*stack));
+    int depth = 0;
+    stack[depth++] = root;
+    while (depth) {
+        struct parse_tree_node* node = stack[--depth];
+        for (; node; node = node->next_sibling) {
+            if (node->op == LITERAL_OR_ID) {
+                leaves++;
+            }
+            if (node->first_child) {
+                if (depth == allocated) {
+                    allocated *= 2;
+                    stack = realloc(stack, allocated * sizeof(*stack));
+                }
+                stack[depth++] = node->first_child;
+            }
+        }
+    }
+    free(stack);
+    return leaves;
+}
+
+/*
+  Compares the pointer tree and the compact tree for a parse of a few
+  megabytes of expressions: memory, a walk over every node, and
+  printing.
+ */
+static void bench_compact() {
+    char* corpus = make_corpus(1 << 22);
+    struct parse_result* result = parse(corpus, 0);
+    struct compact_tree* tree = compact_tree_new(result->node, corpus);
+
+    printf("compact: %u nodes, %zu bytes of pointer nodes, "
+           "%zu bytes of compact nodes\n", tree->n_nodes,
+           tree->n_nodes * sizeof(struct parse_tree_node),
+           tree->n_nodes * sizeof(struct compact_node));
+
+    int iterations = 20;
+    long leaves = 0;
+    double start = now();
+    for (int i = 0; i < iterations; ++i) {
+        leaves += count_leaves(result->node);
+    }
+    double elapsed = now() - start;
+    printf("compact: pointer tree walk %.2f ns/node\n",
+           elapsed / iterations / tree->n_nodes * 1e9);
+
+    long compact_leaves = 0;
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        for (uint32_t j = 0; j < tree->n_nodes; ++j) {
+            if (compact_op(&tree->nodes[j]) == LITERAL_OR_ID) {
+                compact_leaves++;
+            }
+        }
+    }
+    elapsed = now() - start;
+    printf("compact: compact tree scan %.2f ns/node\n",
+           elapsed / iterations / tree->n_nodes * 1e9);
+    if (leaves != compact_leaves) {
+        printf("compact: leaf counts differ\n");
+    }
+
+    char* buf = malloc(compact_tree_string_length(tree) + 1);
+    iterations = 5;
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        write_tree_to_string(result->node, buf);
+    }
+    elapsed = now() - start;
+    printf("compact: print pointer tree %.1f ns/node\n",
+           elapsed / iterations / tree->n_nodes * 1e9);
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        write_compact_tree_to_string(tree, buf);
+    }
+    elapsed = now() - start;
+    printf("compact: print compact tree %.1f ns/node\n",
+           elapsed / iterations / tree->n_nodes * 1e9);
+
+    free(buf);
+
+    /* reloading a saved tree, against parsing it again */
+    const char* path = "/tmp/bench.tree";
+    tree_file_write(tree, path);
+    iterations = 20;
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        const char* error;
+        struct tree_file* file = tree_file_map(path, &error);
+        tree_file_unmap(file);
+    }
+    elapsed = now() - start;
+    printf("compact: map tree file %.2f ms\n", elapsed / iterations * 1e3);
+    unlink(path);
+
+    struct parser_ctx* ctx = parser_ctx_new();
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        parser_ctx_parse(ctx, corpus, 0);
+    }
+    elapsed = now() - start;
+    printf("compact: parse again %.2f ms\n", elapsed / iterations * 1e3);
+    parser_ctx_free(ctx);
+
+    compact_tree_free(tree);
+    free_parse_result_contents(result);
+    free(result);
+    free(corpus);
+}
+
+/*
+  The printer as it was, for comparison: a sprintf per piece, into a
+  buffer that's assumed to be big enough.  Recursive, which is fine
+  for the corpus.
+ */
+static char* sprintf_tree(struct parse_tree_node* node, char* buf) {
+    enum token_type op = node->op;
+    switch (op) {
+    case DEREFERENCE: case REFERENCE: case UNARY_MINUS: case TILDE:
+    case BANG: case PREINCREMENT: case PREDECREMENT:
+        buf += sprintf(buf, "%s(", token_sigils[op]);
+        break;
+    case TYPECAST:
+        buf += sprintf(buf, "((%.*s)", node->text_len, node->text);
+        break;
+    case FUNCTION_CALL: case SUBSCRIPT:
+        break;
+    case SIZEOF:
+        buf += sprintf(buf, "sizeof(%.*s)", node->text_len, node->text);
+        break;
+    case LITERAL_OR_ID:
+        buf += sprintf(buf, "%.*s", node->text_len, node->text);
+        break;
+    default:
+        buf += sprintf(buf, "(");
+        break;
+    }
+    for (struct parse_tree_node* child = node->first_child; child;
+         child = child->next_sibling) {
+        bool first = child == node->first_child;
+        buf = sprintf_tree(child, buf);
+        switch (op) {
+        case FUNCTION_CALL:
+            if (first) {
+                buf += sprintf(buf, "(");
+            } else if (child->next_sibling) {
+                buf += sprintf(buf, ",");
+            }
+            break;
+        case SUBSCRIPT:
+            if (first) {
+                buf += sprintf(buf, "[");
+            }
+            break;
+        case DEREFERENCE: case REFERENCE: case UNARY_MINUS: case TILDE:
+        case BANG: case PREINCREMENT: case PREDECREMENT: case TYPECAST:
+            break;
+        default:
+            if (first) {
+                buf += sprintf(buf, "%s", token_sigils[op]);
+            }
+            break;
+        }
+    }
+    if (op == SUBSCRIPT) {
+        buf += sprintf(buf, "]");
+    } else if (op != SIZEOF && op != LITERAL_OR_ID) {
+        buf += sprintf(buf, ")");
+    }
+    return buf;
+}
+
+/*
+  Prints a parse of a few megabytes of expressions: with sprintf, as
+  write_tree_to_string used to, then measuring and writing with
+  memcpy, and into a strbuf.
+ */
+static void bench_print() {
+    char* corpus = make_corpus(1 << 22);
+    struct parse_result* result = parse(corpus, 0);
+    size_t len = tree_string_length(result->node);
+    char* expected = malloc(len + 1);
+    char* buf = malloc(len + 1);
+    sprintf_tree(result->node, expected);
+    int iterations = 10;
+
+    double start = now();
+    for (int i = 0; i < iterations; ++i) {
+        sprintf_tree(result->node, buf);
+    }
+    double elapsed = now() - start;
+    printf("print: sprintf %.2f ms for %zu bytes\n",
+           elapsed / iterations * 1e3, len);
+
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        tree_string_length(result->node);
+    }
+    elapsed = now() - start;
+    printf("print: measure %.2f ms\n", elapsed / iterations * 1e3);
+
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        write_tree_to_string(result->node, buf);
+    }
+    elapsed = now() - start;
+    printf("print: memcpy %.2f ms\n", elapsed / iterations * 1e3);
+    if (strcmp(buf, expected)) {
+        printf("print: outputs differ\n");
+    }
+
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        struct strbuf out = {0};
+        write_tree_to_strbuf(result->node, &out);
+        strbuf_free(&out);
+    }
+    elapsed = now() - start;
+    printf("print: strbuf, measured and written %.2f ms\n",
+           elapsed / iterations * 1e3);
+
+    const struct tree_emitter* formats[] = {&tree_format_json,
+                                            &tree_format_sexpr};
+    for (int f = 0; f < 2; ++f) {
+        size_t format_len = 0;
+        start = now();
+        for (int i = 0; i < iterations; ++i) {
+            struct strbuf out = {0};
+            struct sink sink;
+            sink_init_strbuf(&sink, &out);
+            emit_tree(formats[f], result->node, &sink);
+            sink_close(&sink);
+            format_len = out.len;
+            strbuf_free(&out);
+        }
+        elapsed = now() - start;
+        printf("print: %s %.2f ms for %zu bytes\n", formats[f]->name,
+               elapsed / iterations * 1e3, format_len);
+    }
+
+    free(buf);
+    free(expected);
+    free_parse_result_contents(result);
+    free(result);
+    free(corpus);
+}
+
+static long max_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/*
+  Prints a tree many times over to /dev/null, as expr_parse does a
+  file of expressions, through a sink and by building the whole output
+  first.  Peak RSS only grows, so the sink goes first.
+ */
+static void bench_stream() {
+    char* corpus = make_corpus(1 << 20);
+    struct parse_result* result = parse(corpus, 0);
+    int fd = open("/dev/null", O_WRONLY);
+    int copies = 64;
+    size_t len = tree_string_length(result->node) * copies;
+
+    long rss = max_rss_kb();
+    double start = now();
+    struct sink sink;
+    sink_init_fd(&sink, fd);
+    for (int i = 0; i < copies; ++i) {
+        write_tree_to_sink(result->node, &sink);
+    }
+    sink_close(&sink);
+    double elapsed = now() - start;
+    printf("stream: sink %.2f ms for %zu bytes, peak RSS +%ld KB\n",
+           elapsed * 1e3, len, max_rss_kb() - rss);
+
+    rss = max_rss_kb();
+    start = now();
+    struct strbuf out = {0};
+    for (int i = 0; i < copies; ++i) {
+        write_tree_to_strbuf(result->node, &out);
+    }
+    if (write(fd, out.data, out.len) < 0) {
+        perror("write");
+    }
+    strbuf_free(&out);
+    elapsed = now() - start;
+    printf("stream: strbuf then write %.2f ms, peak RSS +%ld KB\n",
+           elapsed * 1e3, max_rss_kb() - rss);
+
+    close(fd);
+    free_parse_result_contents(result);
+    free(result);
+    free(corpus);
+}
+
+/*
+  Draws calls with more and more arguments, f(a1, ..., an), to
+  /dev/null.  Layout is linear, so the time per node should stay flat.
+ */
+static void bench_wide() {
+    int fd = open("/dev/null", O_WRONLY);
+    for (int n = 1000; n <= 100000; n *= 10) {
+        struct strbuf expr = {0};
+        strbuf_append(&expr, "f(", 2);
+        for (int i = 1; i <= n; ++i) {
+            char arg[16];
+            int len = snprintf(arg, sizeof(arg), i < n ? "a%d," : "a%d)", i);
+            strbuf_append(&expr, arg, len);
+        }
+        struct parse_result* result = parse(expr.data, 0);
+
+        double start = now();
+        struct sink sink;
+        sink_init_fd(&sink, fd);
+        write_parse_tree_svg(result->node, &sink);
+        sink_close(&sink);
+        double elapsed = now() - start;
+        printf("wide: %d arguments %.2f ms, %.0f ns/node\n", n,
+               elapsed * 1e3, elapsed * 1e9 / (n + 2));
+
+        free_parse_result_contents(result);
+        free(result);
+        strbuf_free(&expr);
+    }
+    close(fd);
+}
+
+/*
+  Draws a big tree whole, with a budget of boxes, and to a depth, for
+  what a level-of-detail view saves in time and in bytes to send.
+ */
+static void bench_lod() {
+    char* corpus = make_corpus(1 << 20);
+    struct parse_result* result = parse(corpus, 0);
+    struct compact_tree* tree = compact_tree_new(result->node, corpus);
+    printf("lod: %u nodes\n", tree->n_nodes);
+    const char* names[] = {"whole", "1000 nodes", "depth 10"};
+    struct svg_options options[] = {{0, 0, 0, 0}, {0, 1000, 0, 0},
+                                    {10, 0, 0, 0}};
+    for (int i = 0; i < 3; ++i) {
+        /* the compact tree counts what's cut off without a walk */
+        for (int compact = 0; compact < 2; ++compact) {
+            struct strbuf svg = {0};
+            int iterations = 3;
+            double start = now();
+            for (int j = 0; j < iterations; ++j) {
+                svg.len = 0;
+                struct sink sink;
+                sink_init_strbuf(&sink, &svg);
+                if (compact) {
+                    write_compact_tree_svg_with_options(tree, &options[i],
+                                                        &sink);
+                } else {
+                    write_parse_tree_svg_with_options(result->node,
+                                                      &options[i], &sink);
+                }
+                sink_close(&sink);
+            }
+            double elapsed = (now() - start) / iterations;
+            printf("lod: %s, %s tree %.2f ms, %zu bytes\n", names[i],
+                   compact ? "compact" : "parse", elapsed * 1e3, svg.len);
+            strbuf_free(&svg);
+        }
+    }
+    compact_tree_free(tree);
+    free_parse_result_contents(result);
+    free(result);
+    free(corpus);
+}
+
+/*
+  Draws a big tree whole to /dev/null with coordinates to one, three
+  and six places, six being what %f gave before there was a choice.
+ */
+static void bench_precision() {
+    char* corpus = make_corpus(1 << 20);
+    struct parse_result* result = parse(corpus, 0);
+    struct compact_tree* tree = compact_tree_new(result->node, corpus);
+    uint32_t n_nodes = tree->n_nodes;
+    compact_tree_free(tree);
+    int fd = open("/dev/null", O_WRONLY);
+    int precisions[] = {1, 3, 6};
+    for (int i = 0; i < 3; ++i) {
+        struct svg_options options = {0, 0, 0, precisions[i]};
+        struct strbuf svg = {0};
+        struct sink sink;
+        sink_init_strbuf(&sink, &svg);
+        write_parse_tree_svg_with_options(result->node, &options, &sink);
+        sink_close(&sink);
+
+        int iterations = 3;
+        double start = now();
+        for (int j = 0; j < iterations; ++j) {
+            sink_init_fd(&sink, fd);
+            write_parse_tree_svg_with_options(result->node, &options, &sink);
+            sink_close(&sink);
+        }
+        double elapsed = (now() - start) / iterations;
+        printf("precision: %d places, %u nodes: %.2f ms, %.0f ns/node, "
+               "%zu bytes, %.0f bytes/node\n", precisions[i], n_nodes,
+               elapsed * 1e3, elapsed * 1e9 / n_nodes, svg.len,
+               (double)svg.len / n_nodes);
+        strbuf_free(&svg);
+    }
+    close(fd);
+    free_parse_result_contents(result);
+    free(result);
+    free(corpus);
+}
+
+/* Including blocks big enough to have been mmapped */
+static size_t heap_in_use() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+/* A flat layout of tree, with widths as svg.c gives them */
+static struct flat_layout* compact_flat_layout(const struct compact_tree*
+                                               tree) {
+    struct flat_layout* layout = flat_layout_new(tree->n_nodes);
+    for (uint32_t i = 0; i < tree->n_nodes; ++i) {
+        layout->width[i] = (compact_text_len(&tree->nodes[i]) + 2) * 8.4;
+        for (uint32_t child = tree->nodes[i].first_child; child;
+             child = tree->nodes[child].next_sibling) {
+            flat_layout_add_child(layout, i, child);
+        }
+    }
+    return layout;
+}
+
+/*
+  Lays out a parse of a few megabytes of expressions as a flat layout,
+  and as a tree of labels, one malloc each as svg.c used to make them.
+  The labels go in preorder and then in a random order, since after a
+  while a heap doesn't hand out neighbouring blocks.  The flat layout
+  goes first, so its one big allocation doesn't pay for malloc sorting
+  the freed labels.
+ */
+static void bench_layout() {
+    char* corpus = make_corpus(1 << 22);
+    struct parse_result* result = parse(corpus, 0);
+    struct compact_tree* tree = compact_tree_new(result->node, corpus);
+    uint32_t n = tree->n_nodes;
+    struct walker_layout_rules rules = {10, 20, 30};
+    struct label** labels = malloc(n * sizeof(*labels));
+    uint32_t* order = malloc(n * sizeof(*order));
+    printf("layout: %u nodes\n", n);
+
+    size_t heap = heap_in_use();
+    double start = now();
+    struct flat_layout* layout = compact_flat_layout(tree);
+    double built = now();
+    flat_layout_run(layout, &rules, 500, 0);
+    double elapsed = now() - built;
+    printf("layout: flat %.1f bytes/node, build %.2f ms, "
+           "layout %.2f ms (%.0f ns/node)\n",
+           (double)(heap_in_use() - heap) / n, (built - start) * 1e3,
+           elapsed * 1e3, elapsed * 1e9 / n);
+
+    for (int shuffled = 0; shuffled < 2; ++shuffled) {
+        for (uint32_t i = 0; i < n; ++i) {
+            order[i] = i;
+        }
+        for (uint32_t i = n - 1; shuffled && i > 0; --i) {
+            uint32_t j = rand() % (i + 1);
+            uint32_t swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+        heap = heap_in_use();
+        start = now();
+        for (uint32_t i = 0; i < n; ++i) {
+            struct label* label = calloc(1, sizeof(struct label));
+            label->ancestor = label;
+            label->width = (compact_text_len(&tree->nodes[order[i]]) + 2) * 8.4;
+            labels[order[i]] = label;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            for (uint32_t child = tree->nodes[i].first_child; child;
+                 child = tree->nodes[child].next_sibling) {
+                struct label* parent = labels[i];
+                struct label* label = labels[child];
+                label->parent = parent;
+                if (parent->last_child) {
+                    label->number = parent->last_child->number + 1;
+                    label->prev_sibling = parent->last_child;
+                    parent->last_child->next_sibling = label;
+                } else {
+                    parent->first_child = label;
+                }
+                parent->last_child = label;
+            }
+        }
+        labels[0]->xcoord = 500;
+        built = now();
+        walker_layout(labels[0], &rules);
+        elapsed = now() - built;
+        printf("layout: labels%s %.1f bytes/node, build %.2f ms, "
+               "layout %.2f ms (%.0f ns/node)\n",
+               shuffled ? " (shuffled)" : "",
+               (double)(heap_in_use() - heap) / n, (built - start) * 1e3,
+               elapsed * 1e3, elapsed * 1e9 / n);
+        bool same = true;
+        for (uint32_t i = 0; i < n; ++i) {
+            same &= labels[i]->xcoord == layout->xcoord[i];
+            free(labels[i]);
+        }
+        if (!same) {
+            printf("layout: coordinates differ\n");
+        }
+    }
+
+    flat_layout_free(layout);
+    free(order);
+    free(labels);
+    compact_tree_free(tree);
+    free_parse_result_contents(result);
+    free(result);
+    free(corpus);
+}
+
+/*
+  Flat layouts with and without the subtree memo, of trees that
+  repeat a lot and of one that doesn't:
+  - nested MAX(a, b) expansions, where each level copies the one below
+  - a long sum of the same term
+  - the corpus, which repeats a few sample expressions
+  - a sum of products of different lengths, whose subtrees of four or
+    more nodes are all different, for what the memo costs when it
+    never helps
+ */
+static void bench_memo() {
+    const char* max_fmt = "((%s) > (y) ? (%s) : (y))";
+    char* nested = strdup("x");
+    for (int i = 0; i < 14; ++i) {
+        char* next = malloc(strlen(nested) * 2 + strlen(max_fmt));
+        sprintf(next, max_fmt, nested, nested);
+        free(nested);
+        nested = next;
+    }
+    const char* term = "(x)->a.b[i] * f((x)->a.b, (x)->c)";
+    int n_terms = 20000;
+    char* sum = malloc((strlen(term) + 3) * n_terms);
+    char* end = sum;
+    for (int i = 0; i < n_terms; ++i) {
+        end += sprintf(end, "%s%s", i ? " + " : "", term);
+    }
+    char* corpus = make_corpus(1 << 22);
+    char* products = malloc(32 * n_terms * 10);
+    end = products;
+    for (int i = 0; i < n_terms * 10; ++i) {
+        end += sprintf(end, "%sx%d * y", i ? " + " : "", i);
+    }
+
+    const char* names[] = {"nested MAX", "repeated terms", "corpus",
+                           "distinct products"};
+    const char* exprs[] = {nested, sum, corpus, products};
+    struct walker_layout_rules rules = {10, 20, 30};
+    for (int i = 0; i < 4; ++i) {
+        struct parse_result* result = parse(exprs[i], 0);
+        struct compact_tree* tree = compact_tree_new(result->node, exprs[i]);
+        struct flat_layout* layouts[2];
+        double elapsed[2];
+        for (int memoize = 0; memoize < 2; ++memoize) {
+            layouts[memoize] = compact_flat_layout(tree);
+            layouts[memoize]->memoize = memoize;
+            int iterations = 5;
+            double start = now();
+            for (int j = 0; j < iterations; ++j) {
+                flat_layout_run(layouts[memoize], &rules, 500, 0);
+            }
+            elapsed[memoize] = (now() - start) / iterations;
+        }
+        printf("memo: %s, %u nodes: plain %.2f ms, memoized %.2f ms\n",
+               names[i], tree->n_nodes, elapsed[0] * 1e3, elapsed[1] * 1e3);
+        if (memcmp(layouts[0]->xcoord, layouts[1]->xcoord,
+                   tree->n_nodes * sizeof(double))) {
+            printf("memo: coordinates differ\n");
+        }
+        flat_layout_free(layouts[0]);
+        flat_layout_free(layouts[1]);
+        compact_tree_free(tree);
+        free_parse_result_contents(result);
+        free(result);
+    }
+    free(nested);
+    free(sum);
+    free(corpus);
+    free(products);
+}
+
+/*
+  Parses macro-expanded expressions, with and without hash-consing:
+  nested MAX(a, b) expansions, which repeat each operand twice per
+  level, and a long sum of the same few member accesses.
+ */
+static void bench_share() {
+    const char* max_fmt = "((%s) > (y) ? (%s) : (y))";
+    char* nested = strdup("x");
+    for (int i = 0; i < 14; ++i) {
+        char* next = malloc(strlen(nested) * 2 + strlen(max_fmt));
+        sprintf(next, max_fmt, nested, nested);
+        free(nested);
+        nested = next;
+    }
+    const char* term = "(x)->a.b[i] * f((x)->a.b, (x)->c)";
+    int n_terms = 20000;
+    char* sum = malloc((strlen(term) + 3) * n_terms);
+    char* end = sum;
+    for (int i = 0; i < n_terms; ++i) {
+        end += sprintf(end, "%s%s", i ? " + " : "", term);
+    }
+
+    const char* names[] = {"nested MAX", "repeated terms"};
+    const char* exprs[] = {nested, sum};
+    struct parser_ctx* ctx = parser_ctx_new();
+    for (int i = 0; i < 2; ++i) {
+        for (int hash_consing = 0; hash_consing < 2; ++hash_consing) {
+            parser_ctx_set_hash_consing(ctx, hash_consing);
+            int iterations = 10;
+            double start = now();
+            for (int j = 0; j < iterations; ++j) {
+                parser_ctx_parse(ctx, exprs[i], 0);
+            }
+            double elapsed = now() - start;
+            struct parse_sharing_stats stats;
+            parser_ctx_get_sharing_stats(ctx, &stats);
+            printf("share: %s, %s: %ld nodes, %ld unique (%zu bytes), "
+                   "%.2f ms\n", names[i],
+                   hash_consing ? "hash-consed" : "plain", stats.nodes,
+                   stats.unique_nodes,
+                   stats.unique_nodes * sizeof(struct parse_tree_node),
+                   elapsed / iterations * 1e3);
+        }
+    }
+    parser_ctx_free(ctx);
+    free(nested);
+    free(sum);
+}
+
+/*
+  The straightforward way to evaluate, for comparison: walk the tree
+  for each record, decoding literals and looking identifiers up by
+  name as they come.  Only handles what bench_eval's expression uses,
+  and everything as doubles.
+ */
+static double walk_eval(struct parse_tree_node* node, const char** names,
+                        const double* values) {
+    struct parse_tree_node* left = node->first_child;
+    struct parse_tree_node* right = left ? left->next_sibling : 0;
+    switch (node->op) {
+    case LITERAL_OR_ID:
+        for (int i = 0; names[i]; ++i) {
+            if (!strncmp(names[i], node->text, node->text_len) &&
+                !names[i][node->text_len]) {
+                return values[i];
+            }
+        }
+        return strtod(node->text, 0);
+    case PLUS:
+        return walk_eval(left, names, values) + walk_eval(right, names, values);
+    case MINUS:
+        return walk_eval(left, names, values) - walk_eval(right, names, values);
+    case STAR:
+        return walk_eval(left, names, values) * walk_eval(right, names, values);
+    case GT:
+        return walk_eval(left, names, values) > walk_eval(right, names, values);
+    case AMPERSAND:
+        return (long)walk_eval(left, names, values) &
+            (long)walk_eval(right, names, values);
+    case DOUBLE_AMPERSAND:
+        return walk_eval(left, names, values) &&
+            walk_eval(right, names, values);
+    case QUESTION:
+        return walk_eval(left, names, values)
+            ? walk_eval(right->first_child, names, values)
+            : walk_eval(right->first_child->next_sibling, names, values);
+    default:
+        return 0;
+    }
+}
+
+/* Evaluates an expression over a million records */
+static void bench_eval() {
+    const char* expr = "price * qty > 100 && (flags & 4) ? "
+        "price * qty * 0.9 - discount : price * qty + tax";
+    const char* names[] = {"price", "qty", "flags", "discount", "tax", 0};
+    int n_records = 1000000;
+    double* records = malloc(n_records * 5 * sizeof(double));
+    for (int i = 0; i < n_records * 5; ++i) {
+        records[i] = (i * 7919L) % 61;
+    }
+    struct parse_result* result = parse(expr, 0);
+
+    double start = now();
+    double walk_sum = 0;
+    for (int i = 0; i < n_records; ++i) {
+        walk_sum += walk_eval(result->node, names, records + i * 5);
+    }
+    double elapsed = now() - start;
+    printf("eval: tree walk %.1f ns/record\n", elapsed / n_records * 1e9);
+
+    char* error;
+    struct eval_program* program = eval_compile(result->node, &error);
+    int slot_fields[5];
+    for (int i = 0; i < eval_program_n_slots(program); ++i) {
+        for (int j = 0; names[j]; ++j) {
+            if (!strcmp(names[j], eval_program_slot_name(program, i))) {
+                slot_fields[i] = j;
+            }
+        }
+    }
+    struct eval_value slots[5];
+    double vm_sum = 0;
+    start = now();
+    for (int i = 0; i < n_records; ++i) {
+        const double* record = records + i * 5;
+        for (int j = 0; j < 5; ++j) {
+            /* flags is an integer, for & */
+            slots[j] = slot_fields[j] == 2
+                ? eval_int((int64_t)record[2])
+                : eval_double(record[slot_fields[j]]);
+        }
+        struct eval_value value;
+        eval_run(program, slots, 0, 0, &value);
+        vm_sum += value.type == EVAL_INT ? value.i : value.d;
+    }
+    elapsed = now() - start;
+    printf("eval: bytecode %.1f ns/record\n", elapsed / n_records * 1e9);
+    if (walk_sum != vm_sum) {
+        printf("eval: results differ\n");
+    }
+
+    /* built, then loaded from the cache */
+    char dir[] = "/tmp/bench_eval.XXXXXX";
+    struct eval_native* native = 0;
+    bool have_dir = mkdtemp(dir) != 0;
+    if (have_dir) {
+        for (int pass = 0; pass < 2; ++pass) {
+            if (native) {
+                eval_native_free(native);
+            }
+            start = now();
+            native = eval_native_build(
+                (const struct eval_program* const*)&program, 1, dir, &error);
+            elapsed = now() - start;
+            if (!native) {
+                printf("eval: %s\n", error);
+                free(error);
+                break;
+            }
+            printf("eval: native %s in %.1f ms\n",
+                   pass == 0 ? "built" : "loaded", elapsed * 1e3);
+        }
+    }
+    if (native) {
+        eval_native_fn fn = eval_native_function(native, 0);
+        double native_sum = 0;
+        start = now();
+        for (int i = 0; i < n_records; ++i) {
+            const double* record = records + i * 5;
+            for (int j = 0; j < 5; ++j) {
+                slots[j] = slot_fields[j] == 2
+                    ? eval_int((int64_t)record[2])
+                    : eval_double(record[slot_fields[j]]);
+            }
+            struct eval_value value;
+            fn(slots, 0, 0, &value);
+            native_sum += value.type == EVAL_INT ? value.i : value.d;
+        }
+        elapsed = now() - start;
+        printf("eval: native %.1f ns/record\n", elapsed / n_records * 1e9);
+        if (native_sum != vm_sum) {
+            printf("eval: results differ\n");
+        }
+        eval_native_free(native);
+    }
+    if (have_dir) {
+        char command[64];
+        snprintf(command, sizeof(command), "rm -rf %s", dir);
+        if (system(command)) {
+            printf("eval: couldn't remove %s\n", dir);
+        }
+    }
+
+    eval_program_free(program);
+    free_parse_result_contents(result);
+    free(result);
+    free(records);
+}
+
+/*
+  Runs bench_eval's expression, and a filter, over a million rows held
+  in columns, one row at a time with eval_run and all at once with a
+  batch.
+ */
+static void bench_batch() {
+    const char* exprs[] = {
+        "price * qty > 100 && (flags & 4) ? "
+        "price * qty * 0.9 - discount : price * qty + tax",
+        "price * qty > 100 && (flags & 4)",
+        0
+    };
+    const char* names[] = {"price", "qty", "flags", "discount", "tax", 0};
+    long n_rows = 1000000;
+    void* columns[5];
+    for (int j = 0; j < 5; ++j) {
+        columns[j] = malloc(n_rows * sizeof(double));
+        for (long i = 0; i < n_rows; ++i) {
+            long value = ((i * 5 + j) * 7919L) % 61;
+            if (j == 2) {
+                ((int64_t*)columns[j])[i] = value;
+            } else {
+                ((double*)columns[j])[i] = value;
+            }
+        }
+    }
+    double* values = malloc(n_rows * sizeof(double));
+    uint64_t* selection = malloc((n_rows + 63) / 64 * sizeof(uint64_t));
+
+    for (const char** expr = exprs; *expr; ++expr) {
+        struct parse_result* result = parse(*expr, 0);
+        char* error;
+        struct eval_program* program = eval_compile(result->node, &error);
+        int n_slots = eval_program_n_slots(program);
+        const void* slot_columns[5];
+        enum eval_type types[5];
+        for (int i = 0; i < n_slots; ++i) {
+            for (int j = 0; names[j]; ++j) {
+                if (!strcmp(names[j], eval_program_slot_name(program, i))) {
+                    slot_columns[i] = columns[j];
+                    types[i] = j == 2 ? EVAL_INT : EVAL_DOUBLE;
+                }
+            }
+        }
+        const char* what = expr == exprs ? "values" : "filter";
+
+        struct eval_value slots[5];
+        double row_sum = 0;
+        long row_count = 0;
+        double start = now();
+        for (long i = 0; i < n_rows; ++i) {
+            for (int j = 0; j < n_slots; ++j) {
+                slots[j] = types[j] == EVAL_INT
+                    ? eval_int(((const int64_t*)slot_columns[j])[i])
+                    : eval_double(((const double*)slot_columns[j])[i]);
+            }
+            struct eval_value value;
+            eval_run(program, slots, 0, 0, &value);
+            double d = value.type == EVAL_INT ? value.i : value.d;
+            row_sum += d;
+            row_count += d != 0;
+        }
+        double elapsed = now() - start;
+        printf("batch: %s by row %.1f ns/row\n", what,
+               elapsed / n_rows * 1e9);
+
+        struct eval_batch* batch = eval_batch_new(program, types, &error);
+        double batch_sum = 0;
+        long batch_count = 0;
+        start = now();
+        if (expr == exprs) {
+            eval_batch_run(batch, slot_columns, n_rows, values);
+        } else {
+            eval_batch_select(batch, slot_columns, n_rows, selection);
+        }
+        elapsed = now() - start;
+        printf("batch: %s in batches %.1f ns/row\n", what,
+               elapsed / n_rows * 1e9);
+        for (long i = 0; i < n_rows; ++i) {
+            if (expr == exprs) {
+                batch_sum += values[i];
+                batch_count += values[i] != 0;
+            } else if (selection[i / 64] >> (i % 64) & 1) {
+                batch_sum++;
+                batch_count++;
+            }
+        }
+        if (batch_count != row_count ||
+            (expr == exprs && batch_sum != row_sum)) {
+            printf("batch: results differ\n");
+        }
+
+        eval_batch_free(batch);
+        eval_program_free(program);
+        free_parse_result_contents(result);
+        free(result);
+    }
+    for (int j = 0; j < 5; ++j) {
+        free(columns[j]);
+    }
+    free(values);
+    free(selection);
+}
+
+struct benchmark {
+    const char* name;
+    void (*run)();
+};
+
+static struct benchmark benchmarks[] = {
+    {"lex", bench_lex},
+    {"scan", bench_scan},
+    {"parse", bench_parse},
+    {"binop", bench_binop},
+    {"typenames", bench_typenames},
+    {"compact", bench_compact},
+    {"print", bench_print},
+    {"stream", bench_stream},
+    {"wide", bench_wide},
+    {"lod", bench_lod},
+    {"precision", bench_precision},
+    {"layout", bench_layout},
+    {"memo", bench_memo},
+    {"share", bench_share},
+    {"eval", bench_eval},
+    {"batch", bench_batch},
+    {0, 0}
+};
+
+int main(int argc, char** argv) {
+    for (struct benchmark* bench = benchmarks; bench->name; ++bench) {
+        int selected = argc == 1;
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], bench->name) == 0) {
+                selected = 1;
+            }
+        }
+        if (selected) {
+            bench->run();
+        }
+    }
+    return 0;
+}
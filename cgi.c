@@ -85,8 +85,12 @@ static struct cgi* parse_query_string(const char* query_string) {
         strtok_arg = 0;
         char* var_name = next_tok;
         char* value = strchr(next_tok, '=');
-        *value = 0;
-        value ++;
+        if (value) {
+            *value++ = 0;
+        } else {
+            /* just a name, as in a&b=c */
+            value = "";
+        }
         struct cgi_var* var = cgi_get_var(cgi, var_name);
         if (var) {
             add_value(var, value);
@@ -114,3 +118,16 @@ struct cgi* cgi_init() {
 
     return parse_query_string("");
 }
+
+void cgi_free(struct cgi* cgi) {
+    for (int i = 0; i < cgi->n_vars; ++i) {
+        struct cgi_var* var = cgi->vars + i;
+        free(var->var);
+        for (int j = 0; j < var->n_values; ++j) {
+            free(var->values[j]);
+        }
+        free(var->values);
+    }
+    free(cgi->vars);
+    free(cgi);
+}
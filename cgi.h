@@ -21,5 +21,6 @@ struct cgi {
 
 struct cgi_var* cgi_get_var(struct cgi* cgi, const char* var_name);
 struct cgi* cgi_init();
+void cgi_free(struct cgi* cgi);
 
 #endif
@@ -2,8 +2,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "cgi.h"
+#include "render_cache.h"
+#include "svg.h"
 
 struct var_spec {
     char* var;
@@ -51,9 +56,345 @@ struct test_spec specs[] = {
       }
      }
     },
+    /* a name without a value */
+    {"a&b=c", 2,
+     {{"a", 1,
+       {""}
+         },
+      {"b", 1,
+       {"c"}
+      }
+     }
+    },
     {0}
 };
 
+/*
+  Adds up the sizes of the entries in the cache in dir, counting
+  leftover temporary files in *n_tmp.
+ */
+static long cache_dir_bytes(const char* dir, int* n_tmp) {
+    long total = 0;
+    *n_tmp = 0;
+    char path[512];
+    for (int shard = 0; shard < 256; ++shard) {
+        snprintf(path, sizeof(path), "%s/%02x", dir, shard);
+        DIR* shard_dir = opendir(path);
+        if (!shard_dir) {
+            continue;
+        }
+        struct dirent* dirent;
+        while ((dirent = readdir(shard_dir))) {
+            if (strncmp(dirent->d_name, ".tmp.", 5) == 0) {
+                (*n_tmp)++;
+            }
+            if (dirent->d_name[0] == '.') {
+                continue;
+            }
+            char entry[1024];
+            snprintf(entry, sizeof(entry), "%s/%s", path, dirent->d_name);
+            struct stat st;
+            if (stat(entry, &st) == 0) {
+                total += st.st_size;
+            }
+        }
+        closedir(shard_dir);
+    }
+    return total;
+}
+
+static void remove_cache_dir(const char* dir) {
+    char path[512];
+    for (int shard = 0; shard < 256; ++shard) {
+        snprintf(path, sizeof(path), "%s/%02x", dir, shard);
+        DIR* shard_dir = opendir(path);
+        if (!shard_dir) {
+            continue;
+        }
+        struct dirent* dirent;
+        while ((dirent = readdir(shard_dir))) {
+            if (strcmp(dirent->d_name, ".") && strcmp(dirent->d_name, "..")) {
+                char entry[1024];
+                snprintf(entry, sizeof(entry), "%s/%s", path, dirent->d_name);
+                unlink(entry);
+            }
+        }
+        closedir(shard_dir);
+        rmdir(path);
+    }
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static int test_render_cache() {
+    int bad = 0;
+    char dir[] = "/tmp/cgitest.XXXXXX";
+    if (!mkdtemp(dir)) {
+        printf("render cache: can't make a temporary directory\n");
+        return 1;
+    }
+
+    long max_bytes = 8192;
+    struct render_cache* cache = render_cache_open(dir, max_bytes);
+    if (!cache) {
+        printf("render cache: can't open %s\n", dir);
+        return 1;
+    }
+
+    size_t size;
+    char* data = render_cache_get(cache, "a+b", 0, 0, &size);
+    if (data) {
+        printf("render cache: hit in an empty cache\n");
+        free(data);
+        bad++;
+    }
+
+    const char* svg = "<svg>a+b</svg>";
+    render_cache_put(cache, "a+b", 0, 0, svg, strlen(svg));
+    data = render_cache_get(cache, "a+b", 0, 0, &size);
+    if (!data || size != strlen(svg) || memcmp(data, svg, size)) {
+        printf("render cache: stored entry not found\n");
+        bad++;
+    }
+    free(data);
+
+    /* the typenames and options are part of the key */
+    const char* other_keys[][3] = {
+        {"a+b", "foo", 0},
+        {"a+b", 0, "depth=3"},
+        {"a+c", 0, 0},
+    };
+    for (int i = 0; i < 3; ++i) {
+        data = render_cache_get(cache, other_keys[i][0], other_keys[i][1],
+                                other_keys[i][2], &size);
+        if (data) {
+            printf("render cache: hit for a different key (%d)\n", i);
+            free(data);
+            bad++;
+        }
+    }
+
+    struct render_cache_stats stats;
+    render_cache_get_stats(cache, &stats);
+    if (stats.hits != 1 || stats.misses != 4) {
+        printf("render cache: %ld hits and %ld misses, expected 1 and 4\n",
+               stats.hits, stats.misses);
+        bad++;
+    }
+
+    /* fill it well past the bound, rereading the first entry as we go
+       so that it stays recently used */
+    char expr[32];
+    char body[512];
+    memset(body, 'x', sizeof(body));
+    for (int i = 0; i < 200; ++i) {
+        snprintf(expr, sizeof(expr), "x%d", i);
+        render_cache_put(cache, expr, 0, 0, body, sizeof(body));
+        if (i % 4 == 0) {
+            free(render_cache_get(cache, "a+b", 0, 0, &size));
+        }
+    }
+    int n_tmp;
+    long on_disk = cache_dir_bytes(dir, &n_tmp);
+    render_cache_get_stats(cache, &stats);
+    if (on_disk > max_bytes) {
+        printf("render cache: %ld bytes on disk, bound is %ld\n",
+               on_disk, max_bytes);
+        bad++;
+    }
+    if (stats.bytes != on_disk) {
+        printf("render cache: stats say %ld bytes, %ld on disk\n",
+               stats.bytes, on_disk);
+        bad++;
+    }
+    if (n_tmp) {
+        printf("render cache: %d temporary files left\n", n_tmp);
+        bad++;
+    }
+    data = render_cache_get(cache, "a+b", 0, 0, &size);
+    if (!data) {
+        printf("render cache: recently used entry was evicted\n");
+        bad++;
+    }
+    free(data);
+    data = render_cache_get(cache, "x0", 0, 0, &size);
+    if (data) {
+        printf("render cache: oldest entry was not evicted\n");
+        free(data);
+        bad++;
+    }
+
+    render_cache_close(cache);
+    remove_cache_dir(dir);
+    return bad;
+}
+
+/*
+  SVGs with different options are cached apart, however long their
+  root paths are and however much of them they share.
+ */
+static int test_svg_options_key() {
+    int bad = 0;
+    char dir[] = "/tmp/cgitest.XXXXXX";
+    if (!mkdtemp(dir)) {
+        printf("svg options key: can't make a temporary directory\n");
+        return 1;
+    }
+    struct render_cache* cache = render_cache_open(dir, 1 << 20);
+
+    /* 1.1.1...1, with 33 ones, and the same with .0 after it */
+    char path[80] = "1";
+    for (int i = 1; i < 33; ++i) {
+        strcat(path, ".1");
+    }
+    char longer_path[sizeof(path) + 2];
+    snprintf(longer_path, sizeof(longer_path), "%s.0", path);
+
+    struct svg_options options = {0};
+    set_svg_option(&options, "root", path);
+    char* key = svg_options_key(&options);
+    set_svg_option(&options, "root", longer_path);
+    char* longer_key = svg_options_key(&options);
+    if (!strcmp(key, longer_key)) {
+        printf("svg options key: roots %s and %s share a key\n", path,
+               longer_path);
+        bad++;
+    }
+
+    const char* svg = "<svg>f(a,b)</svg>";
+    render_cache_put(cache, "f(a,b)", 0, key, svg, strlen(svg));
+    size_t size;
+    char* data = render_cache_get(cache, "f(a,b)", 0, longer_key, &size);
+    if (data) {
+        printf("svg options key: hit for a longer root path\n");
+        free(data);
+        bad++;
+    }
+
+    free(key);
+    free(longer_key);
+    render_cache_close(cache);
+    remove_cache_dir(dir);
+    return bad;
+}
+
+/* Returns what expr.cgi writes for query, malloced, setting *size */
+static char* run_expr_cgi(const char* query, size_t* size) {
+    setenv("QUERY_STRING", query, 1);
+    FILE* cgi = popen("./expr.cgi", "r");
+    if (!cgi) {
+        return 0;
+    }
+    size_t allocated = 4096;
+    char* output = malloc(allocated);
+    *size = 0;
+    size_t got;
+    while ((got = fread(output + *size, 1, allocated - *size - 1, cgi))) {
+        *size += got;
+        if (allocated - *size == 1) {
+            allocated *= 2;
+            output = realloc(output, allocated);
+        }
+    }
+    output[*size] = 0;
+    pclose(cgi);
+    return output;
+}
+
+/*
+  Error pages are plain text, and don't repeat a bad option's value,
+  so that nothing in a query can put markup in an HTML page.
+ */
+static int test_cgi_errors() {
+    static const char* queries[] = {
+        "expr=a%2Bb&root=%3Cscript%3Ealert(1)%3C/script%3E",
+        "expr=a%2Bb&depth=%3Cscript%3E",
+        "expr=a%2Bb&format=%3Cscript%3E",
+        "expr=%3Cscript%3E",
+        "expr=a%2Bb&root=3",
+        "root=1",
+        0
+    };
+    int bad = 0;
+    unsetenv("EXPR_CACHE_DIR");
+    for (const char** query = queries; *query; ++query) {
+        size_t size;
+        char* output = run_expr_cgi(*query, &size);
+        const char* header = "Content-type: text/plain\n\nError: ";
+        if (!output || strncmp(output, header, strlen(header))) {
+            printf("expr.cgi?%s: expected a plain text error, got %s\n",
+                   *query, output ? output : "nothing");
+            bad++;
+        } else if ((strstr(*query, "root=") || strstr(*query, "depth=")) &&
+                   strstr(output, "script")) {
+            printf("expr.cgi?%s: repeated the bad value: %s\n", *query,
+                   output);
+            bad++;
+        }
+        free(output);
+    }
+    return bad;
+}
+
+/*
+  expr.cgi streams its output whether or not there's a cache, and gives
+  the same bytes without one, on a miss and on a hit, for an SVG a
+  few times the size of a sink's buffer.
+ */
+static int test_cgi_streaming() {
+    int bad = 0;
+    char dir[] = "/tmp/cgitest.XXXXXX";
+    if (!mkdtemp(dir)) {
+        printf("cgi streaming: can't make a temporary directory\n");
+        return 1;
+    }
+    /* a%2Ba%2B...a, which parses to about 2000 nodes */
+    size_t n_terms = 1000;
+    char* query = malloc(n_terms * 4 + 8);
+    char* pos = query + sprintf(query, "expr=a");
+    for (size_t i = 1; i < n_terms; ++i) {
+        pos += sprintf(pos, "%%2Ba");
+    }
+
+    unsetenv("EXPR_CACHE_DIR");
+    size_t size;
+    char* uncached = run_expr_cgi(query, &size);
+    const char* header = "Content-type: image/svg+xml\n\n<?xml";
+    if (!uncached || size < 2 * SINK_BUFFER_SIZE ||
+        strncmp(uncached, header, strlen(header))) {
+        printf("cgi streaming: expected a big SVG, got %zu bytes\n",
+               uncached ? size : 0);
+        bad++;
+    }
+    setenv("EXPR_CACHE_DIR", dir, 1);
+    for (int pass = 0; pass < 2 && uncached; ++pass) {
+        size_t cached_size;
+        char* cached = run_expr_cgi(query, &cached_size);
+        if (!cached || cached_size != size ||
+            memcmp(cached, uncached, size)) {
+            printf("cgi streaming: the SVG differs on a cache %s\n",
+                   pass ? "hit" : "miss");
+            bad++;
+        }
+        free(cached);
+    }
+    struct render_cache* cache = render_cache_open(dir, 1 << 20);
+    struct render_cache_stats stats;
+    if (render_cache_get_stats(cache, &stats) ||
+        stats.hits != 1 || stats.misses != 1) {
+        printf("cgi streaming: expected a miss, then a hit\n");
+        bad++;
+    }
+    render_cache_close(cache);
+    unsetenv("EXPR_CACHE_DIR");
+
+    free(uncached);
+    free(query);
+    remove_cache_dir(dir);
+    return bad;
+}
+
 int main() {
     int bad = 0;
 
@@ -87,8 +428,14 @@ int main() {
                 }
             }
         }
+        cgi_free(cgi);
     }
 
+    bad += test_render_cache();
+    bad += test_svg_options_key();
+    bad += test_cgi_errors();
+    bad += test_cgi_streaming();
+
     if (bad) {
         printf ("Found %d errors\n", bad);
     }
@@ -0,0 +1,212 @@
+#include "compact_tree.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct text_pool {
+    char* text;
+    uint32_t used;
+    uint32_t allocated;
+};
+
+static uint32_t add_text(struct text_pool* pool, const char* text, int len) {
+    if (pool->used + len > pool->allocated) {
+        while (pool->used + len > pool->allocated) {
+            pool->allocated *= 2;
+        }
+        pool->text = realloc(pool->text, pool->allocated);
+    }
+    uint32_t offset = pool->used;
+    memcpy(pool->text + offset, text, len);
+    pool->used += len;
+    return offset;
+}
+
+/*
+  The parse tree is walked in preorder with a stack of the nodes
+  above the current one, each with its index in the compact tree.
+ */
+struct path_entry {
+    struct parse_tree_node* node;
+    uint32_t index;
+};
+
+struct compact_builder {
+    struct compact_node* nodes;
+    uint32_t n_nodes;
+    uint32_t allocated;
+    struct text_pool pool;
+    const char* input;
+    uint32_t input_len;
+    bool too_long;
+};
+
+static uint32_t add_node(struct compact_builder* builder,
+                         struct parse_tree_node* node) {
+    if (builder->n_nodes == builder->allocated) {
+        builder->allocated *= 2;
+        builder->nodes = realloc(builder->nodes,
+                                 builder->allocated * sizeof(struct compact_node));
+    }
+    uint32_t index = builder->n_nodes++;
+    struct compact_node* compact = &builder->nodes[index];
+    compact->first_child = compact->next_sibling = COMPACT_NONE;
+    compact->text_offset = 0;
+    int len = node->text ? node->text_len : 0;
+    if (len > COMPACT_MAX_TEXT_LEN) {
+        builder->too_long = true;
+        len = 0;
+    }
+    if (len) {
+        if (node->text >= builder->input &&
+            node->text + len <= builder->input + builder->input_len) {
+            compact->text_offset = node->text - builder->input;
+        } else {
+            compact->text_offset = add_text(&builder->pool, node->text, len);
+        }
+    }
+    compact->op_and_len = node->op | (uint32_t)len << 8;
+    return index;
+}
+
+struct compact_tree* compact_tree_new(struct parse_tree_node* root,
+                                      const char* input) {
+    struct compact_builder builder;
+    builder.allocated = 64;
+    builder.nodes = malloc(builder.allocated * sizeof(struct compact_node));
+    builder.n_nodes = 0;
+    builder.input = input;
+    builder.input_len = strlen(input);
+    builder.pool.allocated = builder.input_len + 64;
+    builder.pool.text = malloc(builder.pool.allocated);
+    builder.pool.used = 0;
+    add_text(&builder.pool, input, builder.input_len);
+    builder.too_long = false;
+
+    int path_allocated = 64;
+    struct path_entry* path = malloc(path_allocated * sizeof(*path));
+    int depth = 0;
+
+    struct parse_tree_node* node = root;
+    uint32_t index = add_node(&builder, root);
+    while (1) {
+        if (node->first_child) {
+            if (depth == path_allocated) {
+                path_allocated *= 2;
+                path = realloc(path, path_allocated * sizeof(*path));
+            }
+            path[depth].node = node;
+            path[depth].index = index;
+            depth++;
+            node = node->first_child;
+            uint32_t child = add_node(&builder, node);
+            builder.nodes[index].first_child = child;
+            index = child;
+            continue;
+        }
+        /* go up until there's a next sibling */
+        while (depth && !node->next_sibling) {
+            depth--;
+            node = path[depth].node;
+            index = path[depth].index;
+        }
+        if (!depth) {
+            break;
+        }
+        node = node->next_sibling;
+        uint32_t sibling = add_node(&builder, node);
+        builder.nodes[index].next_sibling = sibling;
+        index = sibling;
+    }
+    free(path);
+
+    struct compact_tree* tree = 0;
+    if (!builder.too_long) {
+        size_t nodes_size = builder.n_nodes * sizeof(struct compact_node);
+        tree = malloc(sizeof(struct compact_tree));
+        tree->n_nodes = builder.n_nodes;
+        tree->text_size = builder.pool.used;
+        tree->nodes = malloc(nodes_size + builder.pool.used);
+        tree->text = (char*)tree->nodes + nodes_size;
+        memcpy(tree->nodes, builder.nodes, nodes_size);
+        memcpy(tree->text, builder.pool.text, builder.pool.used);
+    }
+    free(builder.nodes);
+    free(builder.pool.text);
+    return tree;
+}
+
+void compact_tree_free(struct compact_tree* tree) {
+    free(tree->nodes);
+    free(tree);
+}
+
+char* write_compact_tree_to_string(const struct compact_tree* tree,
+                                   char* buf) {
+    const struct compact_node* local_path[64];
+    const struct compact_node** path = local_path;
+    int allocated = sizeof(local_path) / sizeof(local_path[0]);
+    int depth = 0;
+
+    const struct compact_node* cur = tree->nodes;
+    while (1) {
+        buf = print_node_start(compact_op(cur), compact_text(tree, cur),
+                               compact_text_len(cur), buf);
+        if (cur->first_child) {
+            if (depth == allocated) {
+                allocated *= 2;
+                if (path == local_path) {
+                    path = malloc(allocated * sizeof(*path));
+                    memcpy(path, local_path, sizeof(local_path));
+                } else {
+                    path = realloc(path, allocated * sizeof(*path));
+                }
+            }
+            path[depth++] = cur;
+            cur = compact_first_child(tree, cur);
+            continue;
+        }
+        buf = print_node_end(compact_op(cur), buf);
+
+        /* go up until there's a next sibling to write */
+        while (depth) {
+            const struct compact_node* parent = path[depth - 1];
+            buf = print_after_child(compact_op(parent),
+                                    cur == compact_first_child(tree, parent),
+                                    !cur->next_sibling, buf);
+            if (cur->next_sibling) {
+                break;
+            }
+            buf = print_node_end(compact_op(parent), buf);
+            cur = parent;
+            depth--;
+        }
+        if (!depth) {
+            break;
+        }
+        cur = compact_next_sibling(tree, cur);
+    }
+
+    if (path != local_path) {
+        free(path);
+    }
+    *buf = 0;
+    return buf;
+}
+
+size_t compact_tree_string_length(const struct compact_tree* tree) {
+    /* the nodes can be taken in any order, so in the array's */
+    size_t len = 0;
+    for (uint32_t i = 0; i < tree->n_nodes; ++i) {
+        const struct compact_node* node = &tree->nodes[i];
+        enum token_type op = compact_op(node);
+        len += print_node_start_length(op, compact_text_len(node)) +
+            print_node_end_length(op);
+        for (const struct compact_node* child = compact_first_child(tree, node);
+             child; child = compact_next_sibling(tree, child)) {
+            len += print_after_child_length(
+                op, child == compact_first_child(tree, node),
+                !child->next_sibling);
+        }
+    }
+    return len;
+}
@@ -0,0 +1,76 @@
+/*
+  A parse tree packed into one block of memory: an array of 16-byte
+  nodes that refer to each other by index, followed by the text they
+  refer to by offset.  It takes half the memory of the pointer tree,
+  walks in array order, and can be copied or saved with one memcpy.
+ */
+#ifndef COMPACT_TREE_H
+#define COMPACT_TREE_H
+
+#include <stdint.h>
+
+#include "parse.h"
+
+/*
+  Nodes are in preorder, so the root is node 0.  No other node can
+  point to the root, so 0 means "none" for first_child and
+  next_sibling.
+ */
+struct compact_node {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t text_offset;
+    /* the op in the low 8 bits, the text's length above them */
+    uint32_t op_and_len;
+};
+
+#define COMPACT_NONE 0
+#define COMPACT_MAX_TEXT_LEN ((1 << 24) - 1)
+
+struct compact_tree {
+    uint32_t n_nodes;
+    uint32_t text_size;
+    /* nodes and text are one allocation, nodes first */
+    struct compact_node* nodes;
+    char* text;
+};
+
+/*
+  The text begins with a copy of input.  Text that isn't a slice of
+  input (typecast and sizeof type names) is added after it.  Returns
+  NULL if a node's text is longer than COMPACT_MAX_TEXT_LEN.
+ */
+struct compact_tree* compact_tree_new(struct parse_tree_node* root,
+                                      const char* input);
+void compact_tree_free(struct compact_tree* tree);
+
+static inline enum token_type compact_op(const struct compact_node* node) {
+    return node->op_and_len & 0xff;
+}
+
+static inline int compact_text_len(const struct compact_node* node) {
+    return node->op_and_len >> 8;
+}
+
+static inline const char* compact_text(const struct compact_tree* tree,
+                                       const struct compact_node* node) {
+    return tree->text + node->text_offset;
+}
+
+/* NULL if the node has no children (or no next sibling) */
+static inline const struct compact_node* compact_first_child(
+    const struct compact_tree* tree, const struct compact_node* node) {
+    return node->first_child ? &tree->nodes[node->first_child] : 0;
+}
+
+static inline const struct compact_node* compact_next_sibling(
+    const struct compact_tree* tree, const struct compact_node* node) {
+    return node->next_sibling ? &tree->nodes[node->next_sibling] : 0;
+}
+
+/* Like write_tree_to_string and tree_string_length */
+char* write_compact_tree_to_string(const struct compact_tree* tree,
+                                   char* buf);
+size_t compact_tree_string_length(const struct compact_tree* tree);
+
+#endif
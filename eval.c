@@ -0,0 +1,934 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "eval.h"
+#include "eval_bytecode.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char* eval_status_message(enum eval_status status) {
+    switch (status) {
+    case EVAL_OK:
+        return "OK";
+    case EVAL_DIVIDE_BY_ZERO:
+        return "Division by zero";
+    case EVAL_NOT_INTEGER:
+        return "Integer operator applied to a double";
+    case EVAL_BAD_SHIFT:
+        return "Shift count out of range";
+    case EVAL_ACCESS_FAILED:
+        return "Member access or subscript failed";
+    case EVAL_BAD_CONVERSION:
+        return "Double out of range for an integer cast";
+    }
+    return "Unknown status";
+}
+
+static uint32_t hash_name(const char* name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int find_name(const struct name_table* table, const char* name,
+                     int len) {
+    if (!table->capacity) {
+        return -1;
+    }
+    uint32_t slot = hash_name(name, len) & (table->capacity - 1);
+    for (; table->index[slot] >= 0; slot = (slot + 1) & (table->capacity - 1)) {
+        const char* existing = table->names[table->index[slot]];
+        if (strncmp(existing, name, len) == 0 && existing[len] == 0) {
+            return table->index[slot];
+        }
+    }
+    return -1;
+}
+
+static void grow_name_index(struct name_table* table) {
+    free(table->index);
+    table->capacity = table->capacity ? table->capacity * 2 : 16;
+    table->index = malloc(table->capacity * sizeof(int));
+    memset(table->index, -1, table->capacity * sizeof(int));
+    for (int i = 0; i < table->count; ++i) {
+        const char* name = table->names[i];
+        uint32_t slot = hash_name(name, strlen(name)) & (table->capacity - 1);
+        while (table->index[slot] >= 0) {
+            slot = (slot + 1) & (table->capacity - 1);
+        }
+        table->index[slot] = i;
+    }
+}
+
+/* Returns the name's number, adding it if it's new */
+static int add_name(struct name_table* table, const char* name, int len) {
+    int found = find_name(table, name, len);
+    if (found >= 0) {
+        return found;
+    }
+    if (table->count == table->allocated) {
+        table->allocated = table->allocated ? table->allocated * 2 : 8;
+        table->names = realloc(table->names,
+                               table->allocated * sizeof(char*));
+    }
+    table->names[table->count++] = strndup(name, len);
+    if (table->count * 2 > table->capacity) {
+        grow_name_index(table);
+    } else {
+        uint32_t slot = hash_name(name, len) & (table->capacity - 1);
+        while (table->index[slot] >= 0) {
+            slot = (slot + 1) & (table->capacity - 1);
+        }
+        table->index[slot] = table->count - 1;
+    }
+    return table->count - 1;
+}
+
+static void free_name_table(struct name_table* table) {
+    for (int i = 0; i < table->count; ++i) {
+        free(table->names[i]);
+    }
+    free(table->names);
+    free(table->index);
+}
+
+int eval_program_n_slots(const struct eval_program* program) {
+    return program->slots.count;
+}
+
+const char* eval_program_slot_name(const struct eval_program* program,
+                                   int slot) {
+    return program->slots.names[slot];
+}
+
+int eval_program_find_slot(const struct eval_program* program,
+                           const char* name) {
+    return find_name(&program->slots, name, strlen(name));
+}
+
+int eval_program_n_fields(const struct eval_program* program) {
+    return program->fields.count;
+}
+
+const char* eval_program_field_name(const struct eval_program* program,
+                                    int field) {
+    return program->fields.names[field];
+}
+
+void eval_program_free(struct eval_program* program) {
+    free(program->code);
+    free(program->consts);
+    free_name_table(&program->slots);
+    free_name_table(&program->fields);
+    free(program);
+}
+
+/*
+  The compiler walks the tree with its own stack, like the parser and
+  the printers, so that deep expressions compile too.  Each frame is
+  a node being compiled; step says how far along it is, and next is
+  the child to compile next for the operators that just evaluate
+  their operands in order.
+ */
+struct compile_frame {
+    const struct parse_tree_node* node;
+    const struct parse_tree_node* next;
+    int step;
+    /* the instruction whose jump target is still to be filled in */
+    int patch;
+};
+
+struct compiler {
+    struct eval_program* program;
+    int allocated_code;
+    int allocated_consts;
+    int depth;
+    char* error;
+};
+
+static void compile_error(struct compiler* compiler, const char* message,
+                          ...) {
+    if (compiler->error) {
+        return;
+    }
+    va_list args;
+    va_start(args, message);
+    int size = vsnprintf(0, 0, message, args);
+    va_end(args);
+    compiler->error = malloc(size + 1);
+    va_start(args, message);
+    vsnprintf(compiler->error, size + 1, message, args);
+    va_end(args);
+}
+
+/* Appends an instruction, returning its index */
+static int emit(struct compiler* compiler, enum eval_op op, int arg) {
+    struct eval_program* program = compiler->program;
+    if (program->code_len == compiler->allocated_code) {
+        compiler->allocated_code *= 2;
+        program->code = realloc(program->code, compiler->allocated_code *
+                                sizeof(struct eval_insn));
+    }
+    program->code[program->code_len].op = op;
+    program->code[program->code_len].arg = arg;
+
+    switch (op) {
+    case OP_PUSH_CONST:
+    case OP_LOAD_SLOT:
+        compiler->depth++;
+        break;
+    case OP_POP:
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+    case OP_SHL: case OP_SHR:
+    case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+    case OP_BIT_AND: case OP_BIT_XOR: case OP_BIT_OR:
+    case OP_JUMP_IF_FALSE:
+    case OP_AND_JUMP:
+    case OP_OR_JUMP:
+    case OP_SUBSCRIPT:
+    case OP_RETURN:
+        /* for the conditional jumps, this is the path that falls
+           through */
+        compiler->depth--;
+        break;
+    default:
+        break;
+    }
+    if (compiler->depth > program->max_stack) {
+        program->max_stack = compiler->depth;
+    }
+    return program->code_len++;
+}
+
+static void emit_const(struct compiler* compiler, struct eval_value value) {
+    struct eval_program* program = compiler->program;
+    if (program->n_consts == compiler->allocated_consts) {
+        compiler->allocated_consts *= 2;
+        program->consts = realloc(program->consts, compiler->allocated_consts *
+                                  sizeof(struct eval_value));
+    }
+    program->consts[program->n_consts] = value;
+    emit(compiler, OP_PUSH_CONST, program->n_consts++);
+}
+
+static bool is_identifier(const struct parse_tree_node* node) {
+    if (node->op != LITERAL_OR_ID || !node->text_len) {
+        return false;
+    }
+    char c = node->text[0];
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+/* The value of one character of a character literal; moves *pos past it */
+static bool decode_char(const char** pos, const char* end, int64_t* value) {
+    const char* p = *pos;
+    if (p == end) {
+        return false;
+    }
+    if (*p != '\\') {
+        *value = (unsigned char)*p;
+        *pos = p + 1;
+        return true;
+    }
+    if (++p == end) {
+        return false;
+    }
+    static const char escapes[] = "n\nt\tr\rv\vf\fb\ba\a\\\\''\"\"??";
+    for (const char* e = escapes; *e; e += 2) {
+        if (*p == e[0]) {
+            *value = e[1];
+            *pos = p + 1;
+            return true;
+        }
+    }
+    int64_t v = 0;
+    if (*p == 'x') {
+        const char* start = ++p;
+        for (; p != end; ++p) {
+            int digit;
+            if (*p >= '0' && *p <= '9') {
+                digit = *p - '0';
+            } else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+                digit = (*p | 0x20) - 'a' + 10;
+            } else {
+                break;
+            }
+            v = v * 16 + digit;
+        }
+        if (p == start) {
+            return false;
+        }
+    } else if (*p >= '0' && *p <= '7') {
+        for (int i = 0; i < 3 && p != end && *p >= '0' && *p <= '7'; ++i) {
+            v = v * 8 + *p++ - '0';
+        }
+    } else {
+        return false;
+    }
+    *value = (unsigned char)v;
+    *pos = p;
+    return true;
+}
+
+/*
+  Decodes a number or character literal.  Integers are int64_t, with
+  any suffix ignored; anything with a decimal point or an exponent is
+  a double.
+ */
+static bool decode_literal(const char* text, int len,
+                           struct eval_value* value) {
+    if (text[0] == '\'') {
+        const char* pos = text + 1;
+        const char* end = text + len - 1;
+        int64_t c;
+        if (len < 3 || *end != '\'' || !decode_char(&pos, end, &c) ||
+            pos != end) {
+            return false;
+        }
+        *value = eval_int(c);
+        return true;
+    }
+
+    char* copy = strndup(text, len);
+    bool hex = len > 1 && copy[0] == '0' && (copy[1] | 0x20) == 'x';
+    bool is_double = strpbrk(copy, hex ? ".pP" : ".eE") != 0;
+    char* end;
+    if (is_double) {
+        *value = eval_double(strtod(copy, &end));
+        if (*end == 'f' || *end == 'F' || *end == 'l' || *end == 'L') {
+            end++;
+        }
+    } else {
+        *value = eval_int((int64_t)strtoull(copy, &end, 0));
+        while (*end && strchr("uUlL", *end)) {
+            end++;
+        }
+    }
+    bool ok = end != copy && !*end;
+    free(copy);
+    return ok;
+}
+
+/*
+  The words of the numeric types: how wide each makes the type (0 if
+  it doesn't say), whether it makes it unsigned, and the conversion
+  if it isn't to an integer.
+ */
+struct type_word {
+    const char* name;
+    int bits;
+    bool is_unsigned;
+    int op;
+};
+
+static const struct type_word type_words[] = {
+    {"char", 8, false, OP_TO_INT}, {"short", 16, false, OP_TO_INT},
+    {"int", 0, false, OP_TO_INT}, {"long", 64, false, OP_TO_INT},
+    {"signed", 0, false, OP_TO_INT}, {"unsigned", 0, true, OP_TO_INT},
+    {"const", 0, false, OP_TO_INT}, {"volatile", 0, false, OP_TO_INT},
+    {"int8_t", 8, false, OP_TO_INT}, {"int16_t", 16, false, OP_TO_INT},
+    {"int32_t", 32, false, OP_TO_INT}, {"int64_t", 64, false, OP_TO_INT},
+    {"uint8_t", 8, true, OP_TO_INT}, {"uint16_t", 16, true, OP_TO_INT},
+    {"uint32_t", 32, true, OP_TO_INT}, {"uint64_t", 64, true, OP_TO_INT},
+    {"size_t", 64, true, OP_TO_INT}, {"ssize_t", 64, false, OP_TO_INT},
+    {"ptrdiff_t", 64, false, OP_TO_INT}, {"intptr_t", 64, false, OP_TO_INT},
+    {"uintptr_t", 64, true, OP_TO_INT}, {"_Bool", 0, false, OP_TO_BOOL},
+    {"float", 0, false, OP_TO_DOUBLE}, {"double", 0, false, OP_TO_DOUBLE},
+    {0, 0, false, 0}
+};
+
+/*
+  What a typecast converts to, or -1 for types there's no value for.
+  For an integer type, sets *cast to its EVAL_CAST_BITS and
+  EVAL_CAST_UNSIGNED, with int 32 bits and long 64, as on LP64, and
+  plain char signed, as on x86.
+ */
+static int cast_op(const char* type, int len, int* cast) {
+    int result = -1;
+    int bits = 0;
+    bool is_unsigned = false;
+    const char* end = type + len;
+    /* the type's words are joined by spaces; every one has to be
+       numeric, and any floating one makes it a double */
+    for (const char* word = type; word < end; ) {
+        const char* word_end = memchr(word, ' ', end - word);
+        if (!word_end) {
+            word_end = end;
+        }
+        int word_len = word_end - word;
+        const struct type_word* found = type_words;
+        while (found->name && ((int)strlen(found->name) != word_len ||
+                               memcmp(found->name, word, word_len))) {
+            found++;
+        }
+        if (!found->name) {
+            return -1;
+        }
+        /* a double beats the rest, and _Bool beats an integer */
+        if (result < 0 || found->op == OP_TO_DOUBLE ||
+            (found->op == OP_TO_BOOL && result == OP_TO_INT)) {
+            result = found->op;
+        }
+        if (found->bits) {
+            bits = found->bits;
+        }
+        is_unsigned |= found->is_unsigned;
+        word = word_end + 1;
+    }
+    *cast = (bits ? bits : 32) | (is_unsigned ? EVAL_CAST_UNSIGNED : 0);
+    return result;
+}
+
+/* indexed by node type; what the operators that just evaluate their
+   operands in order compile to, plus one */
+static const unsigned char simple_ops[END_OF_EXPRESSION + 1] = {
+    [PLUS] = OP_ADD + 1,
+    [MINUS] = OP_SUB + 1,
+    [STAR] = OP_MUL + 1,
+    [SLASH] = OP_DIV + 1,
+    [PERCENT] = OP_MOD + 1,
+    [LEFT_SHIFT] = OP_SHL + 1,
+    [RIGHT_SHIFT] = OP_SHR + 1,
+    [LT] = OP_LT + 1,
+    [GT] = OP_GT + 1,
+    [LTE] = OP_LE + 1,
+    [GTE] = OP_GE + 1,
+    [IS_EQUAL] = OP_EQ + 1,
+    [BANG_EQUAL] = OP_NE + 1,
+    [AMPERSAND] = OP_BIT_AND + 1,
+    [CARET] = OP_BIT_XOR + 1,
+    [BAR] = OP_BIT_OR + 1,
+    [UNARY_MINUS] = OP_NEG + 1,
+    [TILDE] = OP_BIT_NOT + 1,
+    [BANG] = OP_NOT + 1,
+    [SUBSCRIPT] = OP_SUBSCRIPT + 1,
+};
+
+/* the operator in each compound assignment */
+static const unsigned char compound_ops[END_OF_EXPRESSION + 1] = {
+    [PLUS_EQUAL] = OP_ADD,
+    [MINUS_EQUAL] = OP_SUB,
+    [STAR_EQUAL] = OP_MUL,
+    [SLASH_EQUAL] = OP_DIV,
+    [PERCENT_EQUAL] = OP_MOD,
+    [LEFT_SHIFT_EQUAL] = OP_SHL,
+    [RIGHT_SHIFT_EQUAL] = OP_SHR,
+    [AMPERSAND_EQUAL] = OP_BIT_AND,
+    [CARET_EQUAL] = OP_BIT_XOR,
+    [BAR_EQUAL] = OP_BIT_OR,
+};
+
+/* The slot an assignment or increment writes, or -1 with an error */
+static int target_slot(struct compiler* compiler,
+                       const struct parse_tree_node* node,
+                       enum token_type op) {
+    if (!is_identifier(node)) {
+        compile_error(compiler, "Can only assign to identifiers with %s",
+                      token_names[op]);
+        return -1;
+    }
+    return add_name(&compiler->program->slots, node->text, node->text_len);
+}
+
+/*
+  Compiles the node on top of the stack as far as it can go without
+  compiling a child first.  Returns the child to compile next, or 0
+  when the node is done.
+ */
+static const struct parse_tree_node* compile_step(struct compiler* compiler,
+                                                  struct compile_frame* frame) {
+    const struct parse_tree_node* node = frame->node;
+    const struct parse_tree_node* left = node->first_child;
+    const struct parse_tree_node* right = left ? left->next_sibling : 0;
+    struct eval_program* program = compiler->program;
+    int step = frame->step++;
+
+    if (node->op == PLUS && !right) {
+        /* unary plus */
+        return step == 0 ? left : 0;
+    }
+    if (simple_ops[node->op]) {
+        if (frame->next) {
+            const struct parse_tree_node* child = frame->next;
+            frame->next = child->next_sibling;
+            return child;
+        }
+        emit(compiler, simple_ops[node->op] - 1, 0);
+        return 0;
+    }
+    if (compound_ops[node->op]) {
+        int slot = target_slot(compiler, left, node->op);
+        if (step == 0) {
+            emit(compiler, OP_LOAD_SLOT, slot);
+            return right;
+        }
+        emit(compiler, compound_ops[node->op], 0);
+        emit(compiler, OP_STORE_SLOT, slot);
+        return 0;
+    }
+
+    switch (node->op) {
+    case LITERAL_OR_ID:
+        if (is_identifier(node)) {
+            emit(compiler, OP_LOAD_SLOT,
+                 add_name(&program->slots, node->text, node->text_len));
+        } else {
+            struct eval_value value;
+            if (node->text[0] == '"') {
+                compile_error(compiler, "Can't evaluate string literals");
+            } else if (!decode_literal(node->text, node->text_len, &value)) {
+                compile_error(compiler, "Bad literal %.*s", node->text_len,
+                              node->text);
+            } else {
+                emit_const(compiler, value);
+            }
+        }
+        return 0;
+
+    case ASSIGN:
+        if (step == 0) {
+            return right;
+        }
+        emit(compiler, OP_STORE_SLOT, target_slot(compiler, left, ASSIGN));
+        return 0;
+
+    case PREINCREMENT:
+    case PREDECREMENT:
+    case POSTINCREMENT:
+    case POSTDECREMENT:
+    {
+        int slot = target_slot(compiler, left, node->op);
+        bool post = node->op == POSTINCREMENT || node->op == POSTDECREMENT;
+        emit(compiler, OP_LOAD_SLOT, slot);
+        if (post) {
+            emit(compiler, OP_LOAD_SLOT, slot);
+        }
+        emit_const(compiler, eval_int(1));
+        emit(compiler, node->op == PREINCREMENT || node->op == POSTINCREMENT
+             ? OP_ADD : OP_SUB, 0);
+        emit(compiler, OP_STORE_SLOT, slot);
+        if (post) {
+            emit(compiler, OP_POP, 0);
+        }
+        return 0;
+    }
+
+    case COMMA:
+        if (step == 0) {
+            return left;
+        }
+        if (step == 1) {
+            emit(compiler, OP_POP, 0);
+            return right;
+        }
+        return 0;
+
+    case DOUBLE_AMPERSAND:
+    case DOUBLE_BAR:
+        if (step == 0) {
+            return left;
+        }
+        if (step == 1) {
+            frame->patch = emit(compiler, node->op == DOUBLE_AMPERSAND
+                                ? OP_AND_JUMP : OP_OR_JUMP, 0);
+            return right;
+        }
+        emit(compiler, OP_TO_BOOL, 0);
+        program->code[frame->patch].arg = program->code_len;
+        return 0;
+
+    case QUESTION:
+    {
+        /* the right operand is "b : c" */
+        const struct parse_tree_node* then = right->first_child;
+        if (step == 0) {
+            return left;
+        }
+        if (step == 1) {
+            frame->patch = emit(compiler, OP_JUMP_IF_FALSE, 0);
+            return then;
+        }
+        if (step == 2) {
+            int jump = emit(compiler, OP_JUMP, 0);
+            program->code[frame->patch].arg = program->code_len;
+            frame->patch = jump;
+            /* the else branch starts without the then branch's value */
+            compiler->depth--;
+            return then->next_sibling;
+        }
+        program->code[frame->patch].arg = program->code_len;
+        return 0;
+    }
+
+    case DOT:
+    case ARROW:
+        if (step == 0) {
+            return left;
+        }
+        emit(compiler, node->op == DOT ? OP_MEMBER : OP_ARROW,
+             add_name(&program->fields, right->text, right->text_len));
+        return 0;
+
+    case DEREFERENCE:
+        if (step == 0) {
+            return left;
+        }
+        emit_const(compiler, eval_int(0));
+        emit(compiler, OP_SUBSCRIPT, 0);
+        return 0;
+
+    case TYPECAST:
+    {
+        int cast;
+        int op = cast_op(node->text, node->text_len, &cast);
+        if (op < 0) {
+            compile_error(compiler, "Can't evaluate a cast to %.*s",
+                          node->text_len, node->text);
+            return 0;
+        }
+        if (step == 0) {
+            return left;
+        }
+        emit(compiler, op, op == OP_TO_INT ? cast : 0);
+        return 0;
+    }
+
+    default:
+        compile_error(compiler, "Can't evaluate %s", token_names[node->op]);
+        return 0;
+    }
+}
+
+struct eval_program* eval_compile(const struct parse_tree_node* root,
+                                  char** error) {
+    struct eval_program* program = calloc(1, sizeof(struct eval_program));
+    struct compiler compiler = {.program = program, .allocated_code = 64,
+                                .allocated_consts = 16, .depth = 0,
+                                .error = 0};
+    program->code = malloc(compiler.allocated_code * sizeof(struct eval_insn));
+    program->consts = malloc(compiler.allocated_consts *
+                             sizeof(struct eval_value));
+
+    int allocated = 64;
+    int depth = 0;
+    struct compile_frame* frames = malloc(allocated * sizeof(*frames));
+    frames[depth++] = (struct compile_frame){root, root->first_child, 0, 0};
+    while (depth && !compiler.error) {
+        const struct parse_tree_node* child =
+            compile_step(&compiler, &frames[depth - 1]);
+        if (!child) {
+            depth--;
+            continue;
+        }
+        if (depth == allocated) {
+            allocated *= 2;
+            frames = realloc(frames, allocated * sizeof(*frames));
+        }
+        frames[depth++] =
+            (struct compile_frame){child, child->first_child, 0, 0};
+    }
+    free(frames);
+
+    if (compiler.error) {
+        *error = compiler.error;
+        eval_program_free(program);
+        return 0;
+    }
+    emit(&compiler, OP_RETURN, 0);
+    return program;
+}
+
+static inline double as_double(struct eval_value value) {
+    return value.type == EVAL_INT ? (double)value.i : value.d;
+}
+
+static inline bool is_true(struct eval_value value) {
+    return value.type == EVAL_INT ? value.i != 0 : value.d != 0;
+}
+
+/* the fixed-size stack is used up to this depth */
+#define LOCAL_STACK_SIZE 64
+
+/*
+  The dispatch loop uses computed goto where the compiler has it (GCC
+  and clang), which gives each instruction its own indirect branch,
+  and a switch otherwise.  Define EVAL_NO_COMPUTED_GOTO to get the
+  switch anyway.
+ */
+#if defined(__GNUC__) && !defined(EVAL_NO_COMPUTED_GOTO)
+#define EVAL_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+#ifdef EVAL_COMPUTED_GOTO
+#define CASE(name) op_##name:
+#define DISPATCH()                              \
+    do {                                        \
+        insn = pc++;                            \
+        goto *labels[insn->op];                 \
+    } while (0)
+#else
+#define CASE(name) case OP_##name:
+#define DISPATCH() continue
+#endif
+
+/* both ints: int_expr, on a and b; otherwise double_expr, on x and y */
+#define ARITH(name, int_expr, double_expr)                              \
+    CASE(name) {                                                        \
+        struct eval_value b = *--sp;                                    \
+        struct eval_value a = sp[-1];                                   \
+        if (a.type == EVAL_INT && b.type == EVAL_INT) {                 \
+            sp[-1].i = (int_expr);                                      \
+        } else {                                                        \
+            double x = as_double(a);                                    \
+            double y = as_double(b);                                    \
+            sp[-1] = eval_double(double_expr);                          \
+        }                                                               \
+        DISPATCH();                                                     \
+    }
+
+#define COMPARE(name, cmp)                                              \
+    CASE(name) {                                                        \
+        struct eval_value b = *--sp;                                    \
+        struct eval_value a = sp[-1];                                   \
+        if (a.type == EVAL_INT && b.type == EVAL_INT) {                 \
+            sp[-1].i = a.i cmp b.i;                                     \
+        } else {                                                        \
+            sp[-1] = eval_int(as_double(a) cmp as_double(b));           \
+        }                                                               \
+        DISPATCH();                                                     \
+    }
+
+#define BITWISE(name, op)                                               \
+    CASE(name) {                                                        \
+        struct eval_value b = *--sp;                                    \
+        if (sp[-1].type != EVAL_INT || b.type != EVAL_INT) {            \
+            status = EVAL_NOT_INTEGER;                                  \
+            goto done;                                                  \
+        }                                                               \
+        sp[-1].i = sp[-1].i op b.i;                                     \
+        DISPATCH();                                                     \
+    }
+
+/* int64 arithmetic wraps, as unsigned */
+#define WRAP(a, op, b) ((int64_t)((uint64_t)(a) op (uint64_t)(b)))
+
+enum eval_status eval_run(const struct eval_program* program,
+                          struct eval_value* slots,
+                          const struct eval_accessors* accessors,
+                          void* data, struct eval_value* result) {
+#ifdef EVAL_COMPUTED_GOTO
+#define OP_LABEL(name) &&op_##name,
+    static const void* const labels[N_OPS] = {EVAL_OPS(OP_LABEL)};
+#undef OP_LABEL
+#endif
+    struct eval_value local_stack[LOCAL_STACK_SIZE];
+    struct eval_value* stack = local_stack;
+    if (program->max_stack > LOCAL_STACK_SIZE) {
+        stack = malloc(program->max_stack * sizeof(struct eval_value));
+    }
+    /* the next free entry */
+    struct eval_value* sp = stack;
+    const struct eval_value* consts = program->consts;
+    const struct eval_insn* code = program->code;
+    const struct eval_insn* pc = code;
+    const struct eval_insn* insn;
+    enum eval_status status = EVAL_OK;
+
+#ifdef EVAL_COMPUTED_GOTO
+    DISPATCH();
+#else
+    for (;;) {
+        insn = pc++;
+        switch ((enum eval_op)insn->op) {
+#endif
+
+    CASE(PUSH_CONST)
+        *sp++ = consts[insn->arg];
+        DISPATCH();
+
+    CASE(LOAD_SLOT)
+        *sp++ = slots[insn->arg];
+        DISPATCH();
+
+    CASE(STORE_SLOT)
+        slots[insn->arg] = sp[-1];
+        DISPATCH();
+
+    CASE(POP)
+        sp--;
+        DISPATCH();
+
+    ARITH(ADD, WRAP(a.i, +, b.i), x + y)
+    ARITH(SUB, WRAP(a.i, -, b.i), x - y)
+    ARITH(MUL, WRAP(a.i, *, b.i), x * y)
+
+    CASE(DIV) {
+        struct eval_value b = *--sp;
+        struct eval_value a = sp[-1];
+        if (a.type == EVAL_INT && b.type == EVAL_INT) {
+            if (!b.i) {
+                status = EVAL_DIVIDE_BY_ZERO;
+                goto done;
+            }
+            /* INT64_MIN / -1 overflows; it wraps, like the rest */
+            sp[-1].i = b.i == -1 ? WRAP(0, -, a.i) : a.i / b.i;
+        } else {
+            sp[-1] = eval_double(as_double(a) / as_double(b));
+        }
+        DISPATCH();
+    }
+
+    CASE(MOD) {
+        struct eval_value b = *--sp;
+        if (sp[-1].type != EVAL_INT || b.type != EVAL_INT) {
+            status = EVAL_NOT_INTEGER;
+            goto done;
+        }
+        if (!b.i) {
+            status = EVAL_DIVIDE_BY_ZERO;
+            goto done;
+        }
+        sp[-1].i = b.i == -1 ? 0 : sp[-1].i % b.i;
+        DISPATCH();
+    }
+
+    CASE(SHL)
+    CASE(SHR) {
+        struct eval_value b = *--sp;
+        if (sp[-1].type != EVAL_INT || b.type != EVAL_INT) {
+            status = EVAL_NOT_INTEGER;
+            goto done;
+        }
+        if (b.i < 0 || b.i > 63) {
+            status = EVAL_BAD_SHIFT;
+            goto done;
+        }
+        sp[-1].i = insn->op == OP_SHL ? WRAP(sp[-1].i, <<, b.i)
+            : sp[-1].i >> b.i;
+        DISPATCH();
+    }
+
+    COMPARE(LT, <)
+    COMPARE(GT, >)
+    COMPARE(LE, <=)
+    COMPARE(GE, >=)
+    COMPARE(EQ, ==)
+    COMPARE(NE, !=)
+
+    BITWISE(BIT_AND, &)
+    BITWISE(BIT_XOR, ^)
+    BITWISE(BIT_OR, |)
+
+    CASE(NEG)
+        if (sp[-1].type == EVAL_INT) {
+            sp[-1].i = WRAP(0, -, sp[-1].i);
+        } else {
+            sp[-1].d = -sp[-1].d;
+        }
+        DISPATCH();
+
+    CASE(BIT_NOT)
+        if (sp[-1].type != EVAL_INT) {
+            status = EVAL_NOT_INTEGER;
+            goto done;
+        }
+        sp[-1].i = ~sp[-1].i;
+        DISPATCH();
+
+    CASE(NOT)
+        sp[-1] = eval_int(!is_true(sp[-1]));
+        DISPATCH();
+
+    CASE(TO_BOOL)
+        sp[-1] = eval_int(is_true(sp[-1]));
+        DISPATCH();
+
+    CASE(TO_INT)
+        if (sp[-1].type == EVAL_INT) {
+            sp[-1].i = eval_cast_int(sp[-1].i, insn->arg);
+        } else if (eval_cast_fits(sp[-1].d, insn->arg)) {
+            sp[-1] = eval_int(eval_cast_double(sp[-1].d, insn->arg));
+        } else {
+            status = EVAL_BAD_CONVERSION;
+            goto done;
+        }
+        DISPATCH();
+
+    CASE(TO_DOUBLE)
+        sp[-1] = eval_double(as_double(sp[-1]));
+        DISPATCH();
+
+    CASE(JUMP)
+        pc = code + insn->arg;
+        DISPATCH();
+
+    CASE(JUMP_IF_FALSE)
+        if (!is_true(*--sp)) {
+            pc = code + insn->arg;
+        }
+        DISPATCH();
+
+    CASE(AND_JUMP)
+        if (!is_true(sp[-1])) {
+            sp[-1] = eval_int(0);
+            pc = code + insn->arg;
+        } else {
+            sp--;
+        }
+        DISPATCH();
+
+    CASE(OR_JUMP)
+        if (is_true(sp[-1])) {
+            sp[-1] = eval_int(1);
+            pc = code + insn->arg;
+        } else {
+            sp--;
+        }
+        DISPATCH();
+
+    CASE(MEMBER)
+    CASE(ARROW)
+        if (!accessors || !accessors->member ||
+            !accessors->member(data, sp[-1], insn->arg,
+                               insn->op == OP_ARROW, &sp[-1])) {
+            status = EVAL_ACCESS_FAILED;
+            goto done;
+        }
+        DISPATCH();
+
+    CASE(SUBSCRIPT) {
+        struct eval_value index = *--sp;
+        if (!accessors || !accessors->subscript ||
+            !accessors->subscript(data, sp[-1], index, &sp[-1])) {
+            status = EVAL_ACCESS_FAILED;
+            goto done;
+        }
+        DISPATCH();
+    }
+
+    CASE(RETURN)
+        *result = *--sp;
+        goto done;
+
+#ifndef EVAL_COMPUTED_GOTO
+        default:
+            goto done;
+        }
+    }
+#endif
+
+done:
+    if (stack != local_stack) {
+        free(stack);
+    }
+    return status;
+}
+
+#ifdef EVAL_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
@@ -0,0 +1,165 @@
+/*
+  Evaluating parsed expressions against many records: a parse tree is
+  compiled once to bytecode for a small stack machine, which is then
+  run once per record.
+
+  Values are 64-bit integers or doubles, with C's usual arithmetic
+  conversions between them.  Every integer is held as an int64_t,
+  though: only a cast narrows one, wrapping as C does on two's
+  complement, and unsigned 64-bit values keep their bits.
+  Literals are decoded when compiling.  Each distinct identifier gets
+  a slot, numbered when compiling; the caller fills the slots in
+  before each run, and assignments, ++ and -- write back to them.
+  Member names are numbered the same way, and ., -> and [] (and
+  unary *, as [0]) go through accessors the caller supplies, which
+  get the numbers rather than the names.
+ */
+#ifndef EVAL_H
+#define EVAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parse.h"
+
+enum eval_type {
+    EVAL_INT,
+    EVAL_DOUBLE
+};
+
+struct eval_value {
+    enum eval_type type;
+    union {
+        int64_t i;
+        double d;
+    };
+};
+
+static inline struct eval_value eval_int(int64_t i) {
+    struct eval_value value = {.type = EVAL_INT, .i = i};
+    return value;
+}
+
+static inline struct eval_value eval_double(double d) {
+    struct eval_value value = {.type = EVAL_DOUBLE, .d = d};
+    return value;
+}
+
+/*
+  The accessors return false if the access fails, which stops the run
+  with EVAL_ACCESS_FAILED.  data is what was passed to eval_run.
+ */
+struct eval_accessors {
+    /* object.field, or object->field if arrow */
+    bool (*member)(void* data, struct eval_value object, int field,
+                   bool arrow, struct eval_value* result);
+    /* array[index] */
+    bool (*subscript)(void* data, struct eval_value array,
+                      struct eval_value index, struct eval_value* result);
+};
+
+enum eval_status {
+    EVAL_OK,
+    EVAL_DIVIDE_BY_ZERO,
+    /* %, <<, >>, &, ^, | or ~ on a double */
+    EVAL_NOT_INTEGER,
+    /* shifting by less than 0 or more than 63 */
+    EVAL_BAD_SHIFT,
+    EVAL_ACCESS_FAILED,
+    /* casting NaN, or a double out of the type's range, to an integer */
+    EVAL_BAD_CONVERSION
+};
+
+const char* eval_status_message(enum eval_status status);
+
+struct eval_program;
+
+/*
+  Compiles the tree at root.  Returns NULL on error, setting *error to
+  a malloced message: for the things there's no way to evaluate, like
+  function calls, strings, & and sizeof, and for assigning to anything
+  but an identifier.  The program doesn't point into the tree.
+ */
+struct eval_program* eval_compile(const struct parse_tree_node* root,
+                                  char** error);
+void eval_program_free(struct eval_program* program);
+
+int eval_program_n_slots(const struct eval_program* program);
+const char* eval_program_slot_name(const struct eval_program* program,
+                                   int slot);
+/* Returns the slot for identifier name, or -1 if it isn't used. */
+int eval_program_find_slot(const struct eval_program* program,
+                           const char* name);
+
+int eval_program_n_fields(const struct eval_program* program);
+const char* eval_program_field_name(const struct eval_program* program,
+                                    int field);
+
+/*
+  Runs program with slots (eval_program_n_slots of them) holding the
+  identifiers' values, putting the value of the expression in
+  *result.  accessors may be NULL if the expression has no member
+  accesses or subscripts.  A program may be run by any number of
+  threads at once, with different slots.
+ */
+enum eval_status eval_run(const struct eval_program* program,
+                          struct eval_value* slots,
+                          const struct eval_accessors* accessors,
+                          void* data, struct eval_value* result);
+
+/*
+  Evaluating a program over columns: each slot is bound to an array of
+  int64_t or double, and the program is run over all the rows at once,
+  EVAL_BATCH_ROWS at a time, with one vector loop per instruction.
+  &&, || and ?: evaluate both sides for every row and combine them
+  with masks, rather than branching per row; rows where a side
+  wouldn't have been evaluated can't fail, though.
+
+  Types are fixed per column, so they're checked once, by
+  eval_batch_new, which fails for integer operators on doubles as well
+  as for what batches don't do: assignments, ++ and --, and member
+  accesses and subscripts.  Unlike eval_run, ?: with an integer and a
+  double operand gives a double for every row, as in C, and what's
+  computed from it can come out differently: 3 / (c ? 1.5 : 0) is inf
+  in a batch where c is 0, but fails in eval_run, which divides by the
+  integer 0.  Without such a ?:, a batch fails exactly when evaluating
+  some row on its own would.  It fails at the first instruction that
+  fails for any row, though, so if rows fail in different ways its
+  status can be a later row's rather than the first failing row's.
+ */
+#define EVAL_BATCH_ROWS 1024
+
+struct eval_batch;
+
+/*
+  slot_types gives the type of each slot's column.  Returns NULL on
+  error, setting *error to a malloced message.  The batch refers to
+  program, which must outlive it.
+ */
+struct eval_batch* eval_batch_new(const struct eval_program* program,
+                                  const enum eval_type* slot_types,
+                                  char** error);
+void eval_batch_free(struct eval_batch* batch);
+
+enum eval_type eval_batch_result_type(const struct eval_batch* batch);
+
+/*
+  Evaluates n_rows rows, with columns[i] pointing to slot i's column,
+  putting each row's value in result, an array of the result type.
+  A batch holds the working space for a run, so it can only do one at
+  a time.  On failure the values of the rows before the failing block
+  are still written.
+ */
+enum eval_status eval_batch_run(struct eval_batch* batch,
+                                const void* const* columns, long n_rows,
+                                void* result);
+
+/*
+  Like eval_batch_run, but sets bit i % 64 of selection[i / 64] for
+  each row i whose value is true, and clears the rest.
+ */
+enum eval_status eval_batch_select(struct eval_batch* batch,
+                                   const void* const* columns, long n_rows,
+                                   uint64_t* selection);
+
+#endif
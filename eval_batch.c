@@ -0,0 +1,798 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "eval.h"
+#include "eval_bytecode.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __GNUC__
+#error "batch evaluation is written with GCC's vector extensions"
+#endif
+
+#ifdef __x86_64__
+#define BATCH_HAVE_AVX2 1
+#endif
+
+/*
+  A batch runs a plan made from the program's bytecode, with types
+  resolved: conversions are explicit, and the jumps become regions
+  that are evaluated under masks.  Each stack entry is a block of
+  EVAL_BATCH_ROWS values, and each region keeps the mask of the rows
+  its condition held for.
+ */
+enum batch_op {
+    BATCH_LOAD,         /* arg: slot */
+    BATCH_CONST,        /* arg: constant */
+    BATCH_POP,
+    BATCH_TO_DOUBLE,    /* arg: which entry, counting down from the top */
+    BATCH_TO_INT,       /* arg: the cast; type: of the operand */
+    BATCH_BINARY,       /* sub: the eval_op; type: of both operands */
+    BATCH_UNARY,        /* sub: the eval_op; type: of the operand */
+    /* pop a condition and start a region: && runs its right side
+       where it held, || where it didn't, ?: its then side */
+    BATCH_AND_BEGIN,
+    BATCH_OR_BEGIN,
+    BATCH_COND_BEGIN,
+    /* go on to ?:'s else side, where the condition didn't hold */
+    BATCH_COND_ELSE,
+    BATCH_AND_END,
+    BATCH_OR_END,
+    BATCH_COND_END
+};
+
+struct batch_insn {
+    uint8_t op;
+    uint8_t sub;
+    uint8_t type;
+    int32_t arg;
+};
+
+struct eval_batch {
+    const struct eval_program* program;
+    const enum eval_type* slot_types;
+    struct batch_insn* plan;
+    int plan_len;
+    enum eval_type result_type;
+    int max_stack;
+    int max_regions;
+
+    /* the working space: a block per stack entry, and where each
+       entry's values are (its block, or a column) */
+    int64_t* blocks;
+    const void** values;
+    /* per region: the rows its condition held for, and the rows that
+       are live inside it.  live[0] is the rows in the block. */
+    int64_t* conditions;
+    int64_t* live;
+    /* run_block, compiled for this CPU */
+    enum eval_status (*run_block)(struct eval_batch* batch,
+                                  const void* const* columns, long row,
+                                  int n_rows, uint64_t* selection);
+};
+
+typedef int64_t vint __attribute__((vector_size(32)));
+typedef uint64_t vuint __attribute__((vector_size(32)));
+typedef double vdouble __attribute__((vector_size(32)));
+
+#define LANES 4
+/*
+  The blocks are a cache line longer than they need to be, so that
+  the ones a kernel reads and writes don't all start at the same
+  offset in a page, where the loads would wait on the stores.
+ */
+#define BLOCK_STRIDE (EVAL_BATCH_ROWS + 8)
+
+static const char* op_sigils[N_OPS] = {
+    [OP_MOD] = "%", [OP_SHL] = "<<", [OP_SHR] = ">>", [OP_BIT_AND] = "&",
+    [OP_BIT_XOR] = "^", [OP_BIT_OR] = "|", [OP_BIT_NOT] = "~",
+};
+
+static void batch_error(char** error, const char* message, ...) {
+    va_list args;
+    va_start(args, message);
+    int size = vsnprintf(0, 0, message, args);
+    va_end(args);
+    *error = malloc(size + 1);
+    va_start(args, message);
+    vsnprintf(*error, size + 1, message, args);
+    va_end(args);
+}
+
+/* Appends to the batch's plan, which has room for it */
+static void plan(struct eval_batch* batch, enum batch_op op, int sub,
+                 enum eval_type type, int arg) {
+    struct batch_insn* insn = &batch->plan[batch->plan_len++];
+    insn->op = op;
+    insn->sub = sub;
+    insn->type = type;
+    insn->arg = arg;
+}
+
+/*
+  Converts whichever of the top two entries is an integer to a double,
+  if the other is a double.  Returns their common type.
+ */
+static enum eval_type unify(struct eval_batch* batch, enum eval_type* types,
+                            int depth) {
+    enum eval_type left = types[depth - 2];
+    enum eval_type right = types[depth - 1];
+    if (left == right) {
+        return left;
+    }
+    plan(batch, BATCH_TO_DOUBLE, 0, EVAL_DOUBLE, left == EVAL_INT ? 1 : 0);
+    types[depth - 2] = types[depth - 1] = EVAL_DOUBLE;
+    return EVAL_DOUBLE;
+}
+
+struct batch_region {
+    enum eval_op op;
+    /* where it ends; for ?:, where the then side ends until it's
+       reached */
+    int end;
+};
+
+static enum eval_status run_block_generic(struct eval_batch* batch,
+                                          const void* const* columns,
+                                          long row, int n_rows,
+                                          uint64_t* selection);
+#ifdef BATCH_HAVE_AVX2
+static enum eval_status run_block_avx2(struct eval_batch* batch,
+                                       const void* const* columns,
+                                       long row, int n_rows,
+                                       uint64_t* selection);
+#endif
+
+struct eval_batch* eval_batch_new(const struct eval_program* program,
+                                  const enum eval_type* slot_types,
+                                  char** error) {
+    struct eval_batch* batch = calloc(1, sizeof(struct eval_batch));
+    batch->program = program;
+    batch->slot_types = slot_types;
+    /* each instruction takes at most two steps of the plan, and so
+       does the end of the region it may start */
+    batch->plan = malloc(program->code_len * 4 * sizeof(struct batch_insn));
+
+    /* ?:'s then side stays on the stack while its else side is
+       evaluated, so that can be one deeper per region than in eval_run */
+    enum eval_type* types = malloc((program->max_stack + program->code_len
+                                    + 1) * sizeof(enum eval_type));
+    struct batch_region* regions = malloc(program->code_len *
+                                          sizeof(struct batch_region));
+    int depth = 0;
+    int n_regions = 0;
+    *error = 0;
+
+    for (int pc = 0; pc < program->code_len && !*error; ++pc) {
+        while (n_regions && regions[n_regions - 1].end == pc) {
+            switch (regions[--n_regions].op) {
+            case OP_AND_JUMP:
+                plan(batch, BATCH_AND_END, 0, EVAL_INT, 0);
+                break;
+            case OP_OR_JUMP:
+                plan(batch, BATCH_OR_END, 0, EVAL_INT, 0);
+                break;
+            default:
+            {
+                enum eval_type type = unify(batch, types, depth);
+                plan(batch, BATCH_COND_END, 0, type, 0);
+                depth--;
+                break;
+            }
+            }
+        }
+
+        const struct eval_insn* insn = &program->code[pc];
+        enum eval_op op = insn->op;
+        switch (op) {
+        case OP_PUSH_CONST:
+            plan(batch, BATCH_CONST, 0, program->consts[insn->arg].type,
+                 insn->arg);
+            types[depth++] = program->consts[insn->arg].type;
+            break;
+
+        case OP_LOAD_SLOT:
+            plan(batch, BATCH_LOAD, 0, slot_types[insn->arg], insn->arg);
+            types[depth++] = slot_types[insn->arg];
+            break;
+
+        case OP_POP:
+            plan(batch, BATCH_POP, 0, 0, 0);
+            depth--;
+            break;
+
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+        {
+            enum eval_type type = unify(batch, types, depth);
+            plan(batch, BATCH_BINARY, op, type, 0);
+            depth--;
+            types[depth - 1] = op >= OP_LT ? EVAL_INT : type;
+            break;
+        }
+
+        case OP_MOD: case OP_SHL: case OP_SHR:
+        case OP_BIT_AND: case OP_BIT_XOR: case OP_BIT_OR:
+            if (types[depth - 2] != EVAL_INT || types[depth - 1] != EVAL_INT) {
+                batch_error(error, "%s applied to a double", op_sigils[op]);
+                break;
+            }
+            plan(batch, BATCH_BINARY, op, EVAL_INT, 0);
+            depth--;
+            break;
+
+        case OP_BIT_NOT:
+            if (types[depth - 1] != EVAL_INT) {
+                batch_error(error, "%s applied to a double", op_sigils[op]);
+                break;
+            }
+            plan(batch, BATCH_UNARY, op, EVAL_INT, 0);
+            break;
+
+        case OP_NEG:
+            plan(batch, BATCH_UNARY, op, types[depth - 1], 0);
+            break;
+
+        case OP_NOT:
+        case OP_TO_BOOL:
+            plan(batch, BATCH_UNARY, op, types[depth - 1], 0);
+            types[depth - 1] = EVAL_INT;
+            break;
+
+        case OP_TO_INT:
+            /* a 64-bit integer stays as it is */
+            if (types[depth - 1] == EVAL_DOUBLE ||
+                (program->code[pc].arg & EVAL_CAST_BITS) < 64) {
+                plan(batch, BATCH_TO_INT, 0, types[depth - 1],
+                     program->code[pc].arg);
+                types[depth - 1] = EVAL_INT;
+            }
+            break;
+
+        case OP_TO_DOUBLE:
+            if (types[depth - 1] == EVAL_INT) {
+                plan(batch, BATCH_TO_DOUBLE, 0, EVAL_DOUBLE, 0);
+                types[depth - 1] = EVAL_DOUBLE;
+            }
+            break;
+
+        case OP_AND_JUMP:
+        case OP_OR_JUMP:
+        case OP_JUMP_IF_FALSE:
+            plan(batch, op == OP_AND_JUMP ? BATCH_AND_BEGIN
+                 : op == OP_OR_JUMP ? BATCH_OR_BEGIN : BATCH_COND_BEGIN,
+                 0, types[depth - 1], 0);
+            depth--;
+            regions[n_regions].op = op;
+            regions[n_regions++].end = insn->arg;
+            if (n_regions > batch->max_regions) {
+                batch->max_regions = n_regions;
+            }
+            break;
+
+        case OP_JUMP:
+            /* the only jump is from the end of ?:'s then side past
+               its else side */
+            plan(batch, BATCH_COND_ELSE, 0, 0, 0);
+            regions[n_regions - 1].end = insn->arg;
+            break;
+
+        case OP_STORE_SLOT:
+            batch_error(error, "Can't assign in a batch");
+            break;
+
+        case OP_MEMBER:
+        case OP_ARROW:
+        case OP_SUBSCRIPT:
+            batch_error(error, "Can't evaluate member accesses or "
+                        "subscripts in a batch");
+            break;
+
+        case OP_RETURN:
+            batch->result_type = types[depth - 1];
+            break;
+
+        default:
+            break;
+        }
+        if (depth > batch->max_stack) {
+            batch->max_stack = depth;
+        }
+    }
+    free(types);
+    free(regions);
+
+    if (*error) {
+        free(batch->plan);
+        free(batch);
+        return 0;
+    }
+    int n_blocks = batch->max_stack + 2 * (batch->max_regions + 1);
+    batch->blocks = aligned_alloc(32, n_blocks * BLOCK_STRIDE *
+                                  sizeof(int64_t));
+    batch->values = malloc(batch->max_stack * sizeof(void*));
+    batch->conditions = batch->blocks + batch->max_stack * BLOCK_STRIDE;
+    batch->live = batch->conditions + (batch->max_regions + 1) * BLOCK_STRIDE;
+    batch->run_block = run_block_generic;
+#ifdef BATCH_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        batch->run_block = run_block_avx2;
+    }
+#endif
+    return batch;
+}
+
+void eval_batch_free(struct eval_batch* batch) {
+    free(batch->plan);
+    free(batch->blocks);
+    free(batch->values);
+    free(batch);
+}
+
+enum eval_type eval_batch_result_type(const struct eval_batch* batch) {
+    return batch->result_type;
+}
+
+/*
+  The kernels.  Columns needn't be aligned, so everything is loaded
+  and stored with memcpy, which GCC turns into unaligned moves.  (They
+  are macros because returning a vector from a function without AVX
+  enabled is an ABI hazard.)
+ */
+#define LOAD(v, p, i) memcpy(&(v), (const int64_t*)(p) + (i), sizeof(v))
+#define STORE(p, i, v) memcpy((int64_t*)(p) + (i), &(v), sizeof(v))
+
+/*
+  Everything run_block calls is inlined into it, so that it can be
+  compiled twice: for any x86-64, where the vectors are pairs of SSE2
+  registers and 64-bit compares and conversions are done a lane at a
+  time, and for AVX2, which has instructions for nearly all of them.
+  eval_batch_new picks one for the CPU.
+ */
+#define KERNEL static inline __attribute__((always_inline))
+
+#define FOR_EACH_VECTOR(i) for (int i = 0; i < EVAL_BATCH_ROWS; i += LANES)
+
+/* dst = expr, over x and y from a and b */
+#define BINARY_KERNEL(operand_type, result_type, expr)                  \
+    FOR_EACH_VECTOR(i) {                                                \
+        operand_type x, y;                                              \
+        LOAD(x, a, i);                                                  \
+        LOAD(y, b, i);                                                  \
+        result_type r = (expr);                                         \
+        STORE(dst, i, r);                                               \
+    }
+
+#define INT_KERNEL(expr) BINARY_KERNEL(vint, vint, expr)
+#define DOUBLE_KERNEL(result_type, expr)                                \
+    BINARY_KERNEL(vdouble, result_type, expr)
+
+/* dst = expr, over x from a */
+#define UNARY_KERNEL(operand_type, result_type, expr)                   \
+    FOR_EACH_VECTOR(i) {                                                \
+        operand_type x;                                                 \
+        LOAD(x, a, i);                                                  \
+        result_type r = (expr);                                         \
+        STORE(dst, i, r);                                               \
+    }
+
+/*
+  Integer division and remainder have no vector instructions, so
+  they're done a row at a time.  Rows that aren't live may divide by
+  zero; they get 0.
+ */
+KERNEL enum eval_status divide(enum eval_op op, int64_t* dst,
+                               const int64_t* a, const int64_t* b,
+                               const int64_t* live) {
+    int64_t zero_live = 0;
+    for (int i = 0; i < EVAL_BATCH_ROWS; ++i) {
+        int64_t x = a[i];
+        int64_t y = b[i];
+        if (y == 0) {
+            zero_live |= live[i];
+            dst[i] = 0;
+        } else if (y == -1) {
+            /* INT64_MIN / -1 wraps, as in eval_run */
+            dst[i] = op == OP_DIV ? (int64_t)(0 - (uint64_t)x) : 0;
+        } else {
+            dst[i] = op == OP_DIV ? x / y : x % y;
+        }
+    }
+    return zero_live ? EVAL_DIVIDE_BY_ZERO : EVAL_OK;
+}
+
+KERNEL enum eval_status binary_int(enum eval_op op, int64_t* dst,
+                                   const void* a, const void* b,
+                                   const int64_t* live) {
+    switch (op) {
+    case OP_ADD: INT_KERNEL((vint)((vuint)x + (vuint)y)); break;
+    case OP_SUB: INT_KERNEL((vint)((vuint)x - (vuint)y)); break;
+    case OP_MUL: INT_KERNEL((vint)((vuint)x * (vuint)y)); break;
+    case OP_DIV:
+    case OP_MOD:
+        return divide(op, dst, a, b, live);
+    case OP_SHL:
+    case OP_SHR:
+    {
+        int64_t bad = 0;
+        for (int i = 0; i < EVAL_BATCH_ROWS; ++i) {
+            bad |= ((uint64_t)((const int64_t*)b)[i] > 63) & live[i];
+        }
+        if (bad) {
+            return EVAL_BAD_SHIFT;
+        }
+        if (op == OP_SHL) {
+            INT_KERNEL((vint)((vuint)x << ((vuint)y & 63)));
+        } else {
+            INT_KERNEL(x >> (y & 63));
+        }
+        break;
+    }
+    case OP_LT: INT_KERNEL((x < y) & 1); break;
+    case OP_GT: INT_KERNEL((x > y) & 1); break;
+    case OP_LE: INT_KERNEL((x <= y) & 1); break;
+    case OP_GE: INT_KERNEL((x >= y) & 1); break;
+    case OP_EQ: INT_KERNEL((x == y) & 1); break;
+    case OP_NE: INT_KERNEL((x != y) & 1); break;
+    case OP_BIT_AND: INT_KERNEL(x & y); break;
+    case OP_BIT_XOR: INT_KERNEL(x ^ y); break;
+    case OP_BIT_OR: INT_KERNEL(x | y); break;
+    default:
+        break;
+    }
+    return EVAL_OK;
+}
+
+KERNEL void binary_double(enum eval_op op, int64_t* dst, const void* a,
+                          const void* b) {
+    switch (op) {
+    case OP_ADD: DOUBLE_KERNEL(vdouble, x + y); break;
+    case OP_SUB: DOUBLE_KERNEL(vdouble, x - y); break;
+    case OP_MUL: DOUBLE_KERNEL(vdouble, x * y); break;
+    case OP_DIV: DOUBLE_KERNEL(vdouble, x / y); break;
+    case OP_LT: DOUBLE_KERNEL(vint, (x < y) & 1); break;
+    case OP_GT: DOUBLE_KERNEL(vint, (x > y) & 1); break;
+    case OP_LE: DOUBLE_KERNEL(vint, (x <= y) & 1); break;
+    case OP_GE: DOUBLE_KERNEL(vint, (x >= y) & 1); break;
+    case OP_EQ: DOUBLE_KERNEL(vint, (x == y) & 1); break;
+    case OP_NE: DOUBLE_KERNEL(vint, (x != y) & 1); break;
+    default:
+        break;
+    }
+}
+
+KERNEL void unary(enum eval_op op, enum eval_type type, int64_t* dst,
+                  const void* a) {
+    if (type == EVAL_INT) {
+        switch (op) {
+        case OP_NEG: UNARY_KERNEL(vint, vint, (vint)(-(vuint)x)); break;
+        case OP_BIT_NOT: UNARY_KERNEL(vint, vint, ~x); break;
+        case OP_NOT: UNARY_KERNEL(vint, vint, (x == 0) & 1); break;
+        case OP_TO_BOOL: UNARY_KERNEL(vint, vint, (x != 0) & 1); break;
+        default: break;
+        }
+    } else {
+        switch (op) {
+        case OP_NEG: UNARY_KERNEL(vdouble, vdouble, -x); break;
+        case OP_NOT: UNARY_KERNEL(vdouble, vint, (x == 0) & 1); break;
+        case OP_TO_BOOL: UNARY_KERNEL(vdouble, vint, (x != 0) & 1); break;
+        default: break;
+        }
+    }
+}
+
+/* Truncates and extends integers to the cast's type */
+KERNEL void narrow(int64_t* dst, const void* a, int cast) {
+    int bits = cast & EVAL_CAST_BITS;
+    if (cast & EVAL_CAST_UNSIGNED) {
+        int64_t mask = bits < 64 ? (int64_t)(((uint64_t)1 << bits) - 1)
+                                 : -1;
+        UNARY_KERNEL(vint, vint, x & mask);
+    } else {
+        int shift = 64 - bits;
+        UNARY_KERNEL(vint, vint, (vint)((vuint)x << shift) >> shift);
+    }
+}
+
+/*
+  Casts doubles to an integer type, as eval_run does.  A live row that
+  doesn't fit fails the batch; rows that aren't live get 0.
+ */
+KERNEL enum eval_status double_to_int(int64_t* dst, const void* a, int cast,
+                                      const int64_t* live) {
+    if (cast == (64 | EVAL_CAST_UNSIGNED)) {
+        /* past INT64_MAX, with no vector conversion to do it */
+        int64_t bad = 0;
+        for (int i = 0; i < EVAL_BATCH_ROWS; ++i) {
+            double x = ((const double*)a)[i];
+            bool fits = eval_cast_fits(x, cast);
+            bad |= fits ? 0 : live[i];
+            dst[i] = fits ? eval_cast_double(x, cast) : 0;
+        }
+        return bad ? EVAL_BAD_CONVERSION : EVAL_OK;
+    }
+    double low, high;
+    eval_cast_range(cast, &low, &high);
+    vint bad = {0, 0, 0, 0};
+    FOR_EACH_VECTOR(i) {
+        vdouble x;
+        vint m;
+        LOAD(x, a, i);
+        LOAD(m, live, i);
+        vint fits = ((x >= low) | (x > low - 1)) & (x < high);
+        bad |= ~fits & m;
+        vdouble safe = (vdouble)((vint)x & fits);
+        vint r = __builtin_convertvector(safe, vint);
+        STORE(dst, i, r);
+    }
+    if (bad[0] | bad[1] | bad[2] | bad[3]) {
+        return EVAL_BAD_CONVERSION;
+    }
+    if ((cast & EVAL_CAST_BITS) < 64) {
+        narrow(dst, dst, cast);
+    }
+    return EVAL_OK;
+}
+
+/* dst = -1 for the rows where a is true, 0 elsewhere */
+KERNEL void truth_mask(enum eval_type type, int64_t* dst, const void* a) {
+    if (type == EVAL_INT) {
+        UNARY_KERNEL(vint, vint, x != 0);
+    } else {
+        UNARY_KERNEL(vdouble, vint, x != 0);
+    }
+}
+
+/* dst = a where mask is set, else b; on bits, so for either type */
+KERNEL void blend(int64_t* dst, const int64_t* mask, const void* a,
+                  const void* b) {
+    FOR_EACH_VECTOR(i) {
+        vint m, x, y;
+        LOAD(m, mask, i);
+        LOAD(x, a, i);
+        LOAD(y, b, i);
+        vint r = (m & x) | (~m & y);
+        STORE(dst, i, r);
+    }
+}
+
+KERNEL void and_masks(int64_t* dst, const int64_t* a, const int64_t* b,
+                      bool invert_b) {
+    vint flip = {0, 0, 0, 0};
+    if (invert_b) {
+        flip = ~flip;
+    }
+    FOR_EACH_VECTOR(i) {
+        vint x, y;
+        LOAD(x, a, i);
+        LOAD(y, b, i);
+        vint r = x & (y ^ flip);
+        STORE(dst, i, r);
+    }
+}
+
+/*
+  Runs the plan over one block of n_rows rows, starting at row, and
+  leaves the result in batch->values[0].  If selection isn't NULL, it
+  also packs the result's truth into the block's words of it.
+ */
+KERNEL enum eval_status run_block(struct eval_batch* batch,
+                                  const void* const* columns, long row,
+                                  int n_rows, uint64_t* selection) {
+    const struct eval_program* program = batch->program;
+    int64_t* blocks = batch->blocks;
+    const void** values = batch->values;
+    int64_t* conditions = batch->conditions;
+    int64_t* live = batch->live;
+    int sp = 0;
+    int region = 0;
+
+    for (int i = 0; i < EVAL_BATCH_ROWS; ++i) {
+        live[i] = i < n_rows ? -1 : 0;
+    }
+
+#define BLOCK(n) (blocks + (size_t)(n) * BLOCK_STRIDE)
+#define REGION_MASK(masks, n) ((masks) + (size_t)(n) * BLOCK_STRIDE)
+
+    for (int pc = 0; pc < batch->plan_len; ++pc) {
+        const struct batch_insn* insn = &batch->plan[pc];
+        switch ((enum batch_op)insn->op) {
+        case BATCH_LOAD:
+        {
+            const int64_t* column = (const int64_t*)columns[insn->arg] + row;
+            if (n_rows == EVAL_BATCH_ROWS) {
+                values[sp] = column;
+            } else {
+                /* don't read past the end of the column */
+                memcpy(BLOCK(sp), column, n_rows * sizeof(int64_t));
+                memset(BLOCK(sp) + n_rows, 0,
+                       (EVAL_BATCH_ROWS - n_rows) * sizeof(int64_t));
+                values[sp] = BLOCK(sp);
+            }
+            sp++;
+            break;
+        }
+
+        case BATCH_CONST:
+        {
+            struct eval_value value = program->consts[insn->arg];
+            int64_t bits;
+            memcpy(&bits, &value.i, sizeof(bits));
+            int64_t* block = BLOCK(sp);
+            for (int i = 0; i < EVAL_BATCH_ROWS; ++i) {
+                block[i] = bits;
+            }
+            values[sp++] = block;
+            break;
+        }
+
+        case BATCH_POP:
+            sp--;
+            break;
+
+        case BATCH_TO_DOUBLE:
+        {
+            int n = sp - 1 - insn->arg;
+            int64_t* dst = BLOCK(n);
+            const void* a = values[n];
+            UNARY_KERNEL(vint, vdouble, __builtin_convertvector(x, vdouble));
+            values[n] = dst;
+            break;
+        }
+
+        case BATCH_TO_INT:
+        {
+            int64_t* dst = BLOCK(sp - 1);
+            const void* a = values[sp - 1];
+            if (insn->type == EVAL_INT) {
+                narrow(dst, a, insn->arg);
+            } else {
+                enum eval_status status =
+                    double_to_int(dst, a, insn->arg,
+                                  REGION_MASK(live, region));
+                if (status != EVAL_OK) {
+                    return status;
+                }
+            }
+            values[sp - 1] = dst;
+            break;
+        }
+
+        case BATCH_BINARY:
+        {
+            int64_t* dst = BLOCK(sp - 2);
+            if (insn->type == EVAL_INT) {
+                enum eval_status status =
+                    binary_int(insn->sub, dst, values[sp - 2], values[sp - 1],
+                               REGION_MASK(live, region));
+                if (status != EVAL_OK) {
+                    return status;
+                }
+            } else {
+                binary_double(insn->sub, dst, values[sp - 2], values[sp - 1]);
+            }
+            values[sp - 2] = dst;
+            sp--;
+            break;
+        }
+
+        case BATCH_UNARY:
+            unary(insn->sub, insn->type, BLOCK(sp - 1), values[sp - 1]);
+            values[sp - 1] = BLOCK(sp - 1);
+            break;
+
+        case BATCH_AND_BEGIN:
+        case BATCH_OR_BEGIN:
+        case BATCH_COND_BEGIN:
+        {
+            int64_t* condition = REGION_MASK(conditions, region);
+            truth_mask(insn->type, condition, values[--sp]);
+            and_masks(REGION_MASK(live, region + 1), REGION_MASK(live, region),
+                      condition, insn->op == BATCH_OR_BEGIN);
+            region++;
+            break;
+        }
+
+        case BATCH_COND_ELSE:
+            and_masks(REGION_MASK(live, region), REGION_MASK(live, region - 1),
+                      REGION_MASK(conditions, region - 1), true);
+            break;
+
+        case BATCH_AND_END:
+        case BATCH_OR_END:
+        {
+            /* the right side is already 0 or 1; && is 0 where the
+               left side was false, and || is 1 where it was true */
+            region--;
+            const int64_t* condition = REGION_MASK(conditions, region);
+            int64_t* dst = BLOCK(sp - 1);
+            const void* b = values[sp - 1];
+            FOR_EACH_VECTOR(i) {
+                vint m, y;
+                LOAD(m, condition, i);
+                LOAD(y, b, i);
+                vint r = insn->op == BATCH_AND_END ? m & y
+                    : (m & 1) | (~m & y);
+                STORE(dst, i, r);
+            }
+            values[sp - 1] = dst;
+            break;
+        }
+
+        case BATCH_COND_END:
+            region--;
+            blend(BLOCK(sp - 2), REGION_MASK(conditions, region),
+                  values[sp - 2], values[sp - 1]);
+            values[sp - 2] = BLOCK(sp - 2);
+            sp--;
+            break;
+        }
+    }
+#undef BLOCK
+#undef REGION_MASK
+
+    if (selection) {
+        int64_t* mask = conditions;
+        truth_mask(batch->result_type, mask, values[0]);
+        /* clear the rows past the end */
+        and_masks(mask, mask, live, false);
+        for (int word = 0; word * 64 < n_rows; ++word) {
+            uint64_t bits = 0;
+            for (int i = 0; i < 64; ++i) {
+                bits |= (uint64_t)(mask[word * 64 + i] & 1) << i;
+            }
+            selection[row / 64 + word] = bits;
+        }
+    }
+    return EVAL_OK;
+}
+
+static enum eval_status run_block_generic(struct eval_batch* batch,
+                                          const void* const* columns,
+                                          long row, int n_rows,
+                                          uint64_t* selection) {
+    return run_block(batch, columns, row, n_rows, selection);
+}
+
+#ifdef BATCH_HAVE_AVX2
+__attribute__((target("avx2")))
+static enum eval_status run_block_avx2(struct eval_batch* batch,
+                                       const void* const* columns,
+                                       long row, int n_rows,
+                                       uint64_t* selection) {
+    return run_block(batch, columns, row, n_rows, selection);
+}
+#endif
+
+enum eval_status eval_batch_run(struct eval_batch* batch,
+                                const void* const* columns, long n_rows,
+                                void* result) {
+    for (long row = 0; row < n_rows; row += EVAL_BATCH_ROWS) {
+        int block_rows = n_rows - row < EVAL_BATCH_ROWS ? n_rows - row
+            : EVAL_BATCH_ROWS;
+        enum eval_status status =
+            batch->run_block(batch, columns, row, block_rows, 0);
+        if (status != EVAL_OK) {
+            return status;
+        }
+        memcpy((int64_t*)result + row, batch->values[0],
+               block_rows * sizeof(int64_t));
+    }
+    return EVAL_OK;
+}
+
+enum eval_status eval_batch_select(struct eval_batch* batch,
+                                   const void* const* columns, long n_rows,
+                                   uint64_t* selection) {
+    for (long row = 0; row < n_rows; row += EVAL_BATCH_ROWS) {
+        int block_rows = n_rows - row < EVAL_BATCH_ROWS ? n_rows - row
+            : EVAL_BATCH_ROWS;
+        enum eval_status status =
+            batch->run_block(batch, columns, row, block_rows, selection);
+        if (status != EVAL_OK) {
+            return status;
+        }
+    }
+    return EVAL_OK;
+}
@@ -0,0 +1,123 @@
+/*
+  The bytecode behind struct eval_program, shared by eval.c and
+  eval_batch.c.  Not for use outside them.
+ */
+#ifndef EVAL_BYTECODE_H
+#define EVAL_BYTECODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "eval.h"
+
+/*
+  The machine's instructions.  Each one's stack effect is in
+  emit(); the jumps' args are instruction indexes.
+ */
+#define EVAL_OPS(X)                                                     \
+    X(PUSH_CONST)   /* arg: constant */                                 \
+    X(LOAD_SLOT)    /* arg: slot */                                     \
+    X(STORE_SLOT)   /* arg: slot; leaves the value on the stack */      \
+    X(POP)                                                              \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) X(SHL) X(SHR)                    \
+    X(LT) X(GT) X(LE) X(GE) X(EQ) X(NE)                                 \
+    X(BIT_AND) X(BIT_XOR) X(BIT_OR)                                     \
+    X(NEG) X(BIT_NOT) X(NOT) X(TO_BOOL)                                 \
+    X(TO_INT)       /* arg: the type, as EVAL_CAST_BITS and _UNSIGNED */ \
+    X(TO_DOUBLE)                                                        \
+    X(JUMP)                                                             \
+    X(JUMP_IF_FALSE)                                                    \
+    /* if the top is false, replace it with 0 and jump, else pop it */  \
+    X(AND_JUMP)                                                         \
+    /* if the top is true, replace it with 1 and jump, else pop it */   \
+    X(OR_JUMP)                                                          \
+    X(MEMBER)       /* arg: field */                                    \
+    X(ARROW)        /* arg: field */                                    \
+    X(SUBSCRIPT)                                                        \
+    X(RETURN)
+
+#define OP_ENUM(name) OP_##name,
+enum eval_op {
+    EVAL_OPS(OP_ENUM)
+    N_OPS
+};
+#undef OP_ENUM
+
+struct eval_insn {
+    uint8_t op;
+    int32_t arg;
+};
+
+/*
+  An integer type a value is cast to: its width in bits, and whether
+  it's unsigned.  Every integer is held as an int64_t, so a cast to a
+  narrower type truncates and then sign- or zero-extends, and a cast
+  to a 64-bit unsigned type keeps the bits.
+ */
+#define EVAL_CAST_BITS 0xff
+#define EVAL_CAST_UNSIGNED 0x100
+
+static inline int64_t eval_cast_int(int64_t i, int cast) {
+    int bits = cast & EVAL_CAST_BITS;
+    if (bits == 64) {
+        return i;
+    }
+    uint64_t mask = ((uint64_t)1 << bits) - 1;
+    uint64_t low = (uint64_t)i & mask;
+    if (cast & EVAL_CAST_UNSIGNED) {
+        return low;
+    }
+    uint64_t sign = (uint64_t)1 << (bits - 1);
+    return (int64_t)((low ^ sign) - sign);
+}
+
+/* The cast type's least value, and one more than its greatest */
+static inline void eval_cast_range(int cast, double* low, double* high) {
+    int bits = cast & EVAL_CAST_BITS;
+    /* 2 to the bits */
+    double limit = bits == 64 ? 18446744073709551616.0
+                              : (double)((uint64_t)1 << bits);
+    *low = cast & EVAL_CAST_UNSIGNED ? 0 : -limit / 2;
+    *high = cast & EVAL_CAST_UNSIGNED ? limit : limit / 2;
+}
+
+/*
+  Whether d, truncated, fits the cast's type.  Converting it when it
+  doesn't, or is NaN, is undefined in C, so the evaluators fail
+  instead.
+ */
+static inline bool eval_cast_fits(double d, int cast) {
+    double low, high;
+    eval_cast_range(cast, &low, &high);
+    /* below low only by a fraction, which truncation drops */
+    return (d >= low || d > low - 1) && d < high;
+}
+
+/* Converts d, which has to fit */
+static inline int64_t eval_cast_double(double d, int cast) {
+    int64_t i = cast & EVAL_CAST_UNSIGNED ? (int64_t)(uint64_t)d
+                                          : (int64_t)d;
+    return eval_cast_int(i, cast);
+}
+
+/* names numbered in the order they're added */
+struct name_table {
+    char** names;
+    int count;
+    int allocated;
+    /* open addressing, of indexes into names; -1 is empty */
+    int* index;
+    int capacity;
+};
+
+struct eval_program {
+    struct eval_insn* code;
+    int code_len;
+    struct eval_value* consts;
+    int n_consts;
+    int max_stack;
+    struct name_table slots;
+    struct name_table fields;
+};
+
+#endif
@@ -0,0 +1,577 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "eval_native.h"
+#include "eval_bytecode.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct eval_native {
+    void* handle;
+    eval_native_fn* functions;
+    int n_functions;
+    bool cached;
+};
+
+static void native_error(char** error, const char* message, ...) {
+    va_list args;
+    va_start(args, message);
+    int size = vsnprintf(0, 0, message, args);
+    va_end(args);
+    *error = malloc(size + 1);
+    va_start(args, message);
+    vsnprintf(*error, size + 1, message, args);
+    va_end(args);
+}
+
+/*
+  What every generated file starts with: the types, which match
+  eval.h's, and an inline function per instruction, which match
+  eval_run's.  The ones that can fail return a status, or 0.
+ */
+static const char prelude[] =
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "typedef struct {\n"
+    "    int type;\n"
+    "    union { int64_t i; double d; } u;\n"
+    "} value;\n"
+    "\n"
+    "typedef struct {\n"
+    "    _Bool (*member)(void*, value, int, _Bool, value*);\n"
+    "    _Bool (*subscript)(void*, value, value, value*);\n"
+    "} accessors;\n"
+    "\n"
+    "#define WRAP(a, op, b) ((int64_t)((uint64_t)(a) op (uint64_t)(b)))\n"
+    "\n"
+    "static inline value mk_int(int64_t i) {\n"
+    "    value v; v.type = T_INT; v.u.i = i; return v;\n"
+    "}\n"
+    "static inline value mk_double(double d) {\n"
+    "    value v; v.type = T_DOUBLE; v.u.d = d; return v;\n"
+    "}\n"
+    "static inline value mk_bits(uint64_t bits) {\n"
+    "    value v; v.type = T_DOUBLE; memcpy(&v.u.d, &bits, 8); return v;\n"
+    "}\n"
+    "static inline double as_double(value v) {\n"
+    "    return v.type == T_INT ? (double)v.u.i : v.u.d;\n"
+    "}\n"
+    "static inline int is_true(value v) {\n"
+    "    return v.type == T_INT ? v.u.i != 0 : v.u.d != 0;\n"
+    "}\n"
+    "\n"
+    "#define ARITH(name, op)                                         \\\n"
+    "    static inline void name(value* a, value b) {                \\\n"
+    "        if (a->type == T_INT && b.type == T_INT)                \\\n"
+    "            a->u.i = WRAP(a->u.i, op, b.u.i);                   \\\n"
+    "        else                                                    \\\n"
+    "            *a = mk_double(as_double(*a) op as_double(b));      \\\n"
+    "    }\n"
+    "ARITH(op_add, +) ARITH(op_sub, -) ARITH(op_mul, *)\n"
+    "\n"
+    "#define COMPARE(name, op)                                       \\\n"
+    "    static inline void name(value* a, value b) {                \\\n"
+    "        if (a->type == T_INT && b.type == T_INT)                \\\n"
+    "            a->u.i = a->u.i op b.u.i;                           \\\n"
+    "        else                                                    \\\n"
+    "            *a = mk_int(as_double(*a) op as_double(b));         \\\n"
+    "    }\n"
+    "COMPARE(op_lt, <) COMPARE(op_gt, >) COMPARE(op_le, <=)\n"
+    "COMPARE(op_ge, >=) COMPARE(op_eq, ==) COMPARE(op_ne, !=)\n"
+    "\n"
+    "#define BITWISE(name, op)                                       \\\n"
+    "    static inline int name(value* a, value b) {                 \\\n"
+    "        if (a->type != T_INT || b.type != T_INT)                \\\n"
+    "            return S_NOT_INTEGER;                               \\\n"
+    "        a->u.i = a->u.i op b.u.i;                               \\\n"
+    "        return 0;                                               \\\n"
+    "    }\n"
+    "BITWISE(op_bit_and, &) BITWISE(op_bit_xor, ^) BITWISE(op_bit_or, |)\n"
+    "\n"
+    "static inline int op_div(value* a, value b) {\n"
+    "    if (a->type == T_INT && b.type == T_INT) {\n"
+    "        if (!b.u.i) return S_DIVIDE_BY_ZERO;\n"
+    "        a->u.i = b.u.i == -1 ? WRAP(0, -, a->u.i) : a->u.i / b.u.i;\n"
+    "    } else {\n"
+    "        *a = mk_double(as_double(*a) / as_double(b));\n"
+    "    }\n"
+    "    return 0;\n"
+    "}\n"
+    "static inline int op_mod(value* a, value b) {\n"
+    "    if (a->type != T_INT || b.type != T_INT) return S_NOT_INTEGER;\n"
+    "    if (!b.u.i) return S_DIVIDE_BY_ZERO;\n"
+    "    a->u.i = b.u.i == -1 ? 0 : a->u.i % b.u.i;\n"
+    "    return 0;\n"
+    "}\n"
+    "static inline int op_shl(value* a, value b) {\n"
+    "    if (a->type != T_INT || b.type != T_INT) return S_NOT_INTEGER;\n"
+    "    if (b.u.i < 0 || b.u.i > 63) return S_BAD_SHIFT;\n"
+    "    a->u.i = WRAP(a->u.i, <<, b.u.i);\n"
+    "    return 0;\n"
+    "}\n"
+    "static inline int op_shr(value* a, value b) {\n"
+    "    if (a->type != T_INT || b.type != T_INT) return S_NOT_INTEGER;\n"
+    "    if (b.u.i < 0 || b.u.i > 63) return S_BAD_SHIFT;\n"
+    "    a->u.i >>= b.u.i;\n"
+    "    return 0;\n"
+    "}\n"
+    "static inline void op_neg(value* a) {\n"
+    "    if (a->type == T_INT) a->u.i = WRAP(0, -, a->u.i);\n"
+    "    else a->u.d = -a->u.d;\n"
+    "}\n"
+    "static inline int op_bit_not(value* a) {\n"
+    "    if (a->type != T_INT) return S_NOT_INTEGER;\n"
+    "    a->u.i = ~a->u.i;\n"
+    "    return 0;\n"
+    "}\n";
+
+/* The rest of it, which ISO C's limit on a string's length splits off */
+static const char prelude_casts[] =
+    "/* as eval_cast_int, eval_cast_fits and eval_cast_double */\n"
+    "static inline int64_t cast_int(int64_t i, int bits, int is_unsigned) {\n"
+    "    if (bits == 64) return i;\n"
+    "    uint64_t low = (uint64_t)i & (((uint64_t)1 << bits) - 1);\n"
+    "    if (is_unsigned) return low;\n"
+    "    uint64_t sign = (uint64_t)1 << (bits - 1);\n"
+    "    return (int64_t)((low ^ sign) - sign);\n"
+    "}\n"
+    "static inline int op_to_int(value* a, int bits, int is_unsigned) {\n"
+    "    if (a->type == T_INT) {\n"
+    "        a->u.i = cast_int(a->u.i, bits, is_unsigned);\n"
+    "        return 0;\n"
+    "    }\n"
+    "    double limit = bits == 64 ? 18446744073709551616.0\n"
+    "                              : (double)((uint64_t)1 << bits);\n"
+    "    double low = is_unsigned ? 0 : -limit / 2;\n"
+    "    double high = is_unsigned ? limit : limit / 2;\n"
+    "    double d = a->u.d;\n"
+    "    if (!((d >= low || d > low - 1) && d < high))\n"
+    "        return S_BAD_CONVERSION;\n"
+    "    *a = mk_int(cast_int(is_unsigned ? (int64_t)(uint64_t)d\n"
+    "                                     : (int64_t)d, bits, is_unsigned));\n"
+    "    return 0;\n"
+    "}\n";
+
+/* the ops that are an inline function on the top two entries */
+static const char* binary_functions[N_OPS] = {
+    [OP_ADD] = "op_add", [OP_SUB] = "op_sub", [OP_MUL] = "op_mul",
+    [OP_LT] = "op_lt", [OP_GT] = "op_gt", [OP_LE] = "op_le",
+    [OP_GE] = "op_ge", [OP_EQ] = "op_eq", [OP_NE] = "op_ne",
+};
+
+/* and those that can fail */
+static const char* failing_binary_functions[N_OPS] = {
+    [OP_DIV] = "op_div", [OP_MOD] = "op_mod", [OP_SHL] = "op_shl",
+    [OP_SHR] = "op_shr", [OP_BIT_AND] = "op_bit_and",
+    [OP_BIT_XOR] = "op_bit_xor", [OP_BIT_OR] = "op_bit_or",
+};
+
+static void write_value(FILE* out, struct eval_value value) {
+    if (value.type == EVAL_INT) {
+        fprintf(out, "mk_int((int64_t)UINT64_C(%llu))",
+                (unsigned long long)value.i);
+    } else {
+        /* by its bits, which is exact for every double */
+        uint64_t bits;
+        memcpy(&bits, &value.d, sizeof(bits));
+        fprintf(out, "mk_bits(UINT64_C(0x%llx))", (unsigned long long)bits);
+    }
+}
+
+/*
+  Writes program as function name.  Stack entry n is local sn; the
+  depth at each instruction is known when compiling, since every
+  jump is forward and its target's depth is recorded when it's seen.
+ */
+static void write_function(FILE* out, const struct eval_program* program,
+                           int index) {
+    const struct eval_insn* code = program->code;
+    int* depth_at = malloc((program->code_len + 1) * sizeof(int));
+    for (int pc = 0; pc <= program->code_len; ++pc) {
+        depth_at[pc] = -1;
+    }
+
+    fprintf(out, "\nunsigned eval_native_%d(value* slots, "
+            "const accessors* accessors, void* data, value* result) {\n",
+            index);
+    fprintf(out, "    int status;\n");
+    for (int i = 0; i < program->max_stack; ++i) {
+        fprintf(out, "    value s%d;\n", i);
+    }
+    fprintf(out, "    (void)slots; (void)accessors; (void)data; "
+            "(void)status;\n");
+
+    int depth = 0;
+    for (int pc = 0; pc < program->code_len; ++pc) {
+        const struct eval_insn* insn = &code[pc];
+        if (depth_at[pc] >= 0) {
+            depth = depth_at[pc];
+            fprintf(out, "L%d:\n", pc);
+        }
+        int top = depth - 1;
+        enum eval_op op = insn->op;
+        switch (op) {
+        case OP_PUSH_CONST:
+            fprintf(out, "    s%d = ", depth++);
+            write_value(out, program->consts[insn->arg]);
+            fprintf(out, ";\n");
+            break;
+        case OP_LOAD_SLOT:
+            fprintf(out, "    s%d = slots[%d];\n", depth++, insn->arg);
+            break;
+        case OP_STORE_SLOT:
+            fprintf(out, "    slots[%d] = s%d;\n", insn->arg, top);
+            break;
+        case OP_POP:
+            depth--;
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL:
+        case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+            fprintf(out, "    %s(&s%d, s%d);\n", binary_functions[op],
+                    top - 1, top);
+            depth--;
+            break;
+        case OP_DIV: case OP_MOD: case OP_SHL: case OP_SHR:
+        case OP_BIT_AND: case OP_BIT_XOR: case OP_BIT_OR:
+            fprintf(out, "    if ((status = %s(&s%d, s%d))) return status;\n",
+                    failing_binary_functions[op], top - 1, top);
+            depth--;
+            break;
+        case OP_NEG:
+            fprintf(out, "    op_neg(&s%d);\n", top);
+            break;
+        case OP_BIT_NOT:
+            fprintf(out, "    if ((status = op_bit_not(&s%d))) "
+                    "return status;\n", top);
+            break;
+        case OP_NOT:
+            fprintf(out, "    s%d = mk_int(!is_true(s%d));\n", top, top);
+            break;
+        case OP_TO_BOOL:
+            fprintf(out, "    s%d = mk_int(is_true(s%d));\n", top, top);
+            break;
+        case OP_TO_INT:
+            fprintf(out, "    if ((status = op_to_int(&s%d, %d, %d))) "
+                    "return status;\n", top, insn->arg & EVAL_CAST_BITS,
+                    (insn->arg & EVAL_CAST_UNSIGNED) != 0);
+            break;
+        case OP_TO_DOUBLE:
+            fprintf(out, "    s%d = mk_double(as_double(s%d));\n", top, top);
+            break;
+        case OP_JUMP:
+            fprintf(out, "    goto L%d;\n", insn->arg);
+            depth_at[insn->arg] = depth;
+            break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "    if (!is_true(s%d)) goto L%d;\n", top, insn->arg);
+            depth--;
+            depth_at[insn->arg] = depth;
+            break;
+        case OP_AND_JUMP:
+        case OP_OR_JUMP:
+            fprintf(out, "    if (%sis_true(s%d)) { s%d = mk_int(%d); "
+                    "goto L%d; }\n", op == OP_AND_JUMP ? "!" : "", top, top,
+                    op == OP_OR_JUMP, insn->arg);
+            depth_at[insn->arg] = depth;
+            depth--;
+            break;
+        case OP_MEMBER:
+        case OP_ARROW:
+            fprintf(out, "    if (!accessors || !accessors->member || "
+                    "!accessors->member(data, s%d, %d, %d, &s%d)) "
+                    "return S_ACCESS_FAILED;\n", top, insn->arg,
+                    op == OP_ARROW, top);
+            break;
+        case OP_SUBSCRIPT:
+            fprintf(out, "    if (!accessors || !accessors->subscript || "
+                    "!accessors->subscript(data, s%d, s%d, &s%d)) "
+                    "return S_ACCESS_FAILED;\n", top - 1, top, top - 1);
+            depth--;
+            break;
+        case OP_RETURN:
+            fprintf(out, "    *result = s%d;\n    return 0;\n", top);
+            depth--;
+            break;
+        case N_OPS:
+            break;
+        }
+    }
+    fprintf(out, "}\n");
+    free(depth_at);
+}
+
+static char* generate(const struct eval_program* const* programs,
+                      int n_programs, size_t* size) {
+    char* source;
+    FILE* out = open_memstream(&source, size);
+    fprintf(out, "#define T_INT %d\n#define T_DOUBLE %d\n", EVAL_INT,
+            EVAL_DOUBLE);
+    fprintf(out, "#define S_DIVIDE_BY_ZERO %d\n#define S_NOT_INTEGER %d\n"
+            "#define S_BAD_SHIFT %d\n#define S_ACCESS_FAILED %d\n"
+            "#define S_BAD_CONVERSION %d\n",
+            EVAL_DIVIDE_BY_ZERO, EVAL_NOT_INTEGER, EVAL_BAD_SHIFT,
+            EVAL_ACCESS_FAILED, EVAL_BAD_CONVERSION);
+    fputs(prelude, out);
+    fputs(prelude_casts, out);
+    for (int i = 0; i < n_programs; ++i) {
+        write_function(out, programs[i], i);
+    }
+    fclose(out);
+    return source;
+}
+
+/* FNV-1a */
+static uint64_t hash_text(uint64_t hash, const char* text, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Whether the file at path holds exactly size bytes of data */
+static bool file_matches(const char* path, const char* data, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool matches = false;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == size) {
+        char* contents = malloc(size + 1);
+        size_t done = 0;
+        while (done < size) {
+            ssize_t got = read(fd, contents + done, size - done);
+            if (got <= 0) {
+                break;
+            }
+            done += got;
+        }
+        matches = done == size && memcmp(contents, data, size) == 0;
+        free(contents);
+    }
+    close(fd);
+    return matches;
+}
+
+/* Writes a new file at path, failing if there's anything there */
+static bool write_file(const char* path, const char* data, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    FILE* file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+        return false;
+    }
+    bool ok = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+}
+
+/* Runs argv, returning its exit status, or -1 if it didn't exit */
+static int run_command(char* const* argv) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+  Compiles source into the shared object at so_path.  It's built in a
+  new directory of its own under dir, which only we can write to, so
+  nobody can swap the files or plant a link while the compiler has
+  them open.
+ */
+static bool build(const char* dir, const char* compiler,
+                  const char* source, size_t size, const char* so_path,
+                  const char* source_path, char** error) {
+    size_t path_size = strlen(dir) + 32;
+    char* tmp_dir = malloc(path_size);
+    char* tmp_source = malloc(path_size);
+    char* tmp_so = malloc(path_size);
+    snprintf(tmp_dir, path_size, "%s/.tmp.XXXXXX", dir);
+    bool made_dir = mkdtemp(tmp_dir) != 0;
+    snprintf(tmp_source, path_size, "%s/programs.c", tmp_dir);
+    snprintf(tmp_so, path_size, "%s/programs.so", tmp_dir);
+    bool ok = false;
+    /* $CC may be a command with arguments, like "ccache gcc", split
+       on whitespace as make would (without the shell's quoting) */
+    char* words = strdup(compiler);
+    char** argv = malloc((strlen(compiler) / 2 + 9) * sizeof(char*));
+    int argc = 0;
+    char* save_ptr;
+    for (char* word = strtok_r(words, " \t\n", &save_ptr); word;
+         word = strtok_r(0, " \t\n", &save_ptr)) {
+        argv[argc++] = word;
+    }
+
+    if (!made_dir) {
+        native_error(error, "Couldn't create a directory in %s", dir);
+        goto done;
+    }
+    if (!write_file(tmp_source, source, size)) {
+        native_error(error, "Couldn't write %s", tmp_source);
+        goto done;
+    }
+    if (argc == 0) {
+        native_error(error, "$CC is blank");
+        goto done;
+    }
+    /* no fused multiply-adds, which would round differently from
+       eval_run */
+    const char* options[] = {"-O2", "-ffp-contract=off", "-shared", "-fPIC",
+                             "-o", tmp_so, tmp_source, 0};
+    for (const char** option = options; *option; ++option) {
+        argv[argc++] = (char*)*option;
+    }
+    argv[argc] = 0;
+    int status = run_command(argv);
+    if (status) {
+        native_error(error, status == 127 ? "Couldn't run %s"
+                     : "%s failed to build the programs", compiler);
+        goto done;
+    }
+    /* the object first, so that a matching source means it's there */
+    if (rename(tmp_so, so_path) || rename(tmp_source, source_path)) {
+        native_error(error, "Couldn't store the programs in %s", dir);
+        goto done;
+    }
+    ok = true;
+
+done:
+    if (made_dir) {
+        unlink(tmp_source);
+        unlink(tmp_so);
+        rmdir(tmp_dir);
+    }
+    free(tmp_dir);
+    free(tmp_source);
+    free(tmp_so);
+    free(words);
+    free(argv);
+    return ok;
+}
+
+struct eval_native* eval_native_build(
+    const struct eval_program* const* programs, int n_programs,
+    const char* cache_dir, char** error) {
+    const char* compiler = getenv("CC");
+    if (!compiler || !*compiler) {
+        compiler = "cc";
+    }
+    size_t size;
+    char* source = generate(programs, n_programs, &size);
+    uint64_t hash = hash_text(14695981039346656037ull, compiler,
+                              strlen(compiler) + 1);
+    hash = hash_text(hash, source, size);
+
+    char* dir;
+    if (cache_dir) {
+        if (mkdir(cache_dir, 0755) && errno != EEXIST) {
+            native_error(error, "Couldn't create %s", cache_dir);
+            free(source);
+            return 0;
+        }
+        dir = strdup(cache_dir);
+    } else {
+        const char* tmp = getenv("TMPDIR");
+        if (!tmp || !*tmp) {
+            tmp = "/tmp";
+        }
+        dir = malloc(strlen(tmp) + 32);
+        sprintf(dir, "%s/eval_native.XXXXXX", tmp);
+        if (!mkdtemp(dir)) {
+            native_error(error, "Couldn't create a directory in %s", tmp);
+            free(dir);
+            free(source);
+            return 0;
+        }
+    }
+    size_t path_size = strlen(dir) + 32;
+    char* so_path = malloc(path_size);
+    char* source_path = malloc(path_size);
+    snprintf(so_path, path_size, "%s/%016llx.so", dir,
+             (unsigned long long)hash);
+    snprintf(source_path, path_size, "%s/%016llx.c", dir,
+             (unsigned long long)hash);
+
+    struct eval_native* native = calloc(1, sizeof(struct eval_native));
+    *error = 0;
+    if (cache_dir && file_matches(source_path, source, size)) {
+        native->handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+        native->cached = native->handle != 0;
+    }
+    if (!native->handle &&
+        build(dir, compiler, source, size, so_path, source_path, error)) {
+        native->handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+        if (!native->handle) {
+            native_error(error, "Couldn't load %s: %s", so_path, dlerror());
+        }
+    }
+    if (!cache_dir) {
+        /* it stays mapped */
+        unlink(so_path);
+        unlink(source_path);
+        rmdir(dir);
+    }
+
+    if (native->handle) {
+        native->n_functions = n_programs;
+        native->functions = malloc(n_programs * sizeof(eval_native_fn));
+        for (int i = 0; i < n_programs && !*error; ++i) {
+            char name[32];
+            sprintf(name, "eval_native_%d", i);
+            /* POSIX's way around ISO C's object and function pointers */
+            *(void**)&native->functions[i] = dlsym(native->handle, name);
+            if (!native->functions[i]) {
+                native_error(error, "Couldn't find %s in %s", name, so_path);
+            }
+        }
+    }
+    if (*error) {
+        eval_native_free(native);
+        native = 0;
+    }
+    free(so_path);
+    free(source_path);
+    free(dir);
+    free(source);
+    return native;
+}
+
+void eval_native_free(struct eval_native* native) {
+    if (native->handle) {
+        dlclose(native->handle);
+    }
+    free(native->functions);
+    free(native);
+}
+
+eval_native_fn eval_native_function(const struct eval_native* native,
+                                    int i) {
+    return native->functions[i];
+}
+
+bool eval_native_cached(const struct eval_native* native) {
+    return native->cached;
+}
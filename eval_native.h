@@ -0,0 +1,60 @@
+/*
+  Compiling programs to native code, for filters that run long enough
+  for eval_run's dispatch to matter.  A set of programs is translated
+  to C, one function per program, which the system's C compiler ($CC,
+  or cc) builds into a shared object that's then loaded with dlopen.
+  $CC is split into words on whitespace, so it can carry arguments or
+  a wrapper ("ccache gcc"), though not quoting.
+
+  The functions behave exactly like eval_run on their program: same
+  values, same types, same statuses, and they write assignments back
+  to the slots the same way.  Each instruction becomes a call to a
+  small inline function over a local per stack entry, so the C
+  compiler can keep the stack in registers and drop the dispatch.
+
+  Shared objects are cached in a directory, named by a hash of the
+  generated source: building the same programs again just loads the
+  old object, and changing any of them builds a new one.  The source
+  is kept next to each object and compared when loading, so a hash
+  collision is just a rebuild.  Objects are built in a private
+  temporary directory and renamed into place, so processes can share
+  a cache directory.  Whatever is in it gets loaded and run, though,
+  so it mustn't be writable by anyone who isn't trusted.
+ */
+#ifndef EVAL_NATIVE_H
+#define EVAL_NATIVE_H
+
+#include <stdbool.h>
+
+#include "eval.h"
+
+/* Called like eval_run, without the program */
+typedef enum eval_status (*eval_native_fn)(
+    struct eval_value* slots, const struct eval_accessors* accessors,
+    void* data, struct eval_value* result);
+
+struct eval_native;
+
+/*
+  Builds programs[0] to programs[n_programs - 1], or loads them from
+  cache_dir if they were built before.  If cache_dir is NULL, they're
+  built in a temporary directory that's removed once they're loaded.
+  Returns NULL on error (the compiler failing, say), setting *error to
+  a malloced message.  The functions don't refer to the programs,
+  which may be freed; they keep needing the programs' slot and field
+  numbering, though.
+ */
+struct eval_native* eval_native_build(
+    const struct eval_program* const* programs, int n_programs,
+    const char* cache_dir, char** error);
+
+/* Unloads the shared object, so none of its functions may be called */
+void eval_native_free(struct eval_native* native);
+
+eval_native_fn eval_native_function(const struct eval_native* native,
+                                    int i);
+
+/* Whether the shared object came from the cache */
+bool eval_native_cached(const struct eval_native* native);
+
+#endif
@@ -0,0 +1,924 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eval.h"
+#include "eval_native.h"
+#include "parse.h"
+
+/*
+  The identifiers the tests can use.  p and recs are handles for the
+  accessors below: p is record 1, and recs is the array of records.
+ */
+struct binding {
+    const char* name;
+    struct eval_value value;
+};
+
+#define RECS -1
+#define QTY_BASE 1000
+
+static struct binding bindings[] = {
+    {"a", {EVAL_INT, {.i = 6}}},
+    {"b", {EVAL_INT, {.i = 3}}},
+    {"zero", {EVAL_INT, {.i = 0}}},
+    {"x", {EVAL_DOUBLE, {.d = 2.5}}},
+    {"p", {EVAL_INT, {.i = 1}}},
+    {"recs", {EVAL_INT, {.i = RECS}}},
+    {0}
+};
+
+struct record {
+    int64_t id;
+    double price;
+    int64_t qty[3];
+};
+
+static struct record records[] = {
+    {100, 1.25, {1, 2, 3}},
+    {200, 0.5, {4, 5, 6}},
+};
+
+enum field { FIELD_ID, FIELD_PRICE, FIELD_QTY, FIELD_UNKNOWN };
+
+/* the program's field numbers, mapped to the record's fields */
+struct accessor_data {
+    enum field fields[8];
+};
+
+static bool test_member(void* data, struct eval_value object, int field,
+                        bool arrow, struct eval_value* result) {
+    struct accessor_data* accessor_data = data;
+    (void)arrow;
+    if (object.type != EVAL_INT || object.i < 0 || object.i > 1) {
+        return false;
+    }
+    struct record* record = &records[object.i];
+    switch (accessor_data->fields[field]) {
+    case FIELD_ID:
+        *result = eval_int(record->id);
+        return true;
+    case FIELD_PRICE:
+        *result = eval_double(record->price);
+        return true;
+    case FIELD_QTY:
+        *result = eval_int(QTY_BASE + object.i);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool test_subscript(void* data, struct eval_value array,
+                           struct eval_value index,
+                           struct eval_value* result) {
+    (void)data;
+    if (array.type != EVAL_INT || index.type != EVAL_INT) {
+        return false;
+    }
+    if (array.i == RECS && index.i >= 0 && index.i < 2) {
+        *result = eval_int(index.i);
+        return true;
+    }
+    if (array.i >= QTY_BASE && array.i < QTY_BASE + 2 &&
+        index.i >= 0 && index.i < 3) {
+        *result = eval_int(records[array.i - QTY_BASE].qty[index.i]);
+        return true;
+    }
+    return false;
+}
+
+static const struct eval_accessors accessors = {test_member, test_subscript};
+
+struct eval_spec {
+    const char* input;
+    struct eval_value expected;
+};
+
+#define INT(v) {EVAL_INT, {.i = (v)}}
+#define DOUBLE(v) {EVAL_DOUBLE, {.d = (v)}}
+
+struct eval_spec specs[] = {
+    {"1 + 2 * 3", INT(7)},
+    {"a / b", INT(2)},
+    {"7 / 2", INT(3)},
+    {"7.0 / 2", DOUBLE(3.5)},
+    {"-7 % 3", INT(-1)},
+    {"1 << 40", INT(1099511627776)},
+    {"-16 >> 2", INT(-4)},
+    {"0x10 | 0x01", INT(17)},
+    {"0xff & ~0x0f ^ 1", INT(0xf1)},
+    {"017 + 10", INT(25)},
+    {"'a'", INT(97)},
+    {"'\\n' + '\\x41' + '\\0'", INT(75)},
+    {"1e3 + 1", DOUBLE(1001)},
+    {"1.5 * 2", DOUBLE(3)},
+    {"x * 2", DOUBLE(5)},
+    {"x < 3", INT(1)},
+    {"a == 6.0", INT(1)},
+    {"a > b && b > 0", INT(1)},
+    {"a && x", INT(1)},
+    {"zero && 1 / zero", INT(0)},
+    {"a || 1 / zero", INT(1)},
+    {"zero || zero", INT(0)},
+    {"a ? 1 : 2", INT(1)},
+    {"zero ? 1 : 2.5", DOUBLE(2.5)},
+    {"a > 5 ? b > 5 ? 1 : 2 : 3", INT(2)},
+    {"zero ? 1 : (a = 2), a", INT(2)},
+    {"a = 10, a + 1", INT(11)},
+    {"a = b = 4, a + b", INT(8)},
+    {"a += 4", INT(10)},
+    {"a <<= 2, a", INT(24)},
+    {"a++ + a", INT(13)},
+    {"++a * 2", INT(14)},
+    {"a--, a", INT(5)},
+    {"x++, x", DOUBLE(3.5)},
+    {"!zero + -a + +b", INT(-2)},
+    {"(int)x * 2", INT(4)},
+    {"(double)a / 4", DOUBLE(1.5)},
+    {"(unsigned long)a", INT(6)},
+    {"(char)300", INT(44)},
+    {"(short)70000", INT(4464)},
+    {"(unsigned char)-1", INT(255)},
+    {"(unsigned)-1", INT(4294967295)},
+    {"(uint64_t)-1", INT(-1)},
+    {"(char)-x", INT(-2)},
+    {"(unsigned char)(x * 100)", INT(250)},
+    {"(unsigned char)(x - 3)", INT(0)},
+    {"(unsigned long)1e19", INT(-8446744073709551616)},
+    {"(long)-9223372036854775808.0", INT(INT64_MIN)},
+    {"9223372036854775807 + 1", INT(INT64_MIN)},
+    {"p->id", INT(200)},
+    {"p->price * p->qty[2]", DOUBLE(3)},
+    {"recs[0].id + recs[1].id", INT(300)},
+    {"*recs[0].qty + *p->qty", INT(5)},
+    {0}
+};
+
+struct status_spec {
+    const char* input;
+    enum eval_status status;
+};
+
+struct status_spec failing_runs[] = {
+    {"a / zero", EVAL_DIVIDE_BY_ZERO},
+    {"a % zero", EVAL_DIVIDE_BY_ZERO},
+    {"x % 2", EVAL_NOT_INTEGER},
+    {"~x", EVAL_NOT_INTEGER},
+    {"1 << 64", EVAL_BAD_SHIFT},
+    {"1 >> -1", EVAL_BAD_SHIFT},
+    {"p->bogus", EVAL_ACCESS_FAILED},
+    {"recs[2]", EVAL_ACCESS_FAILED},
+    {"(int)1e300", EVAL_BAD_CONVERSION},
+    {"(int)(x * 1e9)", EVAL_BAD_CONVERSION},
+    {"(unsigned char)(x * 120)", EVAL_BAD_CONVERSION},
+    {"(unsigned)-x", EVAL_BAD_CONVERSION},
+    {"(long)9223372036854775808.0", EVAL_BAD_CONVERSION},
+    {"(long)(1e300 * 1e300 - 1e300 * 1e300)", EVAL_BAD_CONVERSION},
+    {0}
+};
+
+struct error_spec {
+    const char* input;
+    const char* error;
+};
+
+struct error_spec failing_compiles[] = {
+    {"f(a)", "Can't evaluate (function call)"},
+    {"\"str\"", "Can't evaluate string literals"},
+    {"&a", "Can't evaluate reference"},
+    {"sizeof a", "Can't evaluate sizeof"},
+    {"1 = 2", "Can only assign to identifiers with ="},
+    {"p->id += 1", "Can only assign to identifiers with +="},
+    {"(char *)p", "Can't evaluate a cast to char *"},
+    {"1e", "Bad literal 1e"},
+    {"'ab'", "Bad literal 'ab'"},
+    {0}
+};
+
+/* Compiles input, or prints why it couldn't */
+static struct eval_program* compile(const char* input) {
+    struct parse_result* result = parse(input, 0);
+    if (result->is_error) {
+        printf("Failed to parse %s: %s\n", input, result->error_message);
+        free_parse_result_contents(result);
+        free(result);
+        return 0;
+    }
+    char* error = 0;
+    struct eval_program* program = eval_compile(result->node, &error);
+    if (!program) {
+        printf("Failed to compile %s: %s\n", input, error);
+        free(error);
+    }
+    free_parse_result_contents(result);
+    free(result);
+    return program;
+}
+
+/*
+  Runs program with the bindings above, with eval_run or as native,
+  if it isn't NULL.  If slots_after isn't NULL, the slots are copied
+  to it afterwards.
+ */
+static enum eval_status run_as(struct eval_program* program,
+                               eval_native_fn native,
+                               struct eval_value* result,
+                               struct eval_value* slots_after) {
+    int n_slots = eval_program_n_slots(program);
+    struct eval_value* slots = malloc((n_slots + 1) * sizeof(*slots));
+    for (int i = 0; i < n_slots; ++i) {
+        slots[i] = eval_int(0);
+        for (struct binding* binding = bindings; binding->name; ++binding) {
+            if (!strcmp(binding->name, eval_program_slot_name(program, i))) {
+                slots[i] = binding->value;
+            }
+        }
+    }
+    struct accessor_data data;
+    for (int i = 0; i < eval_program_n_fields(program); ++i) {
+        const char* name = eval_program_field_name(program, i);
+        data.fields[i] = !strcmp(name, "id") ? FIELD_ID
+            : !strcmp(name, "price") ? FIELD_PRICE
+            : !strcmp(name, "qty") ? FIELD_QTY : FIELD_UNKNOWN;
+    }
+    enum eval_status status = native
+        ? native(slots, &accessors, &data, result)
+        : eval_run(program, slots, &accessors, &data, result);
+    if (slots_after) {
+        memcpy(slots_after, slots, n_slots * sizeof(*slots));
+    }
+    free(slots);
+    return status;
+}
+
+static enum eval_status run(struct eval_program* program,
+                            struct eval_value* result) {
+    return run_as(program, 0, result, 0);
+}
+
+static bool values_equal(struct eval_value a, struct eval_value b) {
+    return a.type == b.type && (a.type == EVAL_INT ? a.i == b.i : a.d == b.d);
+}
+
+static void print_value(struct eval_value value) {
+    if (value.type == EVAL_INT) {
+        printf("%lld", (long long)value.i);
+    } else {
+        printf("%g (double)", value.d);
+    }
+}
+
+int test_eval() {
+    int bad = 0;
+    for (struct eval_spec* spec = specs; spec->input; ++spec) {
+        struct eval_program* program = compile(spec->input);
+        if (!program) {
+            bad++;
+            continue;
+        }
+        struct eval_value result;
+        enum eval_status status = run(program, &result);
+        if (status != EVAL_OK) {
+            printf("Evaluating %s failed: %s\n", spec->input,
+                   eval_status_message(status));
+            bad++;
+        } else if (!values_equal(result, spec->expected)) {
+            printf("Evaluating %s: expected ", spec->input);
+            print_value(spec->expected);
+            printf(", got ");
+            print_value(result);
+            printf("\n");
+            bad++;
+        }
+        eval_program_free(program);
+    }
+    return bad;
+}
+
+int test_eval_failures() {
+    int bad = 0;
+    for (struct status_spec* spec = failing_runs; spec->input; ++spec) {
+        struct eval_program* program = compile(spec->input);
+        if (!program) {
+            bad++;
+            continue;
+        }
+        struct eval_value result;
+        enum eval_status status = run(program, &result);
+        if (status != spec->status) {
+            printf("Evaluating %s: expected \"%s\", got \"%s\"\n",
+                   spec->input, eval_status_message(spec->status),
+                   eval_status_message(status));
+            bad++;
+        }
+        eval_program_free(program);
+    }
+
+    for (struct error_spec* spec = failing_compiles; spec->input; ++spec) {
+        struct parse_result* result = parse(spec->input, 0);
+        if (result->is_error) {
+            printf("Failed to parse %s: %s\n", spec->input,
+                   result->error_message);
+            bad++;
+            free_parse_result_contents(result);
+            free(result);
+            continue;
+        }
+        char* error = 0;
+        struct eval_program* program = eval_compile(result->node, &error);
+        if (program) {
+            printf("Compiled %s, which should have failed\n", spec->input);
+            eval_program_free(program);
+            bad++;
+        } else if (strcmp(error, spec->error)) {
+            printf("Compiling %s: expected error \"%s\", got \"%s\"\n",
+                   spec->input, spec->error, error);
+            bad++;
+        }
+        free(error);
+        free_parse_result_contents(result);
+        free(result);
+    }
+    return bad;
+}
+
+/* Each identifier gets one slot, however often it's used */
+int test_eval_slots() {
+    int bad = 0;
+    struct eval_program* program = compile("a + b * a - (b = a) + c");
+    if (!program) {
+        return 1;
+    }
+    if (eval_program_n_slots(program) != 3 ||
+        eval_program_find_slot(program, "a") != 0 ||
+        eval_program_find_slot(program, "b") != 1 ||
+        eval_program_find_slot(program, "c") != 2 ||
+        eval_program_find_slot(program, "d") != -1) {
+        printf("Wrong slots for a + b * a - (b = a) + c\n");
+        bad++;
+    }
+    struct eval_value slots[3] = {eval_int(2), eval_int(5), eval_int(1)};
+    struct eval_value result;
+    eval_run(program, slots, 0, 0, &result);
+    if (result.i != 2 + 5 * 2 - 2 + 1 || slots[1].i != 2) {
+        printf("Wrong result or slots for a + b * a - (b = a) + c\n");
+        bad++;
+    }
+    eval_program_free(program);
+    return bad;
+}
+
+/* prefix * depth, middle, suffix * depth */
+static char* nest(const char* prefix, const char* middle, const char* suffix,
+                  int depth) {
+    size_t prefix_len = strlen(prefix);
+    size_t suffix_len = strlen(suffix);
+    char* str = malloc((prefix_len + suffix_len) * depth + strlen(middle) + 1);
+    char* end = str;
+    for (int i = 0; i < depth; ++i) {
+        memcpy(end, prefix, prefix_len);
+        end += prefix_len;
+    }
+    end = stpcpy(end, middle);
+    for (int i = 0; i < depth; ++i) {
+        memcpy(end, suffix, suffix_len);
+        end += suffix_len;
+    }
+    *end = 0;
+    return str;
+}
+
+/*
+  Deep expressions compile without recursing, and ones that need more
+  stack than fits locally still run.
+ */
+int test_eval_deep() {
+    int bad = 0;
+    struct {
+        const char* prefix;
+        const char* suffix;
+        int depth;
+        int64_t expected;
+    } deep[] = {
+        {"-(", ")", 100001, -1},
+        {"1+(", ")", 10000, 10001},
+        {"a ? ", " : 0", 10000, 1},
+    };
+    for (size_t i = 0; i < sizeof(deep) / sizeof(deep[0]); ++i) {
+        char* input = nest(deep[i].prefix, "1", deep[i].suffix,
+                           deep[i].depth);
+        struct eval_program* program = compile(input);
+        if (!program) {
+            bad++;
+            free(input);
+            continue;
+        }
+        struct eval_value result;
+        enum eval_status status = run(program, &result);
+        if (status != EVAL_OK || result.type != EVAL_INT ||
+            result.i != deep[i].expected) {
+            printf("Wrong result for %d levels of %s\n", deep[i].depth,
+                   deep[i].prefix);
+            bad++;
+        }
+        eval_program_free(program);
+        free(input);
+    }
+    return bad;
+}
+
+/* columns a, b and c are ints (c is often 0), x and y doubles */
+static const char* batch_columns[] = {"a", "b", "c", "x", "y", 0};
+
+static const char* batch_specs[] = {
+    "a + b * c",
+    "x * y - a",
+    "a > b && x < y",
+    "c && a / c > 1",
+    "c || 10 / c",
+    "c ? a / c : -1",
+    "a % 7 ^ b << 3 | c",
+    "x > 0 ? a : x",
+    "!c + ~a + -x",
+    "(int)x + (double)a",
+    "(unsigned char)a + (short)(a << 12) + (char)(b * 3)",
+    "(unsigned char)(x + 125) + (char)x + (unsigned)(c - 1)",
+    "(unsigned long)(x * c + 300) + (unsigned)(y + 200)",
+    "c == 5 ? (int)(x * 1e20) : (long)x",
+    "(int)(x * 1e20)",
+    "(int)(x * 1e20) + a / c",
+    "a < 0 ? b >> 2 : c ? a / c : 0",
+    "a, b + 1",
+    "a > 0 && (b > 0 || c == 0) && !(x < y)",
+    "c == 0 ? 1.5 : a > 0 ? x : c || a / c",
+    "a / c",
+    "a << b",
+    0
+};
+
+/*
+  Where a batch and eval_run part ways, by design: over rows where c
+  and x are 0 in the first and 1 in the rest, the first failing row's
+  status from eval_run and the batch's.
+ */
+struct batch_divergence_spec {
+    const char* input;
+    enum eval_status run_status;
+    enum eval_status batch_status;
+};
+
+struct batch_divergence_spec diverging_batches[] = {
+    /* a double 0 in the batch, so it's inf */
+    {"3 / (c ? 1.5 : 0)", EVAL_DIVIDE_BY_ZERO, EVAL_OK},
+    /* -1.0 in the batch, which doesn't fit */
+    {"(unsigned long)(c ? -1 : x)", EVAL_OK, EVAL_BAD_CONVERSION},
+    /* the first failing instruction's, not the first failing row's */
+    {"(int)(x * 1e20) + 1 / c", EVAL_DIVIDE_BY_ZERO, EVAL_BAD_CONVERSION},
+    {0}
+};
+
+struct error_spec failing_batches[] = {
+    {"x % 2", "% applied to a double"},
+    {"~y", "~ applied to a double"},
+    {"a = 1", "Can't assign in a batch"},
+    {"a++", "Can't assign in a batch"},
+    {"a[1]", "Can't evaluate member accesses or subscripts in a batch"},
+    {0}
+};
+
+/*
+  Batches give the same results as evaluating each row on its own,
+  and fail when a row would.
+ */
+int test_eval_batch() {
+    int bad = 0;
+    long n_rows = 3 * EVAL_BATCH_ROWS + 77;
+    int64_t* ints[3];
+    double* doubles[2];
+    srand(1);
+    for (int i = 0; i < 3; ++i) {
+        ints[i] = malloc(n_rows * sizeof(int64_t));
+        for (long row = 0; row < n_rows; ++row) {
+            ints[i][row] = i == 2 ? rand() % 3 : rand() % 200 - 100;
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        doubles[i] = malloc(n_rows * sizeof(double));
+        for (long row = 0; row < n_rows; ++row) {
+            doubles[i][row] = (rand() % 2000 - 1000) / 8.0;
+        }
+    }
+    int64_t* result = malloc(n_rows * sizeof(int64_t));
+    uint64_t* selection = malloc((n_rows + 63) / 64 * sizeof(uint64_t));
+
+    for (const char** spec = batch_specs; *spec; ++spec) {
+        struct eval_program* program = compile(*spec);
+        if (!program) {
+            bad++;
+            continue;
+        }
+        int n_slots = eval_program_n_slots(program);
+        enum eval_type types[5];
+        const void* columns[5];
+        int column_of_slot[5];
+        for (int slot = 0; slot < n_slots; ++slot) {
+            const char* name = eval_program_slot_name(program, slot);
+            for (int i = 0; batch_columns[i]; ++i) {
+                if (!strcmp(name, batch_columns[i])) {
+                    column_of_slot[slot] = i;
+                }
+            }
+            int column = column_of_slot[slot];
+            types[slot] = column < 3 ? EVAL_INT : EVAL_DOUBLE;
+            columns[slot] = column < 3 ? (const void*)ints[column]
+                : (const void*)doubles[column - 3];
+        }
+
+        /* what each row gives on its own, and every way rows fail */
+        enum eval_status expected_status = EVAL_OK;
+        unsigned failures = 0;
+        struct eval_value* expected = malloc(n_rows * sizeof(*expected));
+        for (long row = 0; row < n_rows; ++row) {
+            struct eval_value slots[5];
+            for (int slot = 0; slot < n_slots; ++slot) {
+                int column = column_of_slot[slot];
+                slots[slot] = column < 3 ? eval_int(ints[column][row])
+                    : eval_double(doubles[column - 3][row]);
+            }
+            enum eval_status status = eval_run(program, slots, 0, 0,
+                                               &expected[row]);
+            failures |= 1u << status;
+            if (status != EVAL_OK && expected_status == EVAL_OK) {
+                expected_status = status;
+            }
+        }
+
+        char* error = 0;
+        struct eval_batch* batch = eval_batch_new(program, types, &error);
+        if (!batch) {
+            printf("Failed to make a batch for %s: %s\n", *spec, error);
+            free(error);
+            bad++;
+        } else {
+            enum eval_type type = eval_batch_result_type(batch);
+            enum eval_status status = eval_batch_run(batch, columns, n_rows,
+                                                     result);
+            enum eval_status select_status =
+                eval_batch_select(batch, columns, n_rows, selection);
+            /* any failing row's status, if rows fail in different
+               ways */
+            bool status_ok = status == EVAL_OK
+                ? expected_status == EVAL_OK
+                : failures >> status & 1;
+            if (!status_ok || select_status != status) {
+                printf("Batch of %s: expected \"%s\", got \"%s\"\n", *spec,
+                       eval_status_message(expected_status),
+                       eval_status_message(status));
+                bad++;
+            }
+            for (long row = 0; row < n_rows && status == EVAL_OK; ++row) {
+                struct eval_value want = expected[row];
+                bool same;
+                double got_double;
+                memcpy(&got_double, &result[row], sizeof(double));
+                if (type == EVAL_INT) {
+                    same = want.type == EVAL_INT && want.i == result[row];
+                } else {
+                    same = got_double == (want.type == EVAL_INT
+                                          ? (double)want.i : want.d);
+                }
+                bool selected = selection[row / 64] >> (row % 64) & 1;
+                bool want_true = want.type == EVAL_INT ? want.i != 0
+                    : want.d != 0;
+                if (!same || selected != want_true) {
+                    printf("Batch of %s: row %ld differs\n", *spec, row);
+                    bad++;
+                    break;
+                }
+            }
+            if (status == EVAL_OK && n_rows % 64 &&
+                selection[n_rows / 64] >> (n_rows % 64)) {
+                printf("Batch of %s: selection past the end\n", *spec);
+                bad++;
+            }
+            eval_batch_free(batch);
+        }
+        free(expected);
+        eval_program_free(program);
+    }
+
+    for (struct error_spec* spec = failing_batches; spec->input; ++spec) {
+        struct eval_program* program = compile(spec->input);
+        if (!program) {
+            bad++;
+            continue;
+        }
+        enum eval_type types[] = {EVAL_INT, EVAL_DOUBLE};
+        types[0] = strchr(spec->input, 'a') ? EVAL_INT : EVAL_DOUBLE;
+        char* error = 0;
+        struct eval_batch* batch = eval_batch_new(program, types, &error);
+        if (batch) {
+            printf("Made a batch for %s, which should have failed\n",
+                   spec->input);
+            eval_batch_free(batch);
+            bad++;
+        } else if (strcmp(error, spec->error)) {
+            printf("Batch of %s: expected error \"%s\", got \"%s\"\n",
+                   spec->input, spec->error, error);
+            bad++;
+        }
+        free(error);
+        eval_program_free(program);
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        free(ints[i]);
+    }
+    for (int i = 0; i < 2; ++i) {
+        free(doubles[i]);
+    }
+    free(result);
+    free(selection);
+    return bad;
+}
+
+/* The divergences documented for batches are still there */
+int test_eval_batch_divergences() {
+    int bad = 0;
+    enum { N_ROWS = 8 };
+    int64_t c[N_ROWS];
+    double x[N_ROWS];
+    int64_t result[N_ROWS];
+    for (int row = 0; row < N_ROWS; ++row) {
+        c[row] = row > 0;
+        x[row] = row > 0;
+    }
+    for (struct batch_divergence_spec* spec = diverging_batches;
+         spec->input; ++spec) {
+        struct eval_program* program = compile(spec->input);
+        if (!program) {
+            bad++;
+            continue;
+        }
+        enum eval_type types[2];
+        const void* columns[2];
+        for (int slot = 0; slot < eval_program_n_slots(program); ++slot) {
+            bool is_c = !strcmp(eval_program_slot_name(program, slot), "c");
+            types[slot] = is_c ? EVAL_INT : EVAL_DOUBLE;
+            columns[slot] = is_c ? (const void*)c : (const void*)x;
+        }
+        enum eval_status run_status = EVAL_OK;
+        for (int row = 0; row < N_ROWS && run_status == EVAL_OK; ++row) {
+            struct eval_value slots[2];
+            for (int slot = 0; slot < eval_program_n_slots(program); ++slot) {
+                slots[slot] = types[slot] == EVAL_INT ? eval_int(c[row])
+                    : eval_double(x[row]);
+            }
+            struct eval_value value;
+            run_status = eval_run(program, slots, 0, 0, &value);
+        }
+        char* error = 0;
+        struct eval_batch* batch = eval_batch_new(program, types, &error);
+        enum eval_status batch_status = batch
+            ? eval_batch_run(batch, columns, N_ROWS, result) : EVAL_OK;
+        if (!batch) {
+            printf("Failed to make a batch for %s: %s\n", spec->input, error);
+            free(error);
+            bad++;
+        } else if (run_status != spec->run_status ||
+                   batch_status != spec->batch_status) {
+            printf("Batch of %s: expected \"%s\" and \"%s\" by row, "
+                   "got \"%s\" and \"%s\"\n", spec->input,
+                   eval_status_message(spec->batch_status),
+                   eval_status_message(spec->run_status),
+                   eval_status_message(batch_status),
+                   eval_status_message(run_status));
+            bad++;
+        }
+        if (batch) {
+            eval_batch_free(batch);
+        }
+        eval_program_free(program);
+    }
+    return bad;
+}
+
+/* a random expression over the bindings, fully parenthesized */
+static void random_expr(char** pos, int depth, uint32_t* seed) {
+    static const char* leaves[] = {
+        "a", "b", "zero", "x", "0", "1", "2", "7", "63", "64", "2.5", "-1"
+    };
+    static const char* binary[] = {
+        "+", "-", "*", "/", "%", "<<", ">>", "<", ">", "<=", ">=", "==",
+        "!=", "&", "^", "|", "&&", "||", ",", "=", "+=", "*="
+    };
+    static const char* unary[] = {"-", "!", "~", "+", "++", "--"};
+    *seed = *seed * 1103515245 + 12345;
+    uint32_t r = *seed >> 8;
+    int n_leaves = sizeof(leaves) / sizeof(leaves[0]);
+    int n_binary = sizeof(binary) / sizeof(binary[0]);
+    int n_unary = sizeof(unary) / sizeof(unary[0]);
+    if (depth == 0 || r % 8 == 0) {
+        *pos += sprintf(*pos, "%s", leaves[r / 8 % n_leaves]);
+    } else if (r % 8 == 1) {
+        const char* op = unary[r / 8 % n_unary];
+        if (op[0] == op[1]) {
+            /* ++ and -- only go on identifiers */
+            *pos += sprintf(*pos, "(%s%s)", op, r / 64 % 2 ? "a" : "x");
+        } else {
+            *pos += sprintf(*pos, "(%s ", op);
+            random_expr(pos, depth - 1, seed);
+            *pos += sprintf(*pos, ")");
+        }
+    } else if (r % 8 == 2) {
+        *pos += sprintf(*pos, "(");
+        random_expr(pos, depth - 1, seed);
+        *pos += sprintf(*pos, " ? ");
+        random_expr(pos, depth - 1, seed);
+        *pos += sprintf(*pos, " : ");
+        random_expr(pos, depth - 1, seed);
+        *pos += sprintf(*pos, ")");
+    } else {
+        const char* op = binary[r / 8 % n_binary];
+        *pos += sprintf(*pos, "(");
+        if (strchr(op, '=') && op[0] != '=' && op[0] != '!' &&
+            op[0] != '<' && op[0] != '>') {
+            /* assignments too */
+            *pos += sprintf(*pos, "%s", r / 64 % 2 ? "b" : "x");
+        } else if (!strcmp(op, "=")) {
+            *pos += sprintf(*pos, "%s", r / 64 % 2 ? "b" : "x");
+        } else {
+            random_expr(pos, depth - 1, seed);
+        }
+        *pos += sprintf(*pos, " %s ", op);
+        random_expr(pos, depth - 1, seed);
+        *pos += sprintf(*pos, ")");
+    }
+}
+
+/*
+  Native programs give the same results, statuses and slots as
+  eval_run, for the specs and for random expressions, and are loaded
+  from the cache when they haven't changed.
+ */
+int test_eval_native() {
+    int bad = 0;
+    int n_random = 200;
+    int n_programs = 0;
+    struct eval_program** programs =
+        malloc((sizeof(specs) / sizeof(specs[0]) +
+                sizeof(failing_runs) / sizeof(failing_runs[0]) + n_random) *
+               sizeof(struct eval_program*));
+    char** inputs = malloc((n_random) * sizeof(char*));
+    for (struct eval_spec* spec = specs; spec->input; ++spec) {
+        programs[n_programs] = compile(spec->input);
+        n_programs += programs[n_programs] != 0;
+    }
+    for (struct status_spec* spec = failing_runs; spec->input; ++spec) {
+        programs[n_programs] = compile(spec->input);
+        n_programs += programs[n_programs] != 0;
+    }
+    uint32_t seed = 1;
+    for (int i = 0; i < n_random; ++i) {
+        inputs[i] = malloc(4096);
+        char* pos = inputs[i];
+        random_expr(&pos, 4, &seed);
+        programs[n_programs] = compile(inputs[i]);
+        n_programs += programs[n_programs] != 0;
+    }
+
+    char dir[] = "/tmp/evaltest.XXXXXX";
+    if (!mkdtemp(dir)) {
+        printf("Couldn't make a directory for native programs\n");
+        return 1;
+    }
+    char* error = 0;
+    struct eval_native* native =
+        eval_native_build((const struct eval_program* const*)programs,
+                          n_programs, dir, &error);
+    if (!native) {
+        printf("Failed to build native programs: %s\n", error);
+        free(error);
+        bad++;
+    } else if (eval_native_cached(native)) {
+        printf("Native programs came from an empty cache\n");
+        bad++;
+    }
+    for (int i = 0; native && i < n_programs; ++i) {
+        int n_slots = eval_program_n_slots(programs[i]);
+        struct eval_value expected_slots[8], slots[8];
+        struct eval_value expected, result;
+        enum eval_status expected_status =
+            run_as(programs[i], 0, &expected, expected_slots);
+        enum eval_status status =
+            run_as(programs[i], eval_native_function(native, i), &result,
+                   slots);
+        /* by bits, for NaNs */
+        bool same = status == expected_status &&
+            (status != EVAL_OK || (result.type == expected.type &&
+                                   result.i == expected.i));
+        for (int slot = 0; slot < n_slots; ++slot) {
+            same = same && slots[slot].type == expected_slots[slot].type &&
+                slots[slot].i == expected_slots[slot].i;
+        }
+        if (!same) {
+            printf("Native program %d differs from eval_run\n", i);
+            bad++;
+        }
+    }
+    if (native) {
+        eval_native_free(native);
+    }
+
+    /* the same again comes from the cache; a change doesn't */
+    for (int pass = 0; pass < 2; ++pass) {
+        native = eval_native_build((const struct eval_program* const*)programs,
+                                   n_programs - pass, dir, &error);
+        if (!native) {
+            printf("Failed to build native programs: %s\n", error);
+            free(error);
+            bad++;
+            continue;
+        }
+        if (eval_native_cached(native) != (pass == 0)) {
+            printf("Native programs %s from the cache\n",
+                   pass == 0 ? "didn't come" : "came");
+            bad++;
+        }
+        struct eval_value result;
+        if (run_as(programs[0], eval_native_function(native, 0), &result, 0)
+            != EVAL_OK || !values_equal(result, specs[0].expected)) {
+            printf("Wrong result from a native program\n");
+            bad++;
+        }
+        eval_native_free(native);
+    }
+
+    /* without a cache, and with arguments in $CC */
+    const char* cc = getenv("CC");
+    char* old_cc = cc ? strdup(cc) : 0;
+    char cc_with_args[256];
+    snprintf(cc_with_args, sizeof(cc_with_args), " %s  -w ",
+             old_cc && *old_cc ? old_cc : "cc");
+    setenv("CC", cc_with_args, 1);
+    native = eval_native_build((const struct eval_program* const*)programs,
+                               1, 0, &error);
+    if (old_cc) {
+        setenv("CC", old_cc, 1);
+    } else {
+        unsetenv("CC");
+    }
+    free(old_cc);
+    if (!native) {
+        printf("Failed to build a native program: %s\n", error);
+        free(error);
+        bad++;
+    } else {
+        eval_native_free(native);
+    }
+
+    DIR* entries = opendir(dir);
+    for (struct dirent* entry; entries && (entry = readdir(entries));) {
+        char path[300];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (entry->d_name[0] != '.') {
+            unlink(path);
+        } else if (strcmp(entry->d_name, ".") &&
+                   strcmp(entry->d_name, "..")) {
+            printf("Left a temporary file %s\n", entry->d_name);
+            bad++;
+        }
+    }
+    closedir(entries);
+    rmdir(dir);
+
+    for (int i = 0; i < n_programs; ++i) {
+        eval_program_free(programs[i]);
+    }
+    for (int i = 0; i < n_random; ++i) {
+        free(inputs[i]);
+    }
+    free(programs);
+    free(inputs);
+    return bad;
+}
+
+int main() {
+    int bad = 0;
+    bad += test_eval();
+    bad += test_eval_failures();
+    bad += test_eval_slots();
+    bad += test_eval_deep();
+    bad += test_eval_batch();
+    bad += test_eval_batch_divergences();
+    bad += test_eval_native();
+    if (bad) {
+        printf("%d failed tests\n", bad);
+    }
+    return bad;
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "layout.h"
 
 /*
@@ -10,10 +11,20 @@ Christoph Buchheim, Michael Ju"nger, Sebastian Leipert, 2002
 (with a slight modification for variable-width nodes)
 */
 
+/*
+  The walks go up and down the tree by parent pointers instead of
+  recursing, so deep trees can't overflow the stack.  Whatever a
+  recursive walk would keep in its stack frames is kept per level of
+  the tree instead.
+ */
 struct layout_ctx {
     double x_top_adjustment;
     double y_top_adjustment;
-    struct label **prev_node_at_level;
+    /* first_walk: the default ancestor for the children being placed
+       at each level */
+    struct label **default_ancestor;
+    /* second_walk: the sum of the modifiers above each level */
+    double *modsum;
     struct walker_layout_rules *rules;
 };
 
@@ -25,15 +36,12 @@ static struct label* ancestor(struct label* left, struct label* node, struct lab
     return default_ancestor;
 }
 
+/* Spreads the shifts recorded by move_subtree over node's children */
 static void execute_shifts(struct label* node) {
     double shift = 0;
     double change = 0;
-    //find the rightmost child
-    struct label* child = node;
-    while (child->next_sibling) {
-        child = child->next_sibling;
-    }
-    //walk the children backwards
+    //walk the children backwards, from the rightmost
+    struct label* child = node->last_child;
     while (child) {
         child->xcoord += shift;
         child->modifier += shift;
@@ -60,12 +68,8 @@ static struct label* next_left(struct label *node) {
 }
 
 static struct label* next_right(struct label *node) {
-    if (node->first_child) {
-        struct label* child = node->first_child;
-        while(child->next_sibling) {
-            child = child->next_sibling;
-        }
-        return child;
+    if (node->last_child) {
+        return node->last_child;
     }
     return node->thread;
 }
@@ -136,34 +140,39 @@ static struct label* apportion(struct layout_ctx* ctx, struct label* node,
 }
 
 
-static void second_walk(struct layout_ctx* ctx, struct label *node, int level, 
-                        double modsum) {
-
-    node->xcoord = ctx->x_top_adjustment + node->xcoord + modsum;
-    node->ycoord = ctx->y_top_adjustment + level * ctx->rules->level_separation;
-
-    if (node->first_child) {
-        second_walk(ctx, node->first_child, level + 1, 
-                    modsum + node->modifier);
-    }
-    if (node->next_sibling) {
-        second_walk(ctx, node->next_sibling, level, modsum);
+static void second_walk(struct layout_ctx* ctx, struct label *root) {
+    struct label *node = root;
+    int level = 0;
+    ctx->modsum[0] = -root->xcoord;
+    while (1) {
+        node->xcoord = ctx->x_top_adjustment + node->xcoord
+            + ctx->modsum[level];
+        node->ycoord = ctx->y_top_adjustment
+            + level * ctx->rules->level_separation;
+
+        if (node->first_child) {
+            ctx->modsum[level + 1] = ctx->modsum[level] + node->modifier;
+            node = node->first_child;
+            level++;
+            continue;
+        }
+        while (node != root && !node->next_sibling) {
+            node = node->parent;
+            level--;
+        }
+        if (node == root) {
+            return;
+        }
+        node = node->next_sibling;
     }
 }
 
-static void first_walk(struct layout_ctx* ctx, struct label *node) {
+/* Places node once all of its children (if any) have been placed */
+static void place_node(struct layout_ctx* ctx, struct label *node) {
     if (node->first_child) {
-        struct label *default_ancestor = node->first_child;
-        struct label *cur = node->first_child;
-        struct label *last_child;
-        while (cur) {
-            first_walk(ctx, cur);
-            default_ancestor = apportion(ctx, cur, default_ancestor);
-            last_child = cur;
-            cur = cur->next_sibling;
-        }
         execute_shifts(node);
-        double midpoint = (node->first_child->xcoord + last_child->xcoord) / 2;
+        double midpoint = (node->first_child->xcoord
+                           + node->last_child->xcoord) / 2;
 
         if (node->prev_sibling) {
             node->xcoord = node->prev_sibling->xcoord 
@@ -182,25 +191,64 @@ static void first_walk(struct layout_ctx* ctx, struct label *node) {
             node->xcoord = 0;
         }
     }
+}
 
+/* Visits the tree in postorder, placing each node after its children */
+static void first_walk(struct layout_ctx* ctx, struct label *root) {
+    struct label *node = root;
+    int level = 0;
+    while (1) {
+        while (node->first_child) {
+            ctx->default_ancestor[level] = node->first_child;
+            node = node->first_child;
+            level++;
+        }
+        while (1) {
+            place_node(ctx, node);
+            if (node == root) {
+                return;
+            }
+            ctx->default_ancestor[level - 1] =
+                apportion(ctx, node, ctx->default_ancestor[level - 1]);
+            if (node->next_sibling) {
+                break;
+            }
+            node = node->parent;
+            level--;
+        }
+        node = node->next_sibling;
+    }
 }
 
-static int get_max_depth(struct label *node) {
+static int get_max_depth(struct label *root) {
+    struct label *node = root;
+    int level = 0;
     int depth = 0;
-    struct label* child = node->first_child;
-    while (child) {
-        int child_depth = get_max_depth(child);
-        if (child_depth > depth) {
-            depth = child_depth;
+    while (1) {
+        if (level + 1 > depth) {
+            depth = level + 1;
         }
-        child = child->next_sibling;
+        if (node->first_child) {
+            node = node->first_child;
+            level++;
+            continue;
+        }
+        while (node != root && !node->next_sibling) {
+            node = node->parent;
+            level--;
+        }
+        if (node == root) {
+            return depth;
+        }
+        node = node->next_sibling;
     }
-    return depth + 1;
 }
 
 /*
   Lay out a tree using Walker/Buchheim's layout algorithm.  The tree
-  is rooted at node->xcoord, node->ycoord
+  is rooted at node->xcoord, node->ycoord.  Each step is O(1), with
+  last_child for the rightmost child, so it's linear in the number of
+  labels however wide the tree is.
  */
 void walker_layout(struct label *node, struct walker_layout_rules* rules) {
     if (!node) {
@@ -209,13 +257,601 @@ void walker_layout(struct label *node, struct walker_layout_rules* rules) {
 
     struct layout_ctx ctx;
 
-    ctx.prev_node_at_level = calloc(get_max_depth(node), sizeof(node));
+    int depth = get_max_depth(node);
+    ctx.default_ancestor = malloc(depth * sizeof(struct label*));
+    ctx.modsum = malloc(depth * sizeof(double));
     ctx.rules = rules;
 
     ctx.x_top_adjustment = node->xcoord;
     ctx.y_top_adjustment = node->ycoord;
 
     first_walk(&ctx, node);
-    second_walk(&ctx, node, 0, -node->xcoord);
+    second_walk(&ctx, node);
+
+    free(ctx.default_ancestor);
+    free(ctx.modsum);
+
+}
+
+/*
+  The flat layout: the same algorithm, step for step, so the floating
+  point comes out the same, with node numbers for pointers.
+ */
+struct flat_ctx {
+    struct flat_layout* layout;
+    double x_top_adjustment;
+    double y_top_adjustment;
+    uint32_t* default_ancestor;
+    double* modsum;
+    struct walker_layout_rules* rules;
+    /* NULL if the tree isn't in preorder, or memoize is off */
+    struct layout_memo* memo;
+};
+
+struct flat_layout* flat_layout_new(uint32_t n_nodes) {
+    size_t doubles = 6 * (size_t)n_nodes * sizeof(double);
+    size_t ints = 8 * (size_t)n_nodes * sizeof(uint32_t);
+    struct flat_layout* layout = malloc(sizeof(struct flat_layout));
+    char* block = calloc(1, doubles + ints);
+    layout->n_nodes = n_nodes;
+    layout->memoize = true;
+
+    double** double_arrays[] = {
+        &layout->width, &layout->xcoord, &layout->ycoord,
+        &layout->modifier, &layout->change, &layout->shift
+    };
+    for (int i = 0; i < 6; ++i) {
+        *double_arrays[i] = (double*)block + i * (size_t)n_nodes;
+    }
+    uint32_t** int_arrays[] = {
+        &layout->parent, &layout->first_child, &layout->last_child,
+        &layout->prev_sibling, &layout->next_sibling, &layout->number,
+        &layout->thread, &layout->ancestor
+    };
+    for (int i = 0; i < 8; ++i) {
+        *int_arrays[i] = (uint32_t*)(block + doubles) + i * (size_t)n_nodes;
+    }
+    return layout;
+}
+
+void flat_layout_free(struct flat_layout* layout) {
+    if (layout) {
+        /* width is the start of the block */
+        free(layout->width);
+        free(layout);
+    }
+}
+
+static uint32_t flat_ancestor(struct flat_layout* layout, uint32_t left,
+                              uint32_t node, uint32_t default_ancestor) {
+    if (layout->parent[layout->ancestor[left]] == layout->parent[node]) {
+        return layout->ancestor[left];
+    }
+    return default_ancestor;
+}
+
+static void flat_execute_shifts(struct flat_layout* layout, uint32_t node) {
+    double shift = 0;
+    double change = 0;
+    for (uint32_t child = layout->last_child[node]; child;
+         child = layout->prev_sibling[child]) {
+        layout->xcoord[child] += shift;
+        layout->modifier[child] += shift;
+        change += layout->change[child];
+        shift += layout->shift[child] + change;
+    }
+}
+
+static void flat_move_subtree(struct flat_layout* layout, uint32_t left,
+                              uint32_t right, double shift) {
+    int subtrees = (int)layout->number[right] - (int)layout->number[left];
+    layout->change[right] -= shift / subtrees;
+    layout->shift[right] += shift;
+    layout->change[left] += shift / subtrees;
+    layout->xcoord[right] += shift;
+    layout->modifier[right] += shift;
+}
+
+static inline uint32_t flat_next_left(struct flat_layout* layout,
+                                      uint32_t node) {
+    if (layout->first_child[node]) {
+        return layout->first_child[node];
+    }
+    return layout->thread[node];
+}
+
+static inline uint32_t flat_next_right(struct flat_layout* layout,
+                                       uint32_t node) {
+    if (layout->last_child[node]) {
+        return layout->last_child[node];
+    }
+    return layout->thread[node];
+}
+
+static inline double flat_spacing(struct flat_ctx* ctx, uint32_t node,
+                                  uint32_t left, bool siblings) {
+    double separation;
+    if (siblings)
+        separation = ctx->rules->sibling_separation;
+    else
+        separation = ctx->rules->subtree_separation;
+    return separation
+        + 0.5 * (ctx->layout->width[node] + ctx->layout->width[left]);
+}
+
+static uint32_t flat_apportion(struct flat_ctx* ctx, uint32_t node,
+                               uint32_t default_ancestor) {
+    struct flat_layout* layout = ctx->layout;
+    if (!layout->prev_sibling[node]) {
+        return default_ancestor;
+    }
+    uint32_t inner_right_node = node;
+    uint32_t outer_right_node = node;
+    uint32_t inner_left_node = layout->prev_sibling[node];
+    uint32_t outer_left_node = layout->first_child[layout->parent[node]];
+    double shift_inner_right = layout->modifier[inner_right_node];
+    double shift_outer_right = layout->modifier[outer_right_node];
+    double shift_inner_left = layout->modifier[inner_left_node];
+    double shift_outer_left = layout->modifier[outer_left_node];
+
+    while (flat_next_right(layout, inner_left_node) &&
+           flat_next_left(layout, inner_right_node)) {
+
+        inner_left_node = flat_next_right(layout, inner_left_node);
+        inner_right_node = flat_next_left(layout, inner_right_node);
+        outer_left_node = flat_next_left(layout, outer_left_node);
+        outer_right_node = flat_next_right(layout, outer_right_node);
+        layout->ancestor[outer_right_node] = node;
+        double shift = flat_spacing(ctx, inner_left_node, inner_right_node,
+                                    false)
+            + layout->xcoord[inner_left_node] + shift_inner_left
+            - (layout->xcoord[inner_right_node] + shift_inner_right);
+
+        if (shift > 0) {
+            uint32_t a = flat_ancestor(layout, inner_left_node, node,
+                                       default_ancestor);
+            flat_move_subtree(layout, a, node, shift);
+            shift_inner_right += shift;
+            shift_outer_right += shift;
+        }
+        shift_inner_left += layout->modifier[inner_left_node];
+        shift_inner_right += layout->modifier[inner_right_node];
+        shift_outer_left += layout->modifier[outer_left_node];
+        shift_outer_right += layout->modifier[outer_right_node];
+    }
+    if (flat_next_right(layout, inner_left_node) &&
+        flat_next_right(layout, outer_right_node) == 0) {
+
+        layout->thread[outer_right_node] =
+            flat_next_right(layout, inner_left_node);
+        layout->modifier[outer_right_node] +=
+            shift_inner_left - shift_outer_right;
+    } else {
+        if (flat_next_left(layout, inner_right_node) &&
+            flat_next_left(layout, outer_left_node) == 0) {
+
+            layout->thread[outer_left_node] =
+                flat_next_left(layout, inner_right_node);
+            layout->modifier[outer_left_node] +=
+                shift_inner_right - shift_outer_left;
+        }
+        default_ancestor = node;
+    }
+
+    return default_ancestor;
+}
+
+static void flat_place_node(struct flat_ctx* ctx, uint32_t node) {
+    struct flat_layout* layout = ctx->layout;
+    uint32_t prev = layout->prev_sibling[node];
+    if (layout->first_child[node]) {
+        flat_execute_shifts(layout, node);
+        double midpoint = (layout->xcoord[layout->first_child[node]]
+                           + layout->xcoord[layout->last_child[node]]) / 2;
+
+        if (prev) {
+            layout->xcoord[node] = layout->xcoord[prev]
+                + flat_spacing(ctx, prev, node, true)
+                + ctx->rules->sibling_separation;
+            layout->modifier[node] = layout->xcoord[node] - midpoint;
+        } else {
+            layout->xcoord[node] = midpoint;
+        }
+
+    } else {
+        if (prev) {
+            layout->xcoord[node] = layout->xcoord[prev]
+                + flat_spacing(ctx, node, prev, true);
+        } else {
+            layout->xcoord[node] = 0;
+        }
+    }
+}
+
+/*
+  Subtree memoization.  What first_walk leaves below a node, by the
+  time the node itself is placed, depends only on the widths and shape
+  of its descendants: their positions relative to each other, their
+  modifiers, and the threads apportion set among them.  Later steps
+  only read those, besides patching the contours, so another subtree
+  of the same shape can start from a copy and skip everything but
+  placing its root.  (The ancestors set below a node don't need
+  copying: they're all below it too, so they can never be siblings of
+  a node apportioned above it, and only siblings count.)
+
+  With the nodes in preorder, a subtree is the run of numbers from its
+  root to root + size - 1, and nodes inside it are copied by offset.
+  A copy has to be taken as the subtree's root is placed, before
+  apportion at the levels above patches its contours.  Not knowing yet
+  whether a shape will come again, the walk only notes it the first
+  time, saves it the second, and copies it from then on.
+ */
+
+/* Smaller subtrees are cheaper to lay out than to look up */
+#define LAYOUT_MEMO_MIN_SIZE 4
+/*
+  Bigger ones rarely repeat, except as repeats of smaller ones, which
+  are memoized anyway.  Leaving them out keeps the spine of a long sum
+  or comma list out of the table.
+ */
+#define LAYOUT_MEMO_MAX_SIZE 4096
+
+struct memo_entry {
+    /* hash of the shape below a root, not counting the root's width;
+       0 for an empty slot */
+    uint64_t key;
+    /* the root of the saved subtree, or 0 if it's only been seen */
+    uint32_t source;
+    /* where its descendants start in saved */
+    uint32_t saved;
+};
+
+struct saved_node {
+    double xcoord;
+    double modifier;
+    /* relative to the subtree's root, or 0 for none */
+    uint32_t thread;
+};
+
+struct layout_memo {
+    /* per node: the nodes in its subtree, and its key */
+    uint32_t* size;
+    uint64_t* key;
+    /* of the whole tree, in levels, which comes for free */
+    int depth;
+
+    /* open addressed by key */
+    struct memo_entry* entries;
+    uint32_t mask;
+    uint32_t n_entries;
+
+    struct saved_node* saved;
+    uint32_t n_saved;
+    uint32_t allocated_saved;
+    /* saving stops here, so the copies take at most one per node */
+    uint32_t budget;
+};
+
+static inline uint64_t mix_hash(uint64_t hash, uint64_t value) {
+    hash = (hash ^ value) * 0x9e3779b97f4a7c15ull;
+    return hash ^ (hash >> 29);
+}
+
+static uint64_t width_bits(double width) {
+    uint64_t bits;
+    memcpy(&bits, &width, sizeof(bits));
+    return bits;
+}
+
+static void layout_memo_free(struct layout_memo* memo) {
+    if (memo) {
+        free(memo->size);
+        free(memo->key);
+        free(memo->entries);
+        free(memo->saved);
+        free(memo);
+    }
+}
+
+/*
+  Sizes and hashes every subtree, children before parents, which only
+  works in preorder: returns NULL if the nodes aren't.
+ */
+static struct layout_memo* layout_memo_new(const struct flat_layout* layout) {
+    uint32_t n = layout->n_nodes;
+    struct layout_memo* memo = malloc(sizeof(struct layout_memo));
+    memo->size = malloc(n * sizeof(uint32_t));
+    memo->key = malloc(n * sizeof(uint64_t));
+    /* levels below each node */
+    uint32_t* height = malloc(n * sizeof(uint32_t));
+    memo->mask = 255;
+    memo->n_entries = 0;
+    memo->entries = calloc(memo->mask + 1, sizeof(struct memo_entry));
+    memo->saved = 0;
+    memo->n_saved = 0;
+    memo->allocated_saved = 0;
+    memo->budget = n;
+
+    for (uint32_t i = n; i-- > 0;) {
+        uint32_t child = layout->first_child[i];
+        uint32_t size = 1;
+        uint32_t below = 0;
+        uint64_t key = 14695981039346656037ull;
+        if (child && child != i + 1) {
+            free(height);
+            layout_memo_free(memo);
+            return 0;
+        }
+        for (; child; child = layout->next_sibling[child]) {
+            uint32_t next = layout->next_sibling[child];
+            if (next && next != child + memo->size[child]) {
+                free(height);
+                layout_memo_free(memo);
+                return 0;
+            }
+            size += memo->size[child];
+            if (height[child] >= below) {
+                below = height[child] + 1;
+            }
+            /* the child's own width counts here.  Hashing each child
+               apart, then combining, keeps the chain of multiplies
+               through key short. */
+            key = key * 31 + mix_hash(memo->key[child],
+                                      width_bits(layout->width[child]));
+        }
+        /* the size keeps a node with no children apart from an empty
+           hash, and 0 is left for empty slots */
+        key = mix_hash(key, size);
+        memo->size[i] = size;
+        memo->key[i] = key ? key : 1;
+        height[i] = below;
+    }
+    memo->depth = n ? height[0] + 1 : 0;
+    free(height);
+    return memo;
+}
+
+static inline bool memoizable(const struct layout_memo* memo, uint32_t node) {
+    return memo->size[node] >= LAYOUT_MEMO_MIN_SIZE &&
+        memo->size[node] <= LAYOUT_MEMO_MAX_SIZE;
+}
+
+static void grow_memo(struct layout_memo* memo) {
+    struct memo_entry* old = memo->entries;
+    uint32_t old_mask = memo->mask;
+    memo->mask = memo->mask * 2 + 1;
+    memo->entries = calloc(memo->mask + 1, sizeof(struct memo_entry));
+    for (uint32_t i = 0; i <= old_mask; ++i) {
+        if (old[i].key) {
+            uint32_t slot = old[i].key & memo->mask;
+            while (memo->entries[slot].key) {
+                slot = (slot + 1) & memo->mask;
+            }
+            memo->entries[slot] = old[i];
+        }
+    }
+    free(old);
+}
+
+/* Returns the entry for key, adding it if add is true, or NULL */
+static struct memo_entry* find_memo_entry(struct layout_memo* memo,
+                                          uint64_t key, bool add) {
+    uint32_t slot = key & memo->mask;
+    for (; memo->entries[slot].key; slot = (slot + 1) & memo->mask) {
+        if (memo->entries[slot].key == key) {
+            return &memo->entries[slot];
+        }
+    }
+    if (!add) {
+        return 0;
+    }
+    if ((memo->n_entries + 1) * 2 > memo->mask) {
+        grow_memo(memo);
+        return find_memo_entry(memo, key, true);
+    }
+    memo->n_entries++;
+    memo->entries[slot] = (struct memo_entry){key, 0, 0};
+    return &memo->entries[slot];
+}
+
+/*
+  Whether the subtrees under root and source are the same shape with
+  the same widths, root's own width aside.  In preorder, the sizes and
+  widths in order say what the shape is.
+ */
+static bool same_subtree(const struct flat_layout* layout,
+                         const struct layout_memo* memo, uint32_t root,
+                         uint32_t source) {
+    uint32_t size = memo->size[root];
+    if (memo->size[source] != size) {
+        return false;
+    }
+    for (uint32_t i = 1; i < size; ++i) {
+        if (memo->size[root + i] != memo->size[source + i] ||
+            layout->width[root + i] != layout->width[source + i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+  If a subtree like node's has been saved, copies it below node and
+  returns true, and node can be placed like a leaf.
+ */
+static bool restore_subtree(struct flat_ctx* ctx, uint32_t node) {
+    struct layout_memo* memo = ctx->memo;
+    struct flat_layout* layout = ctx->layout;
+    if (!memoizable(memo, node)) {
+        return false;
+    }
+    struct memo_entry* entry = find_memo_entry(memo, memo->key[node], false);
+    if (!entry || !entry->source ||
+        !same_subtree(layout, memo, node, entry->source)) {
+        return false;
+    }
+    const struct saved_node* saved = memo->saved + entry->saved;
+    uint32_t size = memo->size[node];
+    for (uint32_t i = 1; i < size; ++i) {
+        layout->xcoord[node + i] = saved[i - 1].xcoord;
+        layout->modifier[node + i] = saved[i - 1].modifier;
+        layout->thread[node + i] =
+            saved[i - 1].thread ? node + saved[i - 1].thread : 0;
+    }
+    return true;
+}
+
+/*
+  Called once node is placed.  Notes its shape the first time, and
+  saves the subtree below it the second.
+ */
+static void save_subtree(struct flat_ctx* ctx, uint32_t node) {
+    struct layout_memo* memo = ctx->memo;
+    struct flat_layout* layout = ctx->layout;
+    if (!memoizable(memo, node)) {
+        return;
+    }
+    uint32_t n_entries = memo->n_entries;
+    struct memo_entry* entry = find_memo_entry(memo, memo->key[node], true);
+    uint32_t size = memo->size[node];
+    if (memo->n_entries != n_entries || entry->source ||
+        memo->n_saved + size - 1 > memo->budget) {
+        return;
+    }
+    if (memo->n_saved + size - 1 > memo->allocated_saved) {
+        memo->allocated_saved = memo->allocated_saved * 2 + size;
+        if (memo->allocated_saved > memo->budget) {
+            memo->allocated_saved = memo->budget;
+        }
+        memo->saved = realloc(memo->saved, memo->allocated_saved
+                              * sizeof(struct saved_node));
+    }
+    struct saved_node* saved = memo->saved + memo->n_saved;
+    for (uint32_t i = 1; i < size; ++i) {
+        saved[i - 1].xcoord = layout->xcoord[node + i];
+        saved[i - 1].modifier = layout->modifier[node + i];
+        saved[i - 1].thread =
+            layout->thread[node + i] ? layout->thread[node + i] - node : 0;
+    }
+    entry->source = node;
+    entry->saved = memo->n_saved;
+    memo->n_saved += size - 1;
+}
+
+static void flat_first_walk(struct flat_ctx* ctx) {
+    struct flat_layout* layout = ctx->layout;
+    uint32_t node = 0;
+    int level = 0;
+    while (1) {
+        while (layout->first_child[node]) {
+            if (ctx->memo && restore_subtree(ctx, node)) {
+                break;
+            }
+            ctx->default_ancestor[level] = layout->first_child[node];
+            node = layout->first_child[node];
+            level++;
+        }
+        while (1) {
+            flat_place_node(ctx, node);
+            if (ctx->memo) {
+                save_subtree(ctx, node);
+            }
+            if (node == 0) {
+                return;
+            }
+            ctx->default_ancestor[level - 1] =
+                flat_apportion(ctx, node, ctx->default_ancestor[level - 1]);
+            if (layout->next_sibling[node]) {
+                break;
+            }
+            node = layout->parent[node];
+            level--;
+        }
+        node = layout->next_sibling[node];
+    }
+}
+
+static void flat_second_walk(struct flat_ctx* ctx) {
+    struct flat_layout* layout = ctx->layout;
+    uint32_t node = 0;
+    int level = 0;
+    ctx->modsum[0] = -layout->xcoord[0];
+    while (1) {
+        layout->xcoord[node] = ctx->x_top_adjustment + layout->xcoord[node]
+            + ctx->modsum[level];
+        layout->ycoord[node] = ctx->y_top_adjustment
+            + level * ctx->rules->level_separation;
+
+        if (layout->first_child[node]) {
+            ctx->modsum[level + 1] = ctx->modsum[level]
+                + layout->modifier[node];
+            node = layout->first_child[node];
+            level++;
+            continue;
+        }
+        while (node != 0 && !layout->next_sibling[node]) {
+            node = layout->parent[node];
+            level--;
+        }
+        if (node == 0) {
+            return;
+        }
+        node = layout->next_sibling[node];
+    }
+}
+
+static int flat_max_depth(struct flat_layout* layout) {
+    uint32_t node = 0;
+    int level = 0;
+    int depth = 0;
+    while (1) {
+        if (level + 1 > depth) {
+            depth = level + 1;
+        }
+        if (layout->first_child[node]) {
+            node = layout->first_child[node];
+            level++;
+            continue;
+        }
+        while (node != 0 && !layout->next_sibling[node]) {
+            node = layout->parent[node];
+            level--;
+        }
+        if (node == 0) {
+            return depth;
+        }
+        node = layout->next_sibling[node];
+    }
+}
+
+void flat_layout_run(struct flat_layout* layout,
+                     struct walker_layout_rules* rules, double x, double y) {
+    if (!layout->n_nodes) {
+        return;
+    }
+    size_t n = layout->n_nodes;
+    memset(layout->modifier, 0, n * sizeof(double));
+    memset(layout->change, 0, n * sizeof(double));
+    memset(layout->shift, 0, n * sizeof(double));
+    memset(layout->thread, 0, n * sizeof(uint32_t));
+    for (uint32_t i = 0; i < layout->n_nodes; ++i) {
+        layout->ancestor[i] = i;
+    }
+
+    struct flat_ctx ctx;
+    ctx.memo = layout->memoize ? layout_memo_new(layout) : 0;
+    int depth = ctx.memo ? ctx.memo->depth : flat_max_depth(layout);
+    /* the per-level state, in one allocation too */
+    ctx.modsum = malloc(depth * (sizeof(double) + sizeof(uint32_t)));
+    ctx.default_ancestor = (uint32_t*)(ctx.modsum + depth);
+    ctx.layout = layout;
+    ctx.rules = rules;
+    ctx.x_top_adjustment = x;
+    ctx.y_top_adjustment = y;
+
+    flat_first_walk(&ctx);
+    flat_second_walk(&ctx);
 
+    free(ctx.modsum);
+    layout_memo_free(ctx.memo);
 }
@@ -1,6 +1,9 @@
 #ifndef LAYOUT_H
 #define LAYOUT_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 struct walker_layout_rules {
     double sibling_separation;
     double subtree_separation;
@@ -17,6 +20,8 @@ struct label {
     struct label* prev_sibling;
     struct label* next_sibling;
     struct label* first_child;
+    /* so appending and finding the rightmost child are O(1) */
+    struct label* last_child;
 
     /* the next node along the contour of the subtree */
     struct label* thread;
@@ -38,4 +43,69 @@ struct label {
 
 void walker_layout(struct label *node, struct walker_layout_rules* rules);
 
+/*
+  The same layout over nodes numbered 0 to n_nodes - 1, with 0 the
+  root, keeping each field in an array indexed by node rather than in
+  a struct label per node.  All the arrays are one allocation, and
+  each walk only touches the arrays it uses.  As with compact trees,
+  no node can point to the root, so 0 means "none".
+
+  The coordinates are exactly what walker_layout would give a label
+  tree of the same shape and widths.
+
+  If the nodes are numbered in preorder, as svg.c numbers them,
+  subtrees that repeat are laid out twice at most: later copies take
+  their children's positions from an earlier one, and only fit
+  themselves in among their siblings.  The coordinates are the same
+  either way.
+ */
+struct flat_layout {
+    uint32_t n_nodes;
+    /* true unless the caller wants every subtree laid out afresh */
+    bool memoize;
+
+    /* the caller sets the widths */
+    double* width;
+    double* xcoord;
+    double* ycoord;
+    double* modifier;
+    double* change;
+    double* shift;
+
+    /* the tree, built by flat_layout_add_child */
+    uint32_t* parent;
+    uint32_t* first_child;
+    uint32_t* last_child;
+    uint32_t* prev_sibling;
+    uint32_t* next_sibling;
+    /* which number child of the parent each node is */
+    uint32_t* number;
+
+    uint32_t* thread;
+    uint32_t* ancestor;
+};
+
+/* With no children yet, and widths of 0 */
+struct flat_layout* flat_layout_new(uint32_t n_nodes);
+void flat_layout_free(struct flat_layout* layout);
+
+/* Makes child the last child of parent, so far */
+static inline void flat_layout_add_child(struct flat_layout* layout,
+                                         uint32_t parent, uint32_t child) {
+    uint32_t last_child = layout->last_child[parent];
+    layout->parent[child] = parent;
+    layout->last_child[parent] = child;
+    if (!last_child) {
+        layout->first_child[parent] = child;
+        return;
+    }
+    layout->number[child] = layout->number[last_child] + 1;
+    layout->prev_sibling[child] = last_child;
+    layout->next_sibling[last_child] = child;
+}
+
+/* Lays the tree out with the root at (x, y) */
+void flat_layout_run(struct flat_layout* layout,
+                     struct walker_layout_rules* rules, double x, double y);
+
 #endif
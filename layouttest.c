@@ -0,0 +1,707 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "layout.h"
+#include "parse.h"
+#include "svg.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEEP 1000000
+
+/*
+  Lays out a million-deep chain of labels.  Every label should end up
+  directly under the root, one level further down than its parent.
+ */
+int test_deep_layout() {
+    int bad = 0;
+    struct label* labels = calloc(DEEP, sizeof(struct label));
+    for (int i = 0; i < DEEP; ++i) {
+        struct label* label = labels + i;
+        label->parent = i ? label - 1 : 0;
+        label->first_child = i + 1 < DEEP ? label + 1 : 0;
+        label->last_child = label->first_child;
+        label->ancestor = label;
+        label->width = 20;
+    }
+    labels[0].xcoord = 500;
+
+    struct walker_layout_rules rules = {10, 20, 30};
+    walker_layout(labels, &rules);
+
+    for (int i = 0; i < DEEP; ++i) {
+        if (labels[i].xcoord != 500 || labels[i].ycoord != i * 30.0) {
+            printf("Bad layout of deep chain at level %d: (%f, %f)\n",
+                   i, labels[i].xcoord, labels[i].ycoord);
+            bad++;
+            break;
+        }
+    }
+    free(labels);
+    return bad;
+}
+
+static void add_child(struct label* parent, struct label* child) {
+    child->parent = parent;
+    child->ancestor = child;
+    child->width = 20;
+    if (parent->last_child) {
+        child->number = parent->last_child->number + 1;
+        child->prev_sibling = parent->last_child;
+        parent->last_child->next_sibling = child;
+    } else {
+        parent->first_child = child;
+    }
+    parent->last_child = child;
+}
+
+/*
+  A root with three children, the outer two with six children each
+  and the middle one a leaf.  At first the middle one is 30 right of
+  the left one (the sibling separation plus a box width) and the
+  right one 40 further (internal nodes get another 10).  But their
+  children collide, and have to be 40 apart, so the right one gets
+  pushed right by 120, and the middle one, between them, by 60.
+ */
+int test_shift_spreading() {
+    int bad = 0;
+    struct label labels[16] = {{0}};
+    labels[0].ancestor = &labels[0];
+    labels[0].width = 20;
+    for (int i = 1; i <= 3; ++i) {
+        add_child(&labels[0], &labels[i]);
+    }
+    for (int i = 4; i <= 9; ++i) {
+        add_child(&labels[1], &labels[i]);
+    }
+    for (int i = 10; i <= 15; ++i) {
+        add_child(&labels[3], &labels[i]);
+    }
+
+    struct walker_layout_rules rules = {10, 20, 30};
+    walker_layout(labels, &rules);
+
+    double left = labels[1].xcoord;
+    double middle = labels[2].xcoord;
+    double right = labels[3].xcoord;
+    if (middle - left != 30 + 60 || right - left != 70 + 120 ||
+        labels[10].xcoord - labels[9].xcoord != 40) {
+        printf("Bad shifts between subtrees: %f %f %f\n", left, middle,
+               right);
+        bad++;
+    }
+    return bad;
+}
+
+/* Lays labels and layout out, and checks they agree exactly */
+static int compare_layouts(struct label* labels, struct flat_layout* layout,
+                           int n_nodes, const char* name, int round) {
+    struct walker_layout_rules rules = {10, 20, 30};
+    walker_layout(labels, &rules);
+    flat_layout_run(layout, &rules, 500, 0);
+
+    for (int i = 0; i < n_nodes; ++i) {
+        if (labels[i].xcoord != layout->xcoord[i] ||
+            labels[i].ycoord != layout->ycoord[i]) {
+            printf("%s layout differs in round %d at node %d: "
+                   "(%f, %f) vs (%f, %f)\n", name, round, i,
+                   labels[i].xcoord, labels[i].ycoord, layout->xcoord[i],
+                   layout->ycoord[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+  Random trees, each laid out as labels and as a flat layout, which
+  should agree exactly.  Each node's parent is a random earlier node,
+  biased towards recent ones so there are deep paths as well as wide
+  nodes, and widths vary so subtrees collide unevenly.
+ */
+int test_flat_layout() {
+    int bad = 0;
+    srand(12345);
+    for (int round = 0; round < 200; ++round) {
+        int n_nodes = 1 + rand() % (round < 150 ? 50 : 5000);
+        struct label* labels = calloc(n_nodes, sizeof(struct label));
+        struct flat_layout* layout = flat_layout_new(n_nodes);
+        labels[0].ancestor = &labels[0];
+        labels[0].xcoord = 500;
+        for (int i = 0; i < n_nodes; ++i) {
+            if (i) {
+                int parent = rand() % 2 ? i - 1 - rand() % (i < 4 ? i : 4)
+                                        : rand() % i;
+                add_child(&labels[parent], &labels[i]);
+                flat_layout_add_child(layout, parent, i);
+            }
+            labels[i].width = layout->width[i] = 8.4 * (3 + rand() % 12);
+        }
+
+        bad += compare_layouts(labels, layout, n_nodes, "Flat", round);
+        free(labels);
+        flat_layout_free(layout);
+    }
+    return bad;
+}
+
+/*
+  Random trees in preorder, made mostly of copies of their own
+  subtrees, some with a different width at the root, so that the
+  flat layout's memo gets used at every depth.  Widths come from only
+  a few, so that subtrees also turn out the same by chance.
+ */
+struct copying_tree {
+    int* parent;
+    double* width;
+    int n_nodes;
+    int max_nodes;
+    /* subtrees made so far, to copy */
+    int roots[16];
+    int sizes[16];
+};
+
+static double random_width() {
+    return 8.4 * (3 + rand() % 3);
+}
+
+static void add_copying_subtree(struct copying_tree* tree, int parent,
+                                int depth) {
+    int copy = rand() % 16;
+    int size = tree->sizes[copy];
+    if (size && rand() % 2 && tree->n_nodes + size <= tree->max_nodes) {
+        int root = tree->roots[copy];
+        int node = tree->n_nodes;
+        for (int i = 0; i < size; ++i) {
+            tree->parent[node + i] = i ? tree->parent[root + i] - root + node
+                                       : parent;
+            tree->width[node + i] = tree->width[root + i];
+        }
+        if (rand() % 2) {
+            tree->width[node] = random_width();
+        }
+        tree->n_nodes += size;
+        return;
+    }
+    if (tree->n_nodes == tree->max_nodes) {
+        return;
+    }
+    int node = tree->n_nodes++;
+    tree->parent[node] = parent;
+    tree->width[node] = random_width();
+    int n_children = depth < 8 ? rand() % 5 : 0;
+    for (int i = 0; i < n_children; ++i) {
+        add_copying_subtree(tree, node, depth + 1);
+    }
+    if (tree->n_nodes - node > 1) {
+        copy = rand() % 16;
+        tree->roots[copy] = node;
+        tree->sizes[copy] = tree->n_nodes - node;
+    }
+}
+
+int test_flat_layout_memo() {
+    int bad = 0;
+    srand(54321);
+    for (int round = 0; round < 200; ++round) {
+        struct copying_tree tree = {0};
+        tree.max_nodes = 1 + rand() % (round < 150 ? 200 : 20000);
+        tree.parent = malloc(tree.max_nodes * sizeof(int));
+        tree.width = malloc(tree.max_nodes * sizeof(double));
+        add_copying_subtree(&tree, -1, 0);
+
+        int n_nodes = tree.n_nodes;
+        struct label* labels = calloc(n_nodes, sizeof(struct label));
+        struct flat_layout* layout = flat_layout_new(n_nodes);
+        labels[0].ancestor = &labels[0];
+        labels[0].xcoord = 500;
+        for (int i = 0; i < n_nodes; ++i) {
+            if (i) {
+                add_child(&labels[tree.parent[i]], &labels[i]);
+                flat_layout_add_child(layout, tree.parent[i], i);
+            }
+            labels[i].width = layout->width[i] = tree.width[i];
+        }
+
+        bad += compare_layouts(labels, layout, n_nodes, "Memoized", round);
+        free(labels);
+        flat_layout_free(layout);
+        free(tree.parent);
+        free(tree.width);
+    }
+    return bad;
+}
+
+/* Draws a deeply nested parse tree */
+int test_deep_svg() {
+    int bad = 0;
+    int depth = 100000;
+    char* expr = malloc(depth * 2 + 2);
+    for (int i = 0; i < depth; ++i) {
+        expr[i * 2] = '-';
+        expr[i * 2 + 1] = ' ';
+    }
+    strcpy(expr + depth * 2, "x");
+
+    struct parse_result* result = parse(expr, 0);
+    if (result->is_error) {
+        printf("Failed to parse deep expression: %s\n",
+               result->error_message);
+        bad++;
+    } else {
+        char* svg = parse_tree_to_svg(result->node);
+        int rects = 0;
+        for (char* rect = strstr(svg, "<rect"); rect;
+             rect = strstr(rect + 1, "<rect")) {
+            rects++;
+        }
+        if (rects != depth + 1 || !strstr(svg, ">x</tspan>")) {
+            printf("Bad svg for deep expression: %d boxes\n", rects);
+            bad++;
+        }
+        free(svg);
+    }
+    free_parse_result_contents(result);
+    free(result);
+    free(expr);
+    return bad;
+}
+
+/* The compact tree should draw exactly like the tree it came from */
+int test_compact_svg() {
+    int bad = 0;
+    const char* exprs[] = {
+        "a",
+        "f(a,b,c(d,e,f),g)",
+        "*(unsigned long *)p += sizeof(struct frob) << 2",
+        "a?b:c?d(e,f,g):h",
+        "t.a.b->c[\"str\"] >>= '\\n' ^ ~mask",
+        0
+    };
+    for (const char** expr = exprs; *expr; ++expr) {
+        struct parse_result* result = parse(*expr, 0);
+        struct compact_tree* tree = compact_tree_new(result->node, *expr);
+        char* svg = parse_tree_to_svg(result->node);
+        char* compact_svg = compact_tree_to_svg(tree);
+        if (strcmp(svg, compact_svg)) {
+            printf("Compact tree draws differently: %s\n", *expr);
+            bad++;
+        }
+        free(svg);
+        free(compact_svg);
+        compact_tree_free(tree);
+        free_parse_result_contents(result);
+        free(result);
+    }
+    return bad;
+}
+
+struct box {
+    double x;
+    double y;
+    double width;
+};
+
+static int compare_boxes(const void* a, const void* b) {
+    const struct box* box_a = a;
+    const struct box* box_b = b;
+    if (box_a->y != box_b->y) {
+        return box_a->y < box_b->y ? -1 : 1;
+    }
+    return box_a->x < box_b->x ? -1 : box_a->x > box_b->x;
+}
+
+/*
+  No two boxes on a level should be closer than the separation between
+  siblings (10), in trees where subtrees have to be pushed apart.
+ */
+int test_no_overlap() {
+    int bad = 0;
+    const char* exprs[] = {
+        "f(a,b,c(d,e,f),g)",
+        "f(a+b*c-d, x, y*z-w*q)",
+        "g(f(a,b,c,d,e), h(i,j,k,l), m(n(o(p,q,r))))",
+        "(a+b)*(c+d)-(e+f)/(g+h)",
+        "a?b:c?d(e,f,g):h",
+        "f(g(a,b,c,d,e,f,g,h),i,j,k,l,m,n,o,p,q,r,s,t,u)",
+        0
+    };
+    for (const char** expr = exprs; *expr; ++expr) {
+        struct parse_result* result = parse(*expr, 0);
+        char* svg = parse_tree_to_svg(result->node);
+        int n_boxes = 0;
+        struct box boxes[64];
+        for (char* rect = strstr(svg, "<rect"); rect && n_boxes < 64;
+             rect = strstr(rect + 1, "<rect")) {
+            struct box* box = &boxes[n_boxes++];
+            sscanf(strstr(rect, "width="), "width=\"%lf\"", &box->width);
+            sscanf(strstr(rect, " x="), " x=\"%lf\"", &box->x);
+            sscanf(strstr(rect, " y="), " y=\"%lf\"", &box->y);
+        }
+        qsort(boxes, n_boxes, sizeof(boxes[0]), compare_boxes);
+        for (int i = 1; i < n_boxes; ++i) {
+            if (boxes[i].y == boxes[i - 1].y &&
+                boxes[i].x < boxes[i - 1].x + boxes[i - 1].width + 10 - 1e-3) {
+                printf("Boxes overlap at y = %f in %s\n", boxes[i].y, *expr);
+                bad++;
+                break;
+            }
+        }
+        free(svg);
+        free_parse_result_contents(result);
+        free(result);
+    }
+    return bad;
+}
+
+/* Reads what's been written to file, from the start */
+static char* read_back(FILE* file) {
+    fflush(file);
+    long size = ftell(file);
+    char* contents = malloc(size + 1);
+    rewind(file);
+    contents[fread(contents, 1, size, file)] = 0;
+    return contents;
+}
+
+/*
+  Streaming an SVG to a file gives the same bytes as building it in
+  memory, including when it takes many flushes.
+ */
+int test_svg_sink() {
+    int bad = 0;
+    const char* exprs[] = {
+        "a",
+        "*(unsigned long *)p += sizeof(struct frob) << 2",
+        0,
+        0
+    };
+    /* a few megabytes of SVG */
+    char* sum = malloc(20000 * 2 + 2);
+    for (int i = 0; i < 20000; ++i) {
+        memcpy(sum + i * 2, "a+", 2);
+    }
+    strcpy(sum + 20000 * 2, "b");
+    exprs[2] = sum;
+
+    for (const char** expr = exprs; *expr; ++expr) {
+        struct parse_result* result = parse(*expr, 0);
+        char* svg = parse_tree_to_svg(result->node);
+        FILE* file = tmpfile();
+        struct sink sink;
+        sink_init_fd(&sink, fileno(file));
+        write_parse_tree_svg(result->node, &sink);
+        if (sink_close(&sink)) {
+            printf("Failed to write the SVG for %.20s\n", *expr);
+            bad++;
+        }
+        fseek(file, 0, SEEK_END);
+        char* streamed = read_back(file);
+        if (strcmp(svg, streamed)) {
+            printf("Streamed SVG differs for %.20s\n", *expr);
+            bad++;
+        }
+        fclose(file);
+        free(streamed);
+        free(svg);
+        free_parse_result_contents(result);
+        free(result);
+    }
+    free(sum);
+    return bad;
+}
+
+/* The SVG of node as options has it, or NULL if there's none */
+static char* svg_with_options(struct parse_tree_node* node,
+                              const struct svg_options* options) {
+    struct strbuf svg = {0};
+    struct sink sink;
+    sink_init_strbuf(&sink, &svg);
+    int error = write_parse_tree_svg_with_options(node, options, &sink);
+    sink_close(&sink);
+    if (error) {
+        strbuf_free(&svg);
+        return 0;
+    }
+    return svg.data;
+}
+
+/* What an SVG shows: its boxes, and how many nodes they stand for */
+struct svg_counts {
+    int boxes;
+    int summaries;
+    long nodes;
+    int levels;
+    /* boxes outside the viewBox */
+    int outside;
+};
+
+static struct svg_counts count_svg(const char* svg) {
+    struct svg_counts counts = {0};
+    double view_x, view_y, view_width, view_height;
+    sscanf(strstr(svg, "viewBox="), "viewBox=\"%lf %lf %lf %lf\"", &view_x,
+           &view_y, &view_width, &view_height);
+    double bottom = -1;
+    for (const char* rect = strstr(svg, "<rect"); rect;
+         rect = strstr(rect + 1, "<rect")) {
+        struct box box;
+        sscanf(strstr(rect, "width="), "width=\"%lf\"", &box.width);
+        sscanf(strstr(rect, " x="), " x=\"%lf\"", &box.x);
+        sscanf(strstr(rect, " y="), " y=\"%lf\"", &box.y);
+        if (box.x < view_x || box.x + box.width > view_x + view_width ||
+            box.y < view_y || box.y + 17 > view_y + view_height) {
+            counts.outside++;
+        }
+        if (box.y > bottom) {
+            bottom = box.y;
+        }
+        counts.boxes++;
+        unsigned hidden;
+        const char* label = strstr(strstr(rect, "<tspan"), ">") + 1;
+        if (strstr(rect, "dasharray") < strstr(rect, "/>") &&
+            sscanf(label, "%u nodes<", &hidden) == 1) {
+            counts.summaries++;
+            counts.nodes += hidden;
+        } else {
+            counts.nodes++;
+        }
+    }
+    /* levels are level_separation apart */
+    counts.levels = (int)(bottom / 30 + 0.5) + 1;
+    return counts;
+}
+
+/*
+  Limiting the depth or the number of boxes draws part of the tree,
+  with the rest counted in dashed boxes; a root path draws a subtree
+  as if it were the whole tree.
+ */
+int test_svg_options() {
+    int bad = 0;
+    const char* expr = "g(f(a,b,c,d,e), h(i,j,k,l), m(n(o(p,q,r))))";
+    struct parse_result* result = parse(expr, 0);
+    char* svg = svg_with_options(result->node, 0);
+    struct svg_counts all = count_svg(svg);
+    free(svg);
+    if (all.summaries || all.outside) {
+        printf("Whole tree drawn with %d summaries, %d boxes outside\n",
+               all.summaries, all.outside);
+        bad++;
+    }
+
+    for (int depth = 1; depth <= all.levels + 1; ++depth) {
+        struct svg_options options = {depth, 0, 0, 0};
+        svg = svg_with_options(result->node, &options);
+        struct svg_counts counts = count_svg(svg);
+        int levels = depth < all.levels ? depth : all.levels;
+        if (counts.levels != levels || counts.nodes != all.nodes ||
+            counts.outside || (depth >= all.levels) != !counts.summaries) {
+            printf("Depth %d draws %d levels, %ld of %ld nodes, "
+                   "%d boxes outside\n", depth, counts.levels, counts.nodes,
+                   all.nodes, counts.outside);
+            bad++;
+        }
+        free(svg);
+    }
+
+    for (uint32_t max_nodes = 1; max_nodes <= all.nodes + 1; ++max_nodes) {
+        struct svg_options options = {0, max_nodes, 0, 0};
+        svg = svg_with_options(result->node, &options);
+        struct svg_counts counts = count_svg(svg);
+        if (counts.boxes > (int)max_nodes || counts.nodes != all.nodes ||
+            counts.outside || (max_nodes >= all.nodes) != !counts.summaries) {
+            printf("Budget of %u draws %d boxes, %ld of %ld nodes, "
+                   "%d boxes outside\n", max_nodes, counts.boxes,
+                   counts.nodes, all.nodes, counts.outside);
+            bad++;
+        }
+        free(svg);
+    }
+
+    /* the third argument, h(i,j,k,l) */
+    struct parse_result* subtree = parse("h(i,j,k,l)", 0);
+    char* subtree_svg = svg_with_options(subtree->node, 0);
+    struct svg_options options = {0};
+    set_svg_option(&options, "root", "2");
+    svg = svg_with_options(result->node, &options);
+    if (!svg || strcmp(svg, subtree_svg)) {
+        printf("Root 2 of %s isn't h(i,j,k,l)\n", expr);
+        bad++;
+    }
+    free(svg);
+    free(subtree_svg);
+    free_parse_result(subtree);
+
+    /* a compact tree counts what's cut off without walking it */
+    struct compact_tree* tree = compact_tree_new(result->node, expr);
+    const char* roots[] = {0, "1", "3", "3.1", "3.1.0"};
+    for (int i = 0; i < 5; ++i) {
+        for (uint32_t max_nodes = 1; max_nodes < 8; ++max_nodes) {
+            struct svg_options limited = {0, max_nodes, roots[i], 0};
+            svg = svg_with_options(result->node, &limited);
+            struct strbuf compact_svg = {0};
+            struct sink sink;
+            sink_init_strbuf(&sink, &compact_svg);
+            write_compact_tree_svg_with_options(tree, &limited, &sink);
+            sink_close(&sink);
+            if (strcmp(svg, compact_svg.data)) {
+                printf("Compact tree draws root %s with %u boxes "
+                       "differently\n", roots[i], max_nodes);
+                bad++;
+            }
+            free(svg);
+            strbuf_free(&compact_svg);
+        }
+    }
+    compact_tree_free(tree);
+
+    const char* missing[] = {"4", "1.9", "1.0.0", "2.5", 0};
+    for (const char** path = missing; *path; ++path) {
+        options.root_path = *path;
+        svg = svg_with_options(result->node, &options);
+        if (svg) {
+            printf("Drew an SVG for root %s of %s\n", *path, expr);
+            bad++;
+        }
+        free(svg);
+    }
+    free_parse_result(result);
+
+    const char* invalid[][2] = {
+        {"depth", "x"}, {"depth", "-1"}, {"depth", "3x"}, {"depth", ""},
+        {"nodes", "1e3"}, {"nodes", "99999999999"}, {"root", "1..2"},
+        {"root", ".1"}, {"root", "1."}, {"root", "a"}, {"precision", "0"},
+        {"precision", "7"}, {"size", "1"}, {0, 0}
+    };
+    for (int i = 0; invalid[i][0]; ++i) {
+        if (set_svg_option(&options, invalid[i][0], invalid[i][1]) == 0) {
+            printf("Took %s %s as an option\n", invalid[i][0],
+                   invalid[i][1]);
+            bad++;
+        }
+    }
+    return bad;
+}
+
+/*
+  A budget draws a deep tree without visiting more of it than it
+  shows, except to count what's under the last box.
+ */
+int test_svg_budget_deep() {
+    int bad = 0;
+    int depth = 50000;
+    char* expr = malloc(depth * 2 + 2);
+    for (int i = 0; i < depth; ++i) {
+        memcpy(expr + i * 2, "- ", 2);
+    }
+    strcpy(expr + depth * 2, "x");
+
+    struct parse_result* result = parse(expr, 0);
+    struct svg_options options = {0, 10, 0, 0};
+    char* svg = svg_with_options(result->node, &options);
+    struct svg_counts counts = count_svg(svg);
+    if (counts.boxes != 10 || counts.summaries != 1 ||
+        counts.nodes != depth + 1) {
+        printf("Budget of 10 for a deep tree draws %d boxes for %ld nodes\n",
+               counts.boxes, counts.nodes);
+        bad++;
+    }
+    free(svg);
+    free_parse_result(result);
+    free(expr);
+    return bad;
+}
+
+/*
+  Coordinates at the default precision are the ones at six places
+  rounded to one, with one digit after the point, and the rest of the
+  SVG is the same.
+ */
+int test_svg_precision() {
+    int bad = 0;
+    const char* exprs[] = {
+        "a",
+        "f(g(a,b,c,d,e,f,g,h),i,j,k,l,m,n,o,p,q,r,s,t,u)",
+        "*(unsigned long *)p += sizeof(struct frob) << 2 - 3.5e-2",
+        0
+    };
+    struct svg_options fine = {0, 0, 0, 6};
+    for (const char** expr = exprs; *expr; ++expr) {
+        struct parse_result* result = parse(*expr, 0);
+        char* svg = svg_with_options(result->node, 0);
+        char* fine_svg = svg_with_options(result->node, &fine);
+        const char* pos = svg;
+        const char* fine_pos = fine_svg;
+        while (*pos && *pos == *fine_pos) {
+            bool number = (*pos >= '0' && *pos <= '9') ||
+                (*pos == '-' && pos[1] >= '0' && pos[1] <= '9');
+            if (!number) {
+                pos++;
+                fine_pos++;
+                continue;
+            }
+            bool coord = pos[-1] == '"' || pos[-1] == ' ';
+            char* end;
+            char* fine_end;
+            double value = strtod(pos, &end);
+            double fine_value = strtod(fine_pos, &fine_end);
+            const char* point = memchr(pos, '.', end - pos);
+            if (value - fine_value > 0.05 + 1e-6 ||
+                fine_value - value > 0.05 + 1e-6 ||
+                (coord && (!point || end - point != 2))) {
+                printf("Coordinate %.*s is %.*s to six places in %s\n",
+                       (int)(end - pos), pos, (int)(fine_end - fine_pos),
+                       fine_pos, *expr);
+                bad++;
+                break;
+            }
+            pos = end;
+            fine_pos = fine_end;
+        }
+        if (*pos || *fine_pos) {
+            printf("SVGs at different precisions differ at %.20s in %s\n",
+                   pos, *expr);
+            bad++;
+        }
+        free(svg);
+        free(fine_svg);
+        free_parse_result(result);
+    }
+    return bad;
+}
+
+/* Runs on a thread with a small stack, to catch recursion */
+void* run_tests(void* arg) {
+    int* bad = arg;
+    *bad += test_deep_layout();
+    *bad += test_shift_spreading();
+    *bad += test_flat_layout();
+    *bad += test_flat_layout_memo();
+    *bad += test_deep_svg();
+    *bad += test_compact_svg();
+    *bad += test_svg_sink();
+    *bad += test_no_overlap();
+    *bad += test_svg_options();
+    *bad += test_svg_budget_deep();
+    *bad += test_svg_precision();
+    return 0;
+}
+
+int main() {
+    int bad = 0;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    pthread_t thread;
+    pthread_create(&thread, &attr, run_tests, &bad);
+    pthread_join(thread, 0);
+    pthread_attr_destroy(&attr);
+
+    if (bad) {
+        printf("%d failed tests\n", bad);
+        return 1;
+    }
+    return 0;
+}
@@ -1,13 +1,12 @@
 #define _POSIX_C_SOURCE 200809L
 
-#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 
 #include "lex.h"
-#include "obstack_helper.h"
+#include "scan.h"
 
 const char *token_names[] = {
 
@@ -20,137 +19,51 @@ const char *token_names[] = {
     "expr--", "++expr", "--expr", "/*", "bogus", "eof"
 };
 
-const char *token_sigils[] = {
+#define TOKEN_SIGILS(X)                                                 \
+    X("null") X("lit") X("(") X(")") X("[") X("]") X("{") X("}") X("!")  \
+    X("%") X("^") X("&") X("|") X("*") X("-") X("+") X("/") X("<<")      \
+    X(">>") X("!=") X("%=") X("^=") X("&=") X("|=") X("*=") X("-=")      \
+    X("+=") X("/=") X("<<=") X(">>=") X("->") X(".") X("=") X("==")      \
+    X("<=") X(">=") X("<") X(">") X("&&") X("||") X("++") X("--") X("?") \
+    X(":") X("sizeof") X(",") X("~") X("(typecast)")                     \
+    X("(function call)") X("subscript") X("&") X("*") X("-") X("++")     \
+    X("--") X("++") X("--") X("/*") X("bogus") X("eof")
 
-    "null","lit","(",")","[","]","{","}","!","%","^",
-    "&","|","*","-","+","/","<<",">>","!=","%=","^=",
-    "&=","|=","*=","-=","+=","/=","<<=",">>=","->",".",
-    "=","==","<=",">=","<",">","&&","||","++","--","?",
-    ":","sizeof",",","~","(typecast)", "(function call)",
-    "subscript", "&", "*", "-", "++", "--", "++", "--",
-    "/*", "bogus", "eof"
-};
+#define SIGIL(sigil) sigil,
+#define SIGIL_LENGTH(sigil) sizeof(sigil) - 1,
 
-struct token_spec {
-    const char* text;
-    enum token_type token_type;
-};
+const char *token_sigils[] = {TOKEN_SIGILS(SIGIL)};
+const unsigned char token_sigil_lengths[] = {TOKEN_SIGILS(SIGIL_LENGTH)};
 
-struct token_spec token_specs[] = {
-    {"(", OPEN_PAREN},
-    {")",CLOSE_PAREN},
-    {"[",OPEN_BRACKET},
-    {"]",CLOSE_BRACKET},
-    {"{",OPEN_CURLY},
-    {"}",CLOSE_CURLY},
-    {"!",BANG},
-    {"!=",BANG_EQUAL},
-    {"%",PERCENT},
-    {"%=",PERCENT_EQUAL},
-    {"^",CARET},
-    {"^=",CARET_EQUAL},
-    {"&",AMPERSAND},
-    {"&&",DOUBLE_AMPERSAND},
-    {"&=",AMPERSAND_EQUAL},
-    {"|",BAR},
-    {"||",DOUBLE_BAR},
-    {"|=",BAR_EQUAL},
-    {"*",STAR},
-    {"*=",STAR_EQUAL},
-    {"-",MINUS},
-    {"--",DOUBLE_MINUS},
-    {"-=",MINUS_EQUAL},
-    {"->",ARROW},
-    {".",DOT},
-    {"+",PLUS},
-    {"++",DOUBLE_PLUS},
-    {"+=",PLUS_EQUAL},
-    {"/",SLASH},
-    {"/=",SLASH_EQUAL},
-    {"/*",START_COMMENT},
-    {">", GT},
-    {">>",RIGHT_SHIFT},
-    {">>=",RIGHT_SHIFT_EQUAL},
-    {">=",GTE},
-    {"<", LT},
-    {"<<",LEFT_SHIFT},
-    {"<<=",LEFT_SHIFT_EQUAL},
-    {"<=",LTE},
-    {"=", ASSIGN},
-    {"==", IS_EQUAL},
-    {"?", QUESTION},
-    {":", COLON},
-    {",", COMMA},
-    {"~", TILDE},
-    {"", -1},
-};
+#undef SIGIL
+#undef SIGIL_LENGTH
 
-struct token_rule {
-    struct token_rule *children;
-    enum token_type token_type;
+/* pseudo-token types that only appear in the lexer tables */
+enum lex_action {
+    LEX_SPACE = END_OF_EXPRESSION + 1,
+    LEX_IDENT,
+    LEX_NUMBER,
+    LEX_QUOTE
 };
 
-static void add_child_token_rule(struct token_rule* rule, const char* text,
-                          enum token_type token_type) {
-    unsigned char c = *text;
-    if (!c) {
-        rule->token_type = token_type;
-        return;
-    }
-    if (rule->children == 0) {
-        rule->children = calloc(256, sizeof(struct token_rule));
-    }
-    add_child_token_rule(rule->children + c, text + 1, token_type);
-}
-
-static struct token_rule* make_token_rules(struct token_spec* token_spec) {
-    struct token_rule* rule = malloc(sizeof(struct token_rule));
-
-    rule->token_type = 0;
-    rule->children = calloc (256, sizeof(struct token_rule));
-    while (*token_spec->text) {
-        add_child_token_rule(rule, token_spec->text,
-                             token_spec->token_type);
-        token_spec ++;
-
-    }
-    return rule;
-}
-
-static struct token_rule* rules = 0;
+/* generated by lexgen.c */
+#include "lex_table.h"
 
 lex_buf start_lex(const char* expr) {
-    lex_buf buf = {.pos = expr};
-    if (rules == 0) {
-        rules = make_token_rules(token_specs);
-    }
-    obstack_init(&buf.obstack);
+    lex_buf buf = {.pos = expr, .end = expr + strlen(expr)};
     return buf;
 }
 
-void done_lex(lex_buf buf) {
-    obstack_free(&buf.obstack, 0);
+static void read_integer_literal(const char** pos_ref, const char* end) {
+    *pos_ref = scan_digits(*pos_ref, end);
 }
 
-static void read_integer_literal(const char** pos_ref) {
-    const char* pos = *pos_ref;
-    char c;
-    while ((c = *pos)) {
-        if (c < '0' || c > '9') {
-            break;
-        }
-        pos++;
-    }
-
-    *pos_ref = pos;
-}
-
-static bool read_float(const char** pos_ref) {
+static bool read_float(const char** pos_ref, const char* end) {
     char c;
     bool dot_seen = false;
     bool exp_seen = false;
     const char* pos = *pos_ref;
-    while ((c = *pos)) {
+    while ((c = *(pos = scan_digits(pos, end)))) {
         if (c == '.') {
             if (dot_seen || exp_seen) {
                 *pos_ref = pos;
@@ -166,7 +79,7 @@ static bool read_float(const char** pos_ref) {
                 pos++;
             }
             exp_seen = true;
-        } else if (c < '0' || c > '9') {
+        } else {
             break;
         }
         pos++;
@@ -191,7 +104,7 @@ static bool check_octal(const char* start, const char* end) {
     return true;
 }
 
-static bool read_hex_literal(const char** pos_ref) {
+static bool read_hex_literal(const char** pos_ref, const char* end) {
     char c;
     bool dot_seen = false;
     const char* pos = *pos_ref;
@@ -218,7 +131,7 @@ static bool read_hex_literal(const char** pos_ref) {
         }
         pos ++;
         const char* old_pos = pos;
-        read_integer_literal(&pos);
+        read_integer_literal(&pos, end);
         if (old_pos == pos) {
             *pos_ref = pos;
             return false;
@@ -229,7 +142,7 @@ static bool read_hex_literal(const char** pos_ref) {
 }
 
 
-static const char* read_literal_or_id(lex_buf* buf, const char* pos,
+static const char* read_literal_or_id(const char* pos, const char* end,
                                       struct token* token) {
     token->token_type = LITERAL_OR_ID;
     const char *start = pos;
@@ -238,121 +151,155 @@ static const char* read_literal_or_id(lex_buf* buf, const char* pos,
         //handle 0x literals
         if (start[1] == 'x' || start[1] == 'X') {
             pos += 2;
-            bool ok = read_hex_literal(&pos);
+            bool ok = read_hex_literal(&pos, end);
             if (!ok) {
                 token->token_type = BOGUS;
-                return pos;
             }
         } else {
-            bool ok = read_float(&pos);
+            bool ok = read_float(&pos, end);
             if (!ok || !check_octal(start, pos)) {
                 token->token_type = BOGUS;
-                return pos;
             }
         }
         break;
     case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9': case '.': {
-        bool ok = read_float(&pos);
+        bool ok = read_float(&pos, end);
         if (!ok) {
             token->token_type = BOGUS;
-            return pos;
         }
     }
         break;
     default:
-        while (*pos && (isalnum(*pos) || *pos == '_')) {
-            pos++;
-        }
+        pos = scan_identifier(pos, end);
     }
-    token->token_value = obstack_strndup(&buf->obstack, start, pos - start);
     return pos;
 }
 
 struct token get_next_token(lex_buf* buf) {
     const char* pos = buf->pos;
+    const char* start;
 
     struct token token;
-    token.token_value = 0;
 
     while (1) {
-        struct token_rule *rule = rules;
-        while (rule->children && rule->children[(unsigned char)*pos].token_type) {
-            rule = rule->children + (unsigned char)*pos++;
-        }
-        if (rule->token_type == DOT) {
-            //this might be a.b or it might be .1
-            //to tell, we'll look-ahead by one
-            char nextc = *pos;
-            if (nextc < '0' || nextc > '9') {
-                token.token_type = rule->token_type;
-            } else {
-                pos = read_literal_or_id(buf, pos - 1, &token);
-            }
+        start = pos;
+        unsigned char state = lex_root[(unsigned char)*pos];
+        switch (lex_accept[state]) {
+        case END_OF_EXPRESSION:
+            token.token_type = END_OF_EXPRESSION;
             goto done;
-        } else if (rule->token_type == START_COMMENT) {
-            while (*pos) {
-                char c = *pos++;
-                if (c == '*') {
-                    if (*pos == '/') {
-                        pos++;
-                        break;
-                    }
+        case LEX_SPACE:
+            pos = scan_whitespace(pos + 1, buf->end);
+            break;
+        case LEX_QUOTE:
+        {
+            char delimiter = *pos;
+            while (*++pos != delimiter) {
+                if (!*pos) {
+                    token.token_type = BOGUS;
+                    goto done;
+                } else if (*pos == '\\') {
+                    pos ++;
                 }
             }
-        } else if (rule != rules) {
-            token.token_type = rule->token_type;
+            pos++;
+            token.token_type = LITERAL_OR_ID;
             goto done;
-        } else {
-            switch (*pos) {
-            case 0:
-                token.token_type = END_OF_EXPRESSION;
-                goto done;
-            case ' ': case '\t': case '\v': case '\n':
-                break;
-            case '\'':
-            case '"':
-            {
-                char delimiter = *pos;
-                const char *start = pos;
-                while (*++pos != delimiter) {
-                    if (!*pos) {
-                        token.token_type = BOGUS;
-                        goto done;
-                    } else if (*pos == '\\') {
-                        pos ++;
-                    }
-                }
-                pos++;
-                char* val = obstack_strndup(&buf->obstack, start, pos - start);
-                token.token_value = val;
+        }
+        case LEX_IDENT:
+            pos = scan_identifier(pos, buf->end);
+            if (pos - start == 6 && memcmp(start, "sizeof", 6) == 0) {
+                token.token_type = SIZEOF;
+            } else {
                 token.token_type = LITERAL_OR_ID;
-                goto done;
             }
-            case '_': case 'A': case 'a': case 'B': case 'b': case 'C': case 'c': case 'D': case 'd': case 'E': case 'e': case 'F': case 'f': case 'G': case 'g': case 'H': case 'h': case 'I': case 'i': case 'J': case 'j': case 'K': case 'k': case 'L': case 'l': case 'M': case 'm': case 'N': case 'n': case 'O': case 'o': case 'P': case 'p': case 'Q': case 'q': case 'R': case 'r': case 'S': case 's': case 'T': case 't': case 'U': case 'u': case 'V': case 'v': case 'W': case 'w': case 'X': case 'x': case 'Y': case 'y': case 'Z': case 'z': case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
-
-                if (strncmp(pos, "sizeof", 6) == 0 &&
-                    !isalnum(pos[6]) &&
-                    pos[6] != '_') {
-                        token.token_type = SIZEOF;
-                        pos += 6;
-                        goto done;
+            goto done;
+        case LEX_NUMBER:
+            pos = read_literal_or_id(pos, buf->end, &token);
+            goto done;
+        case BOGUS:
+            token.token_type = BOGUS;
+            pos++;
+            goto done;
+        default:
+        {
+            /* an operator; take the longest one that matches */
+            unsigned char next;
+            ++pos;
+            while ((next = lex_next[state][lex_class[(unsigned char)*pos]])) {
+                state = next;
+                ++pos;
+            }
+            if (lex_accept[state] == DOT) {
+                //this might be a.b or it might be .1
+                //to tell, we'll look-ahead by one
+                char nextc = *pos;
+                if (nextc < '0' || nextc > '9') {
+                    token.token_type = DOT;
                 } else {
-                    pos = read_literal_or_id(buf, pos, &token);
-                    goto done;
+                    pos = read_literal_or_id(start, buf->end, &token);
                 }
-                break;
-            default:
-                token.token_value = obstack_strdup(&buf->obstack, pos);
-                token.token_type = BOGUS;
-                pos++;
+                goto done;
+            } else if (lex_accept[state] == START_COMMENT) {
+                pos = scan_comment_end(pos, buf->end);
+                if (pos != buf->end) {
+                    pos += 2;
+                }
+            } else {
+                token.token_type = lex_accept[state];
                 goto done;
             }
-            ++pos;
+        }
         }
     }
 
 done:
+    token.text = start;
+    token.text_len = pos - start;
     buf->pos = pos;
     return token;
 
 }
+
+void init_token_buf(struct token_buf* tokens) {
+    tokens->types = 0;
+    tokens->offsets = 0;
+    tokens->lengths = 0;
+    tokens->n_tokens = 0;
+    tokens->allocated = 0;
+}
+
+void free_token_buf_contents(struct token_buf* tokens) {
+    free(tokens->types);
+    free(tokens->offsets);
+    free(tokens->lengths);
+    init_token_buf(tokens);
+}
+
+static void grow_token_buf(struct token_buf* tokens) {
+    tokens->allocated = tokens->allocated ? tokens->allocated * 2 : 64;
+    tokens->types = realloc(tokens->types, tokens->allocated);
+    tokens->offsets = realloc(tokens->offsets,
+                              tokens->allocated * sizeof(uint32_t));
+    tokens->lengths = realloc(tokens->lengths,
+                              tokens->allocated * sizeof(uint32_t));
+}
+
+void lex_expression(struct token_buf* tokens, const char* expr) {
+    lex_buf buf = start_lex(expr);
+    int n = 0;
+    while (1) {
+        struct token token = get_next_token(&buf);
+        if (n == tokens->allocated) {
+            grow_token_buf(tokens);
+        }
+        tokens->types[n] = token.token_type;
+        tokens->offsets[n] = token.text - expr;
+        tokens->lengths[n] = token.text_len;
+        n++;
+        if (token.token_type == END_OF_EXPRESSION) {
+            break;
+        }
+    }
+    tokens->n_tokens = n;
+}
@@ -1,7 +1,7 @@
 #ifndef LEX_H
 #define LEX_H
 
-#include <obstack.h>
+#include <stdint.h>
 
 enum token_type {
     LITERAL_OR_ID=1,
@@ -81,21 +81,51 @@ enum token_type {
 
 extern const char* token_names[];
 extern const char* token_sigils[];
+/* strlen of each sigil */
+extern const unsigned char token_sigil_lengths[];
 
+/*
+  A token's text is a slice of the expression being lexed (so the
+  expression must outlive it), and is not NUL-terminated.
+ */
 struct token {
     enum token_type token_type;
-    //if non-0, owned by this token
-    char *token_value;
+    const char* text;
+    int text_len;
 };
 
 typedef struct {
     const char* pos;
-    struct obstack obstack;
+    /* the expression's NUL terminator */
+    const char* end;
 } lex_buf;
 
 lex_buf start_lex(const char* expr);
-void done_lex(lex_buf lex_buf);
 
 struct token get_next_token(lex_buf* buf);
 
+/*
+  All of an expression's tokens, as parallel arrays: types[i] is the
+  type of the ith token, and its text is at offsets[i] from the start
+  of the expression, lengths[i] long.  The last token is always
+  END_OF_EXPRESSION.
+ */
+struct token_buf {
+    unsigned char* types;
+    uint32_t* offsets;
+    uint32_t* lengths;
+    int n_tokens;
+    int allocated;
+};
+
+void init_token_buf(struct token_buf* tokens);
+void free_token_buf_contents(struct token_buf* tokens);
+
+/*
+  Lexes all of expr into tokens, replacing what was there.  The
+  arrays are only reallocated when they need to grow, so a token_buf
+  can be reused across expressions cheaply.
+ */
+void lex_expression(struct token_buf* tokens, const char* expr);
+
 #endif
@@ -0,0 +1,221 @@
+/*
+  Generates lex_table.h, the lexer's transition tables, from
+  token_specs below.  The tables are all const, so they live in
+  .rodata and the lexer needs no initialization at runtime.
+
+  A token is lexed by looking up its first character in lex_root,
+  which gives the starting state, then following lex_next (indexed by
+  the lex_class of each further character) for as long as it gives a
+  nonzero state.  lex_accept says what the final state means: a token
+  type for operators, or one of the lexer's pseudo-actions (LEX_SPACE,
+  LEX_IDENT, LEX_NUMBER, LEX_QUOTE) for things that need more than a
+  table lookup.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct token_spec {
+    const char* text;
+    const char* token_type;
+};
+
+#define SPEC(text, type) {text, #type}
+
+static struct token_spec token_specs[] = {
+    SPEC("(", OPEN_PAREN),
+    SPEC(")", CLOSE_PAREN),
+    SPEC("[", OPEN_BRACKET),
+    SPEC("]", CLOSE_BRACKET),
+    SPEC("{", OPEN_CURLY),
+    SPEC("}", CLOSE_CURLY),
+    SPEC("!", BANG),
+    SPEC("!=", BANG_EQUAL),
+    SPEC("%", PERCENT),
+    SPEC("%=", PERCENT_EQUAL),
+    SPEC("^", CARET),
+    SPEC("^=", CARET_EQUAL),
+    SPEC("&", AMPERSAND),
+    SPEC("&&", DOUBLE_AMPERSAND),
+    SPEC("&=", AMPERSAND_EQUAL),
+    SPEC("|", BAR),
+    SPEC("||", DOUBLE_BAR),
+    SPEC("|=", BAR_EQUAL),
+    SPEC("*", STAR),
+    SPEC("*=", STAR_EQUAL),
+    SPEC("-", MINUS),
+    SPEC("--", DOUBLE_MINUS),
+    SPEC("-=", MINUS_EQUAL),
+    SPEC("->", ARROW),
+    SPEC(".", DOT),
+    SPEC("+", PLUS),
+    SPEC("++", DOUBLE_PLUS),
+    SPEC("+=", PLUS_EQUAL),
+    SPEC("/", SLASH),
+    SPEC("/=", SLASH_EQUAL),
+    SPEC("/*", START_COMMENT),
+    SPEC(">", GT),
+    SPEC(">>", RIGHT_SHIFT),
+    SPEC(">>=", RIGHT_SHIFT_EQUAL),
+    SPEC(">=", GTE),
+    SPEC("<", LT),
+    SPEC("<<", LEFT_SHIFT),
+    SPEC("<<=", LEFT_SHIFT_EQUAL),
+    SPEC("<=", LTE),
+    SPEC("=", ASSIGN),
+    SPEC("==", IS_EQUAL),
+    SPEC("?", QUESTION),
+    SPEC(":", COLON),
+    SPEC(",", COMMA),
+    SPEC("~", TILDE),
+    {0, 0}
+};
+
+/*
+  States that the root dispatches to for characters that don't start
+  an operator.  These have no outgoing transitions.
+ */
+static const char* pseudo_states[] = {
+    "BOGUS",
+    "END_OF_EXPRESSION",
+    "LEX_SPACE",
+    "LEX_IDENT",
+    "LEX_NUMBER",
+    "LEX_QUOTE",
+    0
+};
+
+enum { STATE_BOGUS, STATE_END, STATE_SPACE, STATE_IDENT, STATE_NUMBER,
+       STATE_QUOTE, N_PSEUDO_STATES };
+
+#define MAX_STATES 256
+#define CLASS_NONE 0
+#define CLASS_IDENT 1
+
+static int root_next[256];
+static int next_state[MAX_STATES][256];
+static const char* accept[MAX_STATES];
+static int n_states = N_PSEUDO_STATES;
+
+static int is_ident_char(int c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_';
+}
+
+static void add_spec(struct token_spec* spec) {
+    int* next = &root_next[(unsigned char)spec->text[0]];
+    for (const char* c = spec->text; ; ) {
+        if (!*next) {
+            if (n_states == MAX_STATES) {
+                fprintf(stderr, "lexgen: too many states\n");
+                exit(1);
+            }
+            *next = n_states++;
+        }
+        int state = *next;
+        if (!*++c) {
+            accept[state] = spec->token_type;
+            return;
+        }
+        next = &next_state[state][(unsigned char)*c];
+    }
+}
+
+static void print_bytes(const char* name, const int* values) {
+    printf("static const unsigned char %s[256] = {\n", name);
+    for (int i = 0; i < 256; i += 16) {
+        printf("   ");
+        for (int j = i; j < i + 16; ++j) {
+            printf(" %2d,", values[j]);
+        }
+        printf("\n");
+    }
+    printf("};\n\n");
+}
+
+int main() {
+    for (struct token_spec* spec = token_specs; spec->text; ++spec) {
+        add_spec(spec);
+    }
+    for (int i = 0; pseudo_states[i]; ++i) {
+        accept[i] = pseudo_states[i];
+    }
+    for (int state = N_PSEUDO_STATES; state < n_states; ++state) {
+        /* the lexer never backtracks, so every prefix of an operator
+           must be an operator too */
+        if (!accept[state]) {
+            fprintf(stderr, "lexgen: state %d does not accept\n", state);
+            return 1;
+        }
+    }
+
+    /* fold the non-operator dispatch into the root transitions */
+    for (int c = 0; c < 256; ++c) {
+        if (root_next[c]) {
+            continue;
+        }
+        if (c == 0) {
+            root_next[c] = STATE_END;
+        } else if (c == ' ' || c == '\t' || c == '\v' || c == '\n') {
+            root_next[c] = STATE_SPACE;
+        } else if (c >= '0' && c <= '9') {
+            root_next[c] = STATE_NUMBER;
+        } else if (is_ident_char(c)) {
+            root_next[c] = STATE_IDENT;
+        } else if (c == '\'' || c == '"') {
+            root_next[c] = STATE_QUOTE;
+        } else {
+            root_next[c] = STATE_BOGUS;
+        }
+    }
+
+    /* Characters that can continue an operator each get a class of
+       their own; identifier characters share one; everything else
+       is CLASS_NONE. */
+    int char_class[256] = {0};
+    int n_classes = CLASS_IDENT + 1;
+    for (int c = 0; c < 256; ++c) {
+        if (is_ident_char(c)) {
+            char_class[c] = CLASS_IDENT;
+            continue;
+        }
+        for (int state = N_PSEUDO_STATES; state < n_states; ++state) {
+            if (next_state[state][c]) {
+                char_class[c] = n_classes++;
+                break;
+            }
+        }
+    }
+
+    printf("/* Generated by lexgen; do not edit. */\n\n");
+    printf("#define LEX_N_STATES %d\n", n_states);
+    printf("#define LEX_N_CLASSES %d\n", n_classes);
+    printf("#define LEX_CLASS_IDENT %d\n\n", CLASS_IDENT);
+
+    print_bytes("lex_class", char_class);
+    print_bytes("lex_root", root_next);
+
+    printf("static const unsigned char lex_next[LEX_N_STATES][LEX_N_CLASSES] = {\n");
+    for (int state = 0; state < n_states; ++state) {
+        int row[256] = {0};
+        for (int c = 0; c < 256; ++c) {
+            if (char_class[c] > CLASS_IDENT && state >= N_PSEUDO_STATES) {
+                row[char_class[c]] = next_state[state][c];
+            }
+        }
+        printf("    {");
+        for (int class = 0; class < n_classes; ++class) {
+            printf("%s%d", class ? ", " : "", row[class]);
+        }
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    printf("static const unsigned char lex_accept[LEX_N_STATES] = {\n");
+    for (int state = 0; state < n_states; ++state) {
+        printf("    %s,\n", accept[state]);
+    }
+    printf("};\n");
+
+    return 0;
+}
@@ -1,5 +1,7 @@
 #include "lex.h"
+#include "scan.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 struct lex_test {
@@ -54,16 +56,16 @@ static int assert_token(const char* test, lex_buf* buf,
                test, token_names[expected_type], token_names[token.token_type]);
         return 1;
     }
-    if (expected_value) {
-        if (strcmp(expected_value, token.token_value) != 0) {
-            printf("Literal test failed: expected value %s but got %s\n", 
-                   expected_value, token.token_value);
-            return 1;
-        }
-    } else if (token.token_value) {
-            printf("Literal test failed: unexpected value %s\n", 
-                   token.token_value);
-            return 1;
+    if (!expected_value) {
+        /* operators' text is their sigil */
+        expected_value = expected_type == END_OF_EXPRESSION ? "" :
+            token_names[expected_type];
+    }
+    if (strncmp(expected_value, token.text, token.text_len) ||
+        expected_value[token.text_len]) {
+        printf("Literal test failed: expected value %s but got %.*s\n", 
+               expected_value, token.text_len, token.text);
+        return 1;
     }
 
     return 0;
@@ -80,7 +82,6 @@ static int test_literals() {
     failures += assert_token(teststr, &buf, END_OF_EXPRESSION, 0);
 
     teststr = "\"a\001\\x\\\"\"*";
-    done_lex(buf);
     buf = start_lex(teststr);
 
     failures += assert_token(teststr, &buf, LITERAL_OR_ID, "\"a\001\\x\\\"\"");
@@ -88,7 +89,6 @@ static int test_literals() {
     failures += assert_token(teststr, &buf, END_OF_EXPRESSION, 0);
 
     teststr = "\"a\001\\x\\\"\"*''";
-    done_lex(buf);
     buf = start_lex(teststr);
 
     failures += assert_token(teststr, &buf, LITERAL_OR_ID, "\"a\001\\x\\\"\"");
@@ -97,7 +97,6 @@ static int test_literals() {
     failures += assert_token(teststr, &buf, END_OF_EXPRESSION, 0);
 
     teststr = "\"a\001\\x\\\"\"*'\\''";
-    done_lex(buf);
     buf = start_lex(teststr);
 
     failures += assert_token(teststr, &buf, LITERAL_OR_ID, "\"a\001\\x\\\"\"");
@@ -105,13 +104,93 @@ static int test_literals() {
     failures += assert_token(teststr, &buf, LITERAL_OR_ID, "'\\''");
     failures += assert_token(teststr, &buf, END_OF_EXPRESSION, 0);
 
-    done_lex(buf);
+    return failures;
+}
+
+/*
+  Lexes text with the scalar scanners and with simd, and checks that
+  the tokens are the same.
+ */
+static int compare_scans(const char* text, enum scan_simd simd) {
+    scan_set_simd(SCAN_SIMD_NONE);
+    lex_buf scalar_buf = start_lex(text);
+    scan_set_simd(simd);
+    lex_buf simd_buf = start_lex(text);
+    int failures = 0;
+    while (1) {
+        scan_set_simd(SCAN_SIMD_NONE);
+        struct token expected = get_next_token(&scalar_buf);
+        scan_set_simd(simd);
+        struct token token = get_next_token(&simd_buf);
+        if (token.token_type != expected.token_type ||
+            token.text != expected.text ||
+            token.text_len != expected.text_len) {
+            printf("Scan test failed: simd %d lexed %s as %s but scalar "
+                   "lexed it as %s\n", simd, text,
+                   token_names[token.token_type],
+                   token_names[expected.token_type]);
+            ++failures;
+            break;
+        }
+        if (token.token_type == END_OF_EXPRESSION) {
+            break;
+        }
+    }
+    return failures;
+}
+
+/*
+  Differential test of the vector scanners against the scalar ones, on
+  the tests above and on random text built from pieces that exercise
+  run boundaries at every offset within a vector.
+ */
+static int test_scans() {
+    static const char* pieces[] = {
+        "a", "Z", "_", "9", "0x1f", "1.5e-3", "sizeof", " ", "\t", "\n",
+        "\v", "\r", "/*", "*/", "*", "/", "+", "->", ".", "\"s\"", "'c'",
+        "@", "\x80", "\xff", "`", "[", "{", "^", ":"
+    };
+    int n_pieces = sizeof(pieces) / sizeof(pieces[0]);
+    enum scan_simd simds[] = {SCAN_SIMD_SSE2, SCAN_SIMD_AVX2};
+    int failures = 0;
+    unsigned long seed = 1;
+    char text[512];
+
+    for (int s = 0; s < 2; ++s) {
+        if (!scan_set_simd(simds[s])) {
+            continue;
+        }
+        for (struct lex_test* test = tests; test->text; ++test) {
+            failures += compare_scans(test->text, simds[s]);
+        }
+        for (int i = 0; i < 5000 && !failures; ++i) {
+            size_t len = 0;
+            while (1) {
+                seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+                const char* piece = pieces[(seed >> 33) % n_pieces];
+                /* repeat the piece to make long runs */
+                int repeat = 1 + (seed >> 20) % ((seed >> 50) % 4 ? 3 : 70);
+                size_t piece_len = strlen(piece);
+                if (len + piece_len * repeat >= sizeof(text)) {
+                    break;
+                }
+                for (int r = 0; r < repeat; ++r) {
+                    memcpy(text + len, piece, piece_len);
+                    len += piece_len;
+                }
+            }
+            text[len] = 0;
+            failures += compare_scans(text, simds[s]);
+        }
+    }
+    scan_set_simd(SCAN_SIMD_AUTO);
     return failures;
 }
 
 int main() {
     int i = 0;
     int failures = test_literals();
+    failures += test_scans();
     while (tests[i].text) {
         struct lex_test test = tests[i];
         lex_buf buf = start_lex(test.text);
@@ -134,7 +213,6 @@ int main() {
                 break;
             }
         }
-        done_lex(buf);
         ++i;
     }
     return failures > 0 ? 1 : 0;
@@ -1,9 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "parse.h"
 #include "lex.h"
+#include "tree_format.h"
+
+/* how trees are printed, set by --format */
+static const struct tree_emitter* format = &tree_format_text;
 
 static int dump_tree(const char* expr) {
 
@@ -11,17 +18,80 @@ static int dump_tree(const char* expr) {
     if (result->is_error) {
         printf("Error: %s\n", result->error_message);
     } else {
-        char* buf = malloc(strlen(expr) * 3 + 1);
-        write_tree_to_string(result->node, buf);
-        printf("%s\n", buf);
+        struct sink out;
+        sink_init_fd(&out, STDOUT_FILENO);
+        emit_tree(format, result->node, &out);
+        sink_write(&out, "\n", 1);
+        sink_close(&out);
+    }
+
+    int is_error = result->is_error;
+    free_parse_result(result);
+    return is_error;
+}
+
+/*
+  Parses one expression per line of input, printing one line of
+  output for each.  The parser context is reused from line to line,
+  and the output goes straight to stdout through a sink.
+ */
+static int dump_trees(FILE* in) {
+    struct parser_ctx* ctx = parser_ctx_new();
+    char* line = 0;
+    size_t line_allocated = 0;
+    struct sink out;
+    sink_init_fd(&out, STDOUT_FILENO);
+    int errors = 0;
+
+    ssize_t len;
+    while ((len = getline(&line, &line_allocated, in)) != -1) {
+        if (len && line[len - 1] == '\n') {
+            line[--len] = 0;
+        }
+        struct parse_result* result = parser_ctx_parse(ctx, line, 0);
+        if (result->is_error) {
+            sink_printf(&out, "Error: %s\n", result->error_message);
+            errors = 1;
+            continue;
+        }
+        emit_tree(format, result->node, &out);
+        sink_write(&out, "\n", 1);
     }
 
-    return result->is_error;
+    sink_close(&out);
+    free(line);
+    parser_ctx_free(ctx);
+    return errors;
 }
 
 int main(int argc, char** argv) {
+    if (argc >= 3 && strcmp(argv[1], "--format") == 0) {
+        format = find_tree_format(argv[2]);
+        if (!format) {
+            printf("Error: unknown format %s, not one of %s\n", argv[2],
+                   tree_format_names);
+            return 2;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc == 2 && strcmp(argv[1], "-") == 0) {
+        return dump_trees(stdin);
+    }
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        FILE* in = fopen(argv[2], "r");
+        if (!in) {
+            printf("Error: can't open %s\n", argv[2]);
+            return 2;
+        }
+        int errors = dump_trees(in);
+        fclose(in);
+        return errors;
+    }
     if (argc != 2) {
-        printf("Error: must supply a single argument\n");
+        printf("Error: must supply a single argument, - to read "
+               "expressions from stdin, or -f file, optionally after "
+               "--format %s\n", tree_format_names);
         return 2;
     }
     return dump_tree(argv[1]);
@@ -1,4 +1,6 @@
 #include "obstack_helper.h"
+#include <stddef.h>
+#include <stdlib.h>
 
 char* obstack_strdup(struct obstack* obstack, const char* str) {
     while(1) {
@@ -21,3 +23,63 @@ char* obstack_strndup(struct obstack* obstack, const char* str,
     obstack_1grow (obstack, 0);
     return obstack_finish(obstack);
 }
+
+/*
+  Each chunk is preceded by a header giving its size, since the
+  obstack doesn't say how big a chunk is when it frees it.
+ */
+struct cached_chunk {
+    union {
+        struct {
+            struct cached_chunk* next;
+            long size;
+        };
+        max_align_t align;
+    };
+};
+
+static void* cached_chunk_alloc(void* arg, long size) {
+    struct obstack_chunk_cache* cache = arg;
+    /* First fit.  The obstack frees its newest chunk first, so the
+       list starts with the oldest, which is the next one it will
+       want back; with the usual equal-sized chunks, the first chunk
+       fits. */
+    struct cached_chunk** fit = &cache->free_chunks;
+    while (*fit && (*fit)->size < size) {
+        fit = &(*fit)->next;
+    }
+    struct cached_chunk* chunk;
+    if (*fit) {
+        chunk = *fit;
+        *fit = chunk->next;
+    } else {
+        chunk = malloc(sizeof(struct cached_chunk) + size);
+        if (!chunk) {
+            return 0;
+        }
+        chunk->size = size;
+    }
+    return chunk + 1;
+}
+
+static void cached_chunk_free(void* arg, void* data) {
+    struct obstack_chunk_cache* cache = arg;
+    struct cached_chunk* chunk = (struct cached_chunk*)data - 1;
+    chunk->next = cache->free_chunks;
+    cache->free_chunks = chunk;
+}
+
+void obstack_init_cached(struct obstack* obstack,
+                         struct obstack_chunk_cache* cache) {
+    cache->free_chunks = 0;
+    obstack_specify_allocation_with_arg(obstack, 0, 0, cached_chunk_alloc,
+                                        cached_chunk_free, cache);
+}
+
+void obstack_chunk_cache_free(struct obstack_chunk_cache* cache) {
+    while (cache->free_chunks) {
+        struct cached_chunk* next = cache->free_chunks->next;
+        free(cache->free_chunks);
+        cache->free_chunks = next;
+    }
+}
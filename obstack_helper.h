@@ -10,4 +10,20 @@ char* obstack_strdup(struct obstack* obstack, const char* str);
 char* obstack_strndup(struct obstack* obstack, const char* str,
                       size_t n);
 
+/*
+  Keeps the chunks that an obstack frees, to hand back the next time
+  it needs one, so that an obstack that is repeatedly freed back to a
+  mark and refilled stops calling malloc once it has reached its
+  largest size.
+ */
+struct obstack_chunk_cache {
+    struct cached_chunk* free_chunks;
+};
+
+void obstack_init_cached(struct obstack* obstack,
+                         struct obstack_chunk_cache* cache);
+
+/* Frees the cached chunks; call after freeing the obstack itself. */
+void obstack_chunk_cache_free(struct obstack_chunk_cache* cache);
+
 #endif
@@ -6,116 +6,143 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "obstack_helper.h"
 
-#define PARSE_PUSHBACK_BUF_SIZE 2
-
 #define HANDLE_BOGUS_TOKEN(tok)                                 \
     {{                                                          \
         struct token __tok = (tok);                             \
         if (__tok.token_type == BOGUS) {                        \
-            error(state, "Bogus token '%s'", __tok.token_value);\
+            error(state, "Bogus token '%.*s'", __tok.text_len, __tok.text);\
             return 0;                                           \
         }                                                       \
     }}                                                          \
 
-struct parse_state {
-    lex_buf *buf;
-    struct token push_back[PARSE_PUSHBACK_BUF_SIZE];
-    char* error_message;
-    struct obstack* obstack;
-    char** typename_starters;
-};
-
 /*
-   These are C's built-in types (or at least the first words thereof)
+  The parser runs on its own stack of frames rather than recursing,
+  so that deeply nested expressions can't overflow the C stack.  Each
+  frame is one activation of a grammar rule (binop, unop or primary),
+  and step says where it resumes when the rule it called returns.
  */
-static char* typename_starters[] = {
-    "bool",
-    "char",
-    "double",
-    "float",
-    "int",
-    "long",
-    "off_t",
-    "ptrdiff_t",
-    "signed",
-    "short",
-    "size_t",
-    "struct",
-    "time_t",
-    "unsigned",
-    0
+enum parse_step {
+    BINOP_START,
+    BINOP_OPERAND,
+    BINOP_RIGHT,
+    BINOP_TERNARY_MID,
+    BINOP_TERNARY_RIGHT,
+    UNOP_START,
+    UNOP_OPERAND,
+    TYPECAST_OPERAND,
+    PRIMARY_START,
+    PRIMARY_PARENTHESIZED,
+    PRIMARY_SUBSCRIPT,
+    PRIMARY_ARG_DONE
 };
 
-static struct parse_tree_node* parse_comma(struct parse_state *state);
-static struct parse_tree_node* parse_assignop(struct parse_state *state);
-
-static struct token get_next_parse_token(struct parse_state* state) {
+struct parse_frame {
+    unsigned char step;
+    /* binop: the loosest operator this frame may consume */
+    unsigned char precedence;
+    /* binop and unop: the operator waiting for its right operand */
+    unsigned char op;
+    int text_len;
+    struct parse_tree_node* node;
+    union {
+        /* ?: the middle operand */
+        struct parse_tree_node* mid;
+        /* function call: the last argument so far */
+        struct parse_tree_node* prev_child;
+        /* typecast: the type */
+        const char* text;
+    };
+};
 
-    for (int i = PARSE_PUSHBACK_BUF_SIZE - 1; i >= 0; --i) {
-        if (state->push_back[i].token_type) {
-            struct token ret = state->push_back[i];
-            state->push_back[i].token_type = 0;
-            return ret;
-        }
-    }
+struct parse_stack {
+    struct parse_frame* frames;
+    int depth;
+    int allocated;
+    int max_depth;
+};
 
-    return get_next_token(state->buf);
+/*
+  Every node that's been linked into a parent, for hash-consing.
+  Nodes are equal if their ops, texts, first children and next
+  siblings are, so a node is only entered once its children and the
+  siblings after it are final: when its parent is made.
+ */
+struct node_table {
+    struct parse_tree_node** slots;
+    size_t capacity;
+    size_t count;
+};
 
-}
+struct parse_state {
+    const char* string;
+    struct token_buf* tokens;
+    /* index of the next token to read */
+    int cursor;
+    char* error_message;
+    struct obstack* obstack;
+    const struct typename_set* typenames;
+    /* a list of more typenames, given for just this parse */
+    char** typename_list;
+    struct parse_stack* stack;
+    bool too_deep;
+    /* for hash-consing; NULL if it's off */
+    struct node_table* shared;
+    /* duplicates found by hash-consing, to be reused */
+    struct parse_tree_node* free_nodes;
+    long n_nodes;
+};
 
-static void push_back(struct parse_state* state,
-    struct token tok) {
-    if (state->push_back[PARSE_PUSHBACK_BUF_SIZE-1].token_type) {
-        printf("Programmer error: pushed back too many tokens\n");
-        exit(1);
-    }
-    for (int i = 0; i < PARSE_PUSHBACK_BUF_SIZE; ++i) {
-        if (state->push_back[i].token_type == 0) {
-            state->push_back[i] = tok;
-            break;
-        }
+static struct token get_next_parse_token(struct parse_state* state) {
+    /* reading past the end keeps returning END_OF_EXPRESSION, but
+       still advances the cursor so that unget_parse_token stays in
+       step */
+    int i = state->cursor++;
+    if (i >= state->tokens->n_tokens) {
+        i = state->tokens->n_tokens - 1;
     }
+    struct token tok = {
+        .token_type = state->tokens->types[i],
+        .text = state->string + state->tokens->offsets[i],
+        .text_len = state->tokens->lengths[i]
+    };
+    return tok;
 }
 
-static int count_typenames(char** typenames) {
-    if (typenames == 0) {
-        return 0;
-    }
-    int i = 0;
-    for (char** name = typenames; *name; ++name) {
-        ++i;
-    }
-    return i;
+/* Un-reads the last token read */
+static void unget_parse_token(struct parse_state* state) {
+    state->cursor--;
 }
 
-static void copy_typenames(char** dest, char** src) {
-    if (!src) {
-        return;
+static enum token_type peek_parse_token(struct parse_state* state) {
+    int i = state->cursor;
+    if (i >= state->tokens->n_tokens) {
+        i = state->tokens->n_tokens - 1;
     }
-    while ((*dest++ = *src++)) {}
+    return state->tokens->types[i];
 }
 
-static struct parse_state make_parse_state(lex_buf* buf, char** typenames) {
-    struct parse_state state = {.buf = buf, .error_message = 0};
-    for (int i = 0; i < PARSE_PUSHBACK_BUF_SIZE; ++i) {
-        state.push_back[i].token_type = 0;
-    }
-    state.obstack = malloc(sizeof(struct obstack));
-    obstack_init(state.obstack);
-
-    int custom_typenames = count_typenames(typenames);
-    int n_typenames = custom_typenames + count_typenames(typename_starters);
-
-    state.typename_starters = malloc((n_typenames + 1) * sizeof(char*));
-    copy_typenames(state.typename_starters, typenames);
-    copy_typenames(state.typename_starters + custom_typenames,
-                   typename_starters);
-    state.typename_starters[n_typenames] = 0;
-
+static struct parse_state make_parse_state(const char* string,
+                                           struct token_buf* tokens,
+                                           struct obstack* obstack,
+                                           struct parse_stack* stack,
+                                           const struct typename_set*
+                                           typenames,
+                                           char** typename_list) {
+    struct parse_state state = {.string = string, .tokens = tokens,
+                                .cursor = 0, .error_message = 0};
+    state.obstack = obstack;
+    state.typenames = typenames;
+    state.typename_list = typename_list;
+    state.stack = stack;
+    state.too_deep = false;
+    state.shared = 0;
+    state.free_nodes = 0;
+    state.n_nodes = 0;
     return state;
 }
 
@@ -130,7 +157,14 @@ static void error(struct parse_state* state, const char* message, ...) {
     va_start (args, message);
     int size = vsnprintf(0, 0, message, args);
     va_end (args);
-    char* errbuf = malloc(size + 1);
+
+    /* the message goes on the obstack with the tree, so that parsing
+       with a context never mallocs.  If an error interrupts a
+       typename that's still growing, leave that behind. */
+    if (obstack_object_size(state->obstack)) {
+        obstack_finish(state->obstack);
+    }
+    char* errbuf = obstack_alloc(state->obstack, size + 1);
     va_start (args, message);
     vsnprintf(errbuf, size + 1, message, args);
     va_end (args);
@@ -150,14 +184,106 @@ void free_parse_result_contents(struct parse_result *result) {
     }
 }
 
-/* In the event of an error, we need to free the parse
-   tree nodes that we have allocated */
-static void free_parse_state(struct parse_state* state) {
-    obstack_free(state->obstack, 0);
-    free(state->obstack);
-    state->obstack = 0;
-    free(state->typename_starters);
-    state->typename_starters = 0;
+void free_parse_result(struct parse_result *result) {
+    free_parse_result_contents(result);
+    free(result);
+}
+
+static struct parse_tree_node* alloc_node(struct parse_state* state) {
+    state->n_nodes++;
+    struct parse_tree_node* node = state->free_nodes;
+    if (node) {
+        state->free_nodes = node->next_sibling;
+        return node;
+    }
+    return obstack_alloc(state->obstack, sizeof(struct parse_tree_node));
+}
+
+static uint64_t hash_node(const struct parse_tree_node* node) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < node->text_len; ++i) {
+        hash = (hash ^ (unsigned char)node->text[i]) * 1099511628211ull;
+    }
+    hash = (hash ^ node->op) * 1099511628211ull;
+    hash = (hash ^ (uintptr_t)node->first_child) * 1099511628211ull;
+    hash = (hash ^ (uintptr_t)node->next_sibling) * 1099511628211ull;
+    return hash ^ (hash >> 29);
+}
+
+static bool nodes_equal(const struct parse_tree_node* a,
+                        const struct parse_tree_node* b) {
+    return a->op == b->op && a->text_len == b->text_len &&
+        a->first_child == b->first_child &&
+        a->next_sibling == b->next_sibling &&
+        (!a->text_len || !memcmp(a->text, b->text, a->text_len));
+}
+
+static void grow_node_table(struct node_table* table) {
+    size_t old_capacity = table->capacity;
+    struct parse_tree_node** old_slots = table->slots;
+    table->capacity = old_capacity ? old_capacity * 2 : 256;
+    table->slots = calloc(table->capacity, sizeof(*table->slots));
+    for (size_t i = 0; i < old_capacity; ++i) {
+        struct parse_tree_node* node = old_slots[i];
+        if (node) {
+            size_t slot = hash_node(node) & (table->capacity - 1);
+            while (table->slots[slot]) {
+                slot = (slot + 1) & (table->capacity - 1);
+            }
+            table->slots[slot] = node;
+        }
+    }
+    free(old_slots);
+}
+
+/*
+  Gives node its next sibling, and returns the node in the table equal
+  to it, entering it if there is none.  A duplicate is put on the free
+  list.
+ */
+static struct parse_tree_node* intern_node(struct parse_state* state,
+                                           struct parse_tree_node* node,
+                                           struct parse_tree_node* sibling) {
+    struct node_table* table = state->shared;
+    node->next_sibling = sibling;
+    if ((table->count + 1) * 2 > table->capacity) {
+        grow_node_table(table);
+    }
+    size_t slot = hash_node(node) & (table->capacity - 1);
+    for (; table->slots[slot]; slot = (slot + 1) & (table->capacity - 1)) {
+        struct parse_tree_node* existing = table->slots[slot];
+        if (nodes_equal(existing, node)) {
+            node->next_sibling = state->free_nodes;
+            state->free_nodes = node;
+            return existing;
+        }
+    }
+    table->slots[slot] = node;
+    table->count++;
+    return node;
+}
+
+/*
+  Interns parent's children, last first, since each one's sibling has
+  to be final before it can be.
+ */
+static void intern_children(struct parse_state* state,
+                            struct parse_tree_node* parent) {
+    struct parse_tree_node* reversed = 0;
+    struct parse_tree_node* child = parent->first_child;
+    while (child) {
+        struct parse_tree_node* next = child->next_sibling;
+        child->next_sibling = reversed;
+        reversed = child;
+        child = next;
+    }
+    struct parse_tree_node* sibling = 0;
+    while (reversed) {
+        struct parse_tree_node* prev = reversed->next_sibling;
+        sibling = intern_node(state, reversed, sibling);
+        reversed = prev;
+    }
+    parent->first_child = sibling;
 }
 
 static struct parse_tree_node* make_binary_node(struct parse_state* state,
@@ -165,52 +291,38 @@ static struct parse_tree_node* make_binary_node(struct parse_state* state,
                                          struct parse_tree_node* left,
                                          struct parse_tree_node* right) {
 
-    struct parse_tree_node* node;
-    node = obstack_alloc(state->obstack, sizeof(struct parse_tree_node));
+    struct parse_tree_node* node = alloc_node(state);
 
     node->text = 0;
+    node->text_len = 0;
     node->op = op;
     node->next_sibling = 0;
     node->first_child = left;
     left->next_sibling = right;
+    /* a call's arguments are still to come */
+    if (state->shared && op != FUNCTION_CALL) {
+        intern_children(state, node);
+    }
     return node;
 }
 
 static struct parse_tree_node* make_terminal_node(struct parse_state* state,
                                                   struct token token) {
 
-    struct parse_tree_node* node;
-    node = obstack_alloc(state->obstack, sizeof(struct parse_tree_node));
+    struct parse_tree_node* node = alloc_node(state);
 
     node->first_child = node->next_sibling = 0;
     node->op = token.token_type;
-    if (token.token_value) {
-        node->text = obstack_strdup(state->obstack, token.token_value);
+    if (token.token_type == LITERAL_OR_ID) {
+        node->text = token.text;
+        node->text_len = token.text_len;
     } else {
         node->text = 0;
+        node->text_len = 0;
     }
     return node;
 }
 
-static int is_assignop(struct token token) {
-    switch (token.token_type) {
-    case ASSIGN:
-    case PERCENT_EQUAL:
-    case CARET_EQUAL:
-    case AMPERSAND_EQUAL:
-    case BAR_EQUAL:
-    case STAR_EQUAL:
-    case MINUS_EQUAL:
-    case PLUS_EQUAL:
-    case SLASH_EQUAL:
-    case LEFT_SHIFT_EQUAL:
-    case RIGHT_SHIFT_EQUAL:
-        return 1;
-    default:
-        return 0;
-    }
-}
-
 static int is_unop(struct token token) {
     switch(token.token_type) {
     case AMPERSAND:
@@ -228,20 +340,74 @@ static int is_unop(struct token token) {
     }
 }
 
-static enum token_type binops[][5] = {
-    {DOUBLE_BAR, 0},
-    {DOUBLE_AMPERSAND, 0},
-    {BAR, 0},
-    {CARET, 0},
+/*
+  Binary operators' precedence, loosest first.  The conditional
+  operator is handled as a binary operator whose right side is
+  "b : c".
+ */
+enum precedence {
+    PREC_NONE,
+    PREC_COMMA,
+    PREC_ASSIGN,
+    PREC_TERNARY,
+    PREC_LOGICAL_OR,
+    PREC_LOGICAL_AND,
+    PREC_BITWISE_OR,
+    PREC_BITWISE_XOR,
+    PREC_BITWISE_AND,
+    PREC_EQUALITY,
+    PREC_RELATIONAL,
+    PREC_SHIFT,
+    PREC_ADDITIVE,
+    PREC_MULTIPLICATIVE
+};
 
-    {AMPERSAND, 0},
-    {IS_EQUAL, BANG_EQUAL, 0},
-    {LT, GT, LTE, GTE, 0},
-    {LEFT_SHIFT, RIGHT_SHIFT, 0},
+struct binop {
+    unsigned char precedence;
+    unsigned char right_assoc;
+};
 
-    {PLUS, MINUS, 0},
-    {STAR, SLASH, PERCENT, 0},
-    {0}
+/* indexed by token type; tokens that aren't binary operators are 0 */
+static const struct binop binops[END_OF_EXPRESSION + 1] = {
+    [COMMA] = {PREC_COMMA, 0},
+
+    [ASSIGN] = {PREC_ASSIGN, 1},
+    [PERCENT_EQUAL] = {PREC_ASSIGN, 1},
+    [CARET_EQUAL] = {PREC_ASSIGN, 1},
+    [AMPERSAND_EQUAL] = {PREC_ASSIGN, 1},
+    [BAR_EQUAL] = {PREC_ASSIGN, 1},
+    [STAR_EQUAL] = {PREC_ASSIGN, 1},
+    [MINUS_EQUAL] = {PREC_ASSIGN, 1},
+    [PLUS_EQUAL] = {PREC_ASSIGN, 1},
+    [SLASH_EQUAL] = {PREC_ASSIGN, 1},
+    [LEFT_SHIFT_EQUAL] = {PREC_ASSIGN, 1},
+    [RIGHT_SHIFT_EQUAL] = {PREC_ASSIGN, 1},
+
+    [QUESTION] = {PREC_TERNARY, 1},
+
+    [DOUBLE_BAR] = {PREC_LOGICAL_OR, 0},
+    [DOUBLE_AMPERSAND] = {PREC_LOGICAL_AND, 0},
+    [BAR] = {PREC_BITWISE_OR, 0},
+    [CARET] = {PREC_BITWISE_XOR, 0},
+    [AMPERSAND] = {PREC_BITWISE_AND, 0},
+
+    [IS_EQUAL] = {PREC_EQUALITY, 0},
+    [BANG_EQUAL] = {PREC_EQUALITY, 0},
+
+    [LT] = {PREC_RELATIONAL, 0},
+    [GT] = {PREC_RELATIONAL, 0},
+    [LTE] = {PREC_RELATIONAL, 0},
+    [GTE] = {PREC_RELATIONAL, 0},
+
+    [LEFT_SHIFT] = {PREC_SHIFT, 0},
+    [RIGHT_SHIFT] = {PREC_SHIFT, 0},
+
+    [PLUS] = {PREC_ADDITIVE, 0},
+    [MINUS] = {PREC_ADDITIVE, 0},
+
+    [STAR] = {PREC_MULTIPLICATIVE, 0},
+    [SLASH] = {PREC_MULTIPLICATIVE, 0},
+    [PERCENT] = {PREC_MULTIPLICATIVE, 0},
 };
 
 static int is_typename_first_word(struct parse_state* state,
@@ -249,441 +415,618 @@ static int is_typename_first_word(struct parse_state* state,
     if (token.token_type != LITERAL_OR_ID) {
         return 0;
     }
-    for (char** type = state->typename_starters; *type; ++type) {
-        if (strcmp(*type, token.token_value) == 0) {
-            return 1;
+    if (state->typename_list) {
+        /* a list is only searched a few times, so it isn't worth
+           hashing */
+        for (char** type = state->typename_list; *type; ++type) {
+            if (**type == *token.text &&
+                strncmp(*type, token.text, token.text_len) == 0 &&
+                (*type)[token.text_len] == 0) {
+                return 1;
+            }
         }
     }
-    return 0;
+    return typename_set_contains(state->typenames, token.text,
+                                 token.text_len);
 }
 
 static void append_token(struct obstack* obstack, struct token token) {
-    const char* token_str;
-    if (token.token_value) {
-        token_str = token.token_value;
-    } else {
-        token_str = token_names[token.token_type];
-    }
-
     if (obstack_object_size(obstack)) {
         obstack_1grow(obstack, ' ');
     }
-    obstack_grow(obstack, token_str, strlen(token_str));
-
+    obstack_grow(obstack, token.text, token.text_len);
 }
 
-/* () [] . -> expr++ expr--	 */
-static struct parse_tree_node* parse_primary_expression(struct parse_state *state) {
-    struct token tok = get_next_parse_token(state);
-    HANDLE_BOGUS_TOKEN(tok);
-    struct parse_tree_node* node = 0;
-    switch(tok.token_type) {
-    case OPEN_PAREN:
-        node = parse_comma(state);
-        if (!node) {
+/*
+  Joins the tokens up to the next close-paren with spaces, returning
+  the result (on the obstack) and setting *len to its length.
+ */
+static char* parse_parenthesized_typename(struct token tok, struct parse_state* state,
+                                          int* len) {
+    //parse until close-paren
+    while (tok.token_type != CLOSE_PAREN) {
+        if (tok.token_type == END_OF_EXPRESSION) {
+            char* typename = obstack_finish(state->obstack);
+            obstack_free(state->obstack, typename);
             return 0;
         }
+        append_token(state->obstack, tok);
         tok = get_next_parse_token(state);
         HANDLE_BOGUS_TOKEN(tok);
-        if (tok.token_type != CLOSE_PAREN) {
-            error(state, "Missing ) parsing parenthesized expression");
-            return 0;
-        }
-        break;
-    case LITERAL_OR_ID:
-        node = make_terminal_node(state, tok);
-        break;
+    }
+    *len = obstack_object_size(state->obstack);
+    obstack_1grow(state->obstack, 0);
+    return obstack_finish(state->obstack);
+}
+
+static enum token_type unop_node_type(enum token_type token_type) {
+    switch (token_type) {
+    case STAR:
+        return DEREFERENCE;
+    case AMPERSAND:
+        return REFERENCE;
+    case MINUS:
+        return UNARY_MINUS;
+    case DOUBLE_PLUS:
+        return PREINCREMENT;
+    case DOUBLE_MINUS:
+        return PREDECREMENT;
     default:
-        error(state, "Unexpected %s", token_names[tok.token_type]);
-        return 0;
+        return token_type;
     }
+}
 
-    bool more = true;
-    while (more) {
-        tok = get_next_parse_token(state);
-        HANDLE_BOGUS_TOKEN(tok);
-        switch(tok.token_type) {
+/*
+  Pushes a frame that starts at step.  Returns false, with an error,
+  if that would go past the depth limit.
+ */
+static bool push_frame(struct parse_state* state, enum parse_step step,
+                       int precedence) {
+    struct parse_stack* stack = state->stack;
+    /* on every push, since the limit can drop below what's allocated */
+    if (stack->depth >= stack->max_depth) {
+        error(state, "Expression too deeply nested");
+        state->too_deep = true;
+        return false;
+    }
+    if (stack->depth == stack->allocated) {
+        int allocated = stack->allocated ? stack->allocated * 2 : 64;
+        if (allocated > stack->max_depth) {
+            allocated = stack->max_depth;
+        }
+        stack->frames = realloc(stack->frames,
+                                allocated * sizeof(struct parse_frame));
+        stack->allocated = allocated;
+    }
+    struct parse_frame* frame = &stack->frames[stack->depth++];
+    frame->step = step;
+    frame->precedence = precedence;
+    return true;
+}
 
-        case OPEN_BRACKET:
-        {
+/* Saves where the current frame resumes, and starts a new one */
+#define CALL(resume_step, start_step, precedence)                       \
+    {{                                                                  \
+        frame->step = (resume_step);                                    \
+        if (!push_frame(state, (start_step), (precedence))) {           \
+            return 0;                                                   \
+        }                                                               \
+        continue;                                                       \
+    }}
+
+/* Pops the current frame, handing value to the frame below */
+#define RETURN(value)                                                   \
+    {{                                                                  \
+        ret = (value);                                                  \
+        stack->depth--;                                                 \
+        continue;                                                       \
+    }}
+
+/*
+  Runs frames until the stack is empty, returning what the bottom
+  frame returns.  On error, returns 0 and leaves the stack as it was
+  at the error, with the frame that failed on top.
+
+  The rules are:
+
+  binop: unop (binary-operator binop)*, by precedence climbing:
+    operators that bind at least as tightly as the frame's precedence
+    are folded into the tree here, and anything looser is left for
+    the caller.  The conditional operator is handled as a binary
+    operator whose right side is "b : c".
+
+  unop: * & + - ! ~ ++expr --expr (typecast) sizeof, or primary
+
+  primary: () [] . -> expr++ expr--
+ */
+static struct parse_tree_node* run_parser(struct parse_state* state) {
+    struct parse_stack* stack = state->stack;
+    struct parse_tree_node* ret = 0;
+    struct token tok;
+
+    while (stack->depth) {
+        struct parse_frame* frame = &stack->frames[stack->depth - 1];
+        switch ((enum parse_step)frame->step) {
+
+        case BINOP_START:
+            CALL(BINOP_OPERAND, UNOP_START, PREC_NONE);
+
+        case BINOP_OPERAND:
+            frame->node = ret;
+            goto binop_next;
+
+        case BINOP_RIGHT:
+            frame->node = make_binary_node(state, frame->op, frame->node, ret);
+            goto binop_next;
+
+        case BINOP_TERNARY_MID:
+            frame->mid = ret;
             tok = get_next_parse_token(state);
-            push_back(state, tok);
-            if (match(tok, END_OF_EXPRESSION)) {
-                error(state, "Missing ] at end of input");
+            HANDLE_BOGUS_TOKEN(tok);
+            if (tok.token_type != COLON) {
+                error(state, "Missing : in ?: ternary op (found %s)",
+                      token_names[tok.token_type]);
                 return 0;
             }
+            CALL(BINOP_TERNARY_RIGHT, BINOP_START, PREC_TERNARY);
 
-            struct parse_tree_node* right_node = parse_comma(state);
-            if (!right_node) {
-                return 0;
-            }
+        case BINOP_TERNARY_RIGHT:
+        {
+            struct parse_tree_node* new_right = make_binary_node(state, COLON, frame->mid, ret);
+            frame->node = make_binary_node(state, QUESTION, frame->node, new_right);
+            goto binop_next;
+        }
 
+        binop_next:
+        {
             tok = get_next_parse_token(state);
             HANDLE_BOGUS_TOKEN(tok);
-            if (!match(tok, CLOSE_BRACKET)) {
-                error(state, "Missing ]");
-                return 0;
+            struct binop binop = binops[tok.token_type];
+            if (binop.precedence == PREC_NONE ||
+                binop.precedence < frame->precedence) {
+                unget_parse_token(state);
+                if (frame->precedence == PREC_COMMA) {
+                    /* a whole comma expression must end the input or
+                       a bracket */
+                    enum token_type next = peek_parse_token(state);
+                    if (next != END_OF_EXPRESSION &&
+                        next != CLOSE_PAREN &&
+                        next != CLOSE_BRACKET) {
+                        error(state, "Unexpected %s", token_names[next]);
+                        return 0;
+                    }
+                }
+                RETURN(frame->node);
+            }
+
+            if (tok.token_type == QUESTION) {
+                CALL(BINOP_TERNARY_MID, BINOP_START, PREC_TERNARY);
             }
 
-            node = make_binary_node(state, SUBSCRIPT, node, right_node);
+            int right_precedence = binop.right_assoc ? binop.precedence
+                : binop.precedence + 1;
+            frame->op = tok.token_type;
+            CALL(BINOP_RIGHT, BINOP_START, right_precedence);
         }
-        break;
-        case OPEN_PAREN:
-        {
-            struct parse_tree_node* prev_child = node;
-            node = make_binary_node(state, FUNCTION_CALL, node, 0);
-            while (1) {
+
+        case UNOP_START:
+            tok = get_next_parse_token(state);
+            HANDLE_BOGUS_TOKEN(tok);
+            if (tok.token_type == SIZEOF) {
+                struct token sizeof_tok = tok;
+                struct parse_tree_node* node;
                 tok = get_next_parse_token(state);
                 HANDLE_BOGUS_TOKEN(tok);
-
-                struct parse_tree_node* next_node;
                 if (tok.token_type == OPEN_PAREN) {
-                    push_back(state, tok);
-                    next_node = parse_primary_expression(state);
-                } else if (tok.token_type == CLOSE_PAREN) {
-                    break;
+                    //sizeof(typename)
+                    tok = get_next_parse_token(state);
+                    HANDLE_BOGUS_TOKEN(tok);
+                    int typename_len;
+                    char* typename = parse_parenthesized_typename(tok, state,
+                                                                  &typename_len);
+                    if (!typename) {
+                        error(state, "Missing ) in sizeof");
+                        return 0;
+                    }
+                    node = make_terminal_node(state, sizeof_tok);
+                    node->text = typename;
+                    node->text_len = typename_len;
                 } else {
-                    push_back(state, tok);
-                    next_node = parse_assignop(state);
+                    //sizeof var
+                    node = make_terminal_node(state, sizeof_tok);
+                    node->text = tok.text;
+                    node->text_len = tok.text_len;
                 }
-                if (next_node == 0) {
-                    error(state, "Missing ) while parsing function call");
-                    return 0;
-                }
-
-                tok = get_next_parse_token(state);
-                HANDLE_BOGUS_TOKEN(tok);
-                if (!match(tok, COMMA)) {
-                    if (match(tok, CLOSE_PAREN)) {
-                        prev_child->next_sibling = next_node;
-                        prev_child = next_node;
-                        break;
-                    } else {
-                        error(state,
-                              "Unexpected %s while parsing function call",
-                              token_names[tok.token_type]);
+                RETURN(node);
+            }
+            if (is_unop(tok)) {
+                frame->op = unop_node_type(tok.token_type);
+                CALL(UNOP_OPERAND, UNOP_START, PREC_NONE);
+            }
+            if (tok.token_type == OPEN_PAREN) {
+                //handle typecasts via hack
+                struct token next_tok = get_next_parse_token(state);
+                HANDLE_BOGUS_TOKEN(next_tok);
+                if (is_typename_first_word(state, next_tok)) {
+                    int typename_len;
+                    char* typename = parse_parenthesized_typename(next_tok, state,
+                                                                  &typename_len);
+                    if (!typename) {
+                        error(state, "Missing ) in (assumed) typecast");
                         return 0;
                     }
+                    frame->text = typename;
+                    frame->text_len = typename_len;
+                    CALL(TYPECAST_OPERAND, UNOP_START, PREC_NONE);
                 }
-
-                prev_child->next_sibling = next_node;
-                prev_child = next_node;
+                //handle parenthesized expression
+                unget_parse_token(state);
             }
-        }
-        break;
-        case ARROW:
-        case DOT:
+            unget_parse_token(state);
+            /* a unop that's just a primary becomes one, in the same
+               frame */
+            goto primary_start;
+
+        case UNOP_OPERAND:
+            RETURN(make_binary_node(state, frame->op, ret, 0));
+
+        case TYPECAST_OPERAND:
         {
-            enum token_type op = tok.token_type;
+            struct parse_tree_node* node = make_binary_node(state, TYPECAST,
+                                                            ret, 0);
+            node->text = frame->text;
+            node->text_len = frame->text_len;
+            RETURN(node);
+        }
+
+        case PRIMARY_START:
+        primary_start:
             tok = get_next_parse_token(state);
             HANDLE_BOGUS_TOKEN(tok);
-            if (!match(tok, LITERAL_OR_ID)) {
-                error(state, "Expected identifier before %s token",
-                      token_names[tok.token_type]);
+            switch(tok.token_type) {
+            case OPEN_PAREN:
+                CALL(PRIMARY_PARENTHESIZED, BINOP_START, PREC_COMMA);
+            case LITERAL_OR_ID:
+                frame->node = make_terminal_node(state, tok);
+                goto primary_postfix;
+            default:
+                error(state, "Unexpected %s", token_names[tok.token_type]);
                 return 0;
             }
-            node = make_binary_node(state, op, node, make_terminal_node(state, tok));
-            break;
-        }
-        case DOUBLE_PLUS:
-            node = make_binary_node(state, POSTINCREMENT, node, 0);
-            break;
-        case DOUBLE_MINUS:
-            node = make_binary_node(state, POSTDECREMENT, node, 0);
-            break;
-        default:
-            //not part of a primary expression
-            more = false;
-            push_back(state, tok);
-            break;
-        }
-    }
-    return node;
-}
-
-static char* parse_parenthesized_typename(struct token tok, struct parse_state* state) {
-    //parse until close-paren
-    while (tok.token_type != CLOSE_PAREN) {
-        if (tok.token_type == END_OF_EXPRESSION) {
-            char* typename = obstack_finish(state->obstack);
-            obstack_free(state->obstack, typename);
-            return 0;
-        }
-        append_token(state->obstack, tok);
-        tok = get_next_parse_token(state);
-        HANDLE_BOGUS_TOKEN(tok);
-    }
-    obstack_1grow(state->obstack, 0);
-    return obstack_finish(state->obstack);
-}
-
-/*
-   * & + - ! ~ ++expr --expr (typecast) sizeof
- */
-static struct parse_tree_node* parse_unop(struct parse_state *state) {
-
-    struct parse_tree_node* node;
 
-    struct token tok = get_next_parse_token(state);
-    HANDLE_BOGUS_TOKEN(tok);
-    if (tok.token_type == SIZEOF) {
-        struct token sizeof_tok = tok;
-        tok = get_next_parse_token(state);
-        HANDLE_BOGUS_TOKEN(tok);
-        if (tok.token_type == OPEN_PAREN) {
-            //sizeof(typename)
+        case PRIMARY_PARENTHESIZED:
+            frame->node = ret;
             tok = get_next_parse_token(state);
             HANDLE_BOGUS_TOKEN(tok);
-            char* typename = parse_parenthesized_typename(tok, state);
-            if (!typename) {
-                error(state, "Missing ) in sizeof");
+            if (tok.token_type != CLOSE_PAREN) {
+                error(state, "Missing ) parsing parenthesized expression");
                 return 0;
             }
-            node = make_terminal_node(state, sizeof_tok);
-            node->text = typename;
-        } else {
-            //sizeof var
-            node = make_terminal_node(state, sizeof_tok);
-            node->text = obstack_strdup(state->obstack, tok.token_value);
-        }
+            goto primary_postfix;
 
-    } else if (is_unop(tok)) {
-        struct parse_tree_node* child_node = parse_unop(state);
-        if (!child_node) {
-            return 0;
-        }
-        enum token_type token_type;
-        switch (tok.token_type) {
-        case STAR:
-            token_type = DEREFERENCE;
-            break;
-        case AMPERSAND:
-            token_type = REFERENCE;
-            break;
-        case MINUS:
-            token_type = UNARY_MINUS;
-            break;
-        case DOUBLE_PLUS:
-            token_type = PREINCREMENT;
-            break;
-        case DOUBLE_MINUS:
-            token_type = PREDECREMENT;
-            break;
-        default:
-            token_type = tok.token_type;
-            break;
-        }
-        node = make_binary_node(state, token_type, child_node, 0);
-    } else if (tok.token_type == OPEN_PAREN) {
-        //handle typecasts via hack
-        struct token next_tok = get_next_parse_token(state);
-        HANDLE_BOGUS_TOKEN(next_tok);
-        if (is_typename_first_word(state, next_tok)) {
-            char* typename = parse_parenthesized_typename(next_tok, state);
-            if (!typename) {
-                error(state, "Missing ) in (assumed) typecast");
+        case PRIMARY_SUBSCRIPT:
+            tok = get_next_parse_token(state);
+            HANDLE_BOGUS_TOKEN(tok);
+            if (!match(tok, CLOSE_BRACKET)) {
+                error(state, "Missing ]");
                 return 0;
             }
+            frame->node = make_binary_node(state, SUBSCRIPT, frame->node, ret);
+            goto primary_postfix;
 
-            struct parse_tree_node* child_node = parse_unop(state);
-            if (!child_node) {
-                return 0;
+        case PRIMARY_ARG_DONE:
+        {
+            struct parse_tree_node* arg = ret;
+            tok = get_next_parse_token(state);
+            HANDLE_BOGUS_TOKEN(tok);
+            frame->prev_child->next_sibling = arg;
+            frame->prev_child = arg;
+            if (match(tok, CLOSE_PAREN)) {
+                goto primary_call_done;
             }
-            node = make_binary_node(state, TYPECAST, child_node, 0);
-            node->text = typename;
-        } else {
-            push_back(state, next_tok);
-            push_back(state, tok);
-            //handle parenthesized expression
-            node = parse_primary_expression(state);
-            if (!node) {
+            if (!match(tok, COMMA)) {
+                error(state, "Unexpected %s while parsing function call",
+                      token_names[tok.token_type]);
                 return 0;
             }
+            goto primary_arg;
         }
-    } else {
-        push_back(state, tok);
-        node = parse_primary_expression(state);
-    }
 
-    return node;
-}
+        primary_arg:
+            tok = get_next_parse_token(state);
+            HANDLE_BOGUS_TOKEN(tok);
+            if (tok.token_type == CLOSE_PAREN) {
+                goto primary_call_done;
+            }
+            unget_parse_token(state);
+            if (tok.token_type == OPEN_PAREN) {
+                CALL(PRIMARY_ARG_DONE, PRIMARY_START, PREC_NONE);
+            }
+            CALL(PRIMARY_ARG_DONE, BINOP_START, PREC_ASSIGN);
+
+        primary_call_done:
+            if (state->shared) {
+                intern_children(state, frame->node);
+            }
+            goto primary_postfix;
 
-static int is_level_binop(struct token token, int level) {
-    int i = 0;
-    while (binops[level][i]) {
-        if (token.token_type == binops[level][i++]) {
-            return 1;
+        primary_postfix:
+            tok = get_next_parse_token(state);
+            HANDLE_BOGUS_TOKEN(tok);
+            switch(tok.token_type) {
+            case OPEN_BRACKET:
+                if (peek_parse_token(state) == END_OF_EXPRESSION) {
+                    error(state, "Missing ] at end of input");
+                    return 0;
+                }
+                CALL(PRIMARY_SUBSCRIPT, BINOP_START, PREC_COMMA);
+            case OPEN_PAREN:
+                frame->prev_child = frame->node;
+                frame->node = make_binary_node(state, FUNCTION_CALL,
+                                               frame->node, 0);
+                goto primary_arg;
+            case ARROW:
+            case DOT:
+            {
+                enum token_type op = tok.token_type;
+                tok = get_next_parse_token(state);
+                HANDLE_BOGUS_TOKEN(tok);
+                if (!match(tok, LITERAL_OR_ID)) {
+                    error(state, "Expected identifier before %s token",
+                          token_names[tok.token_type]);
+                    return 0;
+                }
+                frame->node = make_binary_node(state, op, frame->node,
+                                               make_terminal_node(state, tok));
+                goto primary_postfix;
+            }
+            case DOUBLE_PLUS:
+                frame->node = make_binary_node(state, POSTINCREMENT,
+                                               frame->node, 0);
+                goto primary_postfix;
+            case DOUBLE_MINUS:
+                frame->node = make_binary_node(state, POSTDECREMENT,
+                                               frame->node, 0);
+                goto primary_postfix;
+            default:
+                //not part of a primary expression
+                unget_parse_token(state);
+                RETURN(frame->node);
+            }
         }
     }
-    return 0;
+    return ret;
 }
 
-/*
- * Binary operations are all parsed the same way, but they're divided
- * into a bunch of different precedence levels.
- */
-static struct parse_tree_node* parse_binop(struct parse_state *state, int level) {
-    struct parse_tree_node* node;
-    if (binops[level][0] == 0) {
-        node = parse_unop(state);
-        return node;
-    } else {
-        node = parse_binop(state, level + 1);
-        if (!node) {
-            return 0;
-        }
+#undef CALL
+#undef RETURN
+
+static struct parse_tree_node* parse_comma(struct parse_state *state) {
+    struct parse_stack* stack = state->stack;
+    stack->depth = 0;
+    if (!push_frame(state, BINOP_START, PREC_COMMA)) {
+        return 0;
     }
-    while(1) {
-        struct token tok = get_next_parse_token(state);
-        HANDLE_BOGUS_TOKEN(tok);
-        if (tok.token_type == END_OF_EXPRESSION) {
-            return node;
-        }
-        else if (tok.token_type == CLOSE_PAREN ||
-                 tok.token_type == CLOSE_BRACKET) {
-            push_back(state, tok);
-            return node;
-        }
-        if (!is_level_binop(tok, level)) {
-            push_back(state, tok);
-            return node;
-        }
-        struct parse_tree_node *right_node = parse_binop(state, level + 1);
-        if (!right_node) {
-            return 0;
+    struct parse_tree_node* node = run_parser(state);
+    if (!node && !state->too_deep) {
+        /* a failure anywhere inside a function call's arguments is
+           reported as the call's */
+        for (int i = 0; i < stack->depth - 1; ++i) {
+            if (stack->frames[i].step == PRIMARY_ARG_DONE) {
+                error(state, "Missing ) while parsing function call");
+                break;
+            }
         }
-        node = make_binary_node(state, tok.token_type, node, right_node);
     }
+    return node;
 }
-
-static struct parse_tree_node* parse_ternop(struct parse_state *state) {
-    struct parse_tree_node *left_node = parse_binop(state, 0);
-    if (!left_node) {
+/*
+  Parses a whole expression.  On error, returns 0 and leaves a
+  message (on the obstack) in state->error_message.
+ */
+static struct parse_tree_node* parse_expression(struct parse_state* state) {
+    if (peek_parse_token(state) == END_OF_EXPRESSION) {
+        error(state, "Empty expression");
         return 0;
     }
-
-    struct token tok = get_next_parse_token(state);
-    HANDLE_BOGUS_TOKEN(tok);
-    if (tok.token_type != QUESTION) {
-        push_back(state, tok);
-        return left_node;
-    }
-
-    struct parse_tree_node *mid_node = parse_ternop(state);
-    if (!mid_node) {
+    struct parse_tree_node* node = parse_comma(state);
+    if (!node) {
         return 0;
     }
-
-    tok = get_next_parse_token(state);
-    HANDLE_BOGUS_TOKEN(tok);
-    if (tok.token_type != COLON) {
-        error(state, "Missing : in ?: ternary op (found %s)",
+    struct token tok = get_next_parse_token(state);
+    if (tok.token_type != END_OF_EXPRESSION) {
+        error(state, "Unexpected %s at end of input",
               token_names[tok.token_type]);
         return 0;
     }
-    struct parse_tree_node* right_node = parse_ternop(state);
-    if (!right_node) {
-        return 0;
+    if (state->shared) {
+        node = intern_node(state, node, 0);
     }
-
-    struct parse_tree_node* new_right = make_binary_node(state, COLON, mid_node, right_node);
-    return make_binary_node(state, QUESTION, left_node, new_right);
+    return node;
 }
 
-static struct parse_tree_node* parse_assignop(struct parse_state *state) {
-    struct parse_tree_node *node = parse_ternop(state);
-    if (!node) {
-        return 0;
+/*
+  Parses string, putting the tree on obstack, which the result takes
+  ownership of.
+ */
+static struct parse_result* parse_on_obstack(struct obstack* obstack,
+                                             const char* string,
+                                             const struct typename_set*
+                                             typenames,
+                                             char** typename_list) {
+    struct token_buf tokens;
+    init_token_buf(&tokens);
+    lex_expression(&tokens, string);
+    struct parse_stack stack = {.frames = 0, .depth = 0, .allocated = 0,
+                                .max_depth = PARSE_DEFAULT_MAX_DEPTH};
+    struct parse_state state = make_parse_state(string, &tokens, obstack,
+                                                &stack, typenames,
+                                                typename_list);
+
+    struct parse_tree_node* node = parse_expression(&state);
+    struct parse_result* result = malloc(sizeof(struct parse_result));
+    if (node) {
+        result->is_error = false;
+        result->node = node;
+        result->obstack = obstack;
+    } else {
+        /* In the event of an error, we need to free the parse
+           tree nodes that we have allocated */
+        result->is_error = true;
+        result->error_message = strdup(state.error_message);
+        result->obstack = 0;
+        obstack_free(obstack, 0);
+        free(obstack);
     }
 
-    struct token tok = get_next_parse_token(state);
-    if (!is_assignop(tok)) {
-        push_back(state, tok);
-        return node;
-    }
+    free(stack.frames);
+    free_token_buf_contents(&tokens);
+    return result;
+}
 
-    struct parse_tree_node *right_node = parse_assignop(state);
-    if (!right_node) {
-        return 0;
-    }
+struct parse_result* parse_with_typenames(const char* string,
+                                          const struct typename_set*
+                                          typenames) {
+    struct obstack* obstack = malloc(sizeof(struct obstack));
+    obstack_init(obstack);
+    return parse_on_obstack(obstack, string, typenames, 0);
+}
 
-    node = make_binary_node(state, tok.token_type, node, right_node);
-    return node;
+struct parse_result* parse(const char* string, char** typenames) {
+    struct obstack* obstack = malloc(sizeof(struct obstack));
+    obstack_init(obstack);
+    return parse_on_obstack(obstack, string, 0, typenames);
 }
 
-static struct parse_tree_node* parse_comma(struct parse_state *state) {
-    struct parse_tree_node *node = parse_assignop(state);
-    if (!node)
-        return 0;
-    while (1) {
-        struct token tok = get_next_parse_token(state);
+struct parse_result* parse_copy(const char* string, char** typenames) {
+    struct obstack* obstack = malloc(sizeof(struct obstack));
+    obstack_init(obstack);
+    char* copy = obstack_strdup(obstack, string);
+    return parse_on_obstack(obstack, copy, 0, typenames);
+}
 
-        if (tok.token_type == END_OF_EXPRESSION ||
-            tok.token_type == CLOSE_PAREN ||
-            tok.token_type == CLOSE_BRACKET) {
-            push_back(state, tok);
-            return node;
-        }
-        if (!match(tok, COMMA)) {
-            error(state, "Unexpected %s", token_names[tok.token_type]);
-            return 0;
-        }
-        struct parse_tree_node *right_node = parse_assignop(state);
-        if (!right_node) {
-            return 0;
-        }
-        node = make_binary_node(state, COMMA, node, right_node);
-    }
+struct parser_ctx {
+    struct token_buf tokens;
+    struct obstack obstack;
+    struct obstack_chunk_cache chunk_cache;
+    /* first object on the obstack; each parse frees back to here */
+    void* mark;
+    struct parse_stack stack;
+    /* not owned by the context */
+    const struct typename_set* typenames;
+    bool hash_consing;
+    struct node_table shared;
+    struct parse_sharing_stats sharing;
+    struct parse_result result;
+};
+
+struct parser_ctx* parser_ctx_new(void) {
+    struct parser_ctx* ctx = malloc(sizeof(struct parser_ctx));
+    init_token_buf(&ctx->tokens);
+    obstack_init_cached(&ctx->obstack, &ctx->chunk_cache);
+    ctx->mark = obstack_alloc(&ctx->obstack, 0);
+    ctx->stack.frames = 0;
+    ctx->stack.depth = 0;
+    ctx->stack.allocated = 0;
+    ctx->stack.max_depth = PARSE_DEFAULT_MAX_DEPTH;
+    ctx->typenames = 0;
+    ctx->hash_consing = false;
+    ctx->shared.slots = 0;
+    ctx->shared.capacity = 0;
+    ctx->shared.count = 0;
+    ctx->sharing.nodes = 0;
+    ctx->sharing.unique_nodes = 0;
+    ctx->result.is_error = false;
+    ctx->result.node = 0;
+    ctx->result.obstack = 0;
+    return ctx;
 }
 
-static bool is_empty(struct parse_state* state) {
-    struct token tok = get_next_parse_token(state);
-    bool is_empty = match(tok, END_OF_EXPRESSION);
-    push_back(state, tok);
-    return is_empty;
+static void clear_ctx_result(struct parser_ctx* ctx) {
+    ctx->result.is_error = false;
+    ctx->result.node = 0;
 }
 
-struct parse_result* parse(const char* string, char** typenames) {
-    lex_buf lex_buf = start_lex(string);
-    struct parse_state state = make_parse_state(&lex_buf, typenames);
+void parser_ctx_free(struct parser_ctx* ctx) {
+    clear_ctx_result(ctx);
+    obstack_free(&ctx->obstack, 0);
+    obstack_chunk_cache_free(&ctx->chunk_cache);
+    free(ctx->stack.frames);
+    free(ctx->shared.slots);
+    free_token_buf_contents(&ctx->tokens);
+    free(ctx);
+}
 
-    struct parse_tree_node* node = 0;
-    if (is_empty(&state)) {
-        state.error_message = strdup("Empty expression");
-    } else {
-        node = parse_comma(&state);
+void parser_ctx_set_max_depth(struct parser_ctx* ctx, int max_depth) {
+    ctx->stack.max_depth = max_depth;
+}
+
+void parser_ctx_set_typenames(struct parser_ctx* ctx,
+                              const struct typename_set* typenames) {
+    ctx->typenames = typenames;
+}
+
+void parser_ctx_set_hash_consing(struct parser_ctx* ctx, bool hash_consing) {
+    ctx->hash_consing = hash_consing;
+}
+
+void parser_ctx_get_sharing_stats(struct parser_ctx* ctx,
+                                  struct parse_sharing_stats* stats) {
+    *stats = ctx->sharing;
+}
+
+struct parse_result* parser_ctx_parse(struct parser_ctx* ctx,
+                                      const char* string, char** typenames) {
+    clear_ctx_result(ctx);
+    obstack_free(&ctx->obstack, ctx->mark);
+    ctx->mark = obstack_alloc(&ctx->obstack, 0);
+    lex_expression(&ctx->tokens, string);
+
+    struct parse_state state = make_parse_state(string, &ctx->tokens,
+                                                &ctx->obstack, &ctx->stack,
+                                                ctx->typenames, typenames);
+    if (ctx->hash_consing) {
+        /* the last parse's nodes are gone */
+        if (ctx->shared.count) {
+            memset(ctx->shared.slots, 0,
+                   ctx->shared.capacity * sizeof(*ctx->shared.slots));
+            ctx->shared.count = 0;
+        }
+        state.shared = &ctx->shared;
     }
-    struct parse_result* result = malloc(sizeof(struct parse_result));
-    result->obstack = 0;
-    if (!node) {
-        result->is_error = true;
-        result->error_message = state.error_message;
-        free_parse_state(&state);
+    struct parse_tree_node* node = parse_expression(&state);
+    ctx->sharing.nodes = state.n_nodes;
+    ctx->sharing.unique_nodes = state.shared ? (long)ctx->shared.count
+        : state.n_nodes;
+    if (node) {
+        ctx->result.node = node;
     } else {
-        struct token tok = get_next_parse_token(&state);
-        if (tok.token_type == END_OF_EXPRESSION) {
-            result->is_error = false;
-            result->node = node;
-            result->obstack = state.obstack;
-        } else {
-            error(&state, "Unexpected %s at end of input",
-                  token_names[tok.token_type]);
-            result->is_error = true;
-            result->error_message = state.error_message;
-            free_parse_state(&state);
-        }
+        ctx->result.is_error = true;
+        ctx->result.error_message = state.error_message;
     }
-
-    done_lex(lex_buf);
-    return result;
+    return &ctx->result;
 }
 
 /*
-  Returns a pointer to the new end of the string.  Assumes
-  that the buffer has enough space for the string.
+  The printer walks the tree with its own stack, like the parser.
+  Each node is written as the text before its first child, the text
+  after each child, and the text after its last child.  Each of those
+  pieces is fixed text, the node's own text (for a node's start), then
+  more fixed text, so the output can be measured exactly before it's
+  written, and is written with memcpy.
  */
-char* write_tree_to_string(struct parse_tree_node* node, char* buf) {
-    switch (node->op) {
+struct print_piece {
+    const char* before;
+    int before_len;
+    bool text;
+    const char* after;
+    int after_len;
+};
+
+#define FIXED(s) s, sizeof(s) - 1
+
+static inline struct print_piece start_piece(enum token_type op) {
+    switch (op) {
     case DEREFERENCE:
     case REFERENCE:
     case UNARY_MINUS:
@@ -692,67 +1035,226 @@ char* write_tree_to_string(struct parse_tree_node* node, char* buf) {
     case PREINCREMENT:
     case PREDECREMENT:
         /* unary ops */
-        assert (node->first_child);
-        buf += sprintf(buf, "%s(", token_sigils[node->op]);
-        buf = write_tree_to_string(node->first_child, buf);
-        buf += sprintf(buf, ")");
-        break;
-
+        return (struct print_piece){token_sigils[op], token_sigil_lengths[op],
+                                    false, FIXED("(")};
     case TYPECAST:
-        buf += sprintf(buf, "((%s)", node->text);
-        assert(node->first_child);
-        assert(!node->first_child->next_sibling);
-        buf = write_tree_to_string(node->first_child, buf);
-        buf += sprintf(buf, ")");
-        break;
-
+        return (struct print_piece){FIXED("(("), true, FIXED(")")};
     case FUNCTION_CALL:
-    {
-        assert(node->first_child);
-        buf = write_tree_to_string(node->first_child, buf);
-        buf += sprintf(buf, "(");
-        struct parse_tree_node* cur = node->first_child->next_sibling;
-        while (cur) {
-            buf = write_tree_to_string(cur, buf);
-            cur = cur->next_sibling;
-            if (cur) {
-                buf += sprintf(buf, ",");
-            }
-        }
-        buf += sprintf(buf, ")");
+    case SUBSCRIPT:
+        return (struct print_piece){FIXED(""), false, FIXED("")};
+    case SIZEOF:
+        return (struct print_piece){FIXED("sizeof("), true, FIXED(")")};
+    case LITERAL_OR_ID:
+        return (struct print_piece){FIXED(""), true, FIXED("")};
+    default:
+        return (struct print_piece){FIXED("("), false, FIXED("")};
     }
-    break;
+}
 
+static inline struct print_piece after_child_piece(enum token_type op,
+                                                   bool first, bool last) {
+    struct print_piece piece = {FIXED(""), false, FIXED("")};
+    switch (op) {
+    case FUNCTION_CALL:
+        if (first) {
+            piece.before = "(";
+            piece.before_len = 1;
+        } else if (!last) {
+            piece.before = ",";
+            piece.before_len = 1;
+        }
+        break;
     case SUBSCRIPT:
-        assert(node->first_child);
-        assert(node->first_child->next_sibling);
-        buf = write_tree_to_string(node->first_child, buf);
-        buf += sprintf(buf, "[");
-        buf = write_tree_to_string(node->first_child->next_sibling, buf);
-        buf += sprintf(buf, "]");
+        if (first) {
+            piece.before = "[";
+            piece.before_len = 1;
+        }
         break;
-
-    case SIZEOF:
-        buf += sprintf(buf, "sizeof(%s)", node->text);
+    case DEREFERENCE:
+    case REFERENCE:
+    case UNARY_MINUS:
+    case TILDE:
+    case BANG:
+    case PREINCREMENT:
+    case PREDECREMENT:
+    case TYPECAST:
         break;
-
-    case LITERAL_OR_ID:
-        buf += sprintf(buf, "%s", node->text);
+    default:
+        if (first) {
+            piece.before = token_sigils[op];
+            piece.before_len = token_sigil_lengths[op];
+        }
         break;
+    }
+    return piece;
+}
 
+static inline struct print_piece end_piece(enum token_type op) {
+    switch (op) {
+    case SIZEOF:
+    case LITERAL_OR_ID:
+        return (struct print_piece){FIXED(""), false, FIXED("")};
+    case SUBSCRIPT:
+        return (struct print_piece){FIXED("]"), false, FIXED("")};
     default:
-        buf += sprintf(buf, "(");
-        if (node->first_child) {
-            buf = write_tree_to_string(node->first_child, buf);
+        return (struct print_piece){FIXED(")"), false, FIXED("")};
+    }
+}
+
+#undef FIXED
+
+static inline size_t piece_length(struct print_piece piece, int text_len) {
+    return piece.before_len + (piece.text ? text_len : 0) + piece.after_len;
+}
+
+static inline char* write_piece(struct print_piece piece, const char* text,
+                                int text_len, char* buf) {
+    memcpy(buf, piece.before, piece.before_len);
+    buf += piece.before_len;
+    if (piece.text) {
+        memcpy(buf, text, text_len);
+        buf += text_len;
+    }
+    memcpy(buf, piece.after, piece.after_len);
+    return buf + piece.after_len;
+}
+
+char* print_node_start(enum token_type op, const char* text, int text_len,
+                       char* buf) {
+    return write_piece(start_piece(op), text, text_len, buf);
+}
+
+char* print_after_child(enum token_type op, bool first, bool last,
+                        char* buf) {
+    return write_piece(after_child_piece(op, first, last), 0, 0, buf);
+}
+
+char* print_node_end(enum token_type op, char* buf) {
+    return write_piece(end_piece(op), 0, 0, buf);
+}
+
+size_t print_node_start_length(enum token_type op, int text_len) {
+    return piece_length(start_piece(op), text_len);
+}
+
+size_t print_after_child_length(enum token_type op, bool first, bool last) {
+    return piece_length(after_child_piece(op, first, last), 0);
+}
+
+size_t print_node_end_length(enum token_type op) {
+    return piece_length(end_piece(op), 0);
+}
+
+/*
+  Returns the length of node's string, and writes it to buf or sink
+  if either isn't NULL, so measuring and writing are the same walk.
+  A sink's buffer is written like buf, through a local pointer, and
+  only drained when a piece doesn't fit.
+ */
+static size_t print_tree(struct parse_tree_node* node, char* buf,
+                         struct sink* sink) {
+    /* the path from node down to the one being written; the stack
+       only goes to the heap for deep trees */
+    struct parse_tree_node* local_path[64];
+    struct parse_tree_node** path = local_path;
+    int allocated = sizeof(local_path) / sizeof(local_path[0]);
+    int depth = 0;
+    size_t len = 0;
+    char* buf_end = 0;
+    if (sink) {
+        buf = sink->buf + sink->len;
+        buf_end = sink->buf + SINK_BUFFER_SIZE;
+    }
+
+#define PRINT(piece, text, text_len)                                    \
+    do {                                                                \
+        struct print_piece piece_ = (piece);                            \
+        size_t piece_len_ = piece_length(piece_, (text_len));           \
+        len += piece_len_;                                              \
+        if (sink && piece_len_ > (size_t)(buf_end - buf)) {             \
+            sink->len = buf - sink->buf;                                \
+            sink_drain(sink);                                           \
+            if (piece_len_ > SINK_BUFFER_SIZE) {                        \
+                /* only a huge type name */                             \
+                sink_write(sink, piece_.before, piece_.before_len);     \
+                sink_write(sink, (text), (text_len));                   \
+                sink_write(sink, piece_.after, piece_.after_len);       \
+            }                                                           \
+            buf = sink->buf + sink->len;                                \
+            if (piece_len_ > SINK_BUFFER_SIZE) {                        \
+                break;                                                  \
+            }                                                           \
+        }                                                               \
+        if (buf) {                                                      \
+            buf = write_piece(piece_, (text), (text_len), buf);         \
+        }                                                               \
+    } while (0)
+
+    struct parse_tree_node* cur = node;
+    while (1) {
+        PRINT(start_piece(cur->op), cur->text, cur->text_len);
+        if (cur->first_child) {
+            if (depth == allocated) {
+                allocated *= 2;
+                if (path == local_path) {
+                    path = malloc(allocated * sizeof(*path));
+                    memcpy(path, local_path, sizeof(local_path));
+                } else {
+                    path = realloc(path, allocated * sizeof(*path));
+                }
+            }
+            path[depth++] = cur;
+            cur = cur->first_child;
+            continue;
+        }
+        PRINT(end_piece(cur->op), 0, 0);
+
+        /* go up until there's a next sibling to write */
+        while (depth) {
+            struct parse_tree_node* parent = path[depth - 1];
+            PRINT(after_child_piece(parent->op, cur == parent->first_child,
+                                    !cur->next_sibling), 0, 0);
+            if (cur->next_sibling) {
+                break;
+            }
+            PRINT(end_piece(parent->op), 0, 0);
+            cur = parent;
+            depth--;
         }
-        buf += sprintf(buf, "%s", token_sigils[node->op]);
-        struct parse_tree_node* cur = node->first_child->next_sibling;
-        while (cur) {
-            buf = write_tree_to_string(cur, buf);
-            cur = cur->next_sibling;
+        if (!depth) {
+            break;
         }
-        buf += sprintf(buf, ")");
-        break;
+        cur = cur->next_sibling;
     }
+#undef PRINT
+
+    if (sink) {
+        sink->len = buf - sink->buf;
+    }
+    if (path != local_path) {
+        free(path);
+    }
+    return len;
+}
+
+size_t tree_string_length(struct parse_tree_node* node) {
+    return print_tree(node, 0, 0);
+}
+
+char* write_tree_to_string(struct parse_tree_node* node, char* buf) {
+    buf += print_tree(node, buf, 0);
+    *buf = 0;
     return buf;
 }
+
+void write_tree_to_strbuf(struct parse_tree_node* node, struct strbuf* buf) {
+    size_t len = tree_string_length(node);
+    char* end = strbuf_reserve(buf, len);
+    print_tree(node, end, 0);
+    buf->len += len;
+    end[len] = 0;
+}
+
+void write_tree_to_sink(struct parse_tree_node* node, struct sink* sink) {
+    print_tree(node, 0, sink);
+}
@@ -2,12 +2,23 @@
 #define PARSE_H
 
 #include "lex.h"
+#include "sink.h"
+#include "strbuf.h"
+#include "typename_set.h"
 #include <obstack.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 struct parse_tree_node;
 
+/*
+  text is a slice of the parsed string, except for typecasts and
+  sizeof(type), where it's the type's tokens joined by spaces.  Either
+  way it isn't necessarily NUL-terminated; use text_len.
+ */
 struct parse_tree_node {
     enum token_type op;
+    int text_len;
     const char* text;
     struct parse_tree_node* first_child;
     struct parse_tree_node* next_sibling;
@@ -22,10 +33,123 @@ struct parse_result {
     struct obstack* obstack;
 };
 
+/*
+  The result's tree points into string, so string must outlive it.
+  typenames is a NULL-terminated list of names (besides C's built-in
+  types) that start a type, or NULL.
+ */
 struct parse_result* parse(const char* string, char** typenames);
 
+/*
+  Like parse, but with a prebuilt set of typenames (or NULL for just
+  the built-ins), which saves building one for each parse.
+ */
+struct parse_result* parse_with_typenames(const char* string,
+                                          const struct typename_set*
+                                          typenames);
+
+/*
+  Like parse, but copies string into the result first, so the caller
+  may free or reuse string while keeping the result.
+ */
+struct parse_result* parse_copy(const char* string, char** typenames);
+
+/*
+  Writes the tree fully parenthesized, NUL-terminated, returning a
+  pointer to the NUL.  buf must have room for tree_string_length
+  bytes and the NUL.
+ */
 char* write_tree_to_string(struct parse_tree_node* node, char* buf);
 
+/* The length of the tree's string, without the NUL */
+size_t tree_string_length(struct parse_tree_node* node);
+
+/* Appends the tree's string to buf, growing it by exactly that much */
+void write_tree_to_strbuf(struct parse_tree_node* node, struct strbuf* buf);
+
+/* Writes the tree's string to sink as it goes, without a NUL */
+void write_tree_to_sink(struct parse_tree_node* node, struct sink* sink);
+
+/*
+  The pieces write_tree_to_string is made of, for printing other
+  representations of the tree.  A node is printed as print_node_start,
+  then each child followed by print_after_child, then print_node_end.
+  Each returns the new end of the string, and doesn't NUL-terminate
+  it; the _length versions say how much each writes.
+ */
+char* print_node_start(enum token_type op, const char* text, int text_len,
+                       char* buf);
+char* print_after_child(enum token_type op, bool first, bool last,
+                        char* buf);
+char* print_node_end(enum token_type op, char* buf);
+size_t print_node_start_length(enum token_type op, int text_len);
+size_t print_after_child_length(enum token_type op, bool first, bool last);
+size_t print_node_end_length(enum token_type op);
+
 void free_parse_result_contents(struct parse_result *result);
 
+/* Frees result's contents and result itself, for results from parse */
+void free_parse_result(struct parse_result *result);
+
+/*
+  A parser context keeps its lexer and parse tree memory alive between
+  calls, for callers that parse many expressions in a row.
+ */
+struct parser_ctx;
+
+struct parser_ctx* parser_ctx_new(void);
+void parser_ctx_free(struct parser_ctx* ctx);
+
+/*
+  Like parse, but the result belongs to ctx: it is valid until the
+  next call to parser_ctx_parse or parser_ctx_free, and must not be
+  passed to free_parse_result_contents.  typenames, if given, are
+  recognized as well as the context's typename set.
+ */
+struct parse_result* parser_ctx_parse(struct parser_ctx* ctx,
+                                      const char* string, char** typenames);
+
+/*
+  Sets the typenames that parses through ctx use by default.  The set
+  must outlive ctx, or be replaced first.
+ */
+void parser_ctx_set_typenames(struct parser_ctx* ctx,
+                              const struct typename_set* typenames);
+
+/*
+  The parser keeps its own stack instead of recursing, so it can
+  handle any depth of nesting that fits in memory; expressions nested
+  deeper than the limit are rejected with an error instead.  Depth
+  is counted in parser frames: one per prefix or right-associative
+  operator still waiting for its operand, and two per open paren or
+  bracket.  parse and parse_copy use PARSE_DEFAULT_MAX_DEPTH.
+ */
+#define PARSE_DEFAULT_MAX_DEPTH (1 << 22)
+
+void parser_ctx_set_max_depth(struct parser_ctx* ctx, int max_depth);
+
+/*
+  With hash-consing on, parses through ctx share nodes: equal nodes
+  are made once, so the result is a DAG rather than a tree.  Since a
+  node's siblings are part of it, a subtree is shared whole only where
+  the operands after it match too (as the last argument, or the right
+  operand); below that its children are shared anyway.  Shared nodes
+  are reached once for each path to them, so the printers, compact
+  trees and SVGs come out as if nothing were shared.  Nodes must not
+  be modified.
+ */
+void parser_ctx_set_hash_consing(struct parser_ctx* ctx, bool hash_consing);
+
+/*
+  For the last parse through ctx: nodes is how many nodes the tree
+  would have without sharing, and unique_nodes how many there are.
+ */
+struct parse_sharing_stats {
+    long nodes;
+    long unique_nodes;
+};
+
+void parser_ctx_get_sharing_stats(struct parser_ctx* ctx,
+                                  struct parse_sharing_stats* stats);
+
 #endif
@@ -1,8 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "alloc_count.h"
+#include "compact_tree.h"
 #include "parse.h"
+#include "tree_file.h"
+#include "tree_format.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 struct testspec {
     const char* input;
@@ -80,6 +88,7 @@ struct testspec expected_failures[] = {
     {"a.*", "Expected identifier before * token"},
     {"-&a.*", "Expected identifier before * token"},
     {"(int)\001", "Bogus token '\001'"},
+    {"a+09", "Bogus token '09'"},
     {"a?b:c?d", "Missing : in ?: ternary op (found eof)"},
     {"a?b:c?d*", "Unexpected eof"},
     {"a=*", "Unexpected eof"},
@@ -91,7 +100,7 @@ struct testspec expected_failures[] = {
     {0, 0}
 };
 
-char* typenames[] = {"foo", "charmander"};
+char* typenames[] = {"foo", "charmander", 0};
 int test_typenames() {
     int bad = 0;
     char* test = "(charmander)a";
@@ -119,6 +128,85 @@ int test_typenames() {
     
 }
 
+/*
+  Builds a set of thousands of names, checks that it holds exactly
+  those and the built-ins, and parses through a context that uses it.
+ */
+int test_typename_set() {
+    int bad = 0;
+    int n_names = 5000;
+    char** names = malloc((n_names + 2) * sizeof(char*));
+    for (int i = 0; i < n_names; ++i) {
+        names[i] = malloc(16);
+        sprintf(names[i], "type%d_t", i);
+    }
+    names[n_names] = "type7_t";
+    names[n_names + 1] = 0;
+    struct typename_set* set = typename_set_new(names);
+
+    char name[16];
+    for (int i = 0; i < n_names * 2; ++i) {
+        sprintf(name, "type%d_t", i);
+        if (typename_set_contains(set, name, strlen(name)) != (i < n_names)) {
+            printf("Wrong typename set membership for %s\n", name);
+            bad++;
+        }
+    }
+    if (!typename_set_contains(set, "unsigned", 8) ||
+        !typename_set_contains(0, "unsigned", 8) ||
+        typename_set_contains(0, "type1_t", 7) ||
+        typename_set_contains(set, "type1", 5)) {
+        printf("Wrong typename set membership\n");
+        bad++;
+    }
+
+    struct parser_ctx* ctx = parser_ctx_new();
+    parser_ctx_set_typenames(ctx, set);
+    const char* exprs[][2] = {
+        {"(type4999_t)a", "((type4999_t)a)"},
+        {"(type12_t *)a", "((type12_t *)a)"},
+        {"(int)a", "((int)a)"},
+        {"(charmander)a", 0},
+    };
+    for (int i = 0; i < 4; ++i) {
+        struct parse_result* result = parser_ctx_parse(ctx, exprs[i][0], 0);
+        char buf[64];
+        if (!result->is_error) {
+            write_tree_to_string(result->node, buf);
+        }
+        if (exprs[i][1] ? result->is_error || strcmp(buf, exprs[i][1])
+            : !result->is_error) {
+            printf("Wrong result parsing %s with typename set\n",
+                   exprs[i][0]);
+            bad++;
+        }
+    }
+    /* a list passed to a parse adds to the set for that parse */
+    if (parser_ctx_parse(ctx, "(charmander)a", typenames)->is_error ||
+        parser_ctx_parse(ctx, "(type1_t)a", typenames)->is_error ||
+        !parser_ctx_parse(ctx, "(charmander)a", 0)->is_error) {
+        printf("Wrong result parsing with typename list and set\n");
+        bad++;
+    }
+    parser_ctx_free(ctx);
+
+    struct parse_result* result = parse_with_typenames("(type3_t)*p", set);
+    if (result->is_error) {
+        printf("Failed to parse with typename set: %s\n",
+               result->error_message);
+        bad++;
+    }
+    free_parse_result_contents(result);
+    free(result);
+
+    typename_set_free(set);
+    for (int i = 0; i < n_names; ++i) {
+        free(names[i]);
+    }
+    free(names);
+    return bad;
+}
+
 int test_parse_failures() {
     int bad = 0;
     for (struct testspec* spec = expected_failures; spec->input; spec++) {
@@ -147,30 +235,705 @@ int test_parse_failures() {
     return bad;
 }
 
+int test_parse_copy() {
+    int bad = 0;
+    char input[] = "(unsigned int)foo->bar";
+    struct parse_result* result = parse_copy(input, 0);
+    memset(input, 'x', sizeof(input) - 1);
+    char buf[64];
+    write_tree_to_string(result->node, buf);
+    if (strcmp(buf, "((unsigned int)(foo->bar))")) {
+        printf("Bad parse with parse_copy: %s\n", buf);
+        bad++;
+    }
+    free_parse_result_contents(result);
+    free(result);
+    return bad;
+}
+
+/*
+  Converts each spec's tree to a compact tree, and checks that it
+  prints the same, and still does after being copied with memcpy.
+ */
+int test_compact_tree() {
+    int bad = 0;
+    if (sizeof(struct compact_node) != 16) {
+        printf("Compact nodes are %zu bytes\n", sizeof(struct compact_node));
+        bad++;
+    }
+    for (struct testspec* spec = specs; spec->input; spec++) {
+        struct parse_result* result = parse_copy(spec->input, 0);
+        struct compact_tree* tree = compact_tree_new(result->node,
+                                                     spec->input);
+        size_t len = compact_tree_string_length(tree);
+        char* buf = malloc(len + 1);
+        write_compact_tree_to_string(tree, buf);
+        if (strcmp(buf, spec->output) || len != strlen(spec->output)) {
+            printf("Bad compact tree for %s: expected %s, got %s\n",
+                   spec->input, spec->output, buf);
+            bad++;
+        }
+
+        size_t size = tree->n_nodes * sizeof(struct compact_node)
+            + tree->text_size;
+        struct compact_tree copy = *tree;
+        copy.nodes = malloc(size);
+        memcpy(copy.nodes, tree->nodes, size);
+        copy.text = (char*)(copy.nodes + copy.n_nodes);
+        compact_tree_free(tree);
+        free_parse_result_contents(result);
+        free(result);
+
+        write_compact_tree_to_string(&copy, buf);
+        if (strcmp(buf, spec->output)) {
+            printf("Bad copied compact tree for %s: got %s\n",
+                   spec->input, buf);
+            bad++;
+        }
+        free(copy.nodes);
+        free(buf);
+    }
+    return bad;
+}
+
+/*
+  Writes each spec's tree to a file and maps it back, then checks
+  that damaged files are rejected.
+ */
+int test_tree_file() {
+    int bad = 0;
+    char path[] = "/tmp/parsetest.XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    const char* error;
+    for (struct testspec* spec = specs; spec->input; spec++) {
+        struct parse_result* result = parse(spec->input, 0);
+        struct compact_tree* tree = compact_tree_new(result->node,
+                                                     spec->input);
+        if (tree_file_write(tree, path)) {
+            printf("Failed to write tree file for %s\n", spec->input);
+            bad++;
+        }
+        compact_tree_free(tree);
+        free_parse_result_contents(result);
+        free(result);
+
+        struct tree_file* file = tree_file_map(path, &error);
+        if (!file) {
+            printf("Failed to map tree file for %s: %s\n", spec->input,
+                   error);
+            bad++;
+            continue;
+        }
+        char* buf = malloc(strlen(spec->input) * 3 + 1);
+        write_compact_tree_to_string(&file->tree, buf);
+        if (strcmp(buf, spec->output)) {
+            printf("Bad tree file for %s: got %s\n", spec->input, buf);
+            bad++;
+        }
+        free(buf);
+        tree_file_unmap(file);
+    }
+
+    /* the file now holds the last spec; damage copies of it */
+    struct tree_file* file = tree_file_map(path, &error);
+    size_t size = file->map_size;
+    uint32_t* data = malloc(size);
+    const char* expected_errors[] = {
+        "not a tree file",
+        "unsupported tree file version",
+        "tree file sections out of bounds",
+        "bad link in tree file",
+        "file too short for a tree file header",
+        "bad link in tree file",
+        "bad link in tree file",
+    };
+    for (int i = 0; i < 7; ++i) {
+        memcpy(data, file->map, size);
+        struct tree_file_header* header = (struct tree_file_header*)data;
+        struct compact_node* nodes =
+            (struct compact_node*)((char*)data + header->nodes_offset);
+        size_t damaged_size = size;
+        switch (i) {
+        case 0: header->magic[0] = 'X'; break;
+        case 1: header->version++; break;
+        case 2: header->text_size++; break;
+        case 3: nodes[0].first_child = 0; nodes[0].next_sibling = 0;
+            nodes[header->n_nodes - 1].first_child = 1; break;
+        case 4: damaged_size = 10; break;
+        /*
+          links that only go forward, but not in a tree in preorder:
+          p = .1's .1 as p's child as well as its sibling, and the
+          root's first child skipping p
+         */
+        case 5: nodes[1].first_child = 2; break;
+        case 6: nodes[0].first_child = 2; break;
+        }
+        struct compact_tree tree;
+        if (!tree_file_read(data, damaged_size, &tree, &error) ||
+            strcmp(error, expected_errors[i])) {
+            printf("Damaged tree file %d not rejected as expected\n", i);
+            bad++;
+        }
+    }
+    free(data);
+    tree_file_unmap(file);
+    unlink(path);
+
+    if (tree_file_map(path, &error)) {
+        printf("Mapped a missing tree file\n");
+        bad++;
+    }
+    return bad;
+}
+
+/*
+  Parse all the specs (and failures) through one context, to check
+  that nothing leaks from one parse into the next.
+ */
+int test_parser_ctx() {
+    int bad = 0;
+    struct parser_ctx* ctx = parser_ctx_new();
+    for (struct testspec* spec = specs; spec->input; spec++) {
+        struct parse_result* result = parser_ctx_parse(ctx, spec->input, 0);
+        if (result->is_error) {
+            printf("Failed to parse %s with context: %s\n", spec->input,
+                   result->error_message);
+            bad++;
+            continue;
+        }
+        char* buf = malloc(strlen(spec->input) * 3 + 1);
+        write_tree_to_string(result->node, buf);
+        if (strcmp(buf, spec->output)) {
+            bad++;
+            printf("Bad parse of %s with context: expected %s, got %s\n",
+                   spec->input, spec->output, buf);
+        }
+        free(buf);
+
+        struct testspec* failure = expected_failures +
+            (spec - specs) % (sizeof(expected_failures) /
+                              sizeof(expected_failures[0]) - 1);
+        result = parser_ctx_parse(ctx, failure->input, 0);
+        if (!result->is_error ||
+            strcmp(result->error_message, failure->output)) {
+            printf("Wrong result parsing %s with context\n", failure->input);
+            bad++;
+        }
+    }
+    parser_ctx_free(ctx);
+    return bad;
+}
+
+/*
+  Hash-consed parses print the same as plain ones, and repeated
+  subexpressions come out as one node.
+ */
+int test_hash_consing() {
+    int bad = 0;
+    struct parser_ctx* ctx = parser_ctx_new();
+    parser_ctx_set_hash_consing(ctx, true);
+    for (struct testspec* spec = specs; spec->input; spec++) {
+        struct parse_result* result = parser_ctx_parse(ctx, spec->input, 0);
+        if (result->is_error) {
+            printf("Failed to parse %s with hash-consing: %s\n", spec->input,
+                   result->error_message);
+            bad++;
+            continue;
+        }
+        char* buf = malloc(strlen(spec->input) * 3 + 1);
+        write_tree_to_string(result->node, buf);
+        if (strcmp(buf, spec->output)) {
+            bad++;
+            printf("Bad parse of %s with hash-consing: expected %s, got %s\n",
+                   spec->input, spec->output, buf);
+        }
+        free(buf);
+    }
+
+    /* the two ?: operands, and the x->a under both b's */
+    struct parse_result* result =
+        parser_ctx_parse(ctx, "c ? f(x->a.b, y) : f(x->a.b, y)", 0);
+    struct parse_tree_node* colon = result->node->first_child->next_sibling;
+    struct parse_tree_node* then = colon->first_child;
+    struct parse_tree_node* otherwise = then->next_sibling;
+    if (then->first_child != otherwise->first_child) {
+        printf("Repeated call not shared\n");
+        bad++;
+    }
+    result = parser_ctx_parse(ctx, "x->a.b + x->a.b", 0);
+    struct parse_tree_node* left = result->node->first_child;
+    struct parse_tree_node* right = left->next_sibling;
+    if (left->first_child != right->first_child) {
+        printf("Repeated x->a not shared\n");
+        bad++;
+    }
+    struct parse_sharing_stats stats;
+    parser_ctx_get_sharing_stats(ctx, &stats);
+    if (stats.nodes != 11 || stats.unique_nodes != 7) {
+        printf("Sharing stats for x->a.b + x->a.b: %ld nodes, %ld unique\n",
+               stats.nodes, stats.unique_nodes);
+        bad++;
+    }
+
+    parser_ctx_set_hash_consing(ctx, false);
+    parser_ctx_parse(ctx, "x->a.b + x->a.b", 0);
+    parser_ctx_get_sharing_stats(ctx, &stats);
+    if (stats.nodes != 11 || stats.unique_nodes != 11) {
+        printf("Sharing stats without hash-consing: %ld nodes, %ld unique\n",
+               stats.nodes, stats.unique_nodes);
+        bad++;
+    }
+    parser_ctx_free(ctx);
+    return bad;
+}
+
+/* prefix * depth, middle, suffix * depth */
+static char* nest(const char* prefix, const char* middle, const char* suffix,
+                  int depth) {
+    size_t prefix_len = strlen(prefix);
+    size_t suffix_len = strlen(suffix);
+    char* str = malloc((prefix_len + suffix_len) * depth + strlen(middle) + 1);
+    char* end = str;
+    for (int i = 0; i < depth; ++i) {
+        memcpy(end, prefix, prefix_len);
+        end += prefix_len;
+    }
+    end = stpcpy(end, middle);
+    for (int i = 0; i < depth; ++i) {
+        memcpy(end, suffix, suffix_len);
+        end += suffix_len;
+    }
+    *end = 0;
+    return str;
+}
+
+/*
+  Once a context has parsed everything once, parsing (and printing)
+  it all again shouldn't allocate at all, with hash-consing or
+  without.
+ */
+int test_parser_ctx_allocations() {
+    int bad = 0;
+    struct parser_ctx* ctx = parser_ctx_new();
+    struct typename_set* set = typename_set_new(typenames);
+    parser_ctx_set_typenames(ctx, set);
+    char buf[1024];
+    /* big enough to need many obstack chunks */
+    char* long_expr = nest("f(a,-", "b", ")+x", 1000);
+    long allocations = 0;
+    for (int pass = 0; pass < 3; ++pass) {
+        parser_ctx_set_hash_consing(ctx, pass != 1);
+        long before = alloc_count_allocations();
+        parser_ctx_parse(ctx, long_expr, 0);
+        for (struct testspec* spec = specs; spec->input; spec++) {
+            struct parse_result* result = parser_ctx_parse(ctx, spec->input,
+                                                           0);
+            if (!result->is_error) {
+                write_tree_to_string(result->node, buf);
+            }
+        }
+        for (struct testspec* spec = expected_failures; spec->input; spec++) {
+            parser_ctx_parse(ctx, spec->input, typenames);
+        }
+        allocations = alloc_count_allocations() - before;
+    }
+    if (allocations) {
+        printf("Parsing with a warm context made %ld allocations\n",
+               allocations);
+        bad++;
+    }
+    parser_ctx_free(ctx);
+    typename_set_free(set);
+    free(long_expr);
+    return bad;
+}
+
+struct deep_spec {
+    const char* prefix;
+    const char* middle;
+    const char* suffix;
+    const char* output_prefix;
+    const char* output_middle;
+    const char* output_suffix;
+};
+
+struct deep_spec deep_specs[] = {
+    {"(", "x", ")", "", "x", ""},
+    {"- ", "x", "", "-(", "x", ")"},
+    {"(int)", "x", "", "((int)", "x", ")"},
+    {"a=", "b", "", "(a=", "b", ")"},
+    {"f(", "x", ")", "f(", "x", ")"},
+    {"t[", "i", "]", "t[", "i", "]"},
+    {0, 0, 0, 0, 0, 0}
+};
+
+#define DEEP 1000000
+
+/*
+  Parses and prints million-deep expressions.  This runs on a thread
+  with a small stack, so anything that recursed per level would
+  crash.
+ */
+void* test_deep_nesting(void* arg) {
+    int* bad = arg;
+    struct parser_ctx* ctx = parser_ctx_new();
+    for (struct deep_spec* spec = deep_specs; spec->prefix; spec++) {
+        char* input = nest(spec->prefix, spec->middle, spec->suffix, DEEP);
+        char* expected = nest(spec->output_prefix, spec->output_middle,
+                              spec->output_suffix, DEEP);
+        struct parse_result* result = parser_ctx_parse(ctx, input, 0);
+        if (result->is_error) {
+            printf("Failed to parse deep %s%s%s: %s\n", spec->prefix,
+                   spec->middle, spec->suffix, result->error_message);
+            (*bad)++;
+        } else {
+            char* buf = malloc(strlen(input) * 3 + 1);
+            write_tree_to_string(result->node, buf);
+            if (strcmp(buf, expected)) {
+                printf("Bad parse of deep %s%s%s\n", spec->prefix,
+                       spec->middle, spec->suffix);
+                (*bad)++;
+            }
+            struct compact_tree* tree = compact_tree_new(result->node, input);
+            write_compact_tree_to_string(tree, buf);
+            if (strcmp(buf, expected)) {
+                printf("Bad compact tree of deep %s%s%s\n", spec->prefix,
+                       spec->middle, spec->suffix);
+                (*bad)++;
+            }
+            compact_tree_free(tree);
+            free(buf);
+
+            /* and emitting, which doesn't recurse either */
+            struct strbuf json = {0};
+            struct sink sink;
+            sink_init_strbuf(&sink, &json);
+            emit_tree(&tree_format_json, result->node, &sink);
+            sink_close(&sink);
+            if (strncmp(json.data, "{\"kind\":", 8) ||
+                json.data[json.len - 1] != '}') {
+                printf("Bad JSON for deep %s%s%s\n", spec->prefix,
+                       spec->middle, spec->suffix);
+                (*bad)++;
+            }
+            strbuf_free(&json);
+        }
+        free(input);
+        free(expected);
+    }
+    parser_ctx_free(ctx);
+    return 0;
+}
+
+int test_depth_limit() {
+    int bad = 0;
+    struct parser_ctx* ctx = parser_ctx_new();
+    parser_ctx_set_max_depth(ctx, 1000);
+
+    char* input = nest("(", "x", ")", 400);
+    struct parse_result* result = parser_ctx_parse(ctx, input, 0);
+    if (result->is_error) {
+        printf("Failed to parse within depth limit: %s\n",
+               result->error_message);
+        bad++;
+    }
+    free(input);
+
+    const char* too_deep[][3] = {{"(", "x", ")"}, {"f(", "x", ")"},
+                                 {"- ", "x", ""}};
+    for (int i = 0; i < 3; ++i) {
+        input = nest(too_deep[i][0], too_deep[i][1], too_deep[i][2], 1200);
+        result = parser_ctx_parse(ctx, input, 0);
+        if (!result->is_error ||
+            strcmp(result->error_message, "Expression too deeply nested")) {
+            printf("Wrong result parsing past the depth limit: %s\n",
+                   result->is_error ? result->error_message : "no error");
+            bad++;
+        }
+        free(input);
+    }
+
+    /* a lower limit holds even once the stack has grown past it */
+    parser_ctx_set_max_depth(ctx, 5000);
+    input = nest("(", "x", ")", 2000);
+    result = parser_ctx_parse(ctx, input, 0);
+    if (result->is_error) {
+        printf("Failed to parse within a raised depth limit: %s\n",
+               result->error_message);
+        bad++;
+    }
+    free(input);
+    parser_ctx_set_max_depth(ctx, 50);
+    input = nest("(", "x", ")", 500);
+    result = parser_ctx_parse(ctx, input, 0);
+    if (!result->is_error) {
+        printf("Parsed past a lowered depth limit\n");
+        bad++;
+    }
+    free(input);
+    parser_ctx_free(ctx);
+    return bad;
+}
+
+/*
+  Printing through a sink, to a strbuf and to a file, across many
+  flushes; and the sink's own paths for big writes and failures.
+ */
+int test_tree_sink() {
+    int bad = 0;
+
+    struct strbuf streamed = {0};
+    struct strbuf expected = {0};
+    struct sink sink;
+    sink_init_strbuf(&sink, &streamed);
+    for (struct testspec* spec = specs; spec->input; spec++) {
+        struct parse_result* result = parse(spec->input, 0);
+        if (!result->is_error) {
+            write_tree_to_sink(result->node, &sink);
+            write_tree_to_strbuf(result->node, &expected);
+        }
+        free_parse_result_contents(result);
+        free(result);
+    }
+    if (sink_close(&sink) || streamed.len != expected.len ||
+        memcmp(streamed.data, expected.data, expected.len)) {
+        printf("Bad sink output for the specs\n");
+        bad++;
+    }
+    strbuf_free(&streamed);
+    strbuf_free(&expected);
+
+    /* several times the buffer size */
+    char* input = nest("f(a, ", "b", ")", 20000);
+    struct parse_result* result = parse(input, 0);
+    char* buf = malloc(tree_string_length(result->node) + 1);
+    write_tree_to_string(result->node, buf);
+    FILE* file = tmpfile();
+    /* keeping a copy, as expr.cgi does for its cache */
+    struct strbuf copy = {0};
+    sink_init_fd_copy(&sink, fileno(file), &copy);
+    write_tree_to_sink(result->node, &sink);
+    /* longer than the buffer, so past what vsnprintf can put there */
+    sink_printf(&sink, "%s", buf);
+    /* big enough to skip the buffer */
+    sink_write(&sink, buf, strlen(buf));
+    if (sink_close(&sink)) {
+        printf("Failed to write to a file through a sink\n");
+        bad++;
+    }
+    size_t len = strlen(buf);
+    char* contents = malloc(3 * len + 1);
+    rewind(file);
+    size_t n_read = fread(contents, 1, 3 * len + 1, file);
+    if (n_read != 3 * len || memcmp(contents, buf, len) ||
+        memcmp(contents + len, buf, len) ||
+        memcmp(contents + 2 * len, buf, len)) {
+        printf("Bad sink output to a file\n");
+        bad++;
+    }
+    if (copy.len != n_read || memcmp(copy.data, contents, n_read)) {
+        printf("Bad copy of sink output to a file\n");
+        bad++;
+    }
+    fclose(file);
+    strbuf_free(&copy);
+    free(contents);
+    free(buf);
+    free(input);
+    free_parse_result_contents(result);
+    free(result);
+
+    /* an identifier too big for the buffer on its own */
+    input = malloc(SINK_BUFFER_SIZE * 2 + 8);
+    strcpy(input, "a + ");
+    memset(input + 4, 'x', SINK_BUFFER_SIZE * 2);
+    input[SINK_BUFFER_SIZE * 2 + 4] = 0;
+    result = parse(input, 0);
+    buf = malloc(tree_string_length(result->node) + 1);
+    write_tree_to_string(result->node, buf);
+    struct strbuf huge = {0};
+    sink_init_strbuf(&sink, &huge);
+    write_tree_to_sink(result->node, &sink);
+    if (sink_close(&sink) || strcmp(huge.data, buf)) {
+        printf("Bad sink output for a huge identifier\n");
+        bad++;
+    }
+    strbuf_free(&huge);
+    free(buf);
+    free(input);
+    free_parse_result_contents(result);
+    free(result);
+
+    /* writing to a read-only descriptor fails, and keeps failing */
+    file = fopen("/dev/null", "r");
+    sink_init_fd(&sink, fileno(file));
+    sink_puts(&sink, "x");
+    if (sink_flush(&sink) != -1) {
+        printf("Sink flush to a read-only file succeeded\n");
+        bad++;
+    }
+    sink_puts(&sink, "y");
+    if (sink_close(&sink) != -1) {
+        printf("Sink close after a failed write succeeded\n");
+        bad++;
+    }
+    fclose(file);
+    return bad;
+}
+
+struct format_spec {
+    const char* input;
+    const char* json;
+    const char* sexpr;
+};
+
+struct format_spec format_specs[] = {
+    {"a",
+     "{\"kind\":\"literal\",\"text\":\"a\"}",
+     "(\"literal\" \"a\")"},
+    {"a + -b",
+     "{\"kind\":\"+\",\"children\":[{\"kind\":\"literal\",\"text\":\"a\"},"
+     "{\"kind\":\"-\",\"children\":[{\"kind\":\"literal\",\"text\":\"b\"}]}]}",
+     "(\"+\" (\"literal\" \"a\") (\"-\" (\"literal\" \"b\")))"},
+    {"f()",
+     "{\"kind\":\"(function call)\",\"children\":"
+     "[{\"kind\":\"literal\",\"text\":\"f\"}]}",
+     "(\"(function call)\" (\"literal\" \"f\"))"},
+    {"sizeof(int) * (char)c",
+     "{\"kind\":\"*\",\"children\":[{\"kind\":\"sizeof\",\"text\":\"int\"},"
+     "{\"kind\":\"(typecast)\",\"text\":\"char\",\"children\":"
+     "[{\"kind\":\"literal\",\"text\":\"c\"}]}]}",
+     "(\"*\" (\"sizeof\" \"int\") (\"(typecast)\" \"char\" (\"literal\" \"c\")))"},
+    /* quotes, backslashes and control characters in strings */
+    {"\"\\\"\t\x01\"",
+     "{\"kind\":\"literal\",\"text\":\"\\\"\\\\\\\"\\t\\u0001\\\"\"}",
+     "(\"literal\" \"\\\"\\\\\\\"\t\x01\\\"\")"},
+    /*
+      bytes that aren't UTF-8 (a stray byte, an overlong form and a
+      cut-off sequence) around ones that are
+     */
+    {"\"\xff\xc3\xa9\xe0\x80\xe2\x82\"",
+     "{\"kind\":\"literal\",\"text\":"
+     "\"\\\"\\ufffd\xc3\xa9\\ufffd\\ufffd\\ufffd\\ufffd\\\"\","
+     "\"invalid_utf8\":true}",
+     "(\"literal\" \"\\\"\xff\xc3\xa9\xe0\x80\xe2\x82\\\"\")"},
+    {0}
+};
+
+/* Emitting trees as JSON and S-expressions, and finding formats */
+int test_tree_formats() {
+    int bad = 0;
+    for (struct format_spec* spec = format_specs; spec->input; spec++) {
+        struct parse_result* result = parse(spec->input, 0);
+        if (result->is_error) {
+            printf("Failed to parse %s: %s\n", spec->input,
+                   result->error_message);
+            bad++;
+            free_parse_result_contents(result);
+            free(result);
+            continue;
+        }
+        const struct tree_emitter* formats[] = {&tree_format_json,
+                                                &tree_format_sexpr};
+        const char* expected[] = {spec->json, spec->sexpr};
+        for (int i = 0; i < 2; ++i) {
+            struct strbuf out = {0};
+            struct sink sink;
+            sink_init_strbuf(&sink, &out);
+            emit_tree(formats[i], result->node, &sink);
+            sink_close(&sink);
+            if (strcmp(out.data, expected[i])) {
+                printf("Bad %s for %s: expected %s, got %s\n",
+                       formats[i]->name, spec->input, expected[i], out.data);
+                bad++;
+            }
+            strbuf_free(&out);
+        }
+        free_parse_result_contents(result);
+        free(result);
+    }
+
+    if (find_tree_format("json") != &tree_format_json ||
+        find_tree_format("sexpr") != &tree_format_sexpr ||
+        find_tree_format("text") != &tree_format_text ||
+        find_tree_format("svg")) {
+        printf("Wrong formats found by name\n");
+        bad++;
+    }
+
+    /* text goes through the printer */
+    struct parse_result* result = parse("a*(b+c)", 0);
+    struct strbuf out = {0};
+    struct sink sink;
+    sink_init_strbuf(&sink, &out);
+    emit_tree(&tree_format_text, result->node, &sink);
+    sink_close(&sink);
+    if (strcmp(out.data, "(a*(b+c))")) {
+        printf("Bad text format: %s\n", out.data);
+        bad++;
+    }
+    strbuf_free(&out);
+    free_parse_result_contents(result);
+    free(result);
+    return bad;
+}
+
 int main() {
     int bad = 0;
 
+    /* every spec's output, one after another */
+    struct strbuf all = {0};
     for (struct testspec* spec = specs; spec->input; spec++) {
-        int len = strlen(spec->input);
-        char* buf = malloc(len * 3 + 1);
+        char* buf = 0;
         struct parse_result* result = parse(spec->input, 0);
         if (result->is_error) {
             printf("Failed to parse %s: %s\n", spec->input, result->error_message);
             goto end_of_loop;
         }
-        write_tree_to_string(result->node, buf);
-        if (strcmp(buf, spec->output)) {
+        /* exactly the right size, which valgrind or ASan would check */
+        size_t len = tree_string_length(result->node);
+        buf = malloc(len + 1);
+        char* end = write_tree_to_string(result->node, buf);
+        if (strcmp(buf, spec->output) || end != buf + len) {
             bad++;
             printf("Bad parse of %s: expected %s, got %s\n", spec->input, spec->output, buf);
         }
+        size_t old_len = all.len;
+        write_tree_to_strbuf(result->node, &all);
+        if (all.len != old_len + len || strcmp(all.data + old_len, buf)) {
+            bad++;
+            printf("Bad strbuf output for %s\n", spec->input);
+        }
     end_of_loop:
         free_parse_result_contents(result);
         free(result);
         free(buf);
         continue;
     }
+    strbuf_free(&all);
 
     bad += test_parse_failures();
+    bad += test_parser_ctx();
+    bad += test_parser_ctx_allocations();
+    bad += test_hash_consing();
+    bad += test_parse_copy();
+    bad += test_compact_tree();
+    bad += test_tree_file();
+    bad += test_typenames();
+    bad += test_typename_set();
+    bad += test_depth_limit();
+    bad += test_tree_sink();
+    bad += test_tree_formats();
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    pthread_t thread;
+    pthread_create(&thread, &attr, test_deep_nesting, &bad);
+    pthread_join(thread, 0);
+    pthread_attr_destroy(&attr);
+
     if (bad) {
         printf ("%d failed tests\n", bad);
         return 1;
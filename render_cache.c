@@ -0,0 +1,371 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "render_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ENTRY_MAGIC "cexpr-cache 1 "
+
+struct render_cache {
+    char* dir;
+    long max_bytes;
+    int stats_fd;
+};
+
+/* the key: expr, typenames and options, each NUL-terminated */
+struct cache_key {
+    char* text;
+    size_t len;
+    uint64_t hash;
+};
+
+/* FNV-1a */
+static uint64_t hash_key(const char* text, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static struct cache_key make_key(const char* expr, const char* typenames,
+                                 const char* options) {
+    const char* parts[] = {expr, typenames ? typenames : "",
+                           options ? options : ""};
+    struct cache_key key;
+    key.len = 0;
+    for (int i = 0; i < 3; ++i) {
+        key.len += strlen(parts[i]) + 1;
+    }
+    key.text = malloc(key.len);
+    char* end = key.text;
+    for (int i = 0; i < 3; ++i) {
+        end = stpcpy(end, parts[i]) + 1;
+    }
+    key.hash = hash_key(key.text, key.len);
+    return key;
+}
+
+static char* entry_path(struct render_cache* cache, uint64_t hash) {
+    char* path = malloc(strlen(cache->dir) + 32);
+    sprintf(path, "%s/%02x/%016llx", cache->dir, (unsigned)(hash >> 56),
+            (unsigned long long)hash);
+    return path;
+}
+
+struct render_cache* render_cache_open(const char* dir, long max_bytes) {
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        return 0;
+    }
+    char* stats_path = malloc(strlen(dir) + 8);
+    sprintf(stats_path, "%s/stats", dir);
+    int stats_fd = open(stats_path, O_RDWR | O_CREAT, 0644);
+    free(stats_path);
+    if (stats_fd < 0) {
+        return 0;
+    }
+
+    struct render_cache* cache = malloc(sizeof(struct render_cache));
+    cache->dir = strdup(dir);
+    cache->max_bytes = max_bytes;
+    cache->stats_fd = stats_fd;
+    return cache;
+}
+
+void render_cache_close(struct render_cache* cache) {
+    close(cache->stats_fd);
+    free(cache->dir);
+    free(cache);
+}
+
+/*
+  The stats file is read and rewritten whole, under an exclusive
+  lock that the caller holds.
+ */
+static void read_stats(struct render_cache* cache,
+                       struct render_cache_stats* stats) {
+    char buf[256];
+    ssize_t len = pread(cache->stats_fd, buf, sizeof(buf) - 1, 0);
+    buf[len > 0 ? len : 0] = 0;
+    stats->hits = stats->misses = stats->bytes = 0;
+    sscanf(buf, "hits %ld\nmisses %ld\nbytes %ld\n", &stats->hits,
+           &stats->misses, &stats->bytes);
+}
+
+static void write_stats(struct render_cache* cache,
+                        struct render_cache_stats* stats) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "hits %ld\nmisses %ld\nbytes %ld\n",
+                       stats->hits, stats->misses, stats->bytes);
+    if (pwrite(cache->stats_fd, buf, len, 0) == len) {
+        if (ftruncate(cache->stats_fd, len)) {
+            /* a longer old file leaves junk after the counts, which
+               read_stats ignores */
+        }
+    }
+}
+
+int render_cache_get_stats(struct render_cache* cache,
+                           struct render_cache_stats* stats) {
+    if (flock(cache->stats_fd, LOCK_SH)) {
+        return -1;
+    }
+    read_stats(cache, stats);
+    flock(cache->stats_fd, LOCK_UN);
+    return 0;
+}
+
+static void count_lookup(struct render_cache* cache, bool hit) {
+    if (flock(cache->stats_fd, LOCK_EX)) {
+        return;
+    }
+    struct render_cache_stats stats;
+    read_stats(cache, &stats);
+    if (hit) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+    }
+    write_stats(cache, &stats);
+    flock(cache->stats_fd, LOCK_UN);
+}
+
+/* Reads the whole file, returning a malloced buffer, or NULL */
+static char* read_file(int fd, size_t* size) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+        return 0;
+    }
+    char* data = malloc(st.st_size + 1);
+    size_t used = 0;
+    while (used < (size_t)st.st_size) {
+        ssize_t len = read(fd, data + used, st.st_size - used);
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            free(data);
+            return 0;
+        }
+        used += len;
+    }
+    data[used] = 0;
+    *size = used;
+    return data;
+}
+
+/*
+  An entry is ENTRY_MAGIC, the key's length in decimal and a newline,
+  then the key, then the data.  Returns the data's offset in the
+  entry if the entry is for key, or 0.
+ */
+static size_t match_entry(const char* entry, size_t size,
+                          struct cache_key* key) {
+    size_t magic_len = strlen(ENTRY_MAGIC);
+    if (size < magic_len || memcmp(entry, ENTRY_MAGIC, magic_len)) {
+        return 0;
+    }
+    char* end;
+    unsigned long key_len = strtoul(entry + magic_len, &end, 10);
+    if (*end != '\n' || key_len != key->len) {
+        return 0;
+    }
+    size_t offset = end + 1 - entry;
+    if (size - offset < key_len || memcmp(entry + offset, key->text, key_len)) {
+        return 0;
+    }
+    return offset + key_len;
+}
+
+char* render_cache_get(struct render_cache* cache, const char* expr,
+                       const char* typenames, const char* options,
+                       size_t* size) {
+    struct cache_key key = make_key(expr, typenames, options);
+    char* path = entry_path(cache, key.hash);
+    char* data = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        size_t entry_size;
+        char* entry = read_file(fd, &entry_size);
+        size_t offset = entry ? match_entry(entry, entry_size, &key) : 0;
+        if (offset) {
+            *size = entry_size - offset;
+            memmove(entry, entry + offset, *size + 1);
+            data = entry;
+            /* mark it recently used, for eviction */
+            futimens(fd, 0);
+        } else {
+            free(entry);
+        }
+        close(fd);
+    }
+
+    count_lookup(cache, data != 0);
+    free(path);
+    free(key.text);
+    return data;
+}
+
+struct cached_file {
+    char* path;
+    long size;
+    struct timespec mtime;
+};
+
+static int compare_mtime(const void* a, const void* b) {
+    const struct cached_file* left = a;
+    const struct cached_file* right = b;
+    if (left->mtime.tv_sec != right->mtime.tv_sec) {
+        return left->mtime.tv_sec < right->mtime.tv_sec ? -1 : 1;
+    }
+    if (left->mtime.tv_nsec != right->mtime.tv_nsec) {
+        return left->mtime.tv_nsec < right->mtime.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+  Removes the least recently used entries until the total is under
+  three quarters of the bound, and returns the new total.  The caller
+  holds the stats lock.
+ */
+static long evict(struct render_cache* cache) {
+    int allocated = 256;
+    int n_files = 0;
+    struct cached_file* files = malloc(allocated * sizeof(*files));
+    long total = 0;
+
+    size_t dir_len = strlen(cache->dir);
+    char* shard_path = malloc(dir_len + 4);
+    for (int shard = 0; shard < 256; ++shard) {
+        sprintf(shard_path, "%s/%02x", cache->dir, shard);
+        DIR* dir = opendir(shard_path);
+        if (!dir) {
+            continue;
+        }
+        struct dirent* dirent;
+        while ((dirent = readdir(dir))) {
+            /* skip . and .., and other processes' temporary files */
+            if (dirent->d_name[0] == '.') {
+                continue;
+            }
+            char* path = malloc(dir_len + 4 + strlen(dirent->d_name) + 1);
+            sprintf(path, "%s/%s", shard_path, dirent->d_name);
+            struct stat st;
+            if (stat(path, &st)) {
+                free(path);
+                continue;
+            }
+            if (n_files == allocated) {
+                allocated *= 2;
+                files = realloc(files, allocated * sizeof(*files));
+            }
+            files[n_files].path = path;
+            files[n_files].size = st.st_size;
+            files[n_files].mtime = st.st_mtim;
+            n_files++;
+            total += st.st_size;
+        }
+        closedir(dir);
+    }
+    free(shard_path);
+
+    qsort(files, n_files, sizeof(*files), compare_mtime);
+    long target = cache->max_bytes / 4 * 3;
+    for (int i = 0; i < n_files; ++i) {
+        if (total > target && unlink(files[i].path) == 0) {
+            total -= files[i].size;
+        }
+        free(files[i].path);
+    }
+    free(files);
+    return total;
+}
+
+static int write_all(int fd, const void* data, size_t size) {
+    const char* pos = data;
+    while (size) {
+        ssize_t written = write(fd, pos, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        pos += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int render_cache_put(struct render_cache* cache, const char* expr,
+                     const char* typenames, const char* options,
+                     const char* data, size_t size) {
+    struct cache_key key = make_key(expr, typenames, options);
+    char* path = entry_path(cache, key.hash);
+    char* tmp_path = malloc(strlen(path) + 32);
+    int ret = -1;
+
+    /* the shard directory */
+    char* slash = strrchr(path, '/');
+    *slash = 0;
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        goto done;
+    }
+    sprintf(tmp_path, "%s/.tmp.%ld.%016llx", path, (long)getpid(),
+            (unsigned long long)key.hash);
+    *slash = '/';
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        goto done;
+    }
+    char header[64];
+    int header_len = sprintf(header, ENTRY_MAGIC "%zu\n", key.len);
+    if (write_all(fd, header, header_len) ||
+        write_all(fd, key.text, key.len) ||
+        write_all(fd, data, size)) {
+        close(fd);
+        unlink(tmp_path);
+        goto done;
+    }
+    if (close(fd)) {
+        unlink(tmp_path);
+        goto done;
+    }
+
+    flock(cache->stats_fd, LOCK_EX);
+    struct stat old;
+    long old_size = stat(path, &old) ? 0 : old.st_size;
+    if (rename(tmp_path, path) == 0) {
+        struct render_cache_stats stats;
+        read_stats(cache, &stats);
+        stats.bytes += header_len + key.len + size - old_size;
+        if (stats.bytes > cache->max_bytes) {
+            stats.bytes = evict(cache);
+        }
+        write_stats(cache, &stats);
+        ret = 0;
+    } else {
+        unlink(tmp_path);
+    }
+    flock(cache->stats_fd, LOCK_UN);
+
+done:
+    free(tmp_path);
+    free(path);
+    free(key.text);
+    return ret;
+}
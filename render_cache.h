@@ -0,0 +1,55 @@
+/*
+  An on-disk cache of rendered output (SVG), for expr.cgi.
+
+  Entries are keyed by the expression, the typenames and the render
+  options, and addressed by a hash of those: dir/ab/abcdef0123456789
+  for hash 0xabcdef0123456789.  Each entry file starts with its full
+  key, which is checked on lookup, so a hash collision is just a miss.
+  Entries are written to a temporary file and renamed into place, so
+  readers never see a partial entry, and any number of processes can
+  share a cache directory.
+
+  The total size of the entries is kept under a bound: when a store
+  takes it over, the least recently used entries (by mtime, which
+  hits update) are removed until it's back under three quarters of
+  the bound.  Hit and miss counts and the total size are kept in
+  dir/stats, a text file updated under flock.
+ */
+#ifndef RENDER_CACHE_H
+#define RENDER_CACHE_H
+
+#include <stddef.h>
+
+struct render_cache;
+
+struct render_cache_stats {
+    long hits;
+    long misses;
+    long bytes;
+};
+
+/*
+  Opens the cache in dir, creating the directory if need be.  Returns
+  NULL if it can't.
+ */
+struct render_cache* render_cache_open(const char* dir, long max_bytes);
+void render_cache_close(struct render_cache* cache);
+
+/*
+  Returns the malloced output stored for the key, setting *size, or
+  NULL on a miss.  typenames and options may be NULL.
+ */
+char* render_cache_get(struct render_cache* cache, const char* expr,
+                       const char* typenames, const char* options,
+                       size_t* size);
+
+/* Returns 0, or -1 if the entry couldn't be stored. */
+int render_cache_put(struct render_cache* cache, const char* expr,
+                     const char* typenames, const char* options,
+                     const char* data, size_t size);
+
+/* Returns 0, or -1 if the stats couldn't be read. */
+int render_cache_get_stats(struct render_cache* cache,
+                           struct render_cache_stats* stats);
+
+#endif
@@ -0,0 +1,221 @@
+#include "scan.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SCAN_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+static enum scan_simd simd = SCAN_SIMD_AUTO;
+
+static bool is_identifier_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_';
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\n';
+}
+
+static const char* scan_identifier_scalar(const char* pos, const char* end) {
+    while (pos != end && is_identifier_char(*pos)) {
+        pos++;
+    }
+    return pos;
+}
+
+static const char* scan_digits_scalar(const char* pos, const char* end) {
+    while (pos != end && *pos >= '0' && *pos <= '9') {
+        pos++;
+    }
+    return pos;
+}
+
+static const char* scan_whitespace_scalar(const char* pos, const char* end) {
+    while (pos != end && is_space(*pos)) {
+        pos++;
+    }
+    return pos;
+}
+
+static const char* scan_comment_end_scalar(const char* pos, const char* end) {
+    for (; pos != end; ++pos) {
+        if (pos[0] == '*' && pos[1] == '/') {
+            return pos;
+        }
+    }
+    return end;
+}
+
+#ifdef SCAN_HAVE_X86
+
+/*
+  Each vector scanner builds a mask of the bytes that continue the run,
+  and stops at the first clear bit.  There's no unsigned byte compare
+  in SSE2, so ranges are checked by shifting lo down to -128 and doing
+  a signed compare.
+ */
+
+static inline __m128i in_range_sse2(__m128i v, int lo, int hi) {
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(-128 - lo)));
+    return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + hi - lo + 1)));
+}
+
+static inline __m128i identifier_mask_sse2(__m128i v) {
+    /* setting the 0x20 bit folds upper case onto lower case */
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i mask = in_range_sse2(lower, 'a', 'z');
+    mask = _mm_or_si128(mask, in_range_sse2(v, '0', '9'));
+    return _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+static inline __m128i space_mask_sse2(__m128i v) {
+    __m128i mask = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('\v')));
+    return _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+}
+
+#define SCAN_RUN_SSE2(name, mask_expr, scalar)                          \
+    static const char* name(const char* pos, const char* end) {        \
+        while (end - pos >= 16) {                                       \
+            __m128i v = _mm_loadu_si128((const __m128i*)pos);           \
+            unsigned stop = ~(unsigned)_mm_movemask_epi8(mask_expr) & 0xffff; \
+            if (stop) {                                                 \
+                return pos + __builtin_ctz(stop);                       \
+            }                                                           \
+            pos += 16;                                                  \
+        }                                                               \
+        return scalar(pos, end);                                        \
+    }
+
+SCAN_RUN_SSE2(scan_identifier_sse2, identifier_mask_sse2(v),
+              scan_identifier_scalar)
+SCAN_RUN_SSE2(scan_digits_sse2, in_range_sse2(v, '0', '9'),
+              scan_digits_scalar)
+SCAN_RUN_SSE2(scan_whitespace_sse2, space_mask_sse2(v),
+              scan_whitespace_scalar)
+
+static const char* scan_comment_end_sse2(const char* pos, const char* end) {
+    /* compare each byte and the one after it at once; the last load
+       may read *end, which is fine */
+    while (end - pos >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)pos);
+        __m128i next = _mm_loadu_si128((const __m128i*)(pos + 1));
+        __m128i mask = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')),
+                                     _mm_cmpeq_epi8(next, _mm_set1_epi8('/')));
+        unsigned found = _mm_movemask_epi8(mask);
+        if (found) {
+            return pos + __builtin_ctz(found);
+        }
+        pos += 16;
+    }
+    return scan_comment_end_scalar(pos, end);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i in_range_avx2(__m256i v, int lo, int hi) {
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(-128 - lo)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + hi - lo + 1)),
+                             shifted);
+}
+
+AVX2 static inline __m256i identifier_mask_avx2(__m256i v) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i mask = in_range_avx2(lower, 'a', 'z');
+    mask = _mm256_or_si256(mask, in_range_avx2(v, '0', '9'));
+    return _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+}
+
+AVX2 static inline __m256i space_mask_avx2(__m256i v) {
+    __m256i mask = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\v')));
+    return _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+}
+
+#define SCAN_RUN_AVX2(name, mask_expr, sse2)                            \
+    AVX2 static const char* name(const char* pos, const char* end) {   \
+        while (end - pos >= 32) {                                       \
+            __m256i v = _mm256_loadu_si256((const __m256i*)pos);        \
+            unsigned stop = ~(unsigned)_mm256_movemask_epi8(mask_expr); \
+            if (stop) {                                                 \
+                return pos + __builtin_ctz(stop);                       \
+            }                                                           \
+            pos += 32;                                                  \
+        }                                                               \
+        return sse2(pos, end);                                          \
+    }
+
+SCAN_RUN_AVX2(scan_identifier_avx2, identifier_mask_avx2(v),
+              scan_identifier_sse2)
+SCAN_RUN_AVX2(scan_digits_avx2, in_range_avx2(v, '0', '9'),
+              scan_digits_sse2)
+SCAN_RUN_AVX2(scan_whitespace_avx2, space_mask_avx2(v),
+              scan_whitespace_sse2)
+
+AVX2 static const char* scan_comment_end_avx2(const char* pos,
+                                              const char* end) {
+    while (end - pos >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)pos);
+        __m256i next = _mm256_loadu_si256((const __m256i*)(pos + 1));
+        __m256i mask = _mm256_and_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')),
+            _mm256_cmpeq_epi8(next, _mm256_set1_epi8('/')));
+        unsigned found = _mm256_movemask_epi8(mask);
+        if (found) {
+            return pos + __builtin_ctz(found);
+        }
+        pos += 32;
+    }
+    return scan_comment_end_sse2(pos, end);
+}
+
+static enum scan_simd current_simd() {
+    if (simd != SCAN_SIMD_AUTO) {
+        return simd;
+    }
+    return __builtin_cpu_supports("avx2") ? SCAN_SIMD_AVX2 : SCAN_SIMD_SSE2;
+}
+
+bool scan_set_simd(enum scan_simd new_simd) {
+    if (new_simd == SCAN_SIMD_AVX2 && !__builtin_cpu_supports("avx2")) {
+        return false;
+    }
+    simd = new_simd;
+    return true;
+}
+
+#define SCAN_DISPATCH(name)                                             \
+    const char* name(const char* pos, const char* end) {                \
+        switch (current_simd()) {                                       \
+        case SCAN_SIMD_AVX2:                                            \
+            return name##_avx2(pos, end);                               \
+        case SCAN_SIMD_SSE2:                                            \
+            return name##_sse2(pos, end);                               \
+        default:                                                        \
+            return name##_scalar(pos, end);                             \
+        }                                                               \
+    }
+
+#else
+
+bool scan_set_simd(enum scan_simd new_simd) {
+    if (new_simd == SCAN_SIMD_SSE2 || new_simd == SCAN_SIMD_AVX2) {
+        return false;
+    }
+    simd = new_simd;
+    return true;
+}
+
+#define SCAN_DISPATCH(name)                                             \
+    const char* name(const char* pos, const char* end) {                \
+        return name##_scalar(pos, end);                                 \
+    }
+
+#endif
+
+SCAN_DISPATCH(scan_identifier)
+SCAN_DISPATCH(scan_digits)
+SCAN_DISPATCH(scan_whitespace)
+SCAN_DISPATCH(scan_comment_end)
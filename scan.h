@@ -0,0 +1,40 @@
+/*
+  Scanning for the ends of runs of characters, for the lexer.  Each
+  function returns a pointer to the first character in [pos, end)
+  that doesn't continue the run, or end if they all do.  The vector
+  versions only load bytes in [pos, end], so end must be readable
+  (it's the NUL terminator, for the lexer).
+ */
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+
+enum scan_simd {
+    SCAN_SIMD_AUTO,
+    SCAN_SIMD_NONE,
+    SCAN_SIMD_SSE2,
+    SCAN_SIMD_AVX2
+};
+
+/*
+  Chooses which instructions the scanners use.  By default
+  (SCAN_SIMD_AUTO), they use the best the CPU supports.  Returns false
+  if the CPU doesn't support the requested ones.  Not thread safe;
+  this is meant for tests and benchmarks.
+ */
+bool scan_set_simd(enum scan_simd simd);
+
+/* [A-Za-z0-9_]* */
+const char* scan_identifier(const char* pos, const char* end);
+
+/* [0-9]* */
+const char* scan_digits(const char* pos, const char* end);
+
+/* [ \t\v\n]* */
+const char* scan_whitespace(const char* pos, const char* end);
+
+/* Returns a pointer to the first star-slash, or end if there is none. */
+const char* scan_comment_end(const char* pos, const char* end);
+
+#endif
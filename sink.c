@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "sink.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+void sink_init_fd(struct sink* sink, int fd) {
+    sink->fd = fd;
+    sink->out = 0;
+    sink->buf = malloc(SINK_BUFFER_SIZE);
+    sink->len = 0;
+    sink->failed = false;
+}
+
+void sink_init_strbuf(struct sink* sink, struct strbuf* out) {
+    sink_init_fd(sink, -1);
+    sink->out = out;
+}
+
+void sink_init_fd_copy(struct sink* sink, int fd, struct strbuf* copy) {
+    sink_init_fd(sink, fd);
+    sink->out = copy;
+}
+
+/* Writes all of iov, however many calls it takes */
+static bool write_all(int fd, struct iovec* iov, int n_iov) {
+    while (n_iov) {
+        ssize_t written = writev(fd, iov, n_iov);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (n_iov && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/* Sends the buffer, then data */
+static void send_out(struct sink* sink, const void* data, size_t n) {
+    if (sink->failed) {
+        /* dropped */
+    } else {
+        if (sink->out) {
+            strbuf_append(sink->out, sink->buf, sink->len);
+            strbuf_append(sink->out, data, n);
+        }
+        if (sink->fd >= 0) {
+            struct iovec iov[2] = {
+                {sink->buf, sink->len},
+                {(void*)data, n},
+            };
+            sink->failed = !write_all(sink->fd, iov, n ? 2 : 1);
+        }
+    }
+    sink->len = 0;
+}
+
+void sink_drain(struct sink* sink) {
+    send_out(sink, 0, 0);
+}
+
+void sink_write(struct sink* sink, const void* data, size_t n) {
+    if (n <= SINK_BUFFER_SIZE - sink->len) {
+        memcpy(sink->buf + sink->len, data, n);
+        sink->len += n;
+    } else if (n >= SINK_BUFFER_SIZE / 2) {
+        /* not worth copying */
+        send_out(sink, data, n);
+    } else {
+        sink_drain(sink);
+        memcpy(sink->buf, data, n);
+        sink->len = n;
+    }
+}
+
+void sink_printf(struct sink* sink, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t room = SINK_BUFFER_SIZE - sink->len;
+    int n = vsnprintf(sink->buf + sink->len, room, format, args);
+    va_end(args);
+    if (n < 0) {
+        sink->failed = true;
+        return;
+    }
+    if ((size_t)n < room) {
+        sink->len += n;
+        return;
+    }
+    /* it didn't fit, so again with more room */
+    va_start(args, format);
+    if (n < SINK_BUFFER_SIZE) {
+        sink_drain(sink);
+        vsnprintf(sink->buf, SINK_BUFFER_SIZE, format, args);
+        sink->len = n;
+    } else {
+        char* text = malloc(n + 1);
+        vsnprintf(text, n + 1, format, args);
+        sink_write(sink, text, n);
+        free(text);
+    }
+    va_end(args);
+}
+
+int sink_flush(struct sink* sink) {
+    if (sink->len) {
+        sink_drain(sink);
+    }
+    return sink->failed ? -1 : 0;
+}
+
+int sink_close(struct sink* sink) {
+    int status = sink_flush(sink);
+    free(sink->buf);
+    sink->buf = 0;
+    return status;
+}
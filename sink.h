@@ -0,0 +1,69 @@
+/*
+  An output sink: a fixed-size buffer that's flushed to a file
+  descriptor, or appended to a strbuf, whenever it fills.  Output of
+  any size goes through the same bounded buffer, and the first of it
+  goes out as soon as the buffer fills, rather than once the whole
+  thing is built.  Large writes skip the buffer and go out with
+  writev alongside what's buffered.
+
+  Errors are sticky: after a failed write the rest of the output is
+  dropped, and sink_flush and sink_close return -1.
+ */
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "strbuf.h"
+
+#define SINK_BUFFER_SIZE (64 * 1024)
+
+struct sink {
+    /* where flushes go: fd, unless it's -1, and out, if it's set */
+    int fd;
+    struct strbuf* out;
+    char* buf;
+    size_t len;
+    bool failed;
+};
+
+void sink_init_fd(struct sink* sink, int fd);
+void sink_init_strbuf(struct sink* sink, struct strbuf* out);
+/* Writes to fd, keeping a copy of everything written in copy */
+void sink_init_fd_copy(struct sink* sink, int fd, struct strbuf* copy);
+
+/*
+  Flushes, then frees the buffer (but doesn't close fd).  Returns 0,
+  or -1 if anything failed to go out.
+ */
+int sink_close(struct sink* sink);
+
+/* Returns 0, or -1 if anything failed to go out */
+int sink_flush(struct sink* sink);
+
+/* Sends the buffer on, leaving it empty */
+void sink_drain(struct sink* sink);
+
+/*
+  Returns room for n bytes (at most SINK_BUFFER_SIZE) in the buffer,
+  draining it first if need be.  The caller writes them there and adds
+  n to len.
+ */
+static inline char* sink_reserve(struct sink* sink, size_t n) {
+    if (SINK_BUFFER_SIZE - sink->len < n) {
+        sink_drain(sink);
+    }
+    return sink->buf + sink->len;
+}
+
+void sink_write(struct sink* sink, const void* data, size_t n);
+
+static inline void sink_puts(struct sink* sink, const char* s) {
+    sink_write(sink, s, strlen(s));
+}
+
+void sink_printf(struct sink* sink, const char* format, ...);
+
+#endif
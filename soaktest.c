@@ -0,0 +1,249 @@
+/*
+  Renders a long run of varied expressions through every public entry
+  point, checking that nothing is left allocated after each one and
+  that RSS stays flat, as it has to in a process that renders forever.
+  Takes the number of expressions as an argument, a million by
+  default.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "alloc_count.h"
+#include "cgi.h"
+#include "compact_tree.h"
+#include "parse.h"
+#include "svg.h"
+#include "tree_format.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* RSS may wander by a few pages as malloc's free lists settle */
+#define RSS_SLACK_KB 512
+
+static unsigned long long seed = 88172645463325252ull;
+
+static int next_random(int n) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed % n;
+}
+
+static void add(struct strbuf* buf, const char* text) {
+    strbuf_append(buf, text, strlen(text));
+}
+
+/*
+  A random expression of every kind the parser knows, with text that
+  needs escaping for SVG and JSON.  Some of them won't parse, which is
+  another path to check.
+ */
+static void random_expr(struct strbuf* buf, int depth) {
+    static const char* primaries[] = {
+        "a", "foo", "x1", "p", "42", "0x1f", "3.5e-2", "'<'", "\"a&b\"",
+        "\"<\\\"q\\\">\"", "T1"
+    };
+    static const char* binary[] = {
+        "+", "-", "*", "/", "%", "<<", ">>", "<", ">", "<=", ">=", "==",
+        "!=", "&", "^", "|", "&&", "||", "=", "+=", "<<=", ","
+    };
+    static const char* unary[] = {"-", "!", "~", "*", "&", "++", "--"};
+    static const char* types[] = {"int", "unsigned long *", "T1", "T2 *"};
+#define PICK(array) array[next_random(sizeof(array) / sizeof(array[0]))]
+
+    if (depth == 0 || next_random(4) == 0) {
+        add(buf, PICK(primaries));
+        return;
+    }
+    switch (next_random(9)) {
+    case 0:
+    case 1:
+        add(buf, "(");
+        random_expr(buf, depth - 1);
+        add(buf, " ");
+        add(buf, PICK(binary));
+        add(buf, " ");
+        random_expr(buf, depth - 1);
+        add(buf, ")");
+        break;
+    case 2:
+        add(buf, PICK(unary));
+        add(buf, " ");
+        random_expr(buf, depth - 1);
+        break;
+    case 3: {
+        add(buf, "f(");
+        int n_args = next_random(5);
+        for (int i = 0; i < n_args; ++i) {
+            if (i) {
+                add(buf, ", ");
+            }
+            random_expr(buf, depth - 1);
+        }
+        add(buf, ")");
+        break;
+    }
+    case 4:
+        random_expr(buf, depth - 1);
+        add(buf, "[");
+        random_expr(buf, depth - 1);
+        add(buf, "]");
+        break;
+    case 5:
+        random_expr(buf, depth - 1);
+        add(buf, next_random(2) ? ".m" : "->m");
+        break;
+    case 6:
+        add(buf, "(");
+        random_expr(buf, depth - 1);
+        add(buf, " ? ");
+        random_expr(buf, depth - 1);
+        add(buf, " : ");
+        random_expr(buf, depth - 1);
+        add(buf, ")");
+        break;
+    case 7:
+        add(buf, "(");
+        add(buf, PICK(types));
+        add(buf, ")");
+        random_expr(buf, depth - 1);
+        break;
+    default:
+        add(buf, "sizeof(");
+        add(buf, PICK(types));
+        add(buf, ")");
+        break;
+    }
+#undef PICK
+}
+
+static long rss_kb() {
+    long size = 0;
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Draws and prints result's tree every way there is */
+static void render(struct parse_tree_node* node, const char* expr,
+                   int null_fd) {
+    free(parse_tree_to_svg(node));
+
+    struct sink sink;
+    sink_init_fd(&sink, null_fd);
+    write_parse_tree_svg(node, &sink);
+    /* part of the tree, or nothing if it has no child 0 */
+    struct svg_options options = {3, 8, "0", 0};
+    write_parse_tree_svg_with_options(node, &options, &sink);
+    sink_close(&sink);
+
+    struct compact_tree* tree = compact_tree_new(node, expr);
+    if (tree) {
+        free(compact_tree_to_svg(tree));
+        compact_tree_free(tree);
+    }
+
+    struct strbuf out = {0};
+    sink_init_strbuf(&sink, &out);
+    emit_tree(&tree_format_json, node, &sink);
+    emit_tree(&tree_format_sexpr, node, &sink);
+    emit_tree(&tree_format_text, node, &sink);
+    sink_close(&sink);
+    write_tree_to_strbuf(node, &out);
+    strbuf_free(&out);
+}
+
+int main(int argc, char** argv) {
+    long n_exprs = argc > 1 ? atol(argv[1]) : 1000000;
+    int bad = 0;
+    char* typenames[] = {"T1", "T2", 0};
+    int null_fd = open("/dev/null", O_WRONLY);
+    setenv("QUERY_STRING", "expr=a%2Bb&typenames=T1,T2&format=json", 1);
+
+    /* stdio would malloc its buffer at the first failure */
+    static char stdout_buffer[BUFSIZ];
+    setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer));
+
+    long live_before = alloc_count_live();
+    struct parser_ctx* ctx = parser_ctx_new();
+    struct strbuf expr = {0};
+    long rss = 0;
+    long errors = 0;
+
+    for (long i = 0; i < n_exprs; ++i) {
+        expr.len = 0;
+        random_expr(&expr, 1 + next_random(6));
+        long live = alloc_count_live();
+
+        struct parse_result* result;
+        bool owned = true;
+        switch (i % 3) {
+        case 0:
+            result = parse(expr.data, typenames);
+            break;
+        case 1:
+            result = parse_copy(expr.data, typenames);
+            break;
+        default:
+            result = parser_ctx_parse(ctx, expr.data, typenames);
+            owned = false;
+            /* the context keeps what it grew by until it's freed */
+            live = alloc_count_live();
+        }
+        if (result->is_error) {
+            errors++;
+        } else {
+            render(result->node, expr.data, null_fd);
+        }
+        if (owned) {
+            free_parse_result(result);
+        }
+        if (i % 16 == 0) {
+            struct cgi* cgi = cgi_init();
+            cgi_free(cgi);
+        }
+
+        if (alloc_count_live() != live) {
+            if (bad < 10) {
+                printf("%ld blocks left allocated after %s\n",
+                       alloc_count_live() - live, expr.data);
+            }
+            bad++;
+        }
+        /* after a warmup, for the context and buffers to reach size */
+        if (i == n_exprs / 10) {
+            rss = rss_kb();
+        }
+    }
+
+    long rss_growth = rss_kb() - rss;
+    if (rss_growth > RSS_SLACK_KB) {
+        printf("RSS grew by %ld KB over the run\n", rss_growth);
+        bad++;
+    }
+    parser_ctx_free(ctx);
+    strbuf_free(&expr);
+    if (alloc_count_live() != live_before) {
+        printf("%ld blocks left allocated at the end\n",
+               alloc_count_live() - live_before);
+        bad++;
+    }
+    close(null_fd);
+    printf("%ld expressions (%ld errors), RSS grew %ld KB\n", n_exprs,
+           errors, rss_growth);
+
+    if (bad) {
+        printf("%d failed tests\n", bad);
+        return 1;
+    }
+    return 0;
+}
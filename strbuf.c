@@ -0,0 +1,29 @@
+#include "strbuf.h"
+#include <stdlib.h>
+#include <string.h>
+
+char* strbuf_reserve(struct strbuf* buf, size_t n) {
+    size_t needed = buf->len + n + 1;
+    if (needed > buf->allocated) {
+        size_t allocated = buf->allocated ? buf->allocated : 64;
+        while (allocated < needed) {
+            allocated *= 2;
+        }
+        buf->data = realloc(buf->data, allocated);
+        buf->allocated = allocated;
+    }
+    return buf->data + buf->len;
+}
+
+void strbuf_append(struct strbuf* buf, const char* data, size_t n) {
+    char* end = strbuf_reserve(buf, n);
+    memcpy(end, data, n);
+    buf->len += n;
+    end[n] = 0;
+}
+
+void strbuf_free(struct strbuf* buf) {
+    free(buf->data);
+    buf->data = 0;
+    buf->len = buf->allocated = 0;
+}
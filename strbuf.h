@@ -0,0 +1,27 @@
+/*
+  A growable string, for output whose size isn't known up front.
+  Zero-initialize one to start empty; once anything has been added,
+  data is NUL-terminated.  To reuse one, set len back to 0.
+ */
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stddef.h>
+
+struct strbuf {
+    char* data;
+    size_t len;
+    size_t allocated;
+};
+
+/*
+  Makes room for n more bytes and a NUL, returning where they go.  The
+  caller writes them and adds n to len.
+ */
+char* strbuf_reserve(struct strbuf* buf, size_t n);
+
+void strbuf_append(struct strbuf* buf, const char* data, size_t n);
+
+void strbuf_free(struct strbuf* buf);
+
+#endif
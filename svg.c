@@ -3,6 +3,8 @@
 #include "parse.h"
 #include "svg.h"
 #include "layout.h"
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,16 +14,26 @@
 #define TEXT_PX 14.0
 #define CHAR_HEIGHT 13.0
 #define BOX_HEIGHT 17.0
+/* around the boxes, inside the edge of the canvas */
+#define CANVAS_MARGIN 10.0
+/* digits after the decimal point in coordinates */
+#define DEFAULT_PRECISION 1
+#define MAX_PRECISION 6
 
 
+/*
+  The templates are written by write_template, which puts a coordinate
+  in place of each %f.
+ */
 static const char* svg_header =
 "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>"
 "<svg"
 "   xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\""
 "   xmlns:svg=\"http://www.w3.org/2000/svg\""
 "   xmlns=\"http://www.w3.org/2000/svg\""
-"   width=\"1000\""
-"   height=\"1000\""
+"   width=\"%f\""
+"   height=\"%f\""
+"   viewBox=\"%f %f %f %f\""
 "   id=\"svg2\""
 "   version=\"1.1\">";
 
@@ -33,6 +45,16 @@ static const char* svg_rect =
 "       x=\"%f\""
 "       y=\"%f\" />";
 
+/* for a subtree drawn as one box */
+static const char* svg_summary_rect =
+"    <rect"
+"       style=\"color:#000000;fill:none;stroke:#000000;stroke-width:1;stroke-dasharray:4,2;\""
+"       width=\"%f\""
+"       height=\"%f\""
+"       x=\"%f\""
+"       y=\"%f\" />";
+
+/* followed by the label's text and svg_text_end */
 static const char* svg_text =
 "    <text"
 "       xml:space=\"preserve\""
@@ -41,7 +63,9 @@ static const char* svg_text =
 "       y=\"%f\">"
 "<tspan"
 "         x=\"%f\""
-"         y=\"%f\">%s</tspan></text>";
+"         y=\"%f\">";
+
+static const char* svg_text_end = "</tspan></text>";
 
 
 static const char* svg_line =
@@ -54,226 +78,623 @@ static const char* svg_line =
 static const char* svg_footer = "</svg>";
 
 
-static void add_child_node(struct label *parent, struct label *child) {
-    struct label* last_child = parent->first_child;
-    if (!last_child) {
-        parent->first_child = child;
-        return;
+/*
+  What a node's box says: its text for literals and identifiers, its
+  type in parentheses for casts, and its token's name for the rest.
+  A box standing for a subtree that isn't drawn says how many nodes
+  it has.
+ */
+struct svg_node {
+    enum token_type op;
+    int text_len;
+    const char* text;
+    /* the nodes in the subtree, if it's drawn as this box, or 0 */
+    uint32_t hidden;
+};
+
+static const char function_call_label[] = "function call";
+static const char hidden_label[] = " nodes";
+
+/* The length of the label, before escaping */
+static int label_length(const struct svg_node* node) {
+    if (node->hidden) {
+        int digits = 1;
+        for (uint32_t n = node->hidden; n >= 10; n /= 10) {
+            digits++;
+        }
+        return digits + sizeof(hidden_label) - 1;
     }
-    child->number = 1;
-    while (last_child->next_sibling) {
-        last_child = last_child->next_sibling;
-        child->number ++;
+    switch (node->op) {
+    case LITERAL_OR_ID:
+        return node->text_len;
+    case TYPECAST:
+        return node->text_len + 2;
+    case FUNCTION_CALL:
+        return sizeof(function_call_label) - 1;
+    default:
+        return strlen(token_names[node->op]);
     }
-    child->prev_sibling = last_child;
-    last_child->next_sibling = child;
 }
 
-static char* xml_escape(const char* str) {
-    int len = 0;
-    for (const char* cur = str; *cur; ++cur) {
-        if (*cur == '&') {
-            /* &amp; */
-            len += 5;
-        } else  if (*cur == '<' || *cur == '>') {
-            /* &lt; */
-            len+=4;
-        } else {
-            len++;
-        }
-    }
-    char* result = malloc(len + 1);
-    char* end = result;
-    for (const char* cur = str; *cur; ++cur) {
-        if (*cur == '&') {
-            strcpy(end, "&amp;");
-            end += 5;
-        } else  if (*cur == '<') {
-            strcpy(end, "&lt;");
-            end += 4;
-        } else  if (*cur == '>') {
-            strcpy(end, "&gt;");
-            end += 4;
-        } else {
-            *end++ = *cur;
+/* Writes text with &, < and > escaped */
+static void write_escaped(struct sink* sink, const char* text, int len) {
+    const char* run = text;
+    const char* end = text + len;
+    for (const char* cur = text; cur < end; ++cur) {
+        const char* escape;
+        switch (*cur) {
+        case '&':
+            escape = "&amp;";
+            break;
+        case '<':
+            escape = "&lt;";
+            break;
+        case '>':
+            escape = "&gt;";
+            break;
+        default:
+            continue;
         }
+        sink_write(sink, run, cur - run);
+        sink_puts(sink, escape);
+        run = cur + 1;
     }
-    *end = 0;
-    return result;
+    sink_write(sink, run, end - run);
 }
 
-static struct label* make_label(struct parse_tree_node* node,
-                         struct label *parent) {
-    struct label* label = malloc(sizeof(struct label));
-    label->parent = parent;
-    label->first_child = 0;
-    label->next_sibling = 0;
-    label->prev_sibling = 0;
-
-    label->thread = 0;
-    label->ancestor = label;
-    label->number = 0;
-    label->modifier = label->change = label->shift = 0;
-
+static void write_label(struct sink* sink, const struct svg_node* node) {
+    if (node->hidden) {
+        sink_printf(sink, "%u%s", node->hidden, hidden_label);
+        return;
+    }
     switch (node->op) {
     case LITERAL_OR_ID:
-        label->text = strdup(node->text);
+        write_escaped(sink, node->text, node->text_len);
         break;
     case TYPECAST:
-        label->text = malloc(strlen(node->text) + 3);
-        sprintf(label->text, "(%s)", node->text);
+        sink_write(sink, "(", 1);
+        write_escaped(sink, node->text, node->text_len);
+        sink_write(sink, ")", 1);
         break;
     case FUNCTION_CALL:
-        label->text = strdup("function call");
+        sink_puts(sink, function_call_label);
         break;
     default:
-        label->text = strdup(token_names[node->op]);
+        write_escaped(sink, token_names[node->op],
+                      strlen(token_names[node->op]));
         break;
     }
-    label->width = (strlen(label->text) + 2) * CHAR_WIDTH;
-    char* old_text = label->text;
-    label->text = xml_escape(old_text);
-    free(old_text);
-    label->xcoord = 500;
-    label->ycoord = 0;
-    label->modifier = 0;
-    return label;
 }
 
-static struct label* get_label_tree(struct parse_tree_node* node,
-                             struct label *parent) {
-    //to parse a node, we need to create a label for it,
+/*
+  A tree to draw: the nodes numbered in preorder, so drawing them in
+  order draws parents before children, and their layout.
+ */
+struct svg_tree {
+    struct flat_layout* layout;
+    struct svg_node* nodes;
+};
 
-    struct label* label = make_label(node, parent);
+static struct svg_tree svg_tree_new(uint32_t n_nodes) {
+    struct svg_tree tree = {flat_layout_new(n_nodes),
+                            malloc(n_nodes * sizeof(struct svg_node))};
+    return tree;
+}
 
-    if (node->first_child) {
-        add_child_node(label, get_label_tree(node->first_child, label));
+static void set_svg_node(struct svg_tree* tree, uint32_t i,
+                         enum token_type op, const char* text, int text_len,
+                         uint32_t hidden) {
+    struct svg_node* node = &tree->nodes[i];
+    node->op = op;
+    node->text = text;
+    node->text_len = text_len;
+    node->hidden = hidden;
+    tree->layout->width[i] = (label_length(node) + 2) * CHAR_WIDTH;
+}
 
-        struct parse_tree_node* cur = node->first_child->next_sibling;
-        while (cur) {
-            add_child_node(label, get_label_tree(cur, label));
-            cur = cur->next_sibling;
-        }
+static void svg_tree_free(struct svg_tree* tree) {
+    flat_layout_free(tree->layout);
+    free(tree->nodes);
+}
+
+/*
+  The tree an SVG is drawn from, of either kind, as pointers to its
+  nodes: parse tree nodes if compact is NULL, and compact nodes if
+  not.
+ */
+struct svg_source {
+    const struct compact_tree* compact;
+    /*
+      In a compact tree, the node just past the root's subtree, or
+      n_nodes.  With nodes in preorder, a subtree is the nodes from
+      its root up to its end, which is its next sibling if it has one,
+      and its parent's end if not.
+     */
+    uint32_t root_end;
+};
+
+static inline const void* source_first_child(const struct svg_source* source,
+                                             const void* node) {
+    if (source->compact) {
+        return compact_first_child(source->compact, node);
     }
+    return ((const struct parse_tree_node*)node)->first_child;
+}
 
-    return label;
+static inline const void* source_next_sibling(
+    const struct svg_source* source, const void* node) {
+    if (source->compact) {
+        return compact_next_sibling(source->compact, node);
+    }
+    return ((const struct parse_tree_node*)node)->next_sibling;
 }
 
-static void realloc_if_necessary(char** p, int* allocated, int new_size) {
-    if (*allocated > new_size) {
-        return;
+/* Where node's subtree ends, given its parent's; 0 in a parse tree */
+static inline uint32_t source_end(const struct svg_source* source,
+                                  const void* node, uint32_t parent_end) {
+    if (source->compact) {
+        const struct compact_node* compact_node = node;
+        return compact_node->next_sibling ? compact_node->next_sibling
+                                          : parent_end;
     }
-    while (*allocated < new_size) {
-        *allocated *= 2;
+    return 0;
+}
+
+static void set_source_node(struct svg_tree* tree, uint32_t i,
+                            const struct svg_source* source,
+                            const void* node, uint32_t hidden) {
+    if (source->compact) {
+        const struct compact_node* compact_node = node;
+        set_svg_node(tree, i, compact_op(compact_node),
+                     compact_text(source->compact, compact_node),
+                     compact_text_len(compact_node), hidden);
+    } else {
+        const struct parse_tree_node* parse_node = node;
+        set_svg_node(tree, i, parse_node->op, parse_node->text,
+                     parse_node->text_len, hidden);
     }
-    *p = realloc(*p, *allocated);
 }
 
-struct queue {
-    struct label* label;
-    struct queue* next;
+/*
+  Which nodes are opened, so that their children are drawn: those
+  above full_depth, and the first partial nodes, from the left, at
+  full_depth.  Breadth first, that's a prefix of the nodes.
+ */
+struct svg_plan {
+    int full_depth;
+    uint32_t partial;
 };
 
-static struct label* next(struct label* node) {
-    if (node->first_child) {
-        return node->first_child;
+static const struct svg_plan draw_everything = {INT_MAX, 0};
+
+/*
+  Opens nodes breadth first from root, keeping the ones to draw in a
+  queue, until a node's children don't fit in max_nodes.  Only the
+  nodes drawn, and their children while counting them, are looked at.
+ */
+static struct svg_plan plan_svg(const struct svg_source* source,
+                                const void* root,
+                                const struct svg_options* options) {
+    struct svg_plan plan = draw_everything;
+    if (options && options->max_depth > 0) {
+        plan.full_depth = options->max_depth - 1;
     }
-    if (node->next_sibling) {
-        return node->next_sibling;
+    if (!options || !options->max_nodes) {
+        return plan;
     }
-    while (node->parent) {
-        if (node->parent->next_sibling)
-            return node->parent->next_sibling;
-        node = node->parent;
+
+    uint32_t allocated = 64;
+    const void** queue = malloc(allocated * sizeof(*queue));
+    queue[0] = root;
+    uint32_t n_queued = 1;
+    uint32_t level_start = 0;
+    uint32_t level_end = 1;
+    int depth = 0;
+    for (uint32_t head = 0; head < n_queued; ++head) {
+        if (head == level_end) {
+            depth++;
+            level_start = level_end;
+            level_end = n_queued;
+        }
+        if (depth >= plan.full_depth) {
+            break;
+        }
+        uint32_t n_children = 0;
+        for (const void* child = source_first_child(source, queue[head]);
+             child; child = source_next_sibling(source, child)) {
+            n_children++;
+        }
+        if (n_children > options->max_nodes - n_queued) {
+            plan.full_depth = depth;
+            plan.partial = head - level_start;
+            break;
+        }
+        if (n_queued + n_children > allocated) {
+            allocated = (n_queued + n_children) * 2;
+            queue = realloc(queue, allocated * sizeof(*queue));
+        }
+        for (const void* child = source_first_child(source, queue[head]);
+             child; child = source_next_sibling(source, child)) {
+            queue[n_queued++] = child;
+        }
     }
-    return 0;
+    free(queue);
+    return plan;
 }
 
-static double max(double a, double b) {
-    return a > b ? a : b;
-}
+/*
+  Walks the part of the tree under root that plan opens, in preorder,
+  and returns the number of boxes.  If tree isn't NULL, fills it in,
+  counting the nodes under each node that isn't opened.
+  The walk keeps a stack of the nodes above the current one, since the
+  parse tree has no parent pointers.
+ */
+static uint32_t walk_svg_tree(const struct svg_source* source,
+                              const void* root, struct svg_plan plan,
+                              struct svg_tree* tree) {
+    struct frame {
+        const void* node;
+        uint32_t label;
+        uint32_t end;
+    };
+    int allocated = 64;
+    struct frame* path = malloc(allocated * sizeof(*path));
+    int depth = 0;
+    uint32_t n_nodes = 0;
+    uint32_t seen_at_full_depth = 0;
+
+    const void* node = root;
+    uint32_t end = source->root_end;
+    while (1) {
+        uint32_t label = n_nodes++;
+        const void* child = source_first_child(source, node);
+        bool open = depth < plan.full_depth ||
+            (depth == plan.full_depth && seen_at_full_depth < plan.partial);
+        if (depth == plan.full_depth) {
+            seen_at_full_depth++;
+        }
+        if (tree) {
+            uint32_t hidden = 0;
+            if (child && !open) {
+                /*
+                  A compact tree knows its subtrees' sizes; a parse tree
+                  has to be walked, which is all the time a big one
+                  takes beyond the boxes drawn.
+                 */
+                hidden = source->compact
+                    ? end - (uint32_t)((const struct compact_node*)node -
+                                       source->compact->nodes)
+                    : walk_svg_tree(source, node, draw_everything, 0);
+            }
+            set_source_node(tree, label, source, node, hidden);
+            if (depth) {
+                flat_layout_add_child(tree->layout, path[depth - 1].label,
+                                      label);
+            }
+        }
 
-static char* tree_to_svg(struct label* tree) {
-    int allocated = 1024;
-    char* svg = malloc(allocated);
+        if (child && open) {
+            if (depth == allocated) {
+                allocated *= 2;
+                path = realloc(path, allocated * sizeof(*path));
+            }
+            path[depth++] = (struct frame){node, label, end};
+            node = child;
+            end = source_end(source, node, end);
+            continue;
+        }
+        /* go up until there's a next sibling, but not past root */
+        while (depth && !source_next_sibling(source, node)) {
+            node = path[--depth].node;
+        }
+        if (!depth) {
+            break;
+        }
+        node = source_next_sibling(source, node);
+        end = source_end(source, node, path[depth - 1].end);
+    }
 
-    int used = strlen(svg_header);
-    realloc_if_necessary(&svg, &allocated, used);
-    strcpy(svg, svg_header);
+    free(path);
+    return n_nodes;
+}
 
-    int rect_len = strlen(svg_rect);
-    int text_len = strlen(svg_text);
-    int line_len = strlen(svg_line);
-    int buf_size = max(max(rect_len, text_len), line_len) + 5 * 15 + 1;
-    char svg_buf[buf_size];
+static struct svg_tree get_svg_tree(const struct svg_source* source,
+                                    const void* root,
+                                    const struct svg_options* options) {
+    struct svg_plan plan = plan_svg(source, root, options);
+    struct svg_tree tree = svg_tree_new(walk_svg_tree(source, root, plan, 0));
+    walk_svg_tree(source, root, plan, &tree);
+    return tree;
+}
 
-    struct label* label = tree;
-    do {
+/*
+  Follows a root path like "2.0", child numbers from 0 separated by
+  dots, down from root, setting source's root_end for where it leads.
+  Returns NULL if it isn't one, or leads nowhere.
+ */
+static const void* follow_root_path(struct svg_source* source,
+                                    const void* root, const char* path) {
+    const void* node = root;
+    if (!path || !*path) {
+        return node;
+    }
+    while (1) {
+        if (*path < '0' || *path > '9') {
+            return 0;
+        }
+        unsigned long n = 0;
+        for (; *path >= '0' && *path <= '9' && n <= UINT32_MAX; ++path) {
+            n = n * 10 + (*path - '0');
+        }
+        uint32_t parent_end = source->root_end;
+        node = source_first_child(source, node);
+        for (; node && n; --n) {
+            node = source_next_sibling(source, node);
+        }
+        if (!node) {
+            return 0;
+        }
+        source->root_end = source_end(source, node, parent_end);
+        if (!*path) {
+            return node;
+        }
+        if (*path++ != '.') {
+            return 0;
+        }
+    }
+}
 
-        double width = label->width;
-        double x = label->xcoord - width / 2;
-        double y = label->ycoord;
+static const long long powers_of_ten[MAX_PRECISION + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000
+};
 
-        if (label->parent) {
-            double parent_width = label->parent->width;
-            double parent_x = label->parent->xcoord - parent_width / 2;
-            double parent_y = label->parent->ycoord;
+/*
+  Writes value with precision digits after the decimal point, like
+  %.*f, but as integers: rounded to a whole number of the last digit's
+  units, then written out backwards.  That's several times faster than
+  going through printf, which is most of the time it takes to draw a
+  tree.
+ */
+static inline void write_coord(struct sink* sink, double value,
+                               int precision) {
+    double scaled = value * powers_of_ten[precision];
+    /* too big to be anywhere on screen, or NaN */
+    if (!(scaled > -1e18 && scaled < 1e18)) {
+        sink_printf(sink, "%.*f", precision, value);
+        return;
+    }
+    long long rounded = scaled < 0 ? (long long)(scaled - 0.5)
+                                   : (long long)(scaled + 0.5);
+    unsigned long long digits = rounded < 0 ? -rounded : rounded;
+
+    /* a sign, 19 digits and a point */
+    char text[24];
+    char* start = text + sizeof(text);
+    for (int i = 0; i < precision; ++i) {
+        *--start = '0' + digits % 10;
+        digits /= 10;
+    }
+    *--start = '.';
+    do {
+        *--start = '0' + digits % 10;
+        digits /= 10;
+    } while (digits);
+    if (rounded < 0) {
+        *--start = '-';
+    }
+    size_t len = text + sizeof(text) - start;
+    memcpy(sink_reserve(sink, len), start, len);
+    sink->len += len;
+}
 
-            int needed = sprintf(svg_buf, svg_line, x + width / 2,
-                                 y, parent_x + parent_width / 2,
-                                 parent_y + BOX_HEIGHT);
+/* Writes template with values in place of its %f's, in order */
+static void write_template(struct sink* sink, const char* template,
+                           const double* values, int precision) {
+    const char* run = template;
+    for (const char* mark = strchr(run, '%'); mark;
+         mark = strchr(run, '%')) {
+        sink_write(sink, run, mark - run);
+        write_coord(sink, *values++, precision);
+        run = mark + 2;
+    }
+    sink_puts(sink, run);
+}
 
-            realloc_if_necessary(&svg, &allocated, used + needed);
-            strcpy(svg + used, svg_buf);
-            used += needed;
+/*
+  Writes the SVG as it goes, so the output never has to be in memory
+  all at once.  The canvas is just big enough for the boxes.
+ */
+static void tree_to_svg(const struct svg_tree* tree, int precision,
+                        struct sink* sink) {
+    const struct flat_layout* layout = tree->layout;
+    double left = layout->xcoord[0] - layout->width[0] / 2;
+    double right = layout->xcoord[0] + layout->width[0] / 2;
+    double top = layout->ycoord[0];
+    double bottom = layout->ycoord[0] + BOX_HEIGHT;
+    for (uint32_t i = 1; i < layout->n_nodes; ++i) {
+        double half_width = layout->width[i] / 2;
+        if (layout->xcoord[i] - half_width < left) {
+            left = layout->xcoord[i] - half_width;
+        }
+        if (layout->xcoord[i] + half_width > right) {
+            right = layout->xcoord[i] + half_width;
+        }
+        if (layout->ycoord[i] < top) {
+            top = layout->ycoord[i];
+        }
+        if (layout->ycoord[i] + BOX_HEIGHT > bottom) {
+            bottom = layout->ycoord[i] + BOX_HEIGHT;
+        }
+    }
+    double width = right - left + 2 * CANVAS_MARGIN;
+    double height = bottom - top + 2 * CANVAS_MARGIN;
+    double header[] = {width, height, left - CANVAS_MARGIN,
+                       top - CANVAS_MARGIN, width, height};
+    write_template(sink, svg_header, header, precision);
+
+    for (uint32_t i = 0; i < layout->n_nodes; ++i) {
+        double width = layout->width[i];
+        double x = layout->xcoord[i] - width / 2;
+        double y = layout->ycoord[i];
+
+        if (i) {
+            uint32_t parent = layout->parent[i];
+            double parent_width = layout->width[parent];
+            double parent_x = layout->xcoord[parent] - parent_width / 2;
+            double parent_y = layout->ycoord[parent];
+
+            double line[] = {x + width / 2, y, parent_x + parent_width / 2,
+                             parent_y + BOX_HEIGHT};
+            write_template(sink, svg_line, line, precision);
         }
 
-
-        int needed = sprintf(svg_buf, svg_rect, width, BOX_HEIGHT, x, y);
-        realloc_if_necessary(&svg, &allocated, used + needed);
-        strcpy(svg + used, svg_buf);
-        used += needed;
+        double rect[] = {width, BOX_HEIGHT, x, y};
+        write_template(sink,
+                       tree->nodes[i].hidden ? svg_summary_rect : svg_rect,
+                       rect, precision);
 
         x += CHAR_WIDTH;
         y += CHAR_HEIGHT;
-        needed = sprintf(svg_buf, svg_text, TEXT_PX, x, y, x, y, label->text);
-        realloc_if_necessary(&svg, &allocated, used + needed);
-        strcpy(svg + used, svg_buf);
-        used += needed;
+        double text[] = {TEXT_PX, x, y, x, y};
+        write_template(sink, svg_text, text, precision);
+        write_label(sink, &tree->nodes[i]);
+        sink_puts(sink, svg_text_end);
+    }
+
+    sink_puts(sink, svg_footer);
+}
 
-        label = next(label);
-    } while (label);
+static void svg_tree_to_sink(struct svg_tree* tree, int precision,
+                             struct sink* sink) {
+    struct walker_layout_rules rules;
+    rules.sibling_separation = 10;
+    rules.subtree_separation = 20;
+    rules.level_separation = 30;
+    flat_layout_run(tree->layout, &rules, 500, 0);
 
-    int needed = strlen(svg_footer);
-    realloc_if_necessary(&svg, &allocated, used + needed);
-    strcpy(svg + used, svg_footer);
-    used += needed;
+    tree_to_svg(tree, precision, sink);
 
-    return svg;
+    svg_tree_free(tree);
 }
 
-static void free_label_tree(struct label* label) {
-    struct label* child = label->first_child;
-    while (child) {
-        struct label* next_child = child->next_sibling;
-        free(child);
-        child = next_child;
+static int write_svg(struct svg_source* source, const void* root,
+                     const struct svg_options* options, struct sink* sink) {
+    root = follow_root_path(source, root, options ? options->root_path : 0);
+    if (!root) {
+        return -1;
     }
-    free(label);
+    struct svg_tree tree = get_svg_tree(source, root, options);
+    int precision = options && options->precision ? options->precision
+                                                  : DEFAULT_PRECISION;
+    svg_tree_to_sink(&tree, precision, sink);
+    return 0;
+}
+
+bool parse_tree_has_root(struct parse_tree_node* node,
+                         const char* root_path) {
+    struct svg_source source = {0, 0};
+    return follow_root_path(&source, node, root_path) != 0;
+}
+
+int write_parse_tree_svg_with_options(struct parse_tree_node* node,
+                                      const struct svg_options* options,
+                                      struct sink* sink) {
+    struct svg_source source = {0, 0};
+    return write_svg(&source, node, options, sink);
+}
+
+int write_compact_tree_svg_with_options(const struct compact_tree* tree,
+                                        const struct svg_options* options,
+                                        struct sink* sink) {
+    struct svg_source source = {tree, tree->n_nodes};
+    return write_svg(&source, tree->nodes, options, sink);
+}
+
+void write_parse_tree_svg(struct parse_tree_node* node, struct sink* sink) {
+    write_parse_tree_svg_with_options(node, 0, sink);
+}
+
+void write_compact_tree_svg(const struct compact_tree* tree,
+                            struct sink* sink) {
+    write_compact_tree_svg_with_options(tree, 0, sink);
 }
 
 char* parse_tree_to_svg(struct parse_tree_node* node) {
-    struct label* label = get_label_tree(node, 0);
+    struct strbuf svg = {0};
+    struct sink sink;
+    sink_init_strbuf(&sink, &svg);
+    write_parse_tree_svg(node, &sink);
+    sink_close(&sink);
+    return svg.data;
+}
 
-    struct walker_layout_rules rules;
-    rules.sibling_separation = 10;
-    rules.subtree_separation = 20;
-    rules.level_separation = 30;
-    walker_layout(label, &rules);
+char* compact_tree_to_svg(const struct compact_tree* tree) {
+    struct strbuf svg = {0};
+    struct sink sink;
+    sink_init_strbuf(&sink, &svg);
+    write_compact_tree_svg(tree, &sink);
+    sink_close(&sink);
+    return svg.data;
+}
 
-    char* svg = tree_to_svg(label);
+/* Parses a count that fits in an int, or returns -1 */
+static long parse_count(const char* value) {
+    char* end;
+    if (*value < '0' || *value > '9') {
+        return -1;
+    }
+    long n = strtol(value, &end, 10);
+    return *end || n > INT_MAX ? -1 : n;
+}
 
-    free_label_tree(label);
+char* svg_options_key(const struct svg_options* options) {
+    struct strbuf key = {0};
+    struct sink sink;
+    sink_init_strbuf(&sink, &key);
+    sink_printf(&sink, "svg depth=%d nodes=%u precision=%d root=",
+                options->max_depth, (unsigned)options->max_nodes,
+                options->precision ? options->precision
+                                   : DEFAULT_PRECISION);
+    /* all of it, however long */
+    if (options->root_path) {
+        sink_puts(&sink, options->root_path);
+    }
+    sink_close(&sink);
+    return key.data;
+}
 
-    return svg;
+int set_svg_option(struct svg_options* options, const char* name,
+                   const char* value) {
+    if (strcmp(name, "depth") == 0 || strcmp(name, "nodes") == 0) {
+        long n = parse_count(value);
+        if (n < 0) {
+            return -1;
+        }
+        if (name[0] == 'd') {
+            options->max_depth = n;
+        } else {
+            options->max_nodes = n;
+        }
+        return 0;
+    }
+    if (strcmp(name, "root") == 0) {
+        /* digits, with single dots between them */
+        for (const char* c = value; *c; ++c) {
+            if ((*c < '0' || *c > '9') &&
+                (*c != '.' || c == value || !c[1] || c[1] == '.')) {
+                return -1;
+            }
+        }
+        options->root_path = value;
+        return 0;
+    }
+    if (strcmp(name, "precision") == 0) {
+        long n = parse_count(value);
+        if (n < 1 || n > MAX_PRECISION) {
+            return -1;
+        }
+        options->precision = n;
+        return 0;
+    }
+    return -1;
 }
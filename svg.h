@@ -1,8 +1,81 @@
 #ifndef SVG_H
 #define SVG_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compact_tree.h"
 #include "parse.h"
+#include "sink.h"
 
 char* parse_tree_to_svg(struct parse_tree_node* node);
+char* compact_tree_to_svg(const struct compact_tree* tree);
+
+/*
+  Like the above, but writing to sink as the SVG is made.  The layout
+  still needs the whole tree, but not the output.
+ */
+void write_parse_tree_svg(struct parse_tree_node* node, struct sink* sink);
+void write_compact_tree_svg(const struct compact_tree* tree,
+                            struct sink* sink);
+
+/*
+  What to draw of a tree too big to draw whole.  A subtree the limits
+  cut off is drawn as one dashed box saying how many nodes it has.
+  Laying out and writing the SVG take time for the boxes drawn, not
+  for the whole tree.  A compact tree knows how many nodes are cut
+  off; a parse tree has to count them, which walks the rest.
+ */
+struct svg_options {
+    /* levels of boxes to draw, counting the root's, or 0 for all */
+    int max_depth;
+    /*
+      boxes to draw at most, counting the dashed ones, or 0 for no
+      limit.  Nodes are opened breadth first, as long as the next
+      one's children fit.
+     */
+    uint32_t max_nodes;
+    /*
+      The subtree to draw, as child numbers from 0 separated by dots
+      ("2.0" is the first child of the root's third), or NULL or ""
+      for the whole tree.
+     */
+    const char* root_path;
+    /*
+      Digits after the decimal point in coordinates, from 1 to 6, or 0
+      for 1.  A tenth of a pixel is as fine as anything draws.
+     */
+    int precision;
+};
+
+/*
+  Sets an option from its name (depth, nodes, root or precision) and
+  its value as text, for command lines and query strings.  Returns 0,
+  or -1 if the name or value isn't one.
+ */
+int set_svg_option(struct svg_options* options, const char* name,
+                   const char* value);
+
+/*
+  Returns options as text starting with "svg", for a cache key:
+  options that draw a tree differently have different keys.  The
+  caller frees it.
+ */
+char* svg_options_key(const struct svg_options* options);
+
+/* Whether root_path (as in svg_options) leads to a node of the tree */
+bool parse_tree_has_root(struct parse_tree_node* node,
+                         const char* root_path);
+
+/*
+  Like the above, with options, which may be NULL.  Returns 0, or -1,
+  writing nothing, if root_path doesn't lead to a node.
+ */
+int write_parse_tree_svg_with_options(struct parse_tree_node* node,
+                                      const struct svg_options* options,
+                                      struct sink* sink);
+int write_compact_tree_svg_with_options(const struct compact_tree* tree,
+                                        const struct svg_options* options,
+                                        struct sink* sink);
 
 #endif
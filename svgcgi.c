@@ -1,59 +1,186 @@
 #define _POSIX_C_SOURCE 200809L
 
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "cgi.h"
-#include "svg.h"
 #include "parse.h"
+#include "render_cache.h"
+#include "svg.h"
+#include "tree_format.h"
 
-int main() {
-    struct cgi* cgi = cgi_init();
+#define DEFAULT_CACHE_MAX_BYTES (64L << 20)
+
+/*
+  Returns the render cache named by EXPR_CACHE_DIR, bounded by
+  EXPR_CACHE_MAX_BYTES, or NULL if there is none.
+ */
+static struct render_cache* open_cache() {
+    const char* dir = getenv("EXPR_CACHE_DIR");
+    if (!dir || !*dir) {
+        return 0;
+    }
+    const char* max_str = getenv("EXPR_CACHE_MAX_BYTES");
+    long max_bytes = max_str ? atol(max_str) : 0;
+    return render_cache_open(dir, max_bytes > 0 ? max_bytes
+                                                : DEFAULT_CACHE_MAX_BYTES);
+}
+
+/*
+  Splits a comma-separated list into a NULL-terminated array of its
+  non-empty names.  The array and the names are one allocation.
+ */
+static char** split_typenames(const char* str) {
+    size_t len = strlen(str);
+    int n_typenames = 1;
+    for (const char* c = str; *c; ++c) {
+        if (*c == ',') {
+            ++n_typenames;
+        }
+    }
+    char** typenames = malloc((n_typenames + 1) * sizeof(char*) + len + 1);
+    char* names = (char*)(typenames + n_typenames + 1);
+    memcpy(names, str, len + 1);
+    int i = 0;
+    char* name = names;
+    for (char* c = names; ; ++c) {
+        if (*c == ',' || !*c) {
+            bool last = !*c;
+            *c = 0;
+            if (*name) {
+                typenames[i++] = name;
+            }
+            if (last) {
+                break;
+            }
+            name = c + 1;
+        }
+    }
+    typenames[i] = 0;
+    return typenames;
+}
+
+/*
+  Sends an error page.  It's plain text, so that a message quoting the
+  query (the expression it couldn't parse, say) can't inject markup.
+ */
+static void send_error(const char* format, ...) {
+    printf("Content-type: text/plain\n\n");
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+static void serve(struct cgi* cgi) {
     struct cgi_var* expr_var = cgi_get_var(cgi, "expr");
     struct cgi_var* typename_var = cgi_get_var(cgi, "typenames");
+    struct cgi_var* format_var = cgi_get_var(cgi, "format");
     if (!expr_var) {
-        printf("Content-type: text/html\n\n");
-        printf("Error: missing arg expr\n");
-        return 0;
+        send_error("Error: missing arg expr\n");
+        return;
     }
 
     const char* expr = expr_var->values[0];
+    const char* typename_str = typename_var ? typename_var->values[0] : 0;
 
-    char** typenames = 0;
-    if (typename_var) {
-        char* typename_str = strdup(typename_var->values[0]);
-        int n_typenames = 1;
-        for (char* c = typename_str; *c; ++c) {
-            if (*c == ',') {
-                ++n_typenames;
-            }
+    /* the tree in one of tree_format's formats, instead of an SVG */
+    const struct tree_emitter* format = 0;
+    const char* content_type = "image/svg+xml";
+    if (format_var && strcmp(format_var->values[0], "svg") != 0) {
+        format = find_tree_format(format_var->values[0]);
+        if (!format) {
+            send_error("Error: unknown format %s, not svg or one of %s\n",
+                       format_var->values[0], tree_format_names);
+            return;
         }
-        typenames = malloc((n_typenames + 1) * sizeof(char*));
-        int i = 0;
-        if (strlen(typename_str)) {
-            typenames[i++] = typename_str;
-        }
-        for (char* c = typename_str; *c; ++c) {
-            if (*c == ',') {
-                *c = 0;
-                if (strlen(c)) {
-                    typenames[i++] = c;
-                }
-            }
+        content_type = format->content_type;
+    }
+
+    /* how much of the tree an SVG shows, and how precisely */
+    static const char* svg_option_names[] = {"depth", "nodes", "root",
+                                             "precision", 0};
+    struct svg_options svg_options = {0};
+    for (const char** name = svg_option_names; *name; ++name) {
+        struct cgi_var* var = cgi_get_var(cgi, *name);
+        if (var && set_svg_option(&svg_options, *name, var->values[0])) {
+            send_error("Error: bad %s\n", *name);
+            return;
+        }
+    }
+    /*
+      SVGs are keyed by all their options, so that none drawn with
+      other options, or before there were any, are served.
+     */
+    char* svg_key = format ? 0 : svg_options_key(&svg_options);
+    const char* options = format ? format->name : svg_key;
+
+    struct render_cache* cache = open_cache();
+    if (cache) {
+        size_t size;
+        char* output = render_cache_get(cache, expr, typename_str, options,
+                                        &size);
+        if (output) {
+            printf("Content-type: %s\n\n", content_type);
+            fwrite(output, 1, size, stdout);
+            free(output);
+            render_cache_close(cache);
+            free(svg_key);
+            return;
         }
-        typenames[i] = 0;
     }
 
+    char** typenames = typename_str ? split_typenames(typename_str) : 0;
     struct parse_result* result = parse(expr, typenames);
     if (result->is_error) {
-        printf("Content-type: text/html\n\n");
-        printf("Error: parsing %s: %s\n", expr, result->error_message);
-        return 0;
+        send_error("Error: parsing %s: %s\n", expr, result->error_message);
+    } else if (!format &&
+               !parse_tree_has_root(result->node, svg_options.root_path)) {
+        /* checked first, since the header goes out before the SVG */
+        send_error("Error: no node at root %s\n", svg_options.root_path);
+    } else {
+        /*
+          Streamed out as it's made, so the first of it goes before the
+          end, with a copy kept for the cache if there is one.
+         */
+        printf("Content-type: %s\n\n", content_type);
+        fflush(stdout);
+        struct strbuf copy = {0};
+        struct sink sink;
+        if (cache) {
+            sink_init_fd_copy(&sink, STDOUT_FILENO, &copy);
+        } else {
+            sink_init_fd(&sink, STDOUT_FILENO);
+        }
+        if (format) {
+            emit_tree(format, result->node, &sink);
+        } else {
+            write_parse_tree_svg_with_options(result->node, &svg_options,
+                                              &sink);
+        }
+        /* only what all went out is stored */
+        if (sink_close(&sink) == 0 && cache) {
+            render_cache_put(cache, expr, typename_str, options, copy.data,
+                             copy.len);
+        }
+        strbuf_free(&copy);
     }
-    
-    printf("Content-type: image/svg+xml\n\n");
-    char* svg = parse_tree_to_svg(result->node);
-    printf("%s", svg);
 
+    free_parse_result(result);
+    free(typenames);
+    free(svg_key);
+    if (cache) {
+        render_cache_close(cache);
+    }
+}
+
+int main() {
+    struct cgi* cgi = cgi_init();
+    serve(cgi);
+    cgi_free(cgi);
     return 0;
 }
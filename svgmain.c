@@ -2,23 +2,43 @@
 #include "parse.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+/* how much of the tree to draw, set by --depth, --nodes and --root */
+static struct svg_options options;
 
 static int dump_tree(const char* expr) {
 
-    struct parse_result* result = parse(expr);
-    if (result->is_error) {
+    struct parse_result* result = parse(expr, 0);
+    int is_error = result->is_error;
+    if (is_error) {
         printf("Error: %s\n", result->error_message);
     } else {
-        char* svg = parse_tree_to_svg(result->node);
-        printf("%s", svg);
-        free(svg);
+        struct sink out;
+        sink_init_fd(&out, STDOUT_FILENO);
+        if (write_parse_tree_svg_with_options(result->node, &options,
+                                              &out)) {
+            sink_printf(&out, "Error: no node at root %s\n",
+                        options.root_path);
+            is_error = 1;
+        }
+        sink_close(&out);
     }
 
-    return result->is_error;
+    free_parse_result(result);
+    return is_error;
 }
 
 int main(int argc, char** argv) {
+    while (argc >= 3 && strncmp(argv[1], "--", 2) == 0) {
+        if (set_svg_option(&options, argv[1] + 2, argv[2])) {
+            printf("Error: bad option %s %s\n", argv[1], argv[2]);
+            return 2;
+        }
+        argv += 2;
+        argc -= 2;
+    }
     if (argc != 2) {
         printf("Error: must supply a single argument\n");
         return 2;
@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "tree_file.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "tree files are read and written in place, so only little-endian hosts are supported"
+#endif
+
+static int write_all(int fd, const void* data, size_t size) {
+    const char* pos = data;
+    while (size) {
+        ssize_t written = write(fd, pos, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        pos += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int tree_file_write(const struct compact_tree* tree, const char* path) {
+    struct tree_file_header header;
+    memcpy(header.magic, TREE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TREE_FILE_VERSION;
+    header.header_size = sizeof(header);
+    header.n_nodes = tree->n_nodes;
+    header.text_size = tree->text_size;
+    header.nodes_offset = sizeof(header);
+    header.text_offset = header.nodes_offset
+        + tree->n_nodes * sizeof(struct compact_node);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write_all(fd, &header, sizeof(header)) ||
+        write_all(fd, tree->nodes,
+                  tree->n_nodes * sizeof(struct compact_node)) ||
+        write_all(fd, tree->text, tree->text_size)) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return close(fd);
+}
+
+#define READ_ERROR(message)                     \
+    {{                                          \
+        *error = (message);                     \
+        return -1;                              \
+    }}
+
+int tree_file_read(const void* data, size_t size, struct compact_tree* tree,
+                   const char** error) {
+    struct tree_file_header header;
+    if (size < sizeof(header)) {
+        READ_ERROR("file too short for a tree file header");
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, TREE_FILE_MAGIC, sizeof(header.magic))) {
+        READ_ERROR("not a tree file");
+    }
+    if (header.version != TREE_FILE_VERSION) {
+        READ_ERROR("unsupported tree file version");
+    }
+    uint64_t nodes_end = header.nodes_offset
+        + (uint64_t)header.n_nodes * sizeof(struct compact_node);
+    uint64_t text_end = (uint64_t)header.text_offset + header.text_size;
+    if (header.header_size < sizeof(header) ||
+        header.nodes_offset < header.header_size ||
+        header.nodes_offset % sizeof(uint32_t) ||
+        header.n_nodes == 0 || nodes_end > size || text_end > size) {
+        READ_ERROR("tree file sections out of bounds");
+    }
+
+    /*
+      The nodes have to be one tree in preorder, as compact_tree_new
+      lays them out, since walks count on it (to skip a subtree, say):
+      a first child comes right after its parent, and a next sibling
+      right after the end of the subtree before it.  ends holds where
+      each subtree still open ends, innermost last.
+     */
+    const struct compact_node* nodes =
+        (const struct compact_node*)((const char*)data + header.nodes_offset);
+    uint32_t* ends = malloc(header.n_nodes * sizeof(uint32_t));
+    int depth = 0;
+    const char* bad = 0;
+    for (uint32_t i = 0; i < header.n_nodes && !bad; ++i) {
+        const struct compact_node* node = &nodes[i];
+        while (depth && ends[depth - 1] == i) {
+            depth--;
+        }
+        /* where the parent's subtree ends, or the root's */
+        uint32_t parent_end = depth ? ends[depth - 1] : header.n_nodes;
+        uint32_t end = node->next_sibling ? node->next_sibling : parent_end;
+        if ((i == 0 && node->next_sibling) ||
+            (node->next_sibling && (node->next_sibling <= i ||
+                                    node->next_sibling >= parent_end)) ||
+            (node->first_child ? node->first_child != i + 1 || end <= i + 1
+                               : end != i + 1)) {
+            bad = "bad link in tree file";
+        }
+        ends[depth++] = end;
+        enum token_type op = compact_op(node);
+        if (op < LITERAL_OR_ID || op > END_OF_EXPRESSION ||
+            (uint64_t)node->text_offset + compact_text_len(node)
+            > header.text_size) {
+            bad = bad ? bad : "bad node in tree file";
+        }
+    }
+    free(ends);
+    if (bad) {
+        READ_ERROR(bad);
+    }
+
+    tree->n_nodes = header.n_nodes;
+    tree->text_size = header.text_size;
+    tree->nodes = (struct compact_node*)nodes;
+    tree->text = (char*)data + header.text_offset;
+    return 0;
+}
+
+struct tree_file* tree_file_map(const char* path, const char** error) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *error = strerror(errno);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        *error = strerror(errno);
+        close(fd);
+        return 0;
+    }
+    if ((size_t)st.st_size < sizeof(struct tree_file_header)) {
+        *error = "file too short for a tree file header";
+        close(fd);
+        return 0;
+    }
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        *error = strerror(errno);
+        return 0;
+    }
+
+    struct tree_file* file = malloc(sizeof(struct tree_file));
+    file->map = map;
+    file->map_size = st.st_size;
+    if (tree_file_read(map, st.st_size, &file->tree, error)) {
+        tree_file_unmap(file);
+        return 0;
+    }
+    return file;
+}
+
+void tree_file_unmap(struct tree_file* file) {
+    munmap(file->map, file->map_size);
+    free(file);
+}
@@ -0,0 +1,59 @@
+/*
+  A file format for compact trees, which can be mapped into memory
+  and walked in place.
+
+  All fields are little-endian.  The file is a header, then the node
+  table (struct compact_node, 16 bytes each) at nodes_offset, then the
+  text at text_offset.  Nodes refer to each other by index and to the
+  text by offset, so nothing needs fixing up after loading.
+ */
+#ifndef TREE_FILE_H
+#define TREE_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compact_tree.h"
+
+#define TREE_FILE_MAGIC "CEXPTREE"
+#define TREE_FILE_VERSION 1
+
+struct tree_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t n_nodes;
+    uint32_t text_size;
+    uint32_t nodes_offset;
+    uint32_t text_offset;
+};
+
+/* Returns 0, or -1 with errno set. */
+int tree_file_write(const struct compact_tree* tree, const char* path);
+
+/*
+  Points tree into data, a whole file's worth of bytes, after
+  checking that it's a well-formed tree file: the header matches,
+  everything is in bounds, and the nodes are one tree laid out in
+  preorder, each reached by exactly one link.  data must be 4-byte
+  aligned.  Returns 0, or -1 with *error set to a
+  message.
+ */
+int tree_file_read(const void* data, size_t size, struct compact_tree* tree,
+                   const char** error);
+
+struct tree_file {
+    /* points into the mapping, which is read-only */
+    struct compact_tree tree;
+    void* map;
+    size_t map_size;
+};
+
+/*
+  Maps the file at path and reads it with tree_file_read.  Returns
+  NULL with *error set to a message on failure.
+ */
+struct tree_file* tree_file_map(const char* path, const char** error);
+void tree_file_unmap(struct tree_file* file);
+
+#endif
@@ -0,0 +1,239 @@
+#include "tree_format.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  The length of the UTF-8 sequence at pos, or 0 if there isn't a valid
+  one: overlong forms, surrogates and code points past U+10FFFF are
+  invalid.
+ */
+static inline int utf8_length(const unsigned char* pos,
+                              const unsigned char* end) {
+    unsigned char c = pos[0];
+    int len;
+    unsigned char low = 0x80;
+    unsigned char high = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+        len = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        len = 3;
+        low = c == 0xe0 ? 0xa0 : 0x80;
+        high = c == 0xed ? 0x9f : 0xbf;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+        low = c == 0xf0 ? 0x90 : 0x80;
+        high = c == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        return 0;
+    }
+    if (end - pos < len || pos[1] < low || pos[1] > high) {
+        return 0;
+    }
+    for (int i = 2; i < len; ++i) {
+        if (pos[i] < 0x80 || pos[i] > 0xbf) {
+            return 0;
+        }
+    }
+    return len;
+}
+
+/*
+  Copies text through in runs, stopping only for the bytes that need
+  escaping, which are rare; nothing is allocated.  JSON has to be
+  UTF-8, so there each byte that isn't part of a valid sequence is
+  replaced with U+FFFD.  Returns whether any was.
+ */
+static inline bool write_string(struct sink* sink, const char* text,
+                                int text_len, bool json) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* run = (const unsigned char*)text;
+    const unsigned char* end = run + text_len;
+    bool replaced = false;
+    sink_write(sink, "\"", 1);
+    for (const unsigned char* pos = run; pos < end; ++pos) {
+        unsigned char c = *pos;
+        if (c >= 0x80) {
+            int len = json ? utf8_length(pos, end) : 1;
+            if (len) {
+                pos += len - 1;
+                continue;
+            }
+            sink_write(sink, run, pos - run);
+            run = pos + 1;
+            sink_write(sink, "\\ufffd", 6);
+            replaced = true;
+            continue;
+        } else if (c != '"' && c != '\\' && (c >= 0x20 || !json)) {
+            continue;
+        }
+        sink_write(sink, run, pos - run);
+        run = pos + 1;
+        char* out = sink_reserve(sink, 6);
+        out[0] = '\\';
+        int len = 2;
+        switch (c) {
+        case '"':
+        case '\\':
+            out[1] = c;
+            break;
+        case '\n':
+            out[1] = 'n';
+            break;
+        case '\t':
+            out[1] = 't';
+            break;
+        case '\r':
+            out[1] = 'r';
+            break;
+        case '\b':
+            out[1] = 'b';
+            break;
+        case '\f':
+            out[1] = 'f';
+            break;
+        default:
+            memcpy(out + 1, "u00", 3);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 0xf];
+            len = 6;
+        }
+        sink->len += len;
+    }
+    sink_write(sink, run, end - run);
+    sink_write(sink, "\"", 1);
+    return replaced;
+}
+
+bool write_json_string(struct sink* sink, const char* text, int text_len) {
+    return write_string(sink, text, text_len, true);
+}
+
+void write_sexpr_string(struct sink* sink, const char* text, int text_len) {
+    write_string(sink, text, text_len, false);
+}
+
+static void json_node_start(struct sink* sink,
+                            const struct parse_tree_node* node,
+                            const struct parse_tree_node* parent) {
+    if (parent && node != parent->first_child) {
+        sink_write(sink, ",", 1);
+    }
+    sink_puts(sink, "{\"kind\":");
+    const char* kind = token_names[node->op];
+    write_json_string(sink, kind, strlen(kind));
+    if (node->text_len) {
+        sink_puts(sink, ",\"text\":");
+        if (write_json_string(sink, node->text, node->text_len)) {
+            sink_puts(sink, ",\"invalid_utf8\":true");
+        }
+    }
+    if (node->first_child) {
+        sink_puts(sink, ",\"children\":[");
+    }
+}
+
+static void json_node_end(struct sink* sink,
+                          const struct parse_tree_node* node) {
+    if (node->first_child) {
+        sink_write(sink, "]}", 2);
+    } else {
+        sink_write(sink, "}", 1);
+    }
+}
+
+static void sexpr_node_start(struct sink* sink,
+                             const struct parse_tree_node* node,
+                             const struct parse_tree_node* parent) {
+    if (parent) {
+        sink_write(sink, " (", 2);
+    } else {
+        sink_write(sink, "(", 1);
+    }
+    const char* kind = token_names[node->op];
+    write_sexpr_string(sink, kind, strlen(kind));
+    if (node->text_len) {
+        sink_write(sink, " ", 1);
+        write_sexpr_string(sink, node->text, node->text_len);
+    }
+}
+
+static void sexpr_node_end(struct sink* sink,
+                           const struct parse_tree_node* node) {
+    (void)node;
+    sink_write(sink, ")", 1);
+}
+
+const struct tree_emitter tree_format_text = {
+    "text", "text/plain", 0, 0, write_tree_to_sink
+};
+
+const struct tree_emitter tree_format_json = {
+    "json", "application/json", json_node_start, json_node_end, 0
+};
+
+const struct tree_emitter tree_format_sexpr = {
+    "sexpr", "text/plain", sexpr_node_start, sexpr_node_end, 0
+};
+
+static const struct tree_emitter* formats[] = {
+    &tree_format_text, &tree_format_json, &tree_format_sexpr, 0
+};
+
+const char tree_format_names[] = "text, json, sexpr";
+
+const struct tree_emitter* find_tree_format(const char* name) {
+    for (const struct tree_emitter** format = formats; *format; ++format) {
+        if (strcmp((*format)->name, name) == 0) {
+            return *format;
+        }
+    }
+    return 0;
+}
+
+void emit_tree(const struct tree_emitter* format,
+               struct parse_tree_node* node, struct sink* sink) {
+    if (format->write_tree) {
+        format->write_tree(node, sink);
+        return;
+    }
+
+    /* the path from node down to the current one, as in print_tree */
+    struct parse_tree_node* local_path[64];
+    struct parse_tree_node** path = local_path;
+    int allocated = sizeof(local_path) / sizeof(local_path[0]);
+    int depth = 0;
+
+    struct parse_tree_node* cur = node;
+    while (1) {
+        format->node_start(sink, cur, depth ? path[depth - 1] : 0);
+        if (cur->first_child) {
+            if (depth == allocated) {
+                allocated *= 2;
+                if (path == local_path) {
+                    path = malloc(allocated * sizeof(*path));
+                    memcpy(path, local_path, sizeof(local_path));
+                } else {
+                    path = realloc(path, allocated * sizeof(*path));
+                }
+            }
+            path[depth++] = cur;
+            cur = cur->first_child;
+            continue;
+        }
+        format->node_end(sink, cur);
+
+        /* go up until there's a next sibling to write */
+        while (depth && !cur->next_sibling) {
+            cur = path[--depth];
+            format->node_end(sink, cur);
+        }
+        if (!depth) {
+            break;
+        }
+        cur = cur->next_sibling;
+    }
+
+    if (path != local_path) {
+        free(path);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+  Writing parse trees for other programs to read, so they don't have
+  to parse the parenthesized text back:
+
+  json:  {"kind":"+","children":[{"kind":"literal","text":"a"},...]}
+  sexpr: ("+" ("literal" "a") ...)
+
+  A node's kind is its token_names entry.  Its text, for literals,
+  identifiers, casts and sizeof(type), is only there if it has some.
+  Children are in order.
+
+  A format is an emitter: two callbacks that emit_tree calls as it
+  walks the tree, without recursion, so adding one is just writing
+  those.  A format with its own walk, like the parenthesized text,
+  sets write_tree instead.
+ */
+#ifndef TREE_FORMAT_H
+#define TREE_FORMAT_H
+
+#include "parse.h"
+#include "sink.h"
+
+struct tree_emitter {
+    /* as --format and format= take it */
+    const char* name;
+    const char* content_type;
+    /*
+      Writes node, up to its children if it has any.  parent is NULL
+      for the root.
+     */
+    void (*node_start)(struct sink* sink, const struct parse_tree_node* node,
+                       const struct parse_tree_node* parent);
+    /* Finishes node, after its children if it has any */
+    void (*node_end)(struct sink* sink, const struct parse_tree_node* node);
+    /* If not NULL, used instead of the callbacks */
+    void (*write_tree)(struct parse_tree_node* node, struct sink* sink);
+};
+
+extern const struct tree_emitter tree_format_text;
+extern const struct tree_emitter tree_format_json;
+extern const struct tree_emitter tree_format_sexpr;
+
+/* Returns the format called name, or NULL if there's none */
+const struct tree_emitter* find_tree_format(const char* name);
+
+/* The formats' names, separated by commas, for messages */
+extern const char tree_format_names[];
+
+void emit_tree(const struct tree_emitter* format,
+               struct parse_tree_node* node, struct sink* sink);
+
+/*
+  Writes text in double quotes, escaped for JSON: ", \ and control
+  characters.  Each byte that isn't part of valid UTF-8 is written as
+  \ufffd, the replacement character, and true is returned, so that
+  the caller can say the text isn't all there; the JSON format puts
+  "invalid_utf8":true after such a node's text.  Other bytes go
+  through as they are.
+ */
+bool write_json_string(struct sink* sink, const char* text, int text_len);
+
+/* The same for S-expressions, where only " and \ are escaped */
+void write_sexpr_string(struct sink* sink, const char* text, int text_len);
+
+#endif
@@ -0,0 +1,126 @@
+#include "typename_set.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "obstack_helper.h"
+
+/*
+   These are C's built-in types (or at least the first words thereof)
+ */
+static const char* builtin_typenames[] = {
+    "bool",
+    "char",
+    "double",
+    "float",
+    "int",
+    "long",
+    "off_t",
+    "ptrdiff_t",
+    "signed",
+    "short",
+    "size_t",
+    "struct",
+    "time_t",
+    "unsigned",
+    0
+};
+
+struct typename_entry {
+    const char* text;
+    int len;
+    uint32_t hash;
+};
+
+/*
+  An open-addressed hash table, probed linearly, which is kept at
+  most half full.  Empty entries have text == 0.
+ */
+struct typename_set {
+    struct typename_entry* entries;
+    uint32_t mask;
+    struct obstack obstack;
+};
+
+/* FNV-1a */
+static uint32_t hash_name(const char* text, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        hash ^= (unsigned char)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct typename_entry* find_entry(const struct typename_set* set,
+                                         const char* text, int len,
+                                         uint32_t hash) {
+    uint32_t i = hash & set->mask;
+    while (1) {
+        struct typename_entry* entry = &set->entries[i];
+        if (!entry->text ||
+            (entry->hash == hash && entry->len == len &&
+             memcmp(entry->text, text, len) == 0)) {
+            return entry;
+        }
+        i = (i + 1) & set->mask;
+    }
+}
+
+static void add_name(struct typename_set* set, const char* name) {
+    int len = strlen(name);
+    uint32_t hash = hash_name(name, len);
+    struct typename_entry* entry = find_entry(set, name, len, hash);
+    if (entry->text) {
+        return;
+    }
+    entry->text = obstack_copy(&set->obstack, name, len);
+    entry->len = len;
+    entry->hash = hash;
+}
+
+struct typename_set* typename_set_new(char** typenames) {
+    int n_names = sizeof(builtin_typenames) / sizeof(builtin_typenames[0]) - 1;
+    if (typenames) {
+        for (char** name = typenames; *name; ++name) {
+            ++n_names;
+        }
+    }
+    uint32_t size = 16;
+    while (size < (uint32_t)n_names * 2) {
+        size *= 2;
+    }
+
+    struct typename_set* set = malloc(sizeof(struct typename_set));
+    set->entries = calloc(size, sizeof(struct typename_entry));
+    set->mask = size - 1;
+    obstack_init(&set->obstack);
+    for (const char** name = builtin_typenames; *name; ++name) {
+        add_name(set, *name);
+    }
+    if (typenames) {
+        for (char** name = typenames; *name; ++name) {
+            add_name(set, *name);
+        }
+    }
+    return set;
+}
+
+void typename_set_free(struct typename_set* set) {
+    obstack_free(&set->obstack, 0);
+    free(set->entries);
+    free(set);
+}
+
+bool typename_set_contains(const struct typename_set* set,
+                           const char* text, int len) {
+    if (!set) {
+        for (const char** name = builtin_typenames; *name; ++name) {
+            if (strncmp(*name, text, len) == 0 && (*name)[len] == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return find_entry(set, text, len, hash_name(text, len))->text != 0;
+}
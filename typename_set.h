@@ -0,0 +1,29 @@
+/*
+  A set of the words that can start a type name, which the parser
+  uses to tell a typecast from a parenthesized expression.  A set is
+  built once from a list of names, and always includes C's built-in
+  types.  After that it is never modified, so one set can be shared
+  by any number of parses, on any number of threads.
+ */
+#ifndef TYPENAME_SET_H
+#define TYPENAME_SET_H
+
+#include <stdbool.h>
+
+struct typename_set;
+
+/*
+  typenames is a NULL-terminated list, or NULL for just the
+  built-ins.  The set keeps its own copy of the names.
+ */
+struct typename_set* typename_set_new(char** typenames);
+void typename_set_free(struct typename_set* set);
+
+/*
+  Checks for the len-byte name at text.  A NULL set holds just the
+  built-ins.
+ */
+bool typename_set_contains(const struct typename_set* set,
+                           const char* text, int len);
+
+#endif